@@ -576,12 +576,12 @@ IPLString ByteCodeGenerator::GetCode()
 				+ " r" + std::to_string(ResolveRegisterName(i.Args[2])) + '\n';
 			break;
 		case ByteCodeGenerator::Instruction::GETG:
-			result += "getg";
-			NOT_IMPLEMENTED;
+			result += "getg r" + std::to_string(ResolveRegisterName(i.Args[0]))
+				+ " '" + i.Args[1] + "'\n";
 			break;
 		case ByteCodeGenerator::Instruction::SETG:
-			result += "setg";
-			NOT_IMPLEMENTED;
+			result += "setg r" + std::to_string(ResolveRegisterName(i.Args[0]))
+				+ " '" + i.Args[1] + "'\n";
 			break;
 		case ByteCodeGenerator::Instruction::GETUP:
 			result += "getup";
@@ -592,12 +592,14 @@ IPLString ByteCodeGenerator::GetCode()
 			NOT_IMPLEMENTED;
 			break;
 		case ByteCodeGenerator::Instruction::GET:
-			result += "get";
-			NOT_IMPLEMENTED;
+			result += "get r" + std::to_string(ResolveRegisterName(i.Args[0]))
+				+ " r" + std::to_string(ResolveRegisterName(i.Args[1]))
+				+ " '" + i.Args[2] + "'\n";
 			break;
 		case ByteCodeGenerator::Instruction::SET:
-			result += "set";
-			NOT_IMPLEMENTED;
+			result += "set r" + std::to_string(ResolveRegisterName(i.Args[0]))
+				+ " r" + std::to_string(ResolveRegisterName(i.Args[1]))
+				+ " '" + i.Args[2] + "'\n";
 			break;
 		case ByteCodeGenerator::Instruction::INC:
 			result += "inc";
@@ -1,6 +1,7 @@
 #include <gtest/gtest.h>
 #include <memory>
 #include <cmath>
+#include <limits>
 #include <spasm.hpp>
 
 TEST(Empty, Empty)
@@ -93,6 +94,30 @@ TEST(NaNBox, IsNaN)
     ASSERT_TRUE(v2.is_double());
 }
 
+TEST(NaNBox, Integers)
+{
+    const Spasm::Value zero(int32_t(0));
+    ASSERT_TRUE(zero.is_integer());
+    ASSERT_FALSE(zero.is_double());
+    ASSERT_FALSE(bool(zero));
+    ASSERT_TRUE(bool(Spasm::Value(int32_t(-1))));
+    ASSERT_EQ(-1.0, Spasm::Value(int32_t(-1)).get_number());
+
+    const Spasm::Value max(std::numeric_limits<int32_t>::max());
+    const auto sum = max + Spasm::Value(int32_t(1));
+    ASSERT_TRUE(sum.is_double());
+    ASSERT_EQ(2147483648.0, sum.get_double());
+    const auto difference = max - Spasm::Value(int32_t(1));
+    ASSERT_TRUE(difference.is_integer());
+    ASSERT_EQ(max.get_integer() - 1, difference.get_integer());
+
+    const auto product = zero * Spasm::Value(int32_t(-5));
+    ASSERT_TRUE(product.is_double());
+    ASSERT_TRUE(std::signbit(product.get_double()));
+    ASSERT_TRUE(bool(Spasm::Value(int32_t(3)) < Spasm::Value(3.5)));
+    ASSERT_TRUE(bool(Spasm::Value(int32_t(3)) == Spasm::Value(3.0)));
+}
+
 TEST(NaNBox, Pointers)
 {
     std::vector<std::unique_ptr<int>> pointers;
@@ -3,7 +3,11 @@ project 'Test'
     language 'C++'
     uuid(os.uuid('Test'))
 
-    files '*.cpp'
+    -- the C generator of spaot, its test compiles the generated program
+    files {
+        '*.cpp',
+        '../../spasm/src/aot/cgen.cpp',
+    }
 
     includedirs {
         'googletest/googletest/include',
@@ -1,8 +1,21 @@
 #include <gtest/gtest.h>
 
 #include <spasm.hpp>
+#include <jit.hpp>
+#include <kernels.hpp>
+#include <threadpool.hpp>
+#include <array.hpp>
+#include <rope.hpp>
+#include <format.hpp>
+#include <parse.hpp>
 #include <assembler.hpp>
+#include <aot/cgen.hpp>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
 #include <sstream>
+#include <thread>
 
 using Spasm::OpCodes;
 
@@ -17,13 +30,14 @@ struct SPRTTest : public ::testing::Test
 
     void Run(const Spasm::byte* bytecode, size_t size)
     {
-        VM.Initialize(size, bytecode, Input, Output);
+        VM.Initialize(size, bytecode, Input, Output, Dispatch);
         ASSERT_EQ(Spasm::Spasm::RunResult::Success, VM.run());
     }
     Spasm::byte Label(Spasm::byte label) const {
         return 0x80 + label;
     }
     Spasm::Spasm VM;
+    Spasm::Spasm::Dispatch Dispatch = Spasm::Spasm::Dispatch::Threaded;
     std::istringstream Input;
     std::ostringstream Output;
 };
@@ -81,7 +95,7 @@ TEST_F(SPRTTest, Div)
 	};
 
 	Run(bytecode, sizeof(bytecode));
-	ASSERT_EQ(Output.str(), "0.857143");
+	ASSERT_EQ(Output.str(), "0.8571428571428571");
 }
 
 TEST_F(SPRTTest, Mod)
@@ -289,6 +303,145 @@ TEST_F(SPRTTest, Call)
 	ASSERT_EQ(Output.str(), "26742");
 }
 
+TEST_F(SPRTTest, DecodeRemapsJumpTargets)
+{
+	Spasm::byte bytecode[] = {
+		OpCodes::Const, 1, 6,   // 3
+		OpCodes::JumpT, 1, 8,   // 6
+		OpCodes::Print, 1,      // 8
+		OpCodes::Jump, 100,     // 10
+	};
+
+	SpasmImpl::InstructionStream code;
+	ASSERT_TRUE(SpasmImpl::DecodeByteCode(bytecode, sizeof(bytecode), code));
+	// decoded program, Halt at the end and Invalid for bad jump targets
+	ASSERT_EQ(code.size(), 6u);
+	ASSERT_EQ(code[1].OpCode, OpCodes::JumpT);
+	ASSERT_EQ(code[1].A1, 3);
+	ASSERT_EQ(code[3].A0, 4);
+	ASSERT_EQ(code[4].OpCode, OpCodes::Halt);
+	ASSERT_EQ(code[5].OpCode, OpCodes::Invalid);
+	ASSERT_EQ(reinterpret_cast<uintptr_t>(code.data()) % 32, 0u);
+}
+
+TEST_F(SPRTTest, WideOperands)
+{
+	Spasm::byte bytecode[] = {
+		Spasm::byte(0x40 | OpCodes::Const), 1, 0, 0x10, 0x27,  // 10000
+		Spasm::byte(0x80 | OpCodes::Const), 2, 0, 0, 0,
+			0x40, 0x42, 0x0f, 0x00,                             // 1000000
+		OpCodes::Add, 3, 1, 2,
+		OpCodes::Print, 3,
+	};
+
+	Run(bytecode, sizeof(bytecode));
+	ASSERT_EQ(Output.str(), "1010000");
+}
+
+TEST_F(SPRTTest, JumpIntoInstruction)
+{
+	Spasm::byte bytecode[] = {
+		OpCodes::Jump, 3,
+		OpCodes::Const, 1, 6,
+	};
+
+	VM.Initialize(sizeof(bytecode), bytecode, Input, Output);
+	ASSERT_EQ(Spasm::Spasm::RunResult::NotImplemented, VM.run());
+}
+
+TEST_F(SPRTTest, FuseLoop)
+{
+	Spasm::byte bytecode[] = {
+		OpCodes::Const, 1, 0,           // 0
+		OpCodes::Const, 2, 5,           // 3
+		OpCodes::Const, 4, 0,           // 6
+		OpCodes::Add, 4, 4, 1,          // 9
+		OpCodes::Const, 3, 1,           // 13
+		OpCodes::Add, 1, 1, 3,          // 16
+		OpCodes::Less, 5, 1, 2,         // 20
+		OpCodes::JumpT, 5, 9,           // 24
+		OpCodes::Print, 4,              // 27
+	};
+
+	SpasmImpl::InstructionStream code;
+	ASSERT_TRUE(SpasmImpl::DecodeByteCode(bytecode, sizeof(bytecode), code));
+	ASSERT_EQ(SpasmImpl::FuseInstructions(code), 3u);
+	ASSERT_EQ(code.size(), 8u);
+	ASSERT_EQ(code[4].OpCode, OpCodes::IncrementConstAndCompare);
+	ASSERT_EQ(code[4].A4, 3);
+	ASSERT_EQ(code[6].OpCode, OpCodes::Halt);
+
+	Run(bytecode, sizeof(bytecode));
+	ASSERT_EQ(Output.str(), "10");
+	Output.str("");
+	Dispatch = Spasm::Spasm::Dispatch::Switch;
+	Run(bytecode, sizeof(bytecode));
+	ASSERT_EQ(Output.str(), "10");
+}
+
+TEST_F(SPRTTest, FuseGeneratedLoop)
+{
+	// for (i = 0; i < 100; i = i + 1) sum = sum + i, as ByteCodeGenerator
+	// emits it: the test at the top, the increment jumps back to it
+	Spasm::byte bytecode[] = {
+		OpCodes::Const, 1, 0,           // 0
+		OpCodes::Const, 2, 100,         // 3
+		OpCodes::Const, 4, 0,           // 6
+		OpCodes::Less, 5, 1, 2,         // 9
+		OpCodes::JumpF, 5, 29,          // 13
+		OpCodes::Add, 4, 4, 1,          // 16
+		OpCodes::Const, 3, 1,           // 20
+		OpCodes::Add, 1, 1, 3,          // 23
+		OpCodes::Jump, 9,               // 27
+		OpCodes::Print, 4,              // 29
+	};
+
+	SpasmImpl::InstructionStream code;
+	ASSERT_TRUE(SpasmImpl::DecodeByteCode(bytecode, sizeof(bytecode), code));
+	ASSERT_EQ(SpasmImpl::FuseInstructions(code), 3u);
+	ASSERT_EQ(code.size(), 10u);
+	ASSERT_EQ(code[3].OpCode, OpCodes::LessJumpF);
+	ASSERT_EQ(code[5].OpCode, OpCodes::IncrementConstAndCompare);
+	ASSERT_EQ(code[5].A4, 4);
+	// the jump back to the test is left for the exit
+	ASSERT_EQ(code[6].OpCode, OpCodes::Jump);
+	ASSERT_EQ(code[6].A0, 3);
+
+	for (auto dispatch : {Spasm::Spasm::Dispatch::Switch,
+						  Spasm::Spasm::Dispatch::Threaded,
+						  Spasm::Spasm::Dispatch::Jit,
+						  Spasm::Spasm::Dispatch::Tracing})
+	{
+		Output.str("");
+		Dispatch = dispatch;
+		Run(bytecode, sizeof(bytecode));
+		ASSERT_EQ(Output.str(), "4950");
+	}
+}
+
+TEST_F(SPRTTest, FuseGreaterBranch)
+{
+	Spasm::byte bytecode[] = {
+		OpCodes::Const, 1, 2,           // 0
+		OpCodes::Const, 2, 3,           // 3
+		OpCodes::Greater, 3, 1, 2,      // 6
+		OpCodes::JumpF, 3, 15,          // 10
+		OpCodes::Print, 1,              // 13
+		OpCodes::Print, 2,              // 15
+	};
+
+	SpasmImpl::InstructionStream code;
+	ASSERT_TRUE(SpasmImpl::DecodeByteCode(bytecode, sizeof(bytecode), code));
+	ASSERT_EQ(SpasmImpl::FuseInstructions(code), 1u);
+	ASSERT_EQ(code[2].OpCode, OpCodes::LessJumpF);
+	ASSERT_EQ(code[2].A1, 2);
+	ASSERT_EQ(code[2].A2, 1);
+	ASSERT_EQ(code[2].A3, 4);
+
+	Run(bytecode, sizeof(bytecode));
+	ASSERT_EQ(Output.str(), "3");
+}
+
 TEST_F(SPRTTest, Read)
 {
 	Spasm::byte bytecode[] = {
@@ -354,6 +507,46 @@ TEST_F(SPASMTest, Call)
 	ASSERT_EQ(Output.str(), "26742");
 }
 
+TEST_F(SPASMTest, RecursiveCall)
+{
+	const char* program =
+		"push 5"		"\n"
+		"read 1"		"\n"
+		"const 2 1"		"\n"
+		"pushr 1"		"\n"
+		"pushr 2"		"\n"
+		"call fib"		"\n"
+		"print 4"		"\n"
+		"halt"			"\n"
+		"label fib"		"\n"
+		"push 5"		"\n"
+		"const 1 2"		"\n"
+		"less 2 -1 1"	"\n"
+		"jmpf 2 rec"	"\n"
+		"ret -1"		"\n"
+		"label rec"		"\n"
+		"const 1 1"		"\n"
+		"sub 2 -1 1"	"\n"
+		"const 3 1"		"\n"
+		"pushr 2"		"\n"
+		"pushr 3"		"\n"
+		"call fib"		"\n"
+		"const 1 0"		"\n"
+		"add 4 5 1"		"\n"
+		"const 1 2"		"\n"
+		"sub 2 -1 1"	"\n"
+		"pushr 2"		"\n"
+		"pushr 3"		"\n"
+		"call fib"		"\n"
+		"add 4 4 5"		"\n"
+		"ret 4"			"\n"
+		""
+		;
+	Input.str("15");
+	CompileAndRun(program);
+	ASSERT_EQ(Output.str(), "610");
+}
+
 TEST_F(SPASMTest, GCD)
 {
 	const char* program =
@@ -380,6 +573,1599 @@ TEST_F(SPASMTest, GCD)
 	ASSERT_EQ(Output.str(), "3");
 }
 
+TEST_F(SPASMTest, GCDSwitchDispatch)
+{
+	const char* program =
+		"push 3"		"\n"
+		"read 1"		"\n"
+		"read 2"		"\n"
+		"label loop"	"\n"
+		"less 3 1 2"	"\n"
+		"jmpt 3 sub_ba"	"\n"
+		"less 3 2 1"	"\n"
+		"jmpt 3 sub_ab"	"\n"
+		"print 1"		"\n"
+		"halt"			"\n"
+		"label sub_ab"	"\n"
+		"sub 1 1 2"		"\n"
+		"jmp loop"		"\n"
+		"label sub_ba"	"\n"
+		"sub 2 2 1"		"\n"
+		"jmp loop"		"\n"
+		""
+		;
+	Input.str("21 12");
+	Dispatch = Spasm::Spasm::Dispatch::Switch;
+	CompileAndRun(program);
+	ASSERT_EQ(Output.str(), "3");
+}
+
+TEST_F(SPRTTest, CallSwitchDispatch)
+{
+	Spasm::byte bytecode[] = {
+		OpCodes::Push, 5,
+		OpCodes::Const, 3, 7,
+		OpCodes::Const, 4, 1,
+		OpCodes::PushFrom, 3,
+		OpCodes::PushFrom, 4,
+		OpCodes::Call, 17,
+		OpCodes::Print, 4,
+		OpCodes::Halt,
+		OpCodes::Mul, 1, -1, -1,
+		OpCodes::Ret, 1,
+	};
+
+	Dispatch = Spasm::Spasm::Dispatch::Switch;
+	Run(bytecode, sizeof(bytecode));
+	ASSERT_EQ(VM.GetDispatch(), Spasm::Spasm::Dispatch::Switch);
+	ASSERT_EQ(Output.str(), "49");
+}
+
+TEST_F(SPRTTest, InvalidOpcode)
+{
+	Spasm::byte bytecode[] = {
+		OpCodes::Const, 1, 6,
+		OpCodes::LastIndex + 1,
+	};
+
+	for (auto dispatch : {Spasm::Spasm::Dispatch::Switch,
+						  Spasm::Spasm::Dispatch::Threaded})
+	{
+		VM.Initialize(sizeof(bytecode), bytecode, Input, Output, dispatch);
+		ASSERT_EQ(Spasm::Spasm::RunResult::NotImplemented, VM.run());
+	}
+}
+
+TEST_F(SPASMTest, CallJit)
+{
+	const char* program =
+		"push 5"		"\n"
+		"const 1 0"		"\n"
+		"const 2 6"		"\n"
+		"const 3 7"		"\n"
+		"const 4 2"		"\n"
+		"pushr 3"		"\n"
+		"pushr 2"		"\n"
+		"pushr 4"		"\n"
+		"call mult"		"\n"
+		"print 4"		"\n"
+		"halt"			"\n"
+		"label mult"	"\n"
+		"print 0"		"\n"
+		"print -1"		"\n"
+		"print -2"		"\n"
+		"mul 1 -2 -1"	"\n"
+		"ret 1"			"\n"
+		""
+		;
+	Dispatch = Spasm::Spasm::Dispatch::Jit;
+	CompileAndRun(program);
+#if SPASM_JIT
+	ASSERT_EQ(VM.GetDispatch(), Spasm::Spasm::Dispatch::Jit);
+#endif
+	ASSERT_EQ(Output.str(), "26742");
+}
+
+TEST_F(SPASMTest, GCDJit)
+{
+	const char* program =
+		"push 3"		"\n"
+		"read 1"		"\n"
+		"read 2"		"\n"
+		"label loop"	"\n"
+		"less 3 1 2"	"\n"
+		"jmpt 3 sub_ba"	"\n"
+		"less 3 2 1"	"\n"
+		"jmpt 3 sub_ab"	"\n"
+		"print 1"		"\n"
+		"halt"			"\n"
+		"label sub_ab"	"\n"
+		"sub 1 1 2"		"\n"
+		"jmp loop"		"\n"
+		"label sub_ba"	"\n"
+		"sub 2 2 1"		"\n"
+		"jmp loop"		"\n"
+		""
+		;
+	Input.str("21 12");
+	Dispatch = Spasm::Spasm::Dispatch::Jit;
+	CompileAndRun(program);
+	ASSERT_EQ(Output.str(), "3");
+}
+
+TEST_F(SPRTTest, JitCompareNaN)
+{
+	Spasm::byte bytecode[] = {
+		OpCodes::Const, 1, 0,
+		OpCodes::Div, 2, 1, 1,          // NaN
+		OpCodes::Less, 3, 2, 1,
+		OpCodes::LessEq, 4, 2, 1,
+		OpCodes::Equal, 5, 2, 2,
+		OpCodes::NotEqual, 6, 2, 2,
+		OpCodes::GreaterEq, 7, 1, 1,
+		OpCodes::Print, 3,
+		OpCodes::Print, 4,
+		OpCodes::Print, 5,
+		OpCodes::Print, 6,
+		OpCodes::Print, 7,
+		OpCodes::Invalid,
+	};
+
+	Dispatch = Spasm::Spasm::Dispatch::Jit;
+	VM.Initialize(sizeof(bytecode), bytecode, Input, Output, Dispatch);
+	ASSERT_EQ(Spasm::Spasm::RunResult::NotImplemented, VM.run());
+	ASSERT_EQ(Output.str(), "00011");
+}
+
+TEST_F(SPRTTest, StackOverflow)
+{
+	Spasm::byte bytecode[] = {
+		OpCodes::Push, 64,
+		OpCodes::Call, 0,
+	};
+
+	for (auto dispatch : {Spasm::Spasm::Dispatch::Switch,
+						  Spasm::Spasm::Dispatch::Threaded,
+						  Spasm::Spasm::Dispatch::Jit})
+	{
+		VM.Initialize(sizeof(bytecode), bytecode, Input, Output, dispatch);
+		ASSERT_EQ(Spasm::Spasm::RunResult::Exception, VM.run());
+	}
+}
+
+TEST_F(SPASMTest, TraceSideExit)
+{
+	const char* program =
+		"push 6"		"\n"
+		"const 1 0"		"\n"
+		"const 2 1000"	"\n"
+		"const 3 0"		"\n"
+		"const 4 0"		"\n"
+		"const 6 500"	"\n"
+		"label loop"	"\n"
+		"less 5 1 6"	"\n"
+		"jmpf 5 big"	"\n"
+		"add 3 3 1"		"\n"
+		"jmp next"		"\n"
+		"label big"		"\n"
+		"sub 4 4 1"		"\n"
+		"label next"	"\n"
+		"const 5 1"		"\n"
+		"add 1 1 5"		"\n"
+		"less 5 1 2"	"\n"
+		"jmpt 5 loop"	"\n"
+		"print 3"		"\n"
+		"print 4"		"\n"
+		"print 5"		"\n"
+		""
+		;
+	Dispatch = Spasm::Spasm::Dispatch::Tracing;
+	CompileAndRun(program);
+#if SPASM_JIT
+	ASSERT_EQ(VM.GetDispatch(), Spasm::Spasm::Dispatch::Tracing);
+#endif
+	ASSERT_EQ(Output.str(), "124750-3747500");
+}
+
+TEST_F(SPASMTest, TraceUnsupportedLoop)
+{
+	const char* program =
+		"push 3"		"\n"
+		"const 1 0"		"\n"
+		"const 2 100"	"\n"
+		"label loop"	"\n"
+		"const 3 1"		"\n"
+		"add 1 1 3"		"\n"
+		"print 1"		"\n"
+		"less 3 1 2"	"\n"
+		"jmpt 3 loop"	"\n"
+		""
+		;
+	std::ostringstream expected;
+	for (int i = 1; i <= 100; ++i)
+	{
+		expected << i;
+	}
+	Dispatch = Spasm::Spasm::Dispatch::Tracing;
+	CompileAndRun(program);
+	ASSERT_EQ(Output.str(), expected.str());
+}
+
+TEST_F(SPASMTest, IntegerOverflowToDouble)
+{
+	const char* program =
+		"push 5"		"\n"
+		"const 1 1"		"\n"
+		"const 2 0"		"\n"
+		"const 3 40"	"\n"
+		"const 4 2"		"\n"
+		"label loop"	"\n"
+		"mul 1 1 4"		"\n"
+		"const 5 1"		"\n"
+		"add 2 2 5"		"\n"
+		"less 5 2 3"	"\n"
+		"jmpt 5 loop"	"\n"
+		"print 1"		"\n"
+		"const 2 0"		"\n"
+		"const 3 -1"	"\n"
+		"mul 4 2 3"		"\n"
+		"print 4"		"\n"
+		"const 3 7"		"\n"
+		"const 4 -3"	"\n"
+		"mod 5 3 4"		"\n"
+		"print 5"		"\n"
+		""
+		;
+	for (auto dispatch : {Spasm::Spasm::Dispatch::Switch,
+						  Spasm::Spasm::Dispatch::Threaded,
+						  Spasm::Spasm::Dispatch::Jit,
+						  Spasm::Spasm::Dispatch::Tracing})
+	{
+		Output.str("");
+		Dispatch = dispatch;
+		CompileAndRun(program);
+		ASSERT_EQ(Output.str(), "1099511627776-01");
+	}
+}
+
+TEST_F(SPASMTest, QuickenAndDequicken)
+{
+	const char* program =
+		"push 5"		"\n"
+		"const 1 1"		"\n"
+		"const 2 2"		"\n"
+		"const 5 1"		"\n"
+		"label loop"	"\n"
+		"add 4 1 1"		"\n"
+		"print 4"		"\n"
+		"string 1 'b'"	"\n"
+		"sub 2 2 5"		"\n"
+		"jmpt 2 loop"	"\n"
+		""
+		;
+	for (auto dispatch : {Spasm::Spasm::Dispatch::Switch,
+						  Spasm::Spasm::Dispatch::Threaded})
+	{
+		Output.str("");
+		Dispatch = dispatch;
+		CompileAndRun(program);
+		ASSERT_EQ(Output.str(), "2bb");
+		// add and sub became AddIntInt and SubIntInt, add failed on strings
+		ASSERT_EQ(VM.GetQuickeningStats().Quickened, 2u);
+		ASSERT_EQ(VM.GetQuickeningStats().Dequickened, 1u);
+	}
+}
+
+TEST_F(SPASMTest, ConcatenateAcrossCollections)
+{
+	const char* program =
+		"push 5"		"\n"
+		"string 1 ''"	"\n"
+		"string 2 'xy'"	"\n"
+		"const 3 20000"	"\n"
+		"const 5 1"		"\n"
+		"label loop"	"\n"
+		"add 1 1 2"		"\n"
+		"sub 3 3 5"		"\n"
+		"jmpt 3 loop"	"\n"
+		"print 1"		"\n"
+		""
+		;
+	std::string expected;
+	for (int i = 0; i < 20000; ++i)
+	{
+		expected += "xy";
+	}
+	for (auto dispatch : {Spasm::Spasm::Dispatch::Switch,
+						  Spasm::Spasm::Dispatch::Threaded,
+						  Spasm::Spasm::Dispatch::Jit,
+						  Spasm::Spasm::Dispatch::Tracing})
+	{
+		Output.str("");
+		Dispatch = dispatch;
+		CompileAndRun(program);
+		ASSERT_EQ(Output.str(), expected);
+		ASSERT_GT(VM.GetHeapStats().MinorCollections, 0u);
+	}
+}
+
+TEST_F(SPRTTest, RopesCompareByCharacters)
+{
+	Spasm::byte bytecode[] = {
+		OpCodes::Push, 12,
+		OpCodes::String, 1, 10, 'a', 'b', 'c', 'd', 'e', 'f', 'g', 'h', 'i', 'j',
+		OpCodes::String, 8, 10, 'a', 'b', 'c', 'd', 'e', 'f', 'g', 'h', 'i', 'k',
+		OpCodes::Add, 2, 1, 1,
+		OpCodes::Add, 2, 2, 2,
+		OpCodes::Add, 2, 2, 2,
+		OpCodes::Add, 2, 2, 2,
+		OpCodes::Add, 2, 2, 2,
+		OpCodes::Add, 2, 2, 2,
+		OpCodes::Add, 2, 2, 2,
+		OpCodes::Add, 3, 2, 1,
+		OpCodes::Add, 4, 1, 2,
+		OpCodes::Add, 6, 3, 1,
+		OpCodes::Add, 9, 2, 8,
+		OpCodes::Equal, 5, 3, 4,
+		OpCodes::Equal, 7, 3, 6,
+		OpCodes::Equal, 10, 3, 9,
+		OpCodes::NotEqual, 11, 3, 9,
+		OpCodes::Length, 12, 6,
+		OpCodes::Print, 5,
+		OpCodes::Print, 7,
+		OpCodes::Print, 10,
+		OpCodes::Print, 11,
+		OpCodes::Print, 12,
+		OpCodes::Print, 4,
+	};
+	std::string expected = "10011300";
+	for (int i = 0; i < 129; ++i)
+	{
+		expected += "abcdefghij";
+	}
+	for (auto dispatch : {Spasm::Spasm::Dispatch::Switch,
+						  Spasm::Spasm::Dispatch::Threaded,
+						  Spasm::Spasm::Dispatch::Jit,
+						  Spasm::Spasm::Dispatch::Tracing})
+	{
+		Output.str("");
+		Dispatch = dispatch;
+		Run(bytecode, sizeof(bytecode));
+		ASSERT_EQ(Output.str(), expected);
+	}
+}
+
+TEST_F(SPASMTest, ObjectProperties)
+{
+	const char* program =
+		"push 8"			"\n"
+		"string 7 ' '"		"\n"
+		"const 2 20000"		"\n"
+		"const 4 0"			"\n"
+		"const 5 1"			"\n"
+		"label loop"		"\n"
+		"new 1"				"\n"
+		"set 1 2 'a'"		"\n"
+		"set 1 2 'b'"		"\n"
+		"set 1 2 'c'"		"\n"
+		"set 1 2 'd'"		"\n"
+		"set 1 2 'e'"		"\n"
+		"set 1 5 'f'"		"\n"
+		"get 3 1 'f'"		"\n"
+		"add 4 4 3"			"\n"
+		"setg 1 'last'"		"\n"
+		"sub 2 2 5"			"\n"
+		"jmpt 2 loop"		"\n"
+		"print 4"			"\n"
+		"print 7"			"\n"
+		"getg 6 'last'"		"\n"
+		"get 3 6 'e'"		"\n"
+		"print 3"			"\n"
+		"get 3 6 'x'"		"\n"
+		"print 3"			"\n"
+		""
+		;
+	for (auto dispatch : {Spasm::Spasm::Dispatch::Switch,
+						  Spasm::Spasm::Dispatch::Threaded,
+						  Spasm::Spasm::Dispatch::Jit,
+						  Spasm::Spasm::Dispatch::Tracing})
+	{
+		Output.str("");
+		Dispatch = dispatch;
+		CompileAndRun(program);
+		// the missing property 'x' is undefined and prints nothing
+		ASSERT_EQ(Output.str(), "20000 1");
+		// 'e' and 'f' live in the overflow array, which the nursery moves
+		ASSERT_GT(VM.GetHeapStats().MinorCollections, 0u);
+		// all the objects share their shapes, only the first ones miss
+		const auto& stats = VM.GetInlineCacheStats();
+		ASSERT_EQ(stats.Hits + stats.Misses, 8u * 20000 + 3);
+		ASSERT_LT(stats.Misses, 16u);
+	}
+}
+
+TEST_F(SPASMTest, ArithmeticOnMissingProperty)
+{
+	const char* program =
+		"push 7"			"\n"
+		"string 6 ' '"		"\n"
+		"new 1"				"\n"
+		"const 2 1"			"\n"
+		"get 3 1 'x'"		"\n"
+		"add 4 3 2"			"\n"
+		"print 4"			"\n"
+		"print 6"			"\n"
+		"mul 4 2 3"			"\n"
+		"print 4"			"\n"
+		"print 6"			"\n"
+		"mod 4 2 3"			"\n"
+		"print 4"			"\n"
+		"print 6"			"\n"
+		"less 5 3 2"		"\n"
+		"print 5"			"\n"
+		"less 5 2 3"		"\n"
+		"print 5"			"\n"
+		"print 6"			"\n"
+		// the remainder of a zero divisor is NaN as well
+		"const 3 0"			"\n"
+		"mod 4 2 3"			"\n"
+		"print 4"			"\n"
+		""
+		;
+	for (auto dispatch : {Spasm::Spasm::Dispatch::Switch,
+						  Spasm::Spasm::Dispatch::Threaded,
+						  Spasm::Spasm::Dispatch::Jit,
+						  Spasm::Spasm::Dispatch::Tracing})
+	{
+		Output.str("");
+		Dispatch = dispatch;
+		CompileAndRun(program);
+		// undefined is NaN in arithmetic and comparisons
+		ASSERT_EQ(Output.str(), "nan nan nan 00 nan");
+	}
+}
+
+TEST_F(SPASMTest, ArithmeticOnHole)
+{
+	const char* program =
+		"push 8"			"\n"
+		"array 1"			"\n"
+		"const 2 4"			"\n"
+		"store 1 2 2"		"\n"
+		"const 3 0"			"\n"
+		"const 5 0"			"\n"
+		"const 6 1"			"\n"
+		"label loop"		"\n"
+		"load 7 1 3"		"\n"
+		"add 5 5 7"			"\n"
+		"add 3 3 6"			"\n"
+		"leq 8 3 2"			"\n"
+		"jmpt 8 loop"		"\n"
+		"print 5"			"\n"
+		"const 3 2"			"\n"
+		"load 7 1 3"		"\n"
+		"less 8 7 2"		"\n"
+		"print 8"			"\n"
+		""
+		;
+	for (auto dispatch : {Spasm::Spasm::Dispatch::Switch,
+						  Spasm::Spasm::Dispatch::Threaded,
+						  Spasm::Spasm::Dispatch::Jit,
+						  Spasm::Spasm::Dispatch::Tracing})
+	{
+		Output.str("");
+		Dispatch = dispatch;
+		CompileAndRun(program);
+		// the holes before a[4] are undefined, so the sum is NaN
+		ASSERT_EQ(Output.str(), "nan0");
+	}
+}
+
+TEST_F(SPASMTest, ArithmeticOnElementOutOfRange)
+{
+	const char* program =
+		"push 6"			"\n"
+		"array 1"			"\n"
+		"const 2 0"			"\n"
+		"store 1 2 2"		"\n"
+		"const 3 1"			"\n"
+		"load 4 1 3"		"\n"
+		"sub 5 3 4"			"\n"
+		"print 5"			"\n"
+		"less 6 4 3"		"\n"
+		"print 6"			"\n"
+		""
+		;
+	for (auto dispatch : {Spasm::Spasm::Dispatch::Switch,
+						  Spasm::Spasm::Dispatch::Threaded,
+						  Spasm::Spasm::Dispatch::Jit,
+						  Spasm::Spasm::Dispatch::Tracing})
+	{
+		Output.str("");
+		Dispatch = dispatch;
+		CompileAndRun(program);
+		// a[1] is past the length and undefined
+		ASSERT_EQ(Output.str(), "nan0");
+	}
+}
+
+TEST_F(SPASMTest, ArithmeticOnLengthOfNonArray)
+{
+	const char* program =
+		"push 5"			"\n"
+		"new 1"				"\n"
+		"length 2 1"		"\n"
+		"const 3 1"			"\n"
+		"add 4 2 3"			"\n"
+		"print 4"			"\n"
+		"leq 5 2 3"			"\n"
+		"print 5"			"\n"
+		""
+		;
+	for (auto dispatch : {Spasm::Spasm::Dispatch::Switch,
+						  Spasm::Spasm::Dispatch::Threaded,
+						  Spasm::Spasm::Dispatch::Jit,
+						  Spasm::Spasm::Dispatch::Tracing})
+	{
+		Output.str("");
+		Dispatch = dispatch;
+		CompileAndRun(program);
+		// an object has no length, it is undefined
+		ASSERT_EQ(Output.str(), "nan0");
+	}
+}
+
+TEST_F(SPASMTest, ArrayElementKinds)
+{
+	const char* program =
+		"push 9"				"\n"
+		"string 7 ' '"			"\n"
+		"array 1"				"\n"
+		"const 2 0"				"\n"
+		"const 3 10"			"\n"
+		"const 5 1"				"\n"
+		"label fill"			"\n"
+		"store 1 2 2"			"\n"
+		"add 2 2 5"				"\n"
+		"less 4 2 3"			"\n"
+		"jmpt 4 fill"			"\n"
+		"length 6 1"			"\n"
+		"print 6"				"\n"
+		"print 7"				"\n"
+		// a double makes the small ints doubles
+		"const 8 5"				"\n"
+		"const 6 2"				"\n"
+		"div 8 8 6"				"\n"
+		"const 6 3"				"\n"
+		"store 1 6 8"			"\n"
+		"load 6 1 6"			"\n"
+		"print 6"				"\n"
+		"print 7"				"\n"
+		// a string makes them boxed
+		"const 6 4"				"\n"
+		"store 1 6 7"			"\n"
+		"string 8 'x'"			"\n"
+		"store 1 6 8"			"\n"
+		"load 6 1 6"			"\n"
+		"print 6"				"\n"
+		"print 7"				"\n"
+		// storing past the length leaves holes, they are undefined
+		"const 6 12"			"\n"
+		"store 1 6 6"			"\n"
+		"length 6 1"			"\n"
+		"print 6"				"\n"
+		"const 6 11"			"\n"
+		"load 6 1 6"			"\n"
+		"print 6"				"\n"
+		"print 7"				"\n"
+		// a far away index turns the array into a dictionary
+		"const 6 100000"		"\n"
+		"store 1 6 5"			"\n"
+		"length 6 1"			"\n"
+		"print 6"				"\n"
+		"print 7"				"\n"
+		"const 6 100000"		"\n"
+		"load 6 1 6"			"\n"
+		"print 6"				"\n"
+		"const 6 9"				"\n"
+		"load 6 1 6"			"\n"
+		"print 6"				"\n"
+		"const 6 3"				"\n"
+		"load 6 1 6"			"\n"
+		"print 6"				"\n"
+		"const 6 12"			"\n"
+		"load 6 1 6"			"\n"
+		"print 6"				"\n"
+		"const 6 99999"			"\n"
+		"load 6 1 6"			"\n"
+		"print 6"				"\n"
+		"load 6 7 5"			"\n"
+		"print 6"				"\n"
+		""
+		;
+	for (auto dispatch : {Spasm::Spasm::Dispatch::Switch,
+						  Spasm::Spasm::Dispatch::Threaded,
+						  Spasm::Spasm::Dispatch::Jit})
+	{
+		Output.str("");
+		Dispatch = dispatch;
+		CompileAndRun(program);
+		ASSERT_EQ(Output.str(), "10 2.5 x 13 100001 192.512");
+	}
+}
+
+TEST_F(SPASMTest, PackedSmallIntsAreUnboxed)
+{
+	const char* program =
+		"push 6"				"\n"
+		"array 1"				"\n"
+		"const 2 0"				"\n"
+		"const 3 100000"		"\n"
+		"const 5 1"				"\n"
+		"label fill"			"\n"
+		"store 1 2 2"			"\n"
+		"add 2 2 5"				"\n"
+		"less 4 2 3"			"\n"
+		"jmpt 4 fill"			"\n"
+		"const 2 0"				"\n"
+		"const 6 0"				"\n"
+		"label sum"				"\n"
+		"load 4 1 2"			"\n"
+		"add 6 6 4"				"\n"
+		"add 2 2 5"				"\n"
+		"less 4 2 3"			"\n"
+		"jmpt 4 sum"			"\n"
+		"print 6"				"\n"
+		""
+		;
+	CompileAndRun(program);
+	ASSERT_EQ(Output.str(), "4999950000");
+	VM.CollectGarbage();
+	// four bytes per element, the capacity is at most twice the length
+	ASSERT_LT(VM.GetHeapStats().LiveBytes, 2 * 4 * 100000u + 4096);
+}
+
+TEST_F(SPASMTest, ArrayBuiltins)
+{
+	const char* program =
+		"push 12"				"\n"
+		"string 11 ' '"			"\n"
+		"array 1"				"\n"
+		"const 2 0"				"\n"
+		"const 3 10"			"\n"
+		"const 5 1"				"\n"
+		"label fill"			"\n"
+		"store 1 2 2"			"\n"
+		"add 2 2 5"				"\n"
+		"less 4 2 3"			"\n"
+		"jmpt 4 fill"			"\n"
+		"builtin 6 1 'sum'"		"\n"
+		"print 6"				"\n"
+		"print 11"				"\n"
+		// scaling by a double makes the small ints doubles
+		"const 2 1"				"\n"
+		"const 3 2"				"\n"
+		"div 2 2 3"				"\n"
+		"builtin 6 1 'scale'"	"\n"
+		"builtin 6 1 'max'"		"\n"
+		"print 6"				"\n"
+		"print 11"				"\n"
+		"builtin 6 1 'min'"		"\n"
+		"print 6"				"\n"
+		"print 11"				"\n"
+		"pushr 1"				"\n"
+		"popr 2"				"\n"
+		"builtin 6 1 'dot'"		"\n"
+		"print 6"				"\n"
+		"print 11"				"\n"
+		"builtin 6 1 'add'"		"\n"
+		"builtin 6 6 'sum'"		"\n"
+		"print 6"				"\n"
+		"print 11"				"\n"
+		// copies the last five elements to the start
+		"const 2 0"				"\n"
+		"const 3 -5"			"\n"
+		"const 4 10"			"\n"
+		"builtin 6 1 'copyWithin'"	"\n"
+		"load 7 1 2"			"\n"
+		"print 7"				"\n"
+		"print 11"				"\n"
+		"builtin 6 1 'sum'"		"\n"
+		"print 6"				"\n"
+		"print 11"				"\n"
+		// the holes are not numbers
+		"array 1"				"\n"
+		"const 2 20"			"\n"
+		"store 1 2 2"			"\n"
+		"builtin 6 1 'sum'"		"\n"
+		"print 6"				"\n"
+		"print 11"				"\n"
+		"const 2 3"				"\n"
+		"builtin 6 1 'fill'"	"\n"
+		"builtin 6 1 'max'"		"\n"
+		"print 6"				"\n"
+		""
+		;
+	for (auto dispatch : {Spasm::Spasm::Dispatch::Switch,
+						  Spasm::Spasm::Dispatch::Threaded,
+						  Spasm::Spasm::Dispatch::Jit})
+	{
+		Output.str("");
+		Dispatch = dispatch;
+		CompileAndRun(program);
+		ASSERT_EQ(Output.str(), "45 4.5 0 71.25 45 5 70 nan 3");
+	}
+
+	SpasmImpl::ASM::Bytecode_Memory bytecode;
+	std::istringstream programInput("push 2\narray 1\nbuiltin 0 1 'nope'\n");
+	ASSERT_TRUE(SpasmImpl::ASM::compile(programInput, bytecode));
+	VM.Initialize(bytecode.bytecode().size(), bytecode.bytecode().data(),
+				  Input, Output);
+	ASSERT_EQ(Spasm::Spasm::RunResult::NotImplemented, VM.run());
+}
+
+TEST_F(SPASMTest, ParallelArrayBuiltins)
+{
+	// 300000 elements are split in chunks, 7919 * i % 300007 shuffles them
+	const char* program =
+		"push 12"				"\n"
+		"string 11 ' '"			"\n"
+		"array 1"				"\n"
+		"const 2 0"				"\n"
+		"const 3 300000"		"\n"
+		"const 5 1"				"\n"
+		"const 6 7919"			"\n"
+		"const 7 300007"		"\n"
+		"label fill"			"\n"
+		"mul 8 2 6"				"\n"
+		"mod 8 8 7"				"\n"
+		"store 1 2 8"			"\n"
+		"add 2 2 5"				"\n"
+		"less 4 2 3"			"\n"
+		"jmpt 4 fill"			"\n"
+		"string 2 'add'"		"\n"
+		"builtin 8 1 'reduce'"	"\n"
+		"print 8"				"\n"
+		"print 11"				"\n"
+		"string 2 'sqrt'"		"\n"
+		"builtin 9 1 'map'"		"\n"
+		"builtin 8 9 'sum'"		"\n"
+		"print 8"				"\n"
+		"print 11"				"\n"
+		// the doubles from the largest, the small ints from the smallest
+		"string 10 'descending'"	"\n"
+		"builtin 9 9 'sort'"	"\n"
+		"const 2 0"				"\n"
+		"load 8 9 2"			"\n"
+		"print 8"				"\n"
+		"print 11"				"\n"
+		"builtin 1 1 'sort'"	"\n"
+		"const 2 1"				"\n"
+		"load 8 1 2"			"\n"
+		"print 8"				"\n"
+		"print 11"				"\n"
+		"const 2 150000"		"\n"
+		"load 8 1 2"			"\n"
+		"print 8"				"\n"
+		"print 11"				"\n"
+		"const 2 299999"		"\n"
+		"load 8 1 2"			"\n"
+		"print 8"				"\n"
+		""
+		;
+	for (size_t workers : {0, 3})
+	{
+		Output.str("");
+		VM.SetWorkerThreads(workers);
+		CompileAndRun(program);
+		ASSERT_EQ(Output.str(),
+				  "45000071704 109544447.04381375 547.7280347033553 1 150000 "
+				  "300006");
+	}
+}
+
+TEST(ThreadPool, RunsEveryTaskOnce)
+{
+	SpasmImpl::ThreadPool pool(3);
+	for (size_t round = 0; round < 10; ++round)
+	{
+		std::vector<std::atomic<int>> runs(1000);
+		pool.ParallelFor(runs.size(), [&](size_t i) { ++runs[i]; });
+		for (const auto& count : runs)
+		{
+			ASSERT_EQ(count, 1);
+		}
+	}
+}
+
+TEST(NumericKernels, AgreeOnEveryInstructionSet)
+{
+	using SpasmImpl::KernelIsa;
+	const auto scalar = SpasmImpl::FindNumericKernels(KernelIsa::Scalar);
+	ASSERT_TRUE(scalar);
+	// not a multiple of the lanes, so the remainder is used too
+	std::vector<double> x(1003), y(1003);
+	for (size_t i = 0; i < x.size(); ++i)
+	{
+		x[i] = 1.0 / double(i + 1) - 0.3;
+		y[i] = double(i % 17) * 1e-3 + 1e10;
+	}
+	for (auto isa : {KernelIsa::Sse2, KernelIsa::Avx2})
+	{
+		const auto kernels = SpasmImpl::FindNumericKernels(isa);
+		if (!kernels)
+		{
+			continue;
+		}
+		const auto n = x.size();
+		ASSERT_EQ(kernels->Sum(x.data(), n), scalar->Sum(x.data(), n))
+			<< kernels->Name;
+		ASSERT_EQ(kernels->Dot(x.data(), y.data(), n),
+				  scalar->Dot(x.data(), y.data(), n)) << kernels->Name;
+		ASSERT_EQ(kernels->Min(x.data(), n), scalar->Min(x.data(), n));
+		ASSERT_EQ(kernels->Max(x.data(), n), scalar->Max(x.data(), n));
+
+		auto scaled = x, expected = x;
+		kernels->Scale(scaled.data(), n, 3.5);
+		scalar->Scale(expected.data(), n, 3.5);
+		ASSERT_EQ(scaled, expected);
+		kernels->Add(scaled.data(), y.data(), n);
+		scalar->Add(expected.data(), y.data(), n);
+		ASSERT_EQ(scaled, expected);
+
+		auto nan = x;
+		nan[5] = std::nan("");
+		ASSERT_TRUE(std::isnan(kernels->Min(nan.data(), n)));
+		ASSERT_TRUE(std::isnan(kernels->Max(nan.data(), n)));
+		ASSERT_EQ(kernels->Min(nan.data(), 0), HUGE_VAL);
+	}
+	ASSERT_EQ(scalar->Max(x.data(), 0), -HUGE_VAL);
+}
+
+TEST(Shape, SharesTransitions)
+{
+	SpasmImpl::Heap heap;
+	SpasmImpl::StringTable table(heap);
+	const auto x = table.Get("x", 1);
+	const auto y = table.Get("y", 1);
+	SpasmImpl::Shape root;
+	const auto xy = root.AddProperty(x)->AddProperty(y);
+	ASSERT_EQ(xy, root.AddProperty(x)->AddProperty(y));
+	ASSERT_NE(xy, root.AddProperty(y)->AddProperty(x));
+	ASSERT_EQ(xy->GetSlotCount(), 2u);
+	ASSERT_EQ(xy->Find(x), 0);
+	ASSERT_EQ(xy->Find(y), 1);
+	ASSERT_EQ(root.Find(x), -1);
+}
+
+TEST(StringTable, InternsWithoutCopying)
+{
+	SpasmImpl::Heap heap;
+	SpasmImpl::StringTable table(heap);
+	const std::string text = "answer answer";
+	const auto first = table.Get(text.data(), 6);
+	ASSERT_EQ(std::string(first->GetData(), first->GetLength()), "answer");
+	ASSERT_EQ(first, table.Get(text.data() + 7, 6));
+	ASSERT_NE(first, table.Get(text.data(), 5));
+}
+
+TEST(Heap, SweepsUnreachable)
+{
+	SpasmImpl::Heap heap;
+	SpasmImpl::StringTable table(heap);
+	std::vector<SpasmImpl::SPStringValue*> strings;
+	for (int i = 0; i < 10000; ++i)
+	{
+		const auto text = std::to_string(i);
+		strings.push_back(table.Get(text.data(), text.size()));
+	}
+	const auto size = heap.GetStats().HeapSize;
+	ASSERT_GT(size, 0u);
+
+	heap.BeginCollection();
+	heap.Mark(strings[42]);
+	heap.Trace();
+	table.RemoveUnmarked();
+	heap.Sweep();
+	ASSERT_EQ(heap.GetStats().Collections, 1u);
+	ASSERT_LT(heap.GetStats().HeapSize, size);
+	ASSERT_EQ(heap.GetStats().LiveBytes, 32u);
+	ASSERT_EQ(strings[42], table.Get("42", 2));
+	ASSERT_EQ(heap.GetStats().AllocatedSinceCollection, 0u);
+
+	// the freed cells are reused before the heap grows
+	const auto swept = heap.GetStats().HeapSize;
+	table.Get("new", 3);
+	ASSERT_EQ(heap.GetStats().HeapSize, swept);
+}
+
+TEST(Heap, MinorCollectionFollowsDirtyCards)
+{
+	using SpasmImpl::SPArrayValue;
+	using SpasmImpl::SPStringValue;
+	SpasmImpl::Heap heap;
+	const auto old = heap.NewOld<SPArrayValue>(
+		SPArrayValue::AllocationSize(2), 2);
+	heap.New<SPArrayValue>(SPArrayValue::AllocationSize(8), 8); // garbage
+	const auto young = heap.New<SPArrayValue>(
+		SPArrayValue::AllocationSize(1), 1);
+	const auto string = heap.New<SPStringValue>(
+		SPStringValue::AllocationSize(2), 2);
+	std::memcpy(string->GetData(), "hi", 2);
+	ASSERT_FALSE(heap.IsYoung(old));
+	ASSERT_TRUE(heap.IsYoung(young));
+
+	const Spasm::Value stringValue(Spasm::ValueType::String, string);
+	heap.Store(young, young->GetElements()[0], stringValue);
+	const Spasm::Value youngValue(Spasm::ValueType::Array, young);
+	heap.Store(old, old->GetElements()[1], youngValue);
+
+	// the stack refers only to the string, the array is found by the card
+	Spasm::Value root = stringValue;
+	heap.BeginMinorCollection();
+	heap.Evacuate(root);
+	heap.FinishMinorCollection();
+
+	const auto promoted = static_cast<SPArrayValue*>(
+		old->GetElements()[1].get_pointer());
+	ASSERT_FALSE(heap.IsYoung(promoted));
+	ASSERT_FALSE(heap.IsYoung(root.get_pointer()));
+	ASSERT_EQ(promoted->GetElements()[0].get_pointer(), root.get_pointer());
+	const auto moved = static_cast<SPStringValue*>(root.get_pointer());
+	ASSERT_EQ(std::string(moved->GetData(), moved->GetLength()), "hi");
+	ASSERT_EQ(heap.GetStats().MinorCollections, 1u);
+	ASSERT_EQ(heap.GetStats().PromotedBytes,
+			  SPArrayValue::AllocationSize(1) +
+				  SPStringValue::AllocationSize(2));
+	ASSERT_FALSE(heap.ShouldCollectYoung(SpasmImpl::Heap::NurserySize));
+}
+
+TEST(Heap, MinorCollectionUpdatesCompressedReferences)
+{
+	using SpasmImpl::SPRopeValue;
+	using SpasmImpl::SPStringValue;
+	SpasmImpl::Heap heap;
+	const auto string = [&heap](const char* text) {
+		const auto value = heap.New<SPStringValue>(
+			SPStringValue::AllocationSize(1), 1);
+		value->GetData()[0] = text[0];
+		return value;
+	};
+	const auto rope = heap.NewOld<SPRopeValue>(sizeof(SPRopeValue), 2, 1);
+	heap.Store(rope, rope->GetLeftRef(), string("a"));
+	heap.Store(rope, rope->GetRightRef(), string("b"));
+	ASSERT_EQ(sizeof(rope->GetLeftRef()), 4u);
+
+	// nothing but the card of the rope refers to the strings
+	heap.BeginMinorCollection();
+	heap.FinishMinorCollection();
+
+	ASSERT_FALSE(rope->IsFlattened());
+	std::string characters;
+	for (const auto child : {rope->GetLeft(), rope->GetRight()})
+	{
+		ASSERT_TRUE(child.is_string());
+		ASSERT_FALSE(heap.IsYoung(child.get_pointer()));
+		const auto flat = static_cast<SPStringValue*>(child.get_pointer());
+		characters.append(flat->GetData(), flat->GetLength());
+	}
+	ASSERT_EQ(characters, "ab");
+
+	heap.Store(rope, rope->GetRightRef(), nullptr);
+	ASSERT_TRUE(rope->IsFlattened());
+	ASSERT_EQ(rope->GetRight().get_type(), Spasm::ValueType::Undefined);
+}
+
+TEST(Heap, CompressesReferencesInItsCage)
+{
+	using SpasmImpl::HeapCage;
+	using SpasmImpl::HeapObject;
+	using SpasmImpl::SPArrayValue;
+	SpasmImpl::Heap heap;
+	const auto young = heap.New<SPArrayValue>(
+		SPArrayValue::AllocationSize(1), 1);
+	const auto old = heap.NewOld<SPArrayValue>(
+		SPArrayValue::AllocationSize(1), 1);
+	const auto large = heap.NewOld<SPArrayValue>(
+		SPArrayValue::AllocationSize(4096), 4096);
+	for (const HeapObject* object : {young, old, large})
+	{
+		const auto ref = HeapCage::Compress(object);
+		ASSERT_NE(ref, 0u);
+		ASSERT_EQ(HeapCage::Decompress<const HeapObject>(young, ref), object);
+		ASSERT_EQ(HeapCage::Decompress<const HeapObject>(large, ref), object);
+	}
+	ASSERT_EQ(HeapCage::Decompress<HeapObject>(old, 0), nullptr);
+
+	// freed ranges are reused and read as zeroes
+	HeapCage cage;
+	const auto first = cage.Allocate(3 * HeapCage::PageSize);
+	first[0] = 1;
+	cage.Allocate(HeapCage::PageSize);
+	cage.Free(first, 3 * HeapCage::PageSize);
+	const auto second = cage.Allocate(2 * HeapCage::PageSize);
+	ASSERT_EQ(second, first);
+	ASSERT_EQ(second[0], 0);
+	ASSERT_TRUE(cage.Contains(second));
+	ASSERT_FALSE(cage.Contains(young));
+}
+
+TEST(Heap, ConcurrentMarkingKeepsSnapshot)
+{
+	using SpasmImpl::SPArrayValue;
+	using SpasmImpl::SPStringValue;
+	SpasmImpl::Heap heap;
+	const auto string = [&heap]() {
+		return heap.NewOld<SPStringValue>(SPStringValue::AllocationSize(1), 1);
+	};
+	const auto root = heap.NewOld<SPArrayValue>(
+		SPArrayValue::AllocationSize(2), 2);
+	const auto a = string();
+	const auto b = string();
+	const auto garbage = string();
+	heap.Store(root, root->GetElements()[0],
+			   Spasm::Value(Spasm::ValueType::String, a));
+	heap.Store(root, root->GetElements()[1],
+			   Spasm::Value(Spasm::ValueType::String, b));
+
+	heap.BeginCollection();
+	heap.Mark(root);
+	heap.TraceConcurrently();
+	ASSERT_TRUE(heap.IsMarking());
+	// the only reference to b is overwritten while the helper marks
+	heap.Store(root, root->GetElements()[1],
+			   Spasm::Value(Spasm::ValueType::String, a));
+	const auto allocated = string();
+	while (!heap.IsMarkingDone())
+	{
+		std::this_thread::yield();
+	}
+	heap.FinishConcurrentMarking();
+	ASSERT_TRUE(SpasmImpl::Heap::IsMarked(b));
+	ASSERT_TRUE(SpasmImpl::Heap::IsMarked(allocated));
+	ASSERT_FALSE(SpasmImpl::Heap::IsMarked(garbage));
+	heap.SweepLazily();
+	ASSERT_FALSE(heap.IsMarking());
+
+	const auto& stats = heap.GetStats();
+	ASSERT_EQ(stats.Collections, 1u);
+	ASSERT_EQ(stats.LiveBytes, 4 * 32u);
+	uint64_t pauses = 0;
+	for (auto count : stats.Pauses.Counts)
+	{
+		pauses += count;
+	}
+	ASSERT_EQ(pauses, 2u);
+	ASSERT_GE(stats.Pauses.Percentile(0.99), 1.0);
+
+	// the first allocation in the size class sweeps it
+	const auto reused = string();
+	ASSERT_TRUE(reused == garbage ||
+				garbage->Kind == SpasmImpl::HeapKind::Free);
+}
+
+TEST_F(SPRTTest, CollectKeepsLiterals)
+{
+	Spasm::byte bytecode[] = {
+		OpCodes::Push, 1,
+		OpCodes::String, 1, 4, 'k', 'e', 'p', 't',
+		OpCodes::Print, 1,
+	};
+
+	VM.Initialize(sizeof(bytecode), bytecode, Input, Output, Dispatch);
+	VM.CollectGarbage();
+	ASSERT_EQ(Spasm::Spasm::RunResult::Success, VM.run());
+	ASSERT_EQ(VM.GetHeapStats().Collections, 1u);
+	ASSERT_GT(VM.GetHeapStats().LiveBytes, 0u);
+	ASSERT_EQ(Output.str(), "kept");
+}
+
+TEST(SpasmMachines, ShareBytecodeAcrossThreads)
+{
+	const Spasm::byte bytecode[] = {
+		OpCodes::Push, 4,
+		OpCodes::Read, 1,
+		OpCodes::Const, 2, 2,
+		OpCodes::Mul, 3, 1, 2,
+		OpCodes::Print, 3,
+		OpCodes::String, 4, 2, 'o', 'k',
+		OpCodes::Print, 4,
+	};
+	const std::vector<Spasm::byte> original(std::begin(bytecode),
+											std::end(bytecode));
+
+	std::vector<std::string> outputs(4);
+	std::vector<std::thread> threads;
+	for (size_t t = 0; t < outputs.size(); ++t)
+	{
+		threads.emplace_back([&, t] {
+			for (int run = 0; run < 20; ++run)
+			{
+				std::istringstream input(std::to_string(t));
+				std::ostringstream output;
+				Spasm::Spasm vm;
+				vm.Initialize(sizeof(bytecode), bytecode, input, output);
+				if (vm.run() == Spasm::Spasm::RunResult::Success)
+				{
+					outputs[t] = output.str();
+				}
+			}
+		});
+	}
+	for (auto& thread : threads)
+	{
+		thread.join();
+	}
+	for (size_t t = 0; t < outputs.size(); ++t)
+	{
+		ASSERT_EQ(outputs[t], std::to_string(2 * t) + "ok");
+	}
+	ASSERT_TRUE(std::equal(original.begin(), original.end(), bytecode));
+}
+
+//! Runs programs translated to C by spaot next to the interpreter
+struct AOTTest : public SPASMTest
+{
+	void SetUp() override
+	{
+		// the compiler and a shell to run it with are needed
+		HasCompiler = std::system("cc --version > /dev/null 2>&1") == 0;
+		if (!HasCompiler)
+		{
+			std::cout << "cc is not available, skipping" << std::endl;
+		}
+	}
+
+	void TearDown() override
+	{
+		for (const auto suffix : {".c", ".in", ".out", ".err", ""})
+		{
+			std::remove((Base + suffix).c_str());
+		}
+	}
+
+	//! Translates and compiles \a program, runs it with \a input
+	//! \return the status of the compiled program
+	int CompileNative(const std::string& program, const std::string& input)
+	{
+		SpasmImpl::ASM::Bytecode_Memory bytecode;
+		std::istringstream programInput(program);
+		EXPECT_TRUE(SpasmImpl::ASM::compile(programInput, bytecode));
+		const auto& code = bytecode.bytecode();
+		return CompileNative(code.data(), code.size(), input);
+	}
+
+	//! Translates and compiles \a bytecode, runs it with \a input
+	//! \return the status of the compiled program
+	int CompileNative(const Spasm::byte* bytecode, size_t size,
+					  const std::string& input)
+	{
+		{
+			std::ofstream source(Base + ".c");
+			EXPECT_TRUE(SpasmImpl::AOT::generate_c(bytecode, size, source,
+												   std::cerr));
+		}
+		std::ofstream(Base + ".in") << input;
+		const auto compile = "cc -o \"" + Base + "\" \"" + Base + ".c\"";
+		EXPECT_EQ(std::system(compile.c_str()), 0);
+		const auto run = "\"" + Base + "\" < \"" + Base + ".in\" > \"" +
+						 Base + ".out\" 2> \"" + Base + ".err\"";
+		const auto status = std::system(run.c_str());
+		NativeOutput = read(".out");
+		NativeErrors = read(".err");
+		return status;
+	}
+
+	std::string read(const char* suffix) const
+	{
+		std::ifstream file(Base + suffix);
+		return std::string((std::istreambuf_iterator<char>(file)),
+						   std::istreambuf_iterator<char>());
+	}
+
+	bool HasCompiler = false;
+	const std::string Base = ::testing::TempDir() + "aot";
+	std::string NativeOutput;
+	std::string NativeErrors;
+};
+
+TEST_F(AOTTest, CompiledProgramPrintsLikeTheInterpreter)
+{
+	if (!HasCompiler)
+	{
+		return;
+	}
+	const char* program =
+		"push 5"			"\n"
+		"read 1"			"\n"
+		"const 2 1"			"\n"
+		"pushr 1"			"\n"
+		"pushr 2"			"\n"
+		"call fib"			"\n"
+		"print 4"			"\n"
+		"string 3 ' '"		"\n"
+		"print 3"			"\n"
+		"label loop"		"\n"
+		"const 2 7"			"\n"
+		"div 4 1 2"			"\n"
+		"print 4"			"\n"
+		"print 3"			"\n"
+		"const 2 1"			"\n"
+		"sub 1 1 2"			"\n"
+		"const 2 0"			"\n"
+		"less 2 2 1"		"\n"
+		"jmpt 2 loop"		"\n"
+		"halt"				"\n"
+		"label fib"			"\n"
+		"push 5"			"\n"
+		"const 1 2"			"\n"
+		"less 2 -1 1"		"\n"
+		"jmpf 2 rec"		"\n"
+		"ret -1"			"\n"
+		"label rec"			"\n"
+		"const 1 1"			"\n"
+		"sub 2 -1 1"		"\n"
+		"const 3 1"			"\n"
+		"pushr 2"			"\n"
+		"pushr 3"			"\n"
+		"call fib"			"\n"
+		"const 1 0"			"\n"
+		"add 4 5 1"			"\n"
+		"const 1 2"			"\n"
+		"sub 2 -1 1"		"\n"
+		"pushr 2"			"\n"
+		"pushr 3"			"\n"
+		"call fib"			"\n"
+		"add 4 4 5"			"\n"
+		"ret 4"				"\n"
+		;
+	ASSERT_EQ(CompileNative(program, "15"), 0);
+
+	Input.str("15");
+	CompileAndRun(program);
+	// the compiled program ends its output with a new line, like sprun
+	ASSERT_EQ(NativeOutput, Output.str() + "\n");
+	ASSERT_EQ(NativeOutput.substr(0, 4), "610 ");
+}
+
+TEST_F(AOTTest, CompiledProgramStopsOnStackOverflow)
+{
+	if (!HasCompiler)
+	{
+		return;
+	}
+	const char* program =
+		"const 1 0"			"\n"
+		"pushr 1"			"\n"
+		"call rec"			"\n"
+		"halt"				"\n"
+		"label rec"			"\n"
+		"push 2"			"\n"
+		"const 1 0"			"\n"
+		"pushr 1"			"\n"
+		"call rec"			"\n"
+		"ret 1"				"\n"
+		;
+	ASSERT_NE(CompileNative(program, ""), 0);
+	ASSERT_EQ(NativeErrors, "stack overflow\n");
+}
+
+TEST_F(AOTTest, CompiledProgramConcatenatesAndComparesStrings)
+{
+	if (!HasCompiler)
+	{
+		return;
+	}
+	Spasm::byte bytecode[] = {
+		OpCodes::String, 1, 2, 'a', 'b',
+		OpCodes::String, 2, 2, 'c', 'd',
+		OpCodes::String, 3, 4, 'a', 'b', 'c', 'd',
+		OpCodes::Add, 4, 1, 2,
+		OpCodes::Print, 4,
+		OpCodes::Equal, 5, 4, 3,
+		OpCodes::Print, 5,
+		OpCodes::NotEqual, 5, 4, 3,
+		OpCodes::Print, 5,
+		OpCodes::Equal, 5, 1, 2,
+		OpCodes::Print, 5,
+		OpCodes::Const, 6, 2,
+		OpCodes::Add, 7, 6, 6,
+		OpCodes::Print, 7,
+	};
+	ASSERT_EQ(CompileNative(bytecode, sizeof(bytecode), ""), 0);
+
+	Run(bytecode, sizeof(bytecode));
+	ASSERT_EQ(NativeOutput, Output.str() + "\n");
+	ASSERT_EQ(NativeOutput.substr(0, 4), "abcd");
+}
+
+TEST_F(AOTTest, RejectsInstructionsWithoutCRuntime)
+{
+	const char* program =
+		"const 1 2"			"\n"
+		"new 2"				"\n"
+		"set 2 1 'x'"		"\n"
+		"readline 3"		"\n"
+		"print 1"			"\n"
+		;
+	SpasmImpl::ASM::Bytecode_Memory bytecode;
+	std::istringstream programInput(program);
+	ASSERT_TRUE(SpasmImpl::ASM::compile(programInput, bytecode));
+	const auto& code = bytecode.bytecode();
+	std::ostringstream source;
+	std::ostringstream errors;
+	ASSERT_FALSE(SpasmImpl::AOT::generate_c(code.data(), code.size(), source,
+											errors));
+	ASSERT_EQ(source.str(), "");
+	ASSERT_EQ(errors.str(), "offset 3: new is not supported\n"
+							"offset 5: set is not supported\n"
+							"offset 10: readline is not supported\n");
+}
+
+TEST(MappedFile, ViewsTheWholeFile)
+{
+	const std::string path = ::testing::TempDir() + "mapped.spb";
+	const std::string contents("bytecode\0image", 14);
+	std::ofstream(path, std::ios_base::binary) << contents;
+
+	Spasm::MappedFile file;
+	ASSERT_TRUE(file.Open(path.c_str()));
+	ASSERT_EQ(std::string(reinterpret_cast<const char*>(file.GetData()),
+						  file.GetSize()),
+			  contents);
+	ASSERT_FALSE(file.Open((path + ".missing").c_str()));
+	ASSERT_EQ(file.GetSize(), 0u);
+	std::remove(path.c_str());
+}
+
+TEST(Module, DescribesTheAssembledProgram)
+{
+	const char* program =
+		"const 1 3"			"\n"
+		"label loop"		"\n"
+		"string 2 'x'"		"\n"
+		"print 2"			"\n"
+		"string 2 'x'"		"\n"
+		"sub 1 1 1"			"\n"
+		"jmpt 1 loop"		"\n"
+		;
+	std::istringstream input(program);
+	SpasmImpl::ASM::Bytecode_Memory bytecode;
+	SpasmImpl::ASM::Module_Writer writer(true);
+	ASSERT_TRUE(SpasmImpl::ASM::compile(input, bytecode, &writer));
+	std::ostringstream output;
+	ASSERT_TRUE(writer.write(bytecode.bytecode(), output));
+
+	const auto image = output.str();
+	ASSERT_EQ(image.size() % SpasmImpl::ModuleAlignment, 0u);
+	// the module is used in place, so it has to be aligned
+	std::vector<uint64_t> aligned(image.size() / sizeof(uint64_t));
+	std::memcpy(aligned.data(), image.data(), image.size());
+	const auto data = reinterpret_cast<const Spasm::byte*>(aligned.data());
+
+	Spasm::Module module;
+	ASSERT_TRUE(module.Load(data, image.size()));
+	ASSERT_EQ(std::vector<Spasm::byte>(module.GetCode(),
+									   module.GetCode() +
+										   module.GetCodeSize()),
+			  bytecode.bytecode());
+	// after the header and the table of the five sections
+	ASSERT_EQ(module.GetCode() - data, 152);
+
+	size_t length;
+	ASSERT_EQ(module.GetStringCount(), 1u);
+	const auto string = module.GetString(0, length);
+	ASSERT_EQ(std::string(string, length), "x");
+	ASSERT_EQ(module.GetNumberCount(), 1u);
+	ASSERT_EQ(module.GetNumbers()[0], 3.0);
+	ASSERT_EQ(module.GetSymbolCount(), 1u);
+	const auto name = module.GetSymbolName(0, length);
+	ASSERT_EQ(std::string(name, length), "loop");
+	// const 1 3 is three bytes long
+	ASSERT_EQ(module.GetSymbol(0).Address, 3u);
+
+	ASSERT_EQ(module.GetLineCount(), 6u);
+	ASSERT_EQ(module.FindLine(0), 1u);
+	ASSERT_EQ(module.FindLine(3), 3u);
+	ASSERT_EQ(module.FindLine(module.GetCodeSize() - 1), 7u);
+
+	ASSERT_FALSE(module.Load(data, image.size() - 1));
+	ASSERT_FALSE(module.Load(data + 8, image.size() - 8));
+	// a header that claims to be shorter than itself has no room for the
+	// sections it lists
+	std::vector<uint64_t> truncated(aligned.begin(),
+									aligned.begin() +
+										sizeof(SpasmImpl::ModuleHeader) /
+											sizeof(uint64_t));
+	reinterpret_cast<SpasmImpl::ModuleHeader*>(truncated.data())->Size = 16;
+	ASSERT_FALSE(module.Load(
+		reinterpret_cast<const Spasm::byte*>(truncated.data()),
+		sizeof(SpasmImpl::ModuleHeader)));
+	aligned[0] = 0;
+	ASSERT_FALSE(module.Load(data, image.size()));
+}
+
+TEST(FormatNumber, WritesTheShortestDecimal)
+{
+	const std::pair<double, const char*> cases[] = {
+		{0.1, "0.1"},
+		{1.0 / 3, "0.3333333333333333"},
+		{-2.5, "-2.5"},
+		{1e16, "10000000000000000"},
+		{1e17, "1e+17"},
+		{0.0001, "0.0001"},
+		{1.5e-5, "1.5e-05"},
+		{5e-324, "5e-324"},
+		{1.7976931348623157e308, "1.7976931348623157e+308"},
+		{9007199254740993.0, "9007199254740992"},
+		{-0.0, "-0"},
+		{-HUGE_VAL, "-inf"},
+	};
+	char text[SpasmImpl::NumberLength];
+	for (const auto& c : cases)
+	{
+		const auto length = SpasmImpl::format_number(c.first, text);
+		ASSERT_EQ(std::string(text, length), c.second);
+		ASSERT_EQ(std::strtod(std::string(text, length).c_str(), nullptr),
+				  c.first);
+	}
+	auto length = SpasmImpl::format_number(std::nan(""), text);
+	ASSERT_EQ(std::string(text, length), "nan");
+	length = SpasmImpl::format_integer(-2147483648LL, text);
+	ASSERT_EQ(std::string(text, length), "-2147483648");
+}
+
+TEST_F(SPASMTest, PrintsMoreThanTheOutputBuffer)
+{
+	const char* program =
+		"push 4"			"\n"
+		"const 1 30000"		"\n"
+		"const 2 1"			"\n"
+		"string 3 ' '"		"\n"
+		"label loop"		"\n"
+		"div 4 1 2"			"\n"
+		"print 4"			"\n"
+		"print 3"			"\n"
+		"const 4 1"			"\n"
+		"sub 1 1 4"			"\n"
+		"const 4 4"			"\n"
+		"mul 2 2 4"			"\n"
+		"const 4 1"			"\n"
+		"less 4 4 1"		"\n"
+		"jmpt 4 loop"		"\n"
+		""
+		;
+	std::ostringstream expected;
+	expected.precision(17);
+	double divisor = 1;
+	for (int i = 30000; i > 1; --i, divisor *= 4)
+	{
+		expected << i / divisor << ' ';
+	}
+	CompileAndRun(program);
+	ASSERT_GT(Output.str().size(), SpasmImpl::OutputBufferSize);
+	std::istringstream printed(Output.str());
+	std::istringstream reference(expected.str());
+	double value, wanted;
+	while (reference >> wanted)
+	{
+		ASSERT_TRUE(printed >> value);
+		ASSERT_EQ(value, wanted);
+	}
+	ASSERT_FALSE(printed >> value);
+}
+
+TEST(ParseNumber, ReadsTheNearestDouble)
+{
+	const char* cases[] = {
+		"0.1", "-2.5", "1e23", "9007199254740993", "2.2250738585072011e-308",
+		"4.9e-324", "2e-324", "1e-400", "1.7976931348623157e308", "1e309",
+		"123456789012345678901234567890", "0.30000000000000001665", ".5",
+		"5.", "+7E+2", "-0",
+	};
+	for (const auto text : cases)
+	{
+		const auto end = text + std::strlen(text);
+		double value;
+		ASSERT_EQ(SpasmImpl::parse_number(text, end, value), end) << text;
+		const auto expected = std::strtod(text, nullptr);
+		ASSERT_EQ(std::memcmp(&value, &expected, sizeof(value)), 0) << text;
+	}
+	const std::string partial = "12e+x";
+	double value;
+	ASSERT_EQ(SpasmImpl::parse_number(partial.data(),
+									  partial.data() + partial.size(), value),
+			  partial.data() + 2);
+	ASSERT_EQ(value, 12);
+	const std::string none = "-.e5";
+	ASSERT_EQ(SpasmImpl::parse_number(none.data(), none.data() + none.size(),
+									  value),
+			  none.data());
+}
+
+TEST_F(SPASMTest, ReadsLinesAndNumbers)
+{
+	Input.str("3 1.5 -2e3 0.25\nhello world\r\n\nlast");
+	const char* program =
+		"push 7"				"\n"
+		"const 1 3"				"\n"
+		"readnumbers 2 1"		"\n"
+		"string 6 '|'"			"\n"
+		"length 3 2"			"\n"
+		"print 3"				"\n"
+		"print 6"				"\n"
+		"const 4 2"				"\n"
+		"load 5 2 4"			"\n"
+		"print 5"				"\n"
+		"label loop"			"\n"
+		"print 6"				"\n"
+		"readline 5"			"\n"
+		"print 5"				"\n"
+		"jmpt 5 loop"			"\n"
+		"readnumbers 2 1"		"\n"
+		"length 3 2"			"\n"
+		"print 3"				"\n"
+		""
+		;
+	CompileAndRun(program);
+	ASSERT_EQ(Output.str(), "3|-2000| 0.25|hello world||last|00");
+}
+
+TEST_F(SPASMTest, ReadsNumbersAcrossTheInputBuffer)
+{
+	std::ostringstream input;
+	double sum = 0;
+	for (int i = 0; i < 30000; ++i)
+	{
+		input << i << ".25 ";
+		sum += i + 0.25;
+	}
+	input << "\n" << std::string(SpasmImpl::InputBufferSize, 'x') << "\n7";
+	Input.str(input.str());
+	const char* program =
+		"push 6"				"\n"
+		"const 1 1000000"		"\n"
+		"readnumbers 2 1"		"\n"
+		"length 3 2"			"\n"
+		"print 3"				"\n"
+		"string 4 ' '"			"\n"
+		"print 4"				"\n"
+		"builtin 5 2 'sum'"		"\n"
+		"print 5"				"\n"
+		"print 4"				"\n"
+		"readline 5"			"\n"
+		"length 5 5"			"\n"
+		"print 5"				"\n"
+		"print 4"				"\n"
+		"read 5"				"\n"
+		"print 5"				"\n"
+		""
+		;
+	CompileAndRun(program);
+	std::ostringstream expected;
+	expected.precision(17);
+	expected << "30000 " << sum << " " << SpasmImpl::InputBufferSize << " 7";
+	ASSERT_EQ(Output.str(), expected.str());
+}
+
+TEST_F(SPASMTest, StringInLoopJit)
+{
+	const char* program =
+		"push 3"		"\n"
+		"const 1 3"		"\n"
+		"const 2 1"		"\n"
+		"label loop"	"\n"
+		"string 3 'x'"	"\n"
+		"print 3"		"\n"
+		"sub 1 1 2"		"\n"
+		"jmpt 1 loop"	"\n"
+		""
+		;
+	Dispatch = Spasm::Spasm::Dispatch::Jit;
+	CompileAndRun(program);
+	ASSERT_EQ(Output.str(), "xxx");
+}
+
 TEST_F(SPASMTest, StringS)
 {
 	const char* program =
@@ -64,6 +64,20 @@ end
         uuid(os.uuid('sprun'))
         files '../src/main.cpp'
         links 'sprt'
+        configuration 'Linux'
+            links 'pthread'
+        configuration '*'
+
+    project 'spaot'
+        kind 'ConsoleApp'
+        language 'C++'
+        uuid(os.uuid('spaot'))
+        files '../src/aot/*.cpp'
+        files '../src/aot/*.hpp'
+        links 'sprt'
+        configuration 'Linux'
+            links 'pthread'
+        configuration '*'
 
     -- include '../test'
     startproject 'sprun'
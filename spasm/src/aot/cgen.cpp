@@ -0,0 +1,561 @@
+#include <cstdio>
+
+#include "cgen.hpp"
+
+namespace SpasmImpl
+{
+namespace AOT
+{
+namespace
+{
+// Runtime of the generated program. Values use the NaN-boxing of
+// Spasm::Value, so the generated code behaves as the interpreter does.
+// Numbers are always doubles, it has no Integer fast paths. Concatenated
+// strings are flat copies that are never freed, there are no ropes and no
+// collector.
+const char* const prelude = R"(#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef union
+{
+    double d;
+    uint64_t u;
+} sp_value;
+
+typedef struct
+{
+    const char* data;
+    size_t length;
+} sp_string;
+
+typedef struct
+{
+    int ret;
+    ptrdiff_t fp;
+    ptrdiff_t sp;
+} sp_frame;
+
+/* values on the data stack and nested calls, an overflow stops the program */
+#define SP_STACK_SIZE (1 << 20)
+#define SP_PAYLOAD 0xffffffffffffull
+#define SP_BOOLEAN 0xfffcu
+#define SP_STRING 0xfffdu
+#define SP_TAG(v) ((unsigned)((v).u >> 48))
+
+static void sp_overflow(void)
+{
+    fflush(stdout);
+    fputs("stack overflow\n", stderr);
+    exit(1);
+}
+
+static inline sp_value sp_bits(uint64_t u)
+{
+    sp_value v;
+    v.u = u;
+    return v;
+}
+
+static inline sp_value sp_boolean(int b)
+{
+    return sp_bits(((uint64_t)SP_BOOLEAN << 48) | (uint64_t)(b != 0));
+}
+
+static inline int sp_truthy(sp_value v)
+{
+    return SP_TAG(v) == SP_BOOLEAN ? (v.u & SP_PAYLOAD) != 0 : v.u != 0;
+}
+
+/* the fewest digits that read back as d, laid out as sprun prints them */
+static void sp_print_number(double d)
+{
+    char text[32];
+    char digits[20];
+    int precision, exponent, count = 0, i;
+    if (d != d)
+    {
+        fputs("nan", stdout);
+        return;
+    }
+    if (d == 0 || d - d != 0)
+    {
+        printf("%g", d);
+        return;
+    }
+    for (precision = 1; precision < 17; ++precision)
+    {
+        snprintf(text, sizeof(text), "%.*e", precision - 1, d);
+        if (strtod(text, NULL) == d)
+            break;
+    }
+    snprintf(text, sizeof(text), "%.*e", precision - 1, d);
+    for (i = 0; text[i] != 'e'; ++i)
+    {
+        if (text[i] >= '0' && text[i] <= '9')
+            digits[count++] = text[i];
+    }
+    exponent = atoi(text + i + 1);
+    while (count > 1 && digits[count - 1] == '0')
+        --count;
+    if (d < 0)
+        putchar('-');
+    if (exponent < -4 || exponent > 16)
+    {
+        putchar(digits[0]);
+        if (count > 1)
+        {
+            putchar('.');
+            fwrite(digits + 1, 1, count - 1, stdout);
+        }
+        printf("e%c%02d", exponent < 0 ? '-' : '+', abs(exponent));
+    }
+    else if (exponent < 0)
+    {
+        fputs("0.", stdout);
+        for (i = -1; i > exponent; --i)
+            putchar('0');
+        fwrite(digits, 1, count, stdout);
+    }
+    else
+    {
+        for (i = 0; i < count || i <= exponent; ++i)
+        {
+            if (i == exponent + 1)
+                putchar('.');
+            putchar(i < count ? digits[i] : '0');
+        }
+    }
+}
+
+static inline void sp_print(sp_value v)
+{
+    if (SP_TAG(v) <= 0xfff8u)
+    {
+        sp_print_number(v.d);
+    }
+    else if (SP_TAG(v) == SP_BOOLEAN)
+    {
+        printf("%d", (int)(v.u & 1));
+    }
+    else if (SP_TAG(v) == SP_STRING)
+    {
+        const sp_string* s = (const sp_string*)(uintptr_t)(v.u & SP_PAYLOAD);
+        fwrite(s->data, 1, s->length, stdout);
+    }
+}
+
+static inline sp_value sp_read(void)
+{
+    sp_value v;
+    if (scanf("%lf", &v.d) != 1)
+    {
+        v.d = 0.0;
+    }
+    return v;
+}
+
+static inline sp_value sp_make_string(const sp_string* s)
+{
+    return sp_bits(((uint64_t)SP_STRING << 48) | (uint64_t)(uintptr_t)s);
+}
+
+static inline const sp_string* sp_string_of(sp_value v)
+{
+    return (const sp_string*)(uintptr_t)(v.u & SP_PAYLOAD);
+}
+
+/* NaN for the values that are not numbers, as in the interpreter */
+static inline double sp_number(sp_value v)
+{
+    return SP_TAG(v) <= 0xfff8u ? v.d : (double)NAN;
+}
+
+static inline sp_value sp_double(double d)
+{
+    sp_value v;
+    v.d = d;
+    return v;
+}
+
+/* Strings concatenate, everything else adds as numbers */
+static sp_value sp_add(sp_value a, sp_value b)
+{
+    const sp_string* l;
+    const sp_string* r;
+    sp_string* s;
+    if (SP_TAG(a) != SP_STRING || SP_TAG(b) != SP_STRING)
+        return sp_double(sp_number(a) + sp_number(b));
+    l = sp_string_of(a);
+    r = sp_string_of(b);
+    s = (sp_string*)malloc(sizeof(sp_string) + l->length + r->length);
+    if (!s)
+    {
+        fputs("out of memory\n", stderr);
+        exit(1);
+    }
+    memcpy((char*)(s + 1), l->data, l->length);
+    memcpy((char*)(s + 1) + l->length, r->data, r->length);
+    s->data = (const char*)(s + 1);
+    s->length = l->length + r->length;
+    return sp_make_string(s);
+}
+
+/* Strings are equal if they have the same characters */
+static int sp_equal(sp_value a, sp_value b)
+{
+    const sp_string* l;
+    const sp_string* r;
+    if (SP_TAG(a) != SP_STRING || SP_TAG(b) != SP_STRING)
+        return sp_number(a) == sp_number(b);
+    l = sp_string_of(a);
+    r = sp_string_of(b);
+    return l->length == r->length &&
+           memcmp(l->data, r->data, l->length) == 0;
+}
+
+)";
+
+//! \return the mnemonic of an instruction the generator does not translate,
+//! nullptr for the ones it does
+const char* unsupported(OpCodes opcode)
+{
+    switch (opcode)
+    {
+        case OpCodes::New:
+            return "new";
+        case OpCodes::Get:
+            return "get";
+        case OpCodes::Set:
+            return "set";
+        case OpCodes::GetG:
+            return "getg";
+        case OpCodes::SetG:
+            return "setg";
+        case OpCodes::NewArray:
+            return "array";
+        case OpCodes::LoadElement:
+            return "load";
+        case OpCodes::StoreElement:
+            return "store";
+        case OpCodes::Length:
+            return "length";
+        case OpCodes::Builtin:
+            return "builtin";
+        case OpCodes::ReadLine:
+            return "readline";
+        case OpCodes::ReadNumbers:
+            return "readnumbers";
+        case OpCodes::Invalid:
+            return "an invalid instruction";
+        default:
+            return nullptr;
+    }
+}
+
+const char* compare_operator(OpCodes opcode)
+{
+    switch (opcode)
+    {
+        case OpCodes::Less:
+            return "<";
+        case OpCodes::LessEq:
+            return "<=";
+        case OpCodes::Greater:
+            return ">";
+        default:
+            return ">=";
+    }
+}
+
+const char* arithmetic_operator(OpCodes opcode)
+{
+    switch (opcode)
+    {
+        case OpCodes::Sub:
+            return "-";
+        case OpCodes::Mul:
+            return "*";
+        default:
+            return "/";
+    }
+}
+
+void write_string(std::ostream& output, const byte* bytes, size_t length)
+{
+    char buffer[8];
+    output << '"';
+    for (size_t i = 0; i < length; ++i)
+    {
+        std::snprintf(buffer, sizeof(buffer), "\\%03o",
+                      unsigned(uint8_t(bytes[i])));
+        output << buffer;
+    }
+    output << '"';
+}
+
+class Generator
+{
+   public:
+    Generator(const byte* bytecode, std::ostream& output)
+        : _bytecode(bytecode), _output(output)
+    {
+    }
+
+    void generate(const InstructionStream& code)
+    {
+        SPVector<bool> labels(code.size(), false);
+        SPVector<size_t> returns;
+        for (size_t i = 0; i < code.size(); ++i)
+        {
+            auto instruction = code[i];
+            if (const auto target = BranchTarget(instruction))
+            {
+                labels[size_t(*target)] = true;
+            }
+            if (instruction.OpCode == OpCodes::Call)
+            {
+                labels[i + 1] = true;
+                returns.push_back(i + 1);
+            }
+        }
+
+        _output << prelude;
+        strings(code);
+        _output << "int main(void)\n"
+                   "{\n"
+                   "    static sp_value stack[SP_STACK_SIZE];\n"
+                   "    static sp_frame frames[SP_STACK_SIZE];\n"
+                   "    int frame_count = 0;\n"
+                   "    int ret = 0;\n"
+                   "    sp_value* fp = stack;\n"
+                   "    sp_value* sp = stack;\n";
+        for (size_t i = 0; i < code.size(); ++i)
+        {
+            if (labels[i])
+            {
+                _output << "L" << i << ":\n";
+            }
+            instruction(code[i], i);
+        }
+
+        // Ret jumps back to the call site through the saved index
+        _output << "sp_return:\n"
+                   "    switch (ret)\n"
+                   "    {\n";
+        for (const auto site : returns)
+        {
+            _output << "        case " << site << ":\n"
+                    << "            goto L" << site << ";\n";
+        }
+        _output << "        default:\n"
+                   "            goto sp_halt;\n"
+                   "    }\n"
+                   "sp_halt:\n"
+                   "    (void)frame_count;\n"
+                   "    (void)ret;\n"
+                   "    (void)sp;\n"
+                   "    printf(\"\\n\");\n"
+                   "    return 0;\n"
+                   "}\n";
+    }
+
+   private:
+    //! The string constants of the program, indexed by instruction
+    void strings(const InstructionStream& code)
+    {
+        for (size_t i = 0; i < code.size(); ++i)
+        {
+            if (code[i].OpCode == OpCodes::String)
+            {
+                _output << "static const sp_string sp_string_" << i << " = {";
+                write_string(_output, _bytecode + code[i].A1,
+                             size_t(code[i].A2));
+                _output << ", " << code[i].A2 << "};\n";
+            }
+        }
+        _output << "\n";
+    }
+
+    std::ostream& statement() { return _output << "    "; }
+
+    std::ostream& local(int32_t reg) { return _output << "fp[" << reg << "]"; }
+
+    //! Stops the program unless \a count more values fit on the stack
+    void overflow_check(int32_t count)
+    {
+        statement() << "if (stack + SP_STACK_SIZE - sp < " << count << ")\n";
+        statement() << "    sp_overflow();\n";
+    }
+
+    void instruction(const Instruction& i, size_t index)
+    {
+        switch (i.OpCode)
+        {
+            case OpCodes::Halt:
+                statement() << "goto sp_halt;\n";
+                break;
+            case OpCodes::Dup:
+                overflow_check(1);
+                statement() << "*sp = sp[-1];\n";
+                statement() << "++sp;\n";
+                break;
+            case OpCodes::Pop:
+                statement() << "sp -= " << i.A0 << ";\n";
+                break;
+            case OpCodes::PopTo:
+                statement();
+                local(i.A0) << " = *--sp;\n";
+                break;
+            case OpCodes::PushFrom:
+                overflow_check(1);
+                statement() << "*sp++ = ";
+                local(i.A0) << ";\n";
+                break;
+            case OpCodes::Push:
+                overflow_check(i.A0);
+                statement() << "for (int i = 0; i < " << i.A0
+                            << "; ++i)\n";
+                statement() << "    *sp++ = sp_bits(0);\n";
+                break;
+            case OpCodes::Print:
+                statement() << "sp_print(";
+                local(i.A0) << ");\n";
+                break;
+            case OpCodes::Read:
+                statement();
+                local(i.A0) << " = sp_read();\n";
+                break;
+            case OpCodes::Call:
+                statement() << "if (frame_count == SP_STACK_SIZE)\n";
+                statement() << "    sp_overflow();\n";
+                statement() << "frames[frame_count].ret = " << index + 1
+                            << ";\n";
+                statement() << "frames[frame_count].fp = fp - stack;\n";
+                statement() << "frames[frame_count].sp = sp - stack - "
+                               "(ptrdiff_t)sp[-1].d - 1;\n";
+                statement() << "++frame_count;\n";
+                statement() << "fp = sp - 1;\n";
+                statement() << "goto L" << i.A0 << ";\n";
+                break;
+            case OpCodes::Ret:
+                statement() << "--frame_count;\n";
+                statement() << "sp = stack + frames[frame_count].sp;\n";
+                statement() << "sp[-1] = ";
+                local(i.A0) << ";\n";
+                statement() << "fp = stack + frames[frame_count].fp;\n";
+                statement() << "ret = frames[frame_count].ret;\n";
+                statement() << "goto sp_return;\n";
+                break;
+            case OpCodes::Jump:
+                statement() << "goto L" << i.A0 << ";\n";
+                break;
+            case OpCodes::JumpT:
+            case OpCodes::JumpF:
+                statement() << "if ("
+                            << (i.OpCode == OpCodes::JumpF ? "!" : "")
+                            << "sp_truthy(";
+                local(i.A0) << "))\n";
+                statement() << "    goto L" << i.A1 << ";\n";
+                break;
+            case OpCodes::Const:
+            {
+                const data_t number(i.Value.get_number());
+                char bits[32];
+                std::snprintf(bits, sizeof(bits), "0x%016llxull",
+                              (unsigned long long)number.m_value.as_int64);
+                statement();
+                local(i.A0) << " = sp_bits(" << bits << ");  /* " << number
+                            << " */\n";
+                break;
+            }
+            case OpCodes::String:
+                statement();
+                local(i.A0) << " = sp_make_string(&sp_string_" << index
+                            << ");\n";
+                break;
+            case OpCodes::Add:
+                statement();
+                local(i.A0) << " = sp_add(";
+                local(i.A1) << ", ";
+                local(i.A2) << ");\n";
+                break;
+            case OpCodes::Sub:
+            case OpCodes::Mul:
+            case OpCodes::Div:
+                statement();
+                local(i.A0) << ".d = sp_number(";
+                local(i.A1) << ") " << arithmetic_operator(i.OpCode)
+                            << " sp_number(";
+                local(i.A2) << ");\n";
+                break;
+            case OpCodes::Mod:
+                // fmod of the truncated operands is the int64_t remainder,
+                // but NaN for NaN and zero divisors instead of a trap
+                statement();
+                local(i.A0) << ".d = fmod(trunc(sp_number(";
+                local(i.A1) << ")), trunc(sp_number(";
+                local(i.A2) << ")));\n";
+                break;
+            case OpCodes::Equal:
+            case OpCodes::NotEqual:
+                statement();
+                local(i.A0) << " = sp_boolean("
+                            << (i.OpCode == OpCodes::Equal ? "" : "!")
+                            << "sp_equal(";
+                local(i.A1) << ", ";
+                local(i.A2) << "));\n";
+                break;
+            case OpCodes::Less:
+            case OpCodes::LessEq:
+            case OpCodes::Greater:
+            case OpCodes::GreaterEq:
+                statement();
+                local(i.A0) << " = sp_boolean(sp_number(";
+                local(i.A1) << ") " << compare_operator(i.OpCode)
+                            << " sp_number(";
+                local(i.A2) << "));\n";
+                break;
+            default:
+                // only the trap the decoder adds for jumps into the middle
+                // of an instruction, check rejects the others
+                statement()
+                    << "fprintf(stderr, \"invalid jump target\\n\");\n";
+                statement() << "return 1;\n";
+                break;
+        }
+    }
+
+    const byte* _bytecode;
+    std::ostream& _output;
+};
+}  // namespace
+
+bool generate_c(const byte* bytecode, size_t size, std::ostream& output,
+                std::ostream& errors)
+{
+    InstructionStream code;
+    SPVector<size_t> offsets;
+    DecodeByteCode(bytecode, size, code, &offsets);
+    bool supported = true;
+    // the Halt and the trap after the program have no offset
+    for (size_t i = 0; i < offsets.size(); ++i)
+    {
+        if (const auto name = unsupported(code[i].OpCode))
+        {
+            errors << "offset " << offsets[i] << ": " << name
+                   << " is not supported" << std::endl;
+            supported = false;
+        }
+    }
+    if (supported)
+    {
+        Generator(bytecode, output).generate(code);
+    }
+    return supported;
+}
+}  // namespace AOT
+}  // namespace SpasmImpl
@@ -0,0 +1,32 @@
+#ifndef CGEN_HPP
+#define CGEN_HPP
+
+#include <iostream>
+
+#include "../spasm_impl.hpp"
+
+namespace SpasmImpl
+{
+namespace AOT
+{
+//! Translates a program into a standalone C translation unit
+/*!
+** Every jump target and return site of the decoded program becomes a
+** label, jumps become gotos and Call/Ret keep an explicit frame stack with
+** the same layout as the interpreter's Frame. Overflowing the data stack or
+** the frame stack stops the program with "stack overflow" and status 1.
+**
+** The objects, arrays, builtins and the line and number input have no C
+** runtime. Programs that use them, or that have invalid instructions, are
+** rejected.
+**
+** \return false if the program is rejected, \a errors gets the byte offset
+** and the mnemonic of every instruction that can't be translated and
+** nothing is written to \a output
+*/
+bool generate_c(const byte* bytecode, size_t size, std::ostream& output,
+                std::ostream& errors);
+}  // namespace AOT
+}  // namespace SpasmImpl
+
+#endif  // CGEN_HPP
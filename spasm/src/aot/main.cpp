@@ -0,0 +1,57 @@
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+#include "../mappedfile.hpp"
+#include "../module.hpp"
+#include "cgen.hpp"
+
+// spaot program.spb program.c [executable]
+// Translates the bytecode into C and optionally compiles it with $CC or cc.
+int main(int argc, const char* argv[])
+{
+    if (argc != 3 && argc != 4)
+    {
+        std::cerr << "usage: spaot program.spb program.c [executable]"
+                  << std::endl;
+        return 1;
+    }
+
+    SpasmImpl::MappedFile image;
+    SpasmImpl::Module module;
+    if (!image.Open(argv[1]) ||
+        !module.Load(image.GetData(), image.GetSize()))
+    {
+        std::cerr << argv[1] << ": not a module" << std::endl;
+        return 1;
+    }
+
+    {
+        std::ofstream output(argv[2]);
+        if (!SpasmImpl::AOT::generate_c(module.GetCode(),
+                                        module.GetCodeSize(), output,
+                                        std::cerr))
+        {
+            std::cerr << argv[1] << ": can't be translated to C" << std::endl;
+            output.close();
+            std::remove(argv[2]);
+            return 1;
+        }
+        if (!output)
+        {
+            std::cerr << argv[2] << ": could not write" << std::endl;
+            return 1;
+        }
+    }
+
+    if (argc == 4)
+    {
+        const char* cc = std::getenv("CC");
+        const auto command = std::string(cc ? cc : "cc") + " -O2 -o \"" +
+                             argv[3] + "\" \"" + argv[2] + "\"";
+        return std::system(command.c_str()) == 0 ? 0 : 1;
+    }
+    return 0;
+}
@@ -0,0 +1,72 @@
+#ifndef ARRAY_HPP
+#define ARRAY_HPP
+
+#include "object.hpp"
+#include "types.hpp"
+
+namespace SpasmImpl
+{
+//! Fixed length array in the Heap, the elements follow the object
+/*!
+** Stores to the elements have to go through Heap::Store.
+*/
+class SPArrayValue : public HeapObject
+{
+   public:
+    explicit SPArrayValue(size_t length) : m_Length(length)
+    {
+        Kind = HeapKind::Array;
+        for (size_t i = 0; i < length; ++i)
+        {
+            new (GetElements() + i) data_t();
+        }
+    }
+
+    SPArrayValue(const SPArrayValue&) = delete;
+    SPArrayValue& operator=(const SPArrayValue&) = delete;
+
+    data_t* GetElements() { return reinterpret_cast<data_t*>(this + 1); }
+    const data_t* GetElements() const
+    {
+        return reinterpret_cast<const data_t*>(this + 1);
+    }
+    size_t GetLength() const { return m_Length; }
+
+    //! \return bytes needed for an array with \a length elements
+    static size_t AllocationSize(size_t length)
+    {
+        return sizeof(SPArrayValue) + length * sizeof(data_t);
+    }
+
+   private:
+    size_t m_Length;
+};
+
+//! Fixed size block of raw bytes in the Heap, the collector does not look
+//! into it
+class SPBufferValue : public HeapObject
+{
+   public:
+    explicit SPBufferValue(size_t size) : m_Size(size)
+    {
+        Kind = HeapKind::Buffer;
+    }
+
+    SPBufferValue(const SPBufferValue&) = delete;
+    SPBufferValue& operator=(const SPBufferValue&) = delete;
+
+    uint8_t* GetData() { return reinterpret_cast<uint8_t*>(this + 1); }
+    size_t GetSize() const { return m_Size; }
+
+    //! \return bytes needed for a buffer of \a size bytes
+    static size_t AllocationSize(size_t size)
+    {
+        return sizeof(SPBufferValue) + size;
+    }
+
+   private:
+    size_t m_Size;
+};
+
+}  // namespace SpasmImpl
+#endif  // #ifndef ARRAY_HPP
@@ -9,8 +9,10 @@ namespace SpasmImpl
 {
 namespace ASM
 {
-Assembler::Assembler(Lexer::Tokenizer& tokenizer, Bytecode_Stream& bytecode)
-    : _tokenizer(&tokenizer), _bytecode(&bytecode)
+Assembler::Assembler(Lexer::Tokenizer& tokenizer,
+                     Bytecode_Stream& bytecode,
+                     Module_Writer* module)
+    : _tokenizer(&tokenizer), _bytecode(&bytecode), _module(module)
 {
 }
 
@@ -79,6 +81,29 @@ int get_arg_size(const Lexer::Token args[])
     return size;
 }
 
+//! Number of arguments of the instruction token \a type
+int get_arg_count(Lexer::Token::Token_type type)
+{
+    switch (type)
+    {
+        case Lexer::Token::New:
+        case Lexer::Token::NewArray:
+        case Lexer::Token::ReadLine:
+            return 1;
+        case Lexer::Token::GetG:
+        case Lexer::Token::SetG:
+        case Lexer::Token::Length:
+        case Lexer::Token::ReadNumbers:
+            return 2;
+        default:
+            return type >= Lexer::Token::_ThreeArgBegin
+                       ? 3
+                       : type >= Lexer::Token::_TwoArgBegin
+                             ? 2
+                             : type >= Lexer::Token::_OneArgBegin ? 1 : 0;
+    }
+}
+
 void Assembler::assemble()
 {
     Lexer::Token token = _tokenizer->next_token();
@@ -105,19 +130,16 @@ void Assembler::assemble()
         else
         {
             Lexer::Token args[3];
-            if (type >= Lexer::Token::_OneArgBegin)
-            {
-                args[0] = _tokenizer->next_token();
-            }
-            if (type >= Lexer::Token::_TwoArgBegin)
+            const auto count = get_arg_count(type);
+            for (int i = 0; i < count; ++i)
             {
-                args[1] = _tokenizer->next_token();
+                args[i] = _tokenizer->next_token();
             }
-            if (type >= Lexer::Token::_ThreeArgBegin)
+            const auto size = get_arg_size(args);
+            if (_module)
             {
-                args[2] = _tokenizer->next_token();
+                _module->add_line(_bytecode->size(), token.lineno() + 1);
             }
-            const auto size = get_arg_size(args);
             _bytecode->push_opcode(
                 (Bytecode_Stream::Opcode_t)((size << 6) | token.type()));
             const auto arg_size = 1 << size;
@@ -142,20 +164,28 @@ void Assembler::assemble()
                     assert(args[1].type() == Lexer::Token::Ident);
                     assemble_identifier(args[1]);
                 }
-                else if (type == Lexer::Token::String)
+                else if (type == Lexer::Token::String ||
+                         type == Lexer::Token::GetG ||
+                         type == Lexer::Token::SetG)
                 {
                     assert(args[1].type() == Lexer::Token::StringValue);
                     const auto& s = args[1].value_str();
+                    add_string(s);
                     _bytecode->push_string(s.data(), s.size(), arg_size);
                 }
                 else
                 {
                     if (args[1].type() == Lexer::Token::Integer)
                     {
+                        if (type == Lexer::Token::Const)
+                        {
+                            add_number(double(args[1].value_int()));
+                        }
                         _bytecode->push_integer(args[1].value_int(), arg_size);
                     }
                     else if (args[1].type() == Lexer::Token::FloatingPoint)
                     {
+                        add_number(args[1].value_double());
                         _bytecode->push_double(args[1].value_double());
                     }
                     else
@@ -164,7 +194,15 @@ void Assembler::assemble()
                     }
                 }
             }
-            if (args[2].type() != Lexer::Token::NotUsed)
+            if (type == Lexer::Token::Get || type == Lexer::Token::Set ||
+                type == Lexer::Token::Builtin)
+            {
+                assert(args[2].type() == Lexer::Token::StringValue);
+                const auto& s = args[2].value_str();
+                add_string(s);
+                _bytecode->push_string(s.data(), s.size(), arg_size);
+            }
+            else if (args[2].type() != Lexer::Token::NotUsed)
             {
                 assert(args[2].type() == Lexer::Token::Integer);
                 _bytecode->push_integer(args[2].value_int(), arg_size);
@@ -180,6 +218,26 @@ void Assembler::assemble()
         backpatch(i->second);
         ++i;
     }
+    if (_module)
+    {
+        _module->add_symbols(_symbols);
+    }
+}
+
+void Assembler::add_string(const std::string& s)
+{
+    if (_module)
+    {
+        _module->add_string(s);
+    }
+}
+
+void Assembler::add_number(double number)
+{
+    if (_module)
+    {
+        _module->add_number(number);
+    }
 }
 
 void Assembler::backpatch(const Symbol* symbol)
@@ -198,10 +256,12 @@ void Assembler::assemble_identifier(const Lexer::Token& token)
     _bytecode->push_location(symbol->definition());
 }
 
-bool compile(std::istream& istr, Bytecode_Stream& bytecode)
+bool compile(std::istream& istr,
+             Bytecode_Stream& bytecode,
+             Module_Writer* module)
 {
     Lexer::Tokenizer tokenizer(istr);
-    Assembler assembler(tokenizer, bytecode);
+    Assembler assembler(tokenizer, bytecode, module);
 
     assembler.assemble();
 
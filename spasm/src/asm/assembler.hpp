@@ -4,6 +4,7 @@
 #include <iostream>
 
 #include "bytecode.hpp"
+#include "module_writer.hpp"
 #include "symbol.hpp"
 #include "tokenizer.hpp"
 
@@ -14,22 +15,29 @@ namespace ASM
 class Assembler
 {
    public:
-    Assembler(Lexer::Tokenizer&, Bytecode_Stream&);
+    //! \param module - when given, collects the constants, the symbols and
+    //! the lines of the program
+    Assembler(Lexer::Tokenizer&, Bytecode_Stream&, Module_Writer* = NULL);
 
     void assemble();
 
    private:
     void backpatch(const Symbol*);
     void assemble_identifier(const Lexer::Token&);
+    void add_string(const std::string&);
+    void add_number(double);
 
     Lexer::Tokenizer* _tokenizer;
     Bytecode_Stream* _bytecode;
+    Module_Writer* _module;
 
     Symbol_Table _symbols;
 
 };  // class Assembler
 
-bool compile(std::istream&, Bytecode_Stream& bytecode);
+bool compile(std::istream&,
+             Bytecode_Stream& bytecode,
+             Module_Writer* module = NULL);
 }  // namespace ASM
 }  // namespace SpasmImpl
 
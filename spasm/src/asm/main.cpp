@@ -1,22 +1,30 @@
+#include <cstring>
 #include <fstream>
 #include <iostream>
 #include "assembler.hpp"
+#include "module_writer.hpp"
 
+// spasm [-g] program.spa program.spb
+// Assembles the program into a module, -g adds the table of source lines.
 int main(int argc, const char* argv[])
 {
-    if (argc != 3)
+    const bool lines = argc == 4 && std::strcmp(argv[1], "-g") == 0;
+    if (argc != 3 && !lines)
         return 1;
-    SpasmImpl::ASM::Bytecode_Memory bytecode;
-    std::ifstream input(argv[1]);
-    SpasmImpl::ASM::compile(input, bytecode);
+    const auto source = argv[argc - 2];
+    const auto target = argv[argc - 1];
 
-    std::ofstream output(argv[2], std::ios_base::out | std::ios_base::binary);
+    SpasmImpl::ASM::Bytecode_Memory bytecode;
+    SpasmImpl::ASM::Module_Writer module(lines);
+    std::ifstream input(source);
+    SpasmImpl::ASM::compile(input, bytecode, &module);
 
-    // output.write ("SPASM", 5);
-    auto& bc = bytecode.bytecode();
-    auto size = bc.size();
-    output.write(reinterpret_cast<const char*>(&size), sizeof(size));
-    output.write(reinterpret_cast<const char*>(bc.data()), size);
+    std::ofstream output(target, std::ios_base::out | std::ios_base::binary);
+    if (!module.write(bytecode.bytecode(), output))
+    {
+        std::cerr << target << ": could not write" << std::endl;
+        return 1;
+    }
 
     return 0;
 }
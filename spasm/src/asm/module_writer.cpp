@@ -0,0 +1,152 @@
+#include <cstring>
+
+#include "../module.hpp"
+#include "module_writer.hpp"
+
+namespace SpasmImpl
+{
+namespace ASM
+{
+namespace
+{
+template <typename T>
+void append(std::string& out, const T& value)
+{
+    out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+size_t padded(size_t size)
+{
+    return (size + ModuleAlignment - 1) / ModuleAlignment * ModuleAlignment;
+}
+
+//! The count, the entries and the names of a Strings or Symbols section
+std::string names_table(const std::vector<std::string>& names,
+                        const std::vector<uint64_t>* addresses)
+{
+    const auto entry_size =
+        addresses ? sizeof(ModuleSymbol) : sizeof(ModuleString);
+    std::string table;
+    append(table, uint64_t(names.size()));
+    uint64_t offset = sizeof(uint64_t) + names.size() * entry_size;
+    for (size_t i = 0; i < names.size(); ++i)
+    {
+        append(table, ModuleString{offset, names[i].size()});
+        if (addresses)
+        {
+            append(table, (*addresses)[i]);
+        }
+        offset += names[i].size();
+    }
+    for (const auto& name : names)
+    {
+        table += name;
+    }
+    return table;
+}
+}  // namespace
+
+Module_Writer::Module_Writer(bool lines) : _lines(lines) {}
+
+void Module_Writer::add_string(const std::string& s)
+{
+    if (_string_set.insert(s).second)
+    {
+        _strings.push_back(s);
+    }
+}
+
+void Module_Writer::add_number(double number)
+{
+    uint64_t bits;
+    std::memcpy(&bits, &number, sizeof(bits));
+    if (_number_set.insert(bits).second)
+    {
+        _numbers.push_back(number);
+    }
+}
+
+/*!
+** Records that the instruction at \a address comes from \a line, which
+** starts from 1. Nothing is recorded unless the line table was asked for.
+*/
+void Module_Writer::add_line(size_t address, size_t line)
+{
+    if (_lines && (_line_table.empty() || _line_table.back().second != line))
+    {
+        _line_table.emplace_back(address, line);
+    }
+}
+
+void Module_Writer::add_symbols(const Symbol_Table& symbols)
+{
+    for (auto i = symbols.begin(); i != symbols.end(); ++i)
+    {
+        _symbol_names.push_back(i->second->identifier());
+        _symbol_addresses.push_back(i->second->definition());
+    }
+}
+
+/*!
+** Writes the header, the section table and the sections, each padded to
+** ModuleAlignment.
+**
+** \return false if the stream fails
+*/
+bool Module_Writer::write(const Bytecode_Memory::Bytecode& code,
+                          std::ostream& output) const
+{
+    std::string lines;
+    for (const auto& line : _line_table)
+    {
+        append(lines, ModuleLine{line.first, line.second});
+    }
+    const auto strings = names_table(_strings, nullptr);
+    const auto symbols = names_table(_symbol_names, &_symbol_addresses);
+    struct Section
+    {
+        SectionKind kind;
+        const void* data;
+        size_t size;
+    };
+    std::vector<Section> sections = {
+        {SectionKind::Code, code.data(), code.size()},
+        {SectionKind::Strings, strings.data(), strings.size()},
+        {SectionKind::Numbers, _numbers.data(),
+         _numbers.size() * sizeof(double)},
+        {SectionKind::Symbols, symbols.data(), symbols.size()},
+    };
+    if (_lines)
+    {
+        sections.push_back({SectionKind::Lines, lines.data(), lines.size()});
+    }
+
+    ModuleHeader header = {};
+    std::memcpy(header.Magic, ModuleMagic, sizeof(ModuleMagic));
+    header.Version = ModuleVersion;
+    header.Flags = _lines ? uint32_t(ModuleHasLines) : 0u;
+    header.SectionCount = uint32_t(sections.size());
+
+    std::string table;
+    uint64_t offset =
+        sizeof(ModuleHeader) + sections.size() * sizeof(ModuleSection);
+    for (const auto& section : sections)
+    {
+        append(table, ModuleSection{section.kind, 0, offset, section.size});
+        offset += padded(section.size);
+    }
+    header.Size = offset;
+
+    const char padding[ModuleAlignment] = {};
+    output.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    output.write(table.data(), table.size());
+    for (const auto& section : sections)
+    {
+        output.write(static_cast<const char*>(section.data), section.size);
+        output.write(padding, padded(section.size) - section.size);
+    }
+    return bool(output);
+}
+
+}  // namespace ASM
+}  // namespace SpasmImpl
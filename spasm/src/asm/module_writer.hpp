@@ -0,0 +1,50 @@
+#ifndef MODULE_WRITER_HPP
+#define MODULE_WRITER_HPP
+
+#include <cstdint>
+#include <iostream>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "bytecode.hpp"
+#include "symbol.hpp"
+
+namespace SpasmImpl
+{
+namespace ASM
+{
+//! Collects what the assembler knows about a program and writes it as a
+//! module, see module.hpp for the layout
+class Module_Writer
+{
+   public:
+    //! \param lines - whether to write the line table
+    explicit Module_Writer(bool lines = false);
+
+    void add_string(const std::string&);
+    void add_number(double);
+    void add_line(size_t address, size_t line);
+    void add_symbols(const Symbol_Table&);
+
+    bool write(const Bytecode_Memory::Bytecode&, std::ostream&) const;
+
+   private:
+    bool _lines;
+
+    //! the distinct strings and numbers in the order they first appear
+    std::vector<std::string> _strings;
+    std::set<std::string> _string_set;
+    std::vector<double> _numbers;
+    //! by the bits of the numbers, so -0.0 and NaNs are kept as they are
+    std::set<uint64_t> _number_set;
+
+    std::vector<std::string> _symbol_names;
+    std::vector<uint64_t> _symbol_addresses;
+    std::vector<std::pair<uint64_t, uint64_t>> _line_table;
+
+};  // class Module_Writer
+}  // namespace ASM
+}  // namespace SpasmImpl
+
+#endif  // MODULE_WRITER_HPP
@@ -40,6 +40,23 @@ class Token
         Mod,
         Less,
         LessEq,
+        // the values of the instruction tokens are their opcodes
+        Greater,
+        GreaterEq,
+        Equal,
+        NotEqual,
+        New,
+        Get,
+        Set,
+        GetG,
+        SetG,
+        NewArray,
+        LoadElement,
+        StoreElement,
+        Length,
+        Builtin,
+        ReadLine,
+        ReadNumbers,
         _NotOpCodeBegin,
         Label = _NotOpCodeBegin,
         Ident,
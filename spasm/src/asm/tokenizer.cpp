@@ -12,6 +12,37 @@ namespace ASM
 {
 namespace Lexer
 {
+namespace
+{
+//! Instructions without a rule in the lexer, they are lexed as identifiers
+const struct
+{
+    const char* name;
+    Token::Token_type type;
+} mnemonics[] = {
+    {"new", Token::New},   {"get", Token::Get},   {"set", Token::Set},
+    {"getg", Token::GetG}, {"setg", Token::SetG}, {"array", Token::NewArray},
+    {"load", Token::LoadElement}, {"store", Token::StoreElement},
+    {"length", Token::Length}, {"builtin", Token::Builtin},
+    {"readline", Token::ReadLine}, {"readnumbers", Token::ReadNumbers},
+};
+
+Token keyword(const Token& token)
+{
+    if (token.type() == Token::Ident)
+    {
+        for (const auto& mnemonic : mnemonics)
+        {
+            if (token.value_str() == mnemonic.name)
+            {
+                return Token(mnemonic.type, token.lineno());
+            }
+        }
+    }
+    return token;
+}
+}  // namespace
+
 Tokenizer::Tokenizer(std::istream& istr)
     : _lexer(new Lexer(istr, 1024)), end_input(false)
 {
@@ -20,7 +51,7 @@ Tokenizer::Tokenizer(std::istream& istr)
 
 void Tokenizer::push_token(const Token& token)
 {
-    _tokens.push(token);
+    _tokens.push(keyword(token));
     if (token.type() == Token::EndInput)
         end_input = true;
 }
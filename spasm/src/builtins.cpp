@@ -0,0 +1,776 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <vector>
+
+#include "elements.hpp"
+#include "rope.hpp"
+#include "spasm_impl.hpp"
+#include "threadpool.hpp"
+
+namespace SpasmImpl
+{
+namespace
+{
+//! Indices of the builtins in the A2 of Builtin instructions
+enum BuiltinId : int32_t
+{
+    Sum,
+    Min,
+    Max,
+    Dot,
+    Scale,
+    AddArrays,
+    Fill,
+    CopyWithin,
+    Sort,
+    Reduce,
+    Map,
+};
+
+//! Names of the builtins in the order of BuiltinId
+const char* const s_Builtins[] = {
+    "sum",  "min",        "max",  "dot",    "scale", "add",
+    "fill", "copyWithin", "sort", "reduce", "map",
+};
+
+//! Operations of reduce, ReduceDot is only for dot
+enum Reduction : int32_t
+{
+    ReduceAdd,
+    ReduceMultiply,
+    ReduceMin,
+    ReduceMax,
+    ReduceDot,
+};
+
+//! Names of the operations of reduce in the order of Reduction
+const char* const s_Reductions[] = {"add", "mul", "min", "max"};
+
+//! Operations of map, the binary ones take the argument after the name
+const struct
+{
+    const char* Name;
+    double (*Apply)(double x, double argument);
+} s_MapOperations[] = {
+    {"abs", [](double x, double) { return std::fabs(x); }},
+    {"neg", [](double x, double) { return -x; }},
+    {"sqrt", [](double x, double) { return std::sqrt(x); }},
+    {"square", [](double x, double) { return x * x; }},
+    {"floor", [](double x, double) { return std::floor(x); }},
+    {"ceil", [](double x, double) { return std::ceil(x); }},
+    {"add", [](double x, double y) { return x + y; }},
+    {"sub", [](double x, double y) { return x - y; }},
+    {"mul", [](double x, double y) { return x * y; }},
+    {"div", [](double x, double y) { return x / y; }},
+    {"pow", [](double x, double y) { return std::pow(x, y); }},
+};
+
+//! Elements of a task of the parallel builtins. The split does not depend
+//! on the number of threads, so neither do the results.
+const uint32_t ChunkSize = 1 << 16;
+//! Shorter arrays are not split across threads
+const uint32_t ParallelThreshold = 1 << 17;
+
+const double NaN = std::numeric_limits<double>::quiet_NaN();
+const double Infinity = std::numeric_limits<double>::infinity();
+
+//! \return the array in \a value or nullptr if it is not an array
+SPElementsArray* elements(data_t value)
+{
+    return value.get_type() == ::Spasm::ValueType::Array
+               ? static_cast<SPElementsArray*>(value.get_pointer())
+               : nullptr;
+}
+
+//! \return \a value as an operand of arithmetic, NaN if it is not a number
+double number_of(data_t value)
+{
+    return value.is_number() ? value.get_number() : NaN;
+}
+
+//! \return true if \a value is the string \a name
+bool is_name(data_t value, const char* name)
+{
+    if (value.get_type() != ::Spasm::ValueType::String)
+    {
+        return false;
+    }
+    // a rope is longer than any name
+    const auto s = flat_string(value);
+    return s && s->GetLength() == std::strlen(name) &&
+           std::memcmp(s->GetData(), name, s->GetLength()) == 0;
+}
+
+size_t chunk_count(uint32_t length)
+{
+    return (size_t(length) + ChunkSize - 1) / ChunkSize;
+}
+
+//! Runs task(0) to task(count - 1) on \a pool or in order without one
+void parallel_for(ThreadPool* pool,
+                  size_t count,
+                  const std::function<void(size_t)>& task)
+{
+    if (pool)
+    {
+        pool->ParallelFor(count, task);
+        return;
+    }
+    for (size_t i = 0; i < count; ++i)
+    {
+        task(i);
+    }
+}
+
+//! The result of \a op on no elements
+double identity(int32_t op)
+{
+    return op == ReduceMultiply ? 1.0
+           : op == ReduceMin    ? Infinity
+           : op == ReduceMax    ? -Infinity
+                                : 0.0;
+}
+
+//! \return \a result combined with \a x by \a op, NaN if either is NaN
+double combine(int32_t op, double result, double x)
+{
+    switch (op)
+    {
+        case ReduceMultiply:
+            return result * x;
+        case ReduceMin:
+            return x < result || x != x ? x : result;
+        case ReduceMax:
+            return x > result || x != x ? x : result;
+        default:
+            return result + x;
+    }
+}
+
+//! \return \a op over \a n doubles, the kernels do the common ones
+double reduce_chunk(const NumericKernels& kernels,
+                    int32_t op,
+                    const double* x,
+                    const double* y,
+                    size_t n)
+{
+    switch (op)
+    {
+        case ReduceAdd:
+            return kernels.Sum(x, n);
+        case ReduceMin:
+            return kernels.Min(x, n);
+        case ReduceMax:
+            return kernels.Max(x, n);
+        case ReduceDot:
+            return kernels.Dot(x, y, n);
+        default:
+        {
+            auto result = identity(op);
+            for (size_t i = 0; i < n; ++i)
+            {
+                result *= x[i];
+            }
+            return result;
+        }
+    }
+}
+
+double reduce_chunk(const NumericKernels&,
+                    int32_t op,
+                    const int32_t* x,
+                    const double*,
+                    size_t n)
+{
+    auto result = identity(op);
+    for (size_t i = 0; i < n; ++i)
+    {
+        result = combine(op, result, double(x[i]));
+    }
+    return result;
+}
+
+//! \return \a op over \a length elements, reduced by chunks on \a pool
+//! and the results of the chunks combined in order
+template <typename T>
+double reduce_elements(ThreadPool* pool,
+                       const NumericKernels& kernels,
+                       int32_t op,
+                       const T* x,
+                       const double* y,
+                       uint32_t length)
+{
+    std::vector<double> results(chunk_count(length));
+    parallel_for(pool, results.size(), [&](size_t c) {
+        const auto begin = c * ChunkSize;
+        const auto n = std::min<size_t>(ChunkSize, length - begin);
+        results[c] =
+            reduce_chunk(kernels, op, x + begin, y ? y + begin : y, n);
+    });
+    auto result = identity(op);
+    for (const auto value : results)
+    {
+        result = combine(op, result, value);
+    }
+    return result;
+}
+
+//! Numbers first from the smallest or the largest, NaN last
+template <bool Descending>
+struct NumericOrder
+{
+    template <typename T>
+    bool operator()(T a, T b) const
+    {
+        return (Descending ? b < a : a < b) || (b != b && a == a);
+    }
+};
+
+//! Sorts the chunks on \a pool and merges them in pairs, a round of
+//! merges at a time
+template <typename T, typename Order>
+void sort_elements(ThreadPool* pool, T* x, uint32_t length, Order order)
+{
+    const auto chunks = chunk_count(length);
+    if (!pool || chunks < 2)
+    {
+        std::sort(x, x + length, order);
+        return;
+    }
+    parallel_for(pool, chunks, [&](size_t c) {
+        const auto begin = c * ChunkSize;
+        std::sort(x + begin, x + std::min<size_t>(begin + ChunkSize, length),
+                  order);
+    });
+    std::vector<T> buffer(length);
+    auto from = x;
+    auto to = buffer.data();
+    for (size_t width = ChunkSize; width < length; width *= 2)
+    {
+        parallel_for(pool, (length + 2 * width - 1) / (2 * width),
+                     [&](size_t pair) {
+                         const auto begin = pair * 2 * width;
+                         const auto middle =
+                             std::min<size_t>(begin + width, length);
+                         const auto end =
+                             std::min<size_t>(begin + 2 * width, length);
+                         std::merge(from + begin, from + middle,
+                                    from + middle, from + end, to + begin,
+                                    order);
+                     });
+        std::swap(from, to);
+    }
+    if (from != x)
+    {
+        std::copy(from, from + length, x);
+    }
+}
+
+//! \return true if \a array may have elements that are not numbers
+bool has_holes(SPElementsArray* array)
+{
+    return array->GetElementsKind() == ElementsKind::Dictionary &&
+           array->GetUsed() < array->GetLength();
+}
+
+//! \return the index copyWithin reads \a value as in an array of
+//! \a length elements, negative values count from the end
+uint32_t relative_index(data_t value, uint32_t length)
+{
+    auto index = std::trunc(number_of(value));
+    if (index != index)
+    {
+        index = 0;
+    }
+    index = index < 0 ? std::max(length + index, 0.0)
+                      : std::min(index, double(length));
+    return uint32_t(index);
+}
+}  // namespace
+
+int32_t FindBuiltin(const char* name, size_t length)
+{
+    for (size_t i = 0; i < sizeof(s_Builtins) / sizeof(s_Builtins[0]); ++i)
+    {
+        if (std::strlen(s_Builtins[i]) == length &&
+            std::memcmp(s_Builtins[i], name, length) == 0)
+        {
+            return int32_t(i);
+        }
+    }
+    return -1;
+}
+
+/*!
+** Runs the builtin \a id on the arguments a1, a1 + 1, ... The reductions
+** store their number in a0, map its new array and the rest change the
+** array in a1 and store it in a0.
+**
+** The builtins compute as the loops of the program would, but read the
+** elements that are not numbers as NaN. The loops over PackedDouble arrays
+** are the NumericKernels of the machine. The reductions work on chunks of
+** the array and combine their results, so sum, dot and reduce add the
+** elements in a different order than a loop from the first to the last
+** does.
+**
+** Arrays of PackedSmallInt and PackedDouble longer than ParallelThreshold
+** are reduced, sorted and mapped by chunks on the worker threads.
+*/
+void Spasm::builtin(reg_t a0, reg_t a1, int32_t id)
+{
+    switch (id)
+    {
+        case Sum:
+            set_local(a0, data_t(reduce(ReduceAdd, a1, a1)));
+            return;
+        case Min:
+            set_local(a0, data_t(reduce(ReduceMin, a1, a1)));
+            return;
+        case Max:
+            set_local(a0, data_t(reduce(ReduceMax, a1, a1)));
+            return;
+        case Dot:
+            set_local(a0, data_t(reduce(ReduceDot, a1, a1 + 1)));
+            return;
+        case Reduce:
+        {
+            for (int32_t op = ReduceAdd; op <= ReduceMax; ++op)
+            {
+                if (is_name(get_local(a1 + 1), s_Reductions[op]))
+                {
+                    set_local(a0, data_t(reduce(op, a1, a1)));
+                    return;
+                }
+            }
+            set_local(a0, data_t(::Spasm::ValueType::Undefined, uint64_t(0)));
+            return;
+        }
+        case Map:
+            map(a0, a1);
+            return;
+        case Sort:
+            sort(a1);
+            break;
+        case Scale:
+            scale(a1);
+            break;
+        case AddArrays:
+            add_arrays(a1);
+            break;
+        case Fill:
+            fill(a1);
+            break;
+        default:
+            copy_within(a1);
+            break;
+    }
+    set_local(a0, get_local(a1));
+}
+
+//! \return \a op over the elements of a1, of a1 and a2 for ReduceDot,
+//! NaN if they are not arrays
+double Spasm::reduce(int32_t op, reg_t a1, reg_t a2)
+{
+    const auto array = elements(get_local(a1));
+    const auto other = elements(get_local(a2));
+    if (!array || !other)
+    {
+        return NaN;
+    }
+    const auto length = std::min(array->GetLength(), other->GetLength());
+    if (has_holes(array) || has_holes(other))
+    {
+        return NaN;
+    }
+
+    const auto kind = array->GetElementsKind();
+    if (kind == ElementsKind::PackedDouble &&
+        (op != ReduceDot ||
+         other->GetElementsKind() == ElementsKind::PackedDouble))
+    {
+        return reduce_elements(thread_pool(length), *m_Kernels, op,
+                               array->GetDoubles(),
+                               op == ReduceDot ? other->GetDoubles()
+                                                : nullptr,
+                               length);
+    }
+    if (kind == ElementsKind::PackedSmallInt && op != ReduceDot)
+    {
+        return reduce_elements(thread_pool(length), *m_Kernels, op,
+                               array->GetSmallInts(), nullptr, length);
+    }
+
+    auto result = identity(op);
+    for (uint32_t i = 0; i < length; ++i)
+    {
+        auto x = number_of(array->Get(i));
+        if (op == ReduceDot)
+        {
+            x *= number_of(other->Get(i));
+        }
+        result = combine(op, result, x);
+        if (result != result)
+        {
+            return NaN;
+        }
+    }
+    return result;
+}
+
+//! Moves the PackedSmallInt array in a0 to an unboxed double store
+void Spasm::to_doubles(reg_t a0)
+{
+    // the collection may move the array, the data stack keeps it updated
+    reserve_data(1);
+    push_data(get_local(a0));
+    reshape_elements(ElementsKind::PackedDouble,
+                     elements(get_local(a0))->GetCapacity());
+    pop_data();
+}
+
+//! Stores \a value in a0[index], the data stack keeps it alive
+void Spasm::put_value(reg_t a0, uint32_t index, data_t value)
+{
+    reserve_data(1);
+    push_data(value);
+    put_element(a0, index, reg_t(m_SP - 1 - m_FP));
+    pop_data();
+}
+
+//! a1[i] *= a1 + 1
+void Spasm::scale(reg_t a1)
+{
+    const auto factor = number_of(get_local(a1 + 1));
+    auto array = elements(get_local(a1));
+    if (!array)
+    {
+        return;
+    }
+    if (array->GetElementsKind() == ElementsKind::PackedSmallInt)
+    {
+        to_doubles(a1);
+        array = elements(get_local(a1));
+    }
+    const auto length = array->GetLength();
+    if (array->GetElementsKind() == ElementsKind::PackedDouble)
+    {
+        if (length)
+        {
+            m_Kernels->Scale(array->GetDoubles(), length, factor);
+        }
+        return;
+    }
+    for (uint32_t i = 0; i < length; ++i)
+    {
+        put_value(a1, i,
+                  data_t(number_of(elements(get_local(a1))->Get(i)) * factor));
+    }
+}
+
+//! a1[i] += (a1 + 1)[i] up to the shorter length
+void Spasm::add_arrays(reg_t a1)
+{
+    if (!elements(get_local(a1)) || !elements(get_local(a1 + 1)))
+    {
+        return;
+    }
+    if (elements(get_local(a1))->GetElementsKind() ==
+        ElementsKind::PackedSmallInt)
+    {
+        to_doubles(a1);
+    }
+    const auto array = elements(get_local(a1));
+    const auto other = elements(get_local(a1 + 1));
+    const auto length = std::min(array->GetLength(), other->GetLength());
+    if (array->GetElementsKind() == ElementsKind::PackedDouble)
+    {
+        const auto x = array->GetDoubles();
+        if (other->GetElementsKind() == ElementsKind::PackedDouble)
+        {
+            if (length)
+            {
+                m_Kernels->Add(x, other->GetDoubles(), length);
+            }
+            return;
+        }
+        for (uint32_t i = 0; i < length; ++i)
+        {
+            x[i] += number_of(other->Get(i));
+        }
+        return;
+    }
+    for (uint32_t i = 0; i < length; ++i)
+    {
+        const auto sum = number_of(elements(get_local(a1))->Get(i)) +
+                         number_of(elements(get_local(a1 + 1))->Get(i));
+        put_value(a1, i, data_t(sum));
+    }
+}
+
+//! a1[i] = a1 + 1 up to the length of a1
+void Spasm::fill(reg_t a1)
+{
+    const auto value = get_local(a1 + 1);
+    auto array = elements(get_local(a1));
+    if (!array)
+    {
+        return;
+    }
+    const auto length = array->GetLength();
+    if (array->GetElementsKind() == ElementsKind::PackedSmallInt)
+    {
+        if (value.is_integer())
+        {
+            std::fill(array->GetSmallInts(), array->GetSmallInts() + length,
+                      value.get_integer());
+            return;
+        }
+        if (value.is_double())
+        {
+            to_doubles(a1);
+            array = elements(get_local(a1));
+        }
+    }
+    if (array->GetElementsKind() == ElementsKind::PackedDouble &&
+        value.is_number())
+    {
+        if (length)
+        {
+            m_Kernels->Fill(array->GetDoubles(), length, value.get_number());
+        }
+        return;
+    }
+    for (uint32_t i = 0; i < length; ++i)
+    {
+        put_element(a1, i, a1 + 1);
+    }
+}
+
+/*!
+** a1.copyWithin(a1 + 1, a1 + 2, a1 + 3) copies the elements from a1 + 2 up
+** to a1 + 3, or the length if it is undefined, to a1 + 1 as memmove does.
+** Negative indices count from the end of the array.
+*/
+void Spasm::copy_within(reg_t a1)
+{
+    const auto array = elements(get_local(a1));
+    if (!array)
+    {
+        return;
+    }
+    const auto length = array->GetLength();
+    const auto to = relative_index(get_local(a1 + 1), length);
+    const auto from = relative_index(get_local(a1 + 2), length);
+    const auto endValue = get_local(a1 + 3);
+    const auto end = endValue.get_type() == ::Spasm::ValueType::Undefined
+                         ? length
+                         : relative_index(endValue, length);
+    if (end <= from || to == from)
+    {
+        return;
+    }
+    const auto count = std::min(end - from, length - to);
+    switch (array->GetElementsKind())
+    {
+        case ElementsKind::PackedSmallInt:
+        {
+            const auto x = array->GetSmallInts();
+            std::memmove(x + to, x + from, count * sizeof(int32_t));
+            return;
+        }
+        case ElementsKind::PackedDouble:
+        {
+            const auto x = array->GetDoubles();
+            std::memmove(x + to, x + from, count * sizeof(double));
+            return;
+        }
+        default:
+            break;
+    }
+    // backwards if the ranges overlap and the target is the later one
+    for (uint32_t k = 0; k < count; ++k)
+    {
+        const auto i = from < to ? count - 1 - k : k;
+        const auto target = elements(get_local(a1));
+        if (target->GetElementsKind() == ElementsKind::Dictionary)
+        {
+            put_value(a1, to + i, target->Get(from + i));
+        }
+        else
+        {
+            const auto values = target->GetValues();
+            m_Heap.Store(target->GetStoreObject(), values[to + i],
+                         values[from + i]);
+        }
+    }
+}
+
+/*!
+** Sorts the numbers of a1 from the smallest, or from the largest if a1 + 1
+** is 'descending'. The elements that are not numbers go after them in
+** their order, holes stay where they are.
+*/
+void Spasm::sort(reg_t a1)
+{
+    const auto array = elements(get_local(a1));
+    if (!array)
+    {
+        return;
+    }
+    const auto descending = is_name(get_local(a1 + 1), "descending");
+    const auto length = array->GetLength();
+    const auto pool = thread_pool(length);
+    switch (array->GetElementsKind())
+    {
+        case ElementsKind::PackedSmallInt:
+            return descending ? sort_elements(pool, array->GetSmallInts(),
+                                              length, NumericOrder<true>())
+                              : sort_elements(pool, array->GetSmallInts(),
+                                              length, NumericOrder<false>());
+        case ElementsKind::PackedDouble:
+            return descending ? sort_elements(pool, array->GetDoubles(),
+                                              length, NumericOrder<true>())
+                              : sort_elements(pool, array->GetDoubles(),
+                                              length, NumericOrder<false>());
+        default:
+            break;
+    }
+
+    // the elements there are and their indices in increasing order
+    std::vector<std::pair<uint32_t, data_t>> present;
+    const auto dictionary =
+        array->GetElementsKind() == ElementsKind::Dictionary;
+    if (dictionary)
+    {
+        const auto table = array->GetValues();
+        for (uint32_t e = 0; e < array->GetCapacity(); ++e)
+        {
+            if (!SPElementsArray::IsHole(table[size_t(e) * 2]))
+            {
+                present.emplace_back(
+                    uint32_t(table[size_t(e) * 2].get_double()),
+                    table[size_t(e) * 2 + 1]);
+            }
+        }
+        std::sort(present.begin(), present.end(),
+                  [](const std::pair<uint32_t, data_t>& a,
+                     const std::pair<uint32_t, data_t>& b) {
+                      return a.first < b.first;
+                  });
+    }
+    else
+    {
+        for (uint32_t i = 0; i < length; ++i)
+        {
+            const auto value = array->Get(i);
+            if (!SPElementsArray::IsHole(value))
+            {
+                present.emplace_back(i, value);
+            }
+        }
+    }
+    std::vector<data_t> values;
+    for (const auto& element : present)
+    {
+        values.push_back(element.second);
+    }
+    const auto order = [descending](data_t a, data_t b) {
+        return descending ? NumericOrder<true>()(number_of(a), number_of(b))
+                          : NumericOrder<false>()(number_of(a), number_of(b));
+    };
+    std::stable_sort(values.begin(), values.end(), order);
+
+    // the slots exist, storing to them does not allocate
+    const auto store = array->GetStoreObject();
+    for (size_t k = 0; k < values.size(); ++k)
+    {
+        auto& slot = dictionary ? array->FindEntry(present[k].first)[1]
+                                : array->GetValues()[present[k].first];
+        m_Heap.Store(store, slot, values[k]);
+    }
+}
+
+/*!
+** a0 = a new PackedDouble array of the operation named by a1 + 1 on the
+** elements of a1, the binary operations take a1 + 2 as their second
+** operand. a0 is undefined if a1 is not an array or there is no such
+** operation.
+*/
+void Spasm::map(reg_t a0, reg_t a1)
+{
+    auto apply = decltype(s_MapOperations[0].Apply)(nullptr);
+    for (const auto& operation : s_MapOperations)
+    {
+        if (is_name(get_local(a1 + 1), operation.Name))
+        {
+            apply = operation.Apply;
+        }
+    }
+    if (!apply || !elements(get_local(a1)))
+    {
+        set_local(a0, data_t(::Spasm::ValueType::Undefined, uint64_t(0)));
+        return;
+    }
+    const auto argument = number_of(get_local(a1 + 2));
+    const auto length = elements(get_local(a1))->GetLength();
+
+    // the collection may move the new array, the data stack keeps it updated
+    const auto size = sizeof(SPElementsArray);
+    reserve_data(1);
+    collect(size);
+    push_data(data_t(::Spasm::ValueType::Array,
+                     (void*)m_Heap.New<SPElementsArray>(size)));
+    reshape_elements(ElementsKind::PackedDouble, length);
+    const auto value = pop_data();
+    const auto result = elements(value);
+    result->SetLength(length);
+
+    const auto source = elements(get_local(a1));
+    const auto kind = source->GetElementsKind();
+    const auto x = result->GetDoubles();
+    if (kind > ElementsKind::PackedDouble)
+    {
+        for (uint32_t i = 0; i < length; ++i)
+        {
+            x[i] = number_of(source->Get(i));
+        }
+    }
+    parallel_for(thread_pool(length), chunk_count(length), [&](size_t c) {
+        const auto begin = c * ChunkSize;
+        const auto end = std::min<size_t>(begin + ChunkSize, length);
+        for (auto i = begin; i < end; ++i)
+        {
+            const auto element =
+                kind == ElementsKind::PackedSmallInt ? source->GetSmallInts()[i]
+                : kind == ElementsKind::PackedDouble ? source->GetDoubles()[i]
+                                                     : x[i];
+            x[i] = apply(element, argument);
+        }
+    });
+    set_local(a0, value);
+}
+
+void Spasm::SetWorkerThreads(size_t workers)
+{
+    m_WorkerThreads = workers;
+    m_ThreadPool.reset();
+}
+
+//! \return the pool for an array of \a length elements, nullptr if it is
+//! too short to split or there are no worker threads
+ThreadPool* Spasm::thread_pool(uint32_t length)
+{
+    if (length < ParallelThreshold || m_WorkerThreads == 0)
+    {
+        return nullptr;
+    }
+    if (!m_ThreadPool)
+    {
+        m_ThreadPool.reset(new ThreadPool(m_WorkerThreads));
+    }
+    return m_ThreadPool.get();
+}
+
+}  // namespace SpasmImpl
@@ -0,0 +1,175 @@
+#include <algorithm>
+
+#include "cage.hpp"
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+namespace SpasmImpl
+{
+namespace
+{
+uint64_t align_up(uint64_t value, uint64_t alignment)
+{
+    return (value + alignment - 1) & ~(alignment - 1);
+}
+
+#if defined(_WIN32)
+uint8_t* reserve()
+{
+    // another thread may take the aligned range between the two calls
+    for (int attempt = 0; attempt < 8; ++attempt)
+    {
+        const auto probe = static_cast<uint8_t*>(VirtualAlloc(
+            nullptr, 2 * HeapCage::Size, MEM_RESERVE, PAGE_NOACCESS));
+        if (!probe)
+        {
+            break;
+        }
+        const auto aligned = align_up(uintptr_t(probe), HeapCage::Size);
+        VirtualFree(probe, 0, MEM_RELEASE);
+        if (const auto base = VirtualAlloc(reinterpret_cast<void*>(aligned),
+                                           HeapCage::Size, MEM_RESERVE,
+                                           PAGE_NOACCESS))
+        {
+            return static_cast<uint8_t*>(base);
+        }
+    }
+    throw std::bad_alloc();
+}
+#else
+uint8_t* reserve()
+{
+    const auto size = 2 * HeapCage::Size;
+    void* reservation =
+        mmap(nullptr, size, PROT_NONE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (reservation == MAP_FAILED)
+    {
+        throw std::bad_alloc();
+    }
+    const auto begin = uintptr_t(reservation);
+    const auto base = align_up(begin, HeapCage::Size);
+    if (base > begin)
+    {
+        munmap(reservation, base - begin);
+    }
+    munmap(reinterpret_cast<void*>(base + HeapCage::Size),
+           begin + size - base - HeapCage::Size);
+    return reinterpret_cast<uint8_t*>(base);
+}
+#endif
+}  // namespace
+
+const uint64_t HeapCage::Size;
+const size_t HeapCage::PageSize;
+
+HeapCage::HeapCage() : m_Base(reserve())
+{
+}
+
+HeapCage::~HeapCage()
+{
+#if defined(_WIN32)
+    VirtualFree(m_Base, 0, MEM_RELEASE);
+#else
+    munmap(m_Base, Size);
+#endif
+}
+
+/*!
+** Takes the first free range that fits, or grows the cage.
+**
+** \return zeroed memory
+*/
+uint8_t* HeapCage::Allocate(size_t size, size_t alignment)
+{
+    size = align_up(size, PageSize);
+    alignment = std::max(alignment, PageSize);
+    for (size_t i = 0; i < m_Free.size(); ++i)
+    {
+        const auto span = m_Free[i];
+        const auto offset = align_up(span.Offset, alignment);
+        if (offset + size > span.Offset + span.Size)
+        {
+            continue;
+        }
+        m_Free.erase(m_Free.begin() + i);
+        release(span.Offset, offset - span.Offset);
+        release(offset + size, span.Offset + span.Size - offset - size);
+        commit(offset, size);
+        return m_Base + offset;
+    }
+    const auto offset = align_up(m_Top, alignment);
+    if (offset + size > Size)
+    {
+        throw std::bad_alloc();
+    }
+    release(m_Top, offset - m_Top);
+    m_Top = offset + size;
+    commit(offset, size);
+    return m_Base + offset;
+}
+
+void HeapCage::Free(void* memory, size_t size)
+{
+    size = align_up(size, PageSize);
+#if defined(_WIN32)
+    VirtualFree(memory, size, MEM_DECOMMIT);
+#else
+    // the pages read as zeroes when they are committed again
+    madvise(memory, size, MADV_DONTNEED);
+    mprotect(memory, size, PROT_NONE);
+#endif
+    release(uint64_t(static_cast<uint8_t*>(memory) - m_Base), size);
+}
+
+void HeapCage::commit(uint64_t offset, size_t size)
+{
+#if defined(_WIN32)
+    const bool committed = VirtualAlloc(m_Base + offset, size, MEM_COMMIT,
+                                        PAGE_READWRITE) != nullptr;
+#else
+    const bool committed =
+        mprotect(m_Base + offset, size, PROT_READ | PROT_WRITE) == 0;
+#endif
+    if (!committed)
+    {
+        throw std::bad_alloc();
+    }
+}
+
+//! Adds the range to the free ones and merges it with its neighbours
+void HeapCage::release(uint64_t offset, uint64_t size)
+{
+    if (size == 0)
+    {
+        return;
+    }
+    auto next = std::lower_bound(
+        m_Free.begin(), m_Free.end(), offset,
+        [](const Span& span, uint64_t o) { return span.Offset < o; });
+    if (next != m_Free.end() && offset + size == next->Offset)
+    {
+        next->Offset = offset;
+        next->Size += size;
+    }
+    else
+    {
+        next = m_Free.insert(next, Span{offset, size});
+    }
+    if (next != m_Free.begin())
+    {
+        const auto previous = next - 1;
+        if (previous->Offset + previous->Size == next->Offset)
+        {
+            previous->Size += next->Size;
+            m_Free.erase(next);
+        }
+    }
+}
+
+}  // namespace SpasmImpl
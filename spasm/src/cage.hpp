@@ -0,0 +1,80 @@
+#ifndef CAGE_HPP
+#define CAGE_HPP
+
+#include <cstdint>
+
+#include "object.hpp"
+#include "types.hpp"
+
+namespace SpasmImpl
+{
+//! Virtual memory range of 4 GiB where a Heap allocates all its objects
+/*!
+** The range is reserved up front and aligned to its size, so the offset of
+** an object is the low half of its address and the base of the cage is
+** the high half of the address of anything in it. References stored in
+** heap objects take 32 bits and the object that holds one is enough to
+** decompress it, there is no global base.
+**
+** Memory is committed in pages when it is allocated and decommitted when
+** it is freed, the free ranges are reused before the cage grows. A full
+** cage throws std::bad_alloc.
+*/
+class HeapCage
+{
+   public:
+    static const uint64_t Size = uint64_t(1) << 32;
+    static const size_t PageSize = 4096;
+
+    HeapCage();
+    ~HeapCage();
+    HeapCage(const HeapCage&) = delete;
+    HeapCage& operator=(const HeapCage&) = delete;
+
+    //! Commits \a size bytes aligned to \a alignment, a power of two
+    uint8_t* Allocate(size_t size, size_t alignment = PageSize);
+    void Free(void* memory, size_t size);
+
+    bool Contains(const void* address) const
+    {
+        return uintptr_t(address) - uintptr_t(m_Base) < Size;
+    }
+
+    static HeapRef Compress(const void* object)
+    {
+        return HeapRef(uintptr_t(object));
+    }
+
+    //! \return the object \a ref refers to in the cage of \a holder
+    template <typename T>
+    static T* Decompress(const void* holder, HeapRef ref)
+    {
+        const auto base = uintptr_t(holder) & ~uintptr_t(Size - 1);
+        return ref ? reinterpret_cast<T*>(base + ref) : nullptr;
+    }
+
+    template <typename T>
+    T* Decompress(HeapRef ref) const
+    {
+        return Decompress<T>(m_Base, ref);
+    }
+
+   private:
+    struct Span
+    {
+        uint64_t Offset;
+        uint64_t Size;
+    };
+
+    void commit(uint64_t offset, size_t size);
+    void release(uint64_t offset, uint64_t size);
+
+    uint8_t* m_Base = nullptr;
+    //! offset of the memory that was never allocated
+    uint64_t m_Top = PageSize;
+    //! freed ranges below m_Top sorted by offset
+    SPVector<Span> m_Free;
+};
+
+}  // namespace SpasmImpl
+#endif  // #ifndef CAGE_HPP
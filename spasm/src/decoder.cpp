@@ -0,0 +1,277 @@
+#include <algorithm>
+#include <cstring>
+#include <utility>
+
+#include "spasm_impl.hpp"
+
+namespace SpasmImpl
+{
+namespace
+{
+//! Number of register/integer operands of the raw opcode
+int operand_count(OpCodes opcode)
+{
+    switch (opcode)
+    {
+        case OpCodes::Halt:
+        case OpCodes::Dup:
+            return 0;
+        case OpCodes::Pop:
+        case OpCodes::PopTo:
+        case OpCodes::PushFrom:
+        case OpCodes::Push:
+        case OpCodes::Print:
+        case OpCodes::Read:
+        case OpCodes::Call:
+        case OpCodes::Ret:
+        case OpCodes::Jump:
+        case OpCodes::New:
+        case OpCodes::NewArray:
+        case OpCodes::ReadLine:
+            return 1;
+        case OpCodes::JumpT:
+        case OpCodes::JumpF:
+        case OpCodes::Const:
+        case OpCodes::String:
+        case OpCodes::GetG:
+        case OpCodes::SetG:
+        case OpCodes::Length:
+        case OpCodes::ReadNumbers:
+            return 2;
+        default:
+            return 3;
+    }
+}
+
+class Reader
+{
+   public:
+    Reader(const byte* bytecode, size_t size)
+        : m_ByteCode(bytecode), m_Size(size)
+    {
+    }
+
+    bool at_end() const { return m_PC >= m_Size; }
+    size_t pc() const { return m_PC; }
+
+    uint8_t read_byte() { return uint8_t(m_ByteCode[m_PC++]); }
+
+    //! Reads a little endian signed integer of 1 << size bytes
+    bool read_integer(size_t size, int64_t& result)
+    {
+        const size_t width = size_t(1) << size;
+        if (m_Size - m_PC < width)
+        {
+            return false;
+        }
+        switch (size)
+        {
+            case 0:
+                result = m_ByteCode[m_PC];
+                break;
+            case 1:
+                result = read_as<int16_t>();
+                break;
+            case 2:
+                result = read_as<int32_t>();
+                break;
+            default:
+                result = read_as<int64_t>();
+                break;
+        }
+        m_PC += width;
+        return true;
+    }
+
+    bool skip(size_t length)
+    {
+        if (m_Size - m_PC < length)
+        {
+            return false;
+        }
+        m_PC += length;
+        return true;
+    }
+
+   private:
+    template <typename T>
+    T read_as() const
+    {
+        T value;
+        std::memcpy(&value, m_ByteCode + m_PC, sizeof(value));
+        return value;
+    }
+
+    const byte* m_ByteCode;
+    size_t m_Size;
+    size_t m_PC = 0;
+};
+}  // namespace
+
+/*!
+** \return pointer to the operand holding the jump or call target of the
+** instruction or nullptr if it does not branch
+*/
+int32_t* BranchTarget(Instruction& instruction)
+{
+    switch (instruction.OpCode)
+    {
+        case OpCodes::Call:
+        case OpCodes::Jump:
+            return &instruction.A0;
+        case OpCodes::JumpT:
+        case OpCodes::JumpF:
+            return &instruction.A1;
+        case OpCodes::LessJumpT:
+        case OpCodes::LessJumpF:
+        case OpCodes::LessEqJumpT:
+        case OpCodes::LessEqJumpF:
+        case OpCodes::EqualJumpT:
+        case OpCodes::EqualJumpF:
+        case OpCodes::NotEqualJumpT:
+        case OpCodes::NotEqualJumpF:
+            return &instruction.A3;
+        case OpCodes::IncrementAndCompare:
+        case OpCodes::IncrementConstAndCompare:
+            return &instruction.A4;
+        default:
+            return nullptr;
+    }
+}
+
+/*!
+** Translates variable width bytecode into fixed width instructions.
+** Jump and call targets are remapped from byte offsets to indices. The
+** stream is terminated by a Halt, which is also the target of every jump
+** past the end of the bytecode, followed by an Invalid for jumps into the
+** middle of an instruction.
+**
+** \param bytecode	- the bytecode of the program
+** \param size		- size/length of the bytecode
+** \param code		- receives the decoded program
+** \param instructionOffsets	- receives the byte offset of every decoded
+** instruction, the Halt and the Invalid after them have none
+**
+** \return false if the bytecode contains an invalid or truncated
+** instruction. The program is still decoded up to it and executing it
+** traps.
+*/
+bool DecodeByteCode(const byte* bytecode, size_t size, InstructionStream& code,
+                    SPVector<size_t>* instructionOffsets)
+{
+    code.clear();
+    SPVector<size_t> offsets;
+    Reader reader(bytecode, size);
+    bool valid = true;
+
+    while (!reader.at_end())
+    {
+        offsets.push_back(reader.pc());
+        const auto raw = reader.read_byte();
+        Instruction instruction;
+        instruction.OpCode = OpCodes(raw & 0x3f);
+        const size_t operandSize = raw >> 6;
+
+        if (instruction.OpCode > OpCodes::LastIndex)
+        {
+            instruction.OpCode = OpCodes::Invalid;
+            instruction.A0 = raw & 0x3f;
+            code.push_back(instruction);
+            valid = false;
+            break;
+        }
+
+        int64_t operands[3] = {};
+        const auto count = operand_count(instruction.OpCode);
+        bool complete = true;
+        for (int i = 0; i < count && complete; ++i)
+        {
+            complete = reader.read_integer(operandSize, operands[i]);
+        }
+        if (complete && instruction.OpCode == OpCodes::String)
+        {
+            // the string bytes follow the length operand
+            operands[2] = operands[1];
+            operands[1] = int64_t(reader.pc());
+            complete = reader.skip(size_t(operands[2]));
+        }
+        int64_t nameOffset = 0;
+        int64_t nameLength = 0;
+        if (complete && HasName(instruction.OpCode))
+        {
+            // the name follows its length, the last operand
+            nameLength = operands[count - 1];
+            operands[count - 1] = 0;
+            nameOffset = int64_t(reader.pc());
+            complete = reader.skip(size_t(nameLength));
+        }
+        if (!complete)
+        {
+            instruction.OpCode = OpCodes::Invalid;
+            instruction.A0 = raw & 0x3f;
+            code.push_back(instruction);
+            valid = false;
+            break;
+        }
+
+        if (instruction.OpCode == OpCodes::Const)
+        {
+            instruction.A0 = int32_t(operands[0]);
+            instruction.Value = data_t::from_int64(operands[1]);
+        }
+        else
+        {
+            instruction.A0 = int32_t(operands[0]);
+            instruction.A1 = int32_t(operands[1]);
+            instruction.A2 = int32_t(operands[2]);
+            instruction.A3 = int32_t(nameOffset);
+            instruction.A4 = int32_t(nameLength);
+        }
+        if (const auto target = BranchTarget(instruction))
+        {
+            // byte offsets are kept until all instructions are known, jumps
+            // outside of the bytecode stop the machine
+            const auto offset = (target == &instruction.A0) ? operands[0]
+                                                            : operands[1];
+            *target = (offset < 0 || uint64_t(offset) >= size)
+                          ? -1
+                          : int32_t(offset);
+        }
+        code.push_back(instruction);
+    }
+
+    const auto end = int32_t(code.size());
+    const auto invalidTarget = end + 1;
+    for (auto& instruction : code)
+    {
+        const auto targetPtr = BranchTarget(instruction);
+        if (!targetPtr)
+        {
+            continue;
+        }
+        auto& target = *targetPtr;
+        if (target < 0)
+        {
+            target = end;
+            continue;
+        }
+        const auto found =
+            std::lower_bound(offsets.begin(), offsets.end(), size_t(target));
+        target = (found != offsets.end() && *found == size_t(target))
+                     ? int32_t(found - offsets.begin())
+                     : invalidTarget;
+    }
+
+    code.emplace_back();
+    Instruction trap;
+    trap.OpCode = OpCodes::Invalid;
+    trap.A0 = -1;
+    code.push_back(trap);
+    if (instructionOffsets)
+    {
+        *instructionOffsets = std::move(offsets);
+    }
+    return valid;
+}
+
+}  // namespace SpasmImpl
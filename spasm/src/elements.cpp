@@ -0,0 +1,321 @@
+#include <algorithm>
+
+#include "elements.hpp"
+#include "spasm_impl.hpp"
+
+namespace SpasmImpl
+{
+namespace
+{
+//! Largest gap a store may leave past the length before the array becomes
+//! a Dictionary
+const uint32_t MaxGap = 1024;
+const uint32_t MinCapacity = 4;
+
+//! \return true if \a value is a valid array index and stores it in \a index
+bool to_index(data_t value, uint32_t& index)
+{
+    if (value.is_integer())
+    {
+        index = uint32_t(value.get_integer());
+        return value.get_integer() >= 0;
+    }
+    if (!value.is_double())
+    {
+        return false;
+    }
+    const auto number = value.get_double();
+    // 2^32 - 1 is the largest length, not an index
+    if (!(number >= 0 && number < 4294967295.0) ||
+        double(uint32_t(number)) != number)
+    {
+        return false;
+    }
+    index = uint32_t(number);
+    return true;
+}
+
+//! \return the kind with room for \a value
+ElementsKind kind_of(data_t value)
+{
+    return value.is_integer()  ? ElementsKind::PackedSmallInt
+           : value.is_double() ? ElementsKind::PackedDouble
+                               : ElementsKind::Packed;
+}
+
+//! \return the bytes of a store of \a kind with room for \a capacity
+size_t store_size(ElementsKind kind, uint32_t capacity)
+{
+    switch (kind)
+    {
+        case ElementsKind::PackedSmallInt:
+            return SPBufferValue::AllocationSize(capacity * sizeof(int32_t));
+        case ElementsKind::PackedDouble:
+            return SPBufferValue::AllocationSize(capacity * sizeof(double));
+        case ElementsKind::Dictionary:
+            return SPArrayValue::AllocationSize(size_t(capacity) * 2);
+        default:
+            return SPArrayValue::AllocationSize(capacity);
+    }
+}
+
+data_t key(uint32_t index)
+{
+    return data_t(double(index));
+}
+}  // namespace
+
+data_t SPElementsArray::Get(uint32_t index)
+{
+    data_t value;
+    if (GetFast(index, value))
+    {
+        return value;
+    }
+    if (m_ElementsKind == ElementsKind::Dictionary && m_Capacity)
+    {
+        const auto entry = FindEntry(index);
+        return IsHole(entry[0]) ? Hole() : entry[1];
+    }
+    return Hole();
+}
+
+/*!
+** The table has a power of two entries and is never full, the entries are
+** probed linearly from the hash of \a index.
+*/
+data_t* SPElementsArray::FindEntry(uint32_t index)
+{
+    const auto table = GetValues();
+    const auto mask = m_Capacity - 1;
+    const auto wanted = key(index).m_value.as_int64;
+    for (auto i = (index * 2654435761u) & mask;; i = (i + 1) & mask)
+    {
+        const auto entry = table + size_t(i) * 2;
+        if (IsHole(entry[0]) || entry[0].m_value.as_int64 == wanted)
+        {
+            return entry;
+        }
+    }
+}
+
+//! Stores a new empty array in a0
+void Spasm::new_array(reg_t a0)
+{
+    const auto size = sizeof(SPElementsArray);
+    collect(size);
+    const auto array = m_Heap.New<SPElementsArray>(size);
+    set_local(a0, data_t(::Spasm::ValueType::Array, (void*)array));
+}
+
+//! \return a1[a2] or undefined if there is no such element
+data_t Spasm::get_element(data_t array, data_t index)
+{
+    uint32_t i;
+    if (array.get_type() == ::Spasm::ValueType::Array && to_index(index, i))
+    {
+        const auto value =
+            static_cast<SPElementsArray*>(array.get_pointer())->Get(i);
+        if (!SPElementsArray::IsHole(value))
+        {
+            return value;
+        }
+    }
+    return data_t(::Spasm::ValueType::Undefined, uint64_t(0));
+}
+
+/*!
+** Stores a2 in a0[a1] for the stores the inline path in store_element does
+** not handle. Stores at invalid indices are ignored.
+*/
+void Spasm::set_element(reg_t a0, reg_t a1, reg_t a2)
+{
+    uint32_t index;
+    if (to_index(get_local(a1), index))
+    {
+        put_element(a0, index, a2);
+    }
+}
+
+/*!
+** Stores a2 in a0[index]. The array changes its kind if a2 does not fit,
+** grows if \a index is past its capacity and gets holes if \a index is past
+** its length. Stores to values that are not arrays are ignored.
+*/
+void Spasm::put_element(reg_t a0, uint32_t index, reg_t a2)
+{
+    if (get_local(a0).get_type() != ::Spasm::ValueType::Array)
+    {
+        return;
+    }
+    auto array = static_cast<SPElementsArray*>(get_local(a0).get_pointer());
+    const auto length = array->GetLength();
+    auto kind = std::max(array->GetElementsKind(), kind_of(get_local(a2)));
+    if (index > length)
+    {
+        kind = std::max(kind, index - length > MaxGap
+                                  ? ElementsKind::Dictionary
+                                  : ElementsKind::Holey);
+    }
+
+    auto capacity = array->GetCapacity();
+    if (kind == ElementsKind::Dictionary)
+    {
+        const auto used = array->GetElementsKind() == ElementsKind::Dictionary
+                              ? array->GetUsed()
+                              : length;
+        // at most half of the power of two entries are used
+        if (array->GetElementsKind() != ElementsKind::Dictionary)
+        {
+            capacity = MinCapacity * 2;
+        }
+        while ((used + 1) * 2 > capacity)
+        {
+            capacity *= 2;
+        }
+    }
+    else if (index >= capacity)
+    {
+        capacity = std::max(std::max(index + 1, capacity * 2), MinCapacity);
+    }
+    if (kind != array->GetElementsKind() || capacity != array->GetCapacity())
+    {
+        // the collection may move the array, the data stack keeps it updated
+        reserve_data(1);
+        push_data(get_local(a0));
+        reshape_elements(kind, capacity);
+        array = static_cast<SPElementsArray*>(pop_data().get_pointer());
+    }
+
+    const auto value = get_local(a2);
+    switch (kind)
+    {
+        case ElementsKind::PackedSmallInt:
+            array->GetSmallInts()[index] = value.get_integer();
+            break;
+        case ElementsKind::PackedDouble:
+            array->GetDoubles()[index] = value.get_number();
+            break;
+        case ElementsKind::Dictionary:
+        {
+            const auto entry = array->FindEntry(index);
+            const auto table = array->GetStoreObject();
+            if (SPElementsArray::IsHole(entry[0]))
+            {
+                m_Heap.Store(table, entry[0], key(index));
+                array->SetUsed(array->GetUsed() + 1);
+            }
+            m_Heap.Store(table, entry[1], value);
+            break;
+        }
+        default:
+            m_Heap.Store(array->GetStoreObject(), array->GetValues()[index],
+                         value);
+            break;
+    }
+    array->SetLength(std::max(length, index + 1));
+}
+
+/*!
+** Moves the elements of the array on top of the data stack to a new store
+** of \a kind with room for \a capacity elements, or entries for a
+** Dictionary.
+*/
+void Spasm::reshape_elements(ElementsKind kind, uint32_t capacity)
+{
+    const auto size = store_size(kind, capacity);
+    collect(size);
+    const auto array = static_cast<SPElementsArray*>((m_SP - 1)->get_pointer());
+    const auto oldKind = array->GetElementsKind();
+    const auto oldCapacity = array->GetCapacity();
+    const auto length = array->GetLength();
+
+    HeapObject* store;
+    if (kind <= ElementsKind::PackedDouble)
+    {
+        store = m_Heap.New<SPBufferValue>(size, size - sizeof(SPBufferValue));
+    }
+    else
+    {
+        const auto values = m_Heap.New<SPArrayValue>(
+            size, (size - sizeof(SPArrayValue)) / sizeof(data_t));
+        if (kind != ElementsKind::Packed)
+        {
+            std::fill(values->GetElements(),
+                      values->GetElements() + values->GetLength(),
+                      SPElementsArray::Hole());
+        }
+        store = values;
+    }
+    if (kind == ElementsKind::Dictionary)
+    {
+        const auto table = static_cast<SPArrayValue*>(store)->GetElements();
+        const auto mask = capacity - 1;
+        uint32_t used = 0;
+        const auto insert = [&](uint32_t index, data_t value) {
+            auto i = (index * 2654435761u) & mask;
+            while (!SPElementsArray::IsHole(table[size_t(i) * 2]))
+            {
+                i = (i + 1) & mask;
+            }
+            m_Heap.Store(store, table[size_t(i) * 2], key(index));
+            m_Heap.Store(store, table[size_t(i) * 2 + 1], value);
+            ++used;
+        };
+        if (oldKind == ElementsKind::Dictionary)
+        {
+            const auto old = array->GetValues();
+            for (uint32_t e = 0; e < oldCapacity; ++e)
+            {
+                if (!SPElementsArray::IsHole(old[size_t(e) * 2]))
+                {
+                    insert(uint32_t(old[size_t(e) * 2].get_double()),
+                           old[size_t(e) * 2 + 1]);
+                }
+            }
+        }
+        else
+        {
+            for (uint32_t i = 0; i < length; ++i)
+            {
+                const auto value = array->Get(i);
+                if (!SPElementsArray::IsHole(value))
+                {
+                    insert(i, value);
+                }
+            }
+        }
+        array->SetUsed(used);
+    }
+    else
+    {
+        for (uint32_t i = 0; i < length; ++i)
+        {
+            const auto value = array->Get(i);
+            switch (kind)
+            {
+                case ElementsKind::PackedSmallInt:
+                    reinterpret_cast<int32_t*>(
+                        static_cast<SPBufferValue*>(store)->GetData())[i] =
+                        value.get_integer();
+                    break;
+                case ElementsKind::PackedDouble:
+                    reinterpret_cast<double*>(
+                        static_cast<SPBufferValue*>(store)->GetData())[i] =
+                        value.get_number();
+                    break;
+                default:
+                    m_Heap.Store(
+                        store,
+                        static_cast<SPArrayValue*>(store)->GetElements()[i],
+                        value);
+                    break;
+            }
+        }
+    }
+    m_Heap.Store(array, array->GetStore(), store);
+    array->SetElementsKind(kind);
+    array->SetCapacity(capacity);
+}
+
+}  // namespace SpasmImpl
@@ -0,0 +1,128 @@
+#ifndef ELEMENTS_HPP
+#define ELEMENTS_HPP
+
+#include "array.hpp"
+#include "cage.hpp"
+
+namespace SpasmImpl
+{
+//! How an SPElementsArray stores its elements
+/*!
+** An array starts as PackedSmallInt and moves down the list only when a
+** store does not fit its kind, it never moves back up.
+*/
+enum class ElementsKind : uint8_t
+{
+    //! an int32_t per element in an SPBufferValue
+    PackedSmallInt,
+    //! an unboxed double per element in an SPBufferValue
+    PackedDouble,
+    //! a data_t per element in an SPArrayValue
+    Packed,
+    //! as Packed, the missing elements are Hole
+    Holey,
+    //! hash table of index and value pairs in an SPArrayValue, for arrays
+    //! with large gaps
+    Dictionary,
+};
+
+//! The array of the programs, its store depends on the ElementsKind
+/*!
+** The elements past the length up to the capacity are allocated, so
+** appending does not reallocate every time. The machine changes the kind
+** and the capacity, this class only reads the elements.
+*/
+class SPElementsArray : public HeapObject
+{
+   public:
+    SPElementsArray() { Kind = HeapKind::Elements; }
+
+    SPElementsArray(const SPElementsArray&) = delete;
+    SPElementsArray& operator=(const SPElementsArray&) = delete;
+
+    //! the missing elements of Holey arrays and the free entries of the
+    //! Dictionary, no program value has its bits
+    static data_t Hole()
+    {
+        return data_t(::Spasm::ValueType::Undefined, uint64_t(1));
+    }
+    static bool IsHole(data_t value)
+    {
+        return value.m_value.as_int64 == Hole().m_value.as_int64;
+    }
+
+    ElementsKind GetElementsKind() const { return m_ElementsKind; }
+    uint32_t GetLength() const { return m_Length; }
+    //! elements the store has room for, entries of the Dictionary table
+    uint32_t GetCapacity() const { return m_Capacity; }
+    //! used entries of the Dictionary table
+    uint32_t GetUsed() const { return m_Used; }
+    //! the null reference while the array has no store
+    HeapRef& GetStore() { return m_Store; }
+    HeapObject* GetStoreObject() const
+    {
+        return HeapCage::Decompress<HeapObject>(this, m_Store);
+    }
+
+    int32_t* GetSmallInts() { return reinterpret_cast<int32_t*>(buffer()); }
+    double* GetDoubles() { return reinterpret_cast<double*>(buffer()); }
+    data_t* GetValues()
+    {
+        return HeapCage::Decompress<SPArrayValue>(this, m_Store)
+            ->GetElements();
+    }
+
+    //! Reads the element at \a index without a lookup
+    /*!
+    ** \return false if \a index is past the length, is a hole or the array
+    ** is a Dictionary, Get takes care of those
+    */
+    bool GetFast(uint32_t index, data_t& value)
+    {
+        if (index >= m_Length)
+        {
+            return false;
+        }
+        switch (m_ElementsKind)
+        {
+            case ElementsKind::PackedSmallInt:
+                value = data_t(GetSmallInts()[index]);
+                return true;
+            case ElementsKind::PackedDouble:
+                value = data_t(GetDoubles()[index]);
+                return true;
+            case ElementsKind::Packed:
+            case ElementsKind::Holey:
+                value = GetValues()[index];
+                return !IsHole(value);
+            default:
+                return false;
+        }
+    }
+
+    //! \return the element at \a index, Hole if the array does not have it
+    data_t Get(uint32_t index);
+
+    //! \return the Dictionary entry of \a index or the free one to add it in
+    data_t* FindEntry(uint32_t index);
+
+    void SetElementsKind(ElementsKind kind) { m_ElementsKind = kind; }
+    void SetLength(uint32_t length) { m_Length = length; }
+    void SetCapacity(uint32_t capacity) { m_Capacity = capacity; }
+    void SetUsed(uint32_t used) { m_Used = used; }
+
+   private:
+    uint8_t* buffer()
+    {
+        return HeapCage::Decompress<SPBufferValue>(this, m_Store)->GetData();
+    }
+
+    ElementsKind m_ElementsKind = ElementsKind::PackedSmallInt;
+    uint32_t m_Length = 0;
+    uint32_t m_Capacity = 0;
+    uint32_t m_Used = 0;
+    HeapRef m_Store = 0;
+};
+
+}  // namespace SpasmImpl
+#endif  // #ifndef ELEMENTS_HPP
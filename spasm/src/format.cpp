@@ -0,0 +1,354 @@
+#include <algorithm>
+#include <cstring>
+
+#include "format.hpp"
+#include "format_tables.hpp"
+
+namespace SpasmImpl
+{
+namespace
+{
+const int32_t MantissaBits = 52;
+const int32_t ExponentBias = 1023;
+const int32_t Pow5InverseBits = 125;
+const int32_t Pow5Bits = 125;
+
+//! Mantissa * 10^Exponent
+struct Decimal
+{
+    uint64_t Mantissa;
+    int32_t Exponent;
+};
+
+//! \return the number of bits of 5^e
+int32_t pow5_bits(int32_t e)
+{
+    return int32_t(((uint32_t(e) * 1217359) >> 19) + 1);
+}
+
+//! \return floor(log10(2^e))
+uint32_t log10_pow2(int32_t e)
+{
+    return (uint32_t(e) * 78913) >> 18;
+}
+
+//! \return floor(log10(5^e))
+uint32_t log10_pow5(int32_t e)
+{
+    return (uint32_t(e) * 732923) >> 20;
+}
+
+bool multiple_of_pow5(uint64_t value, uint32_t p)
+{
+    uint32_t count = 0;
+    for (; value % 5 == 0; value /= 5)
+    {
+        ++count;
+    }
+    return count >= p;
+}
+
+bool multiple_of_pow2(uint64_t value, uint32_t p)
+{
+    return (value & ((uint64_t(1) << p) - 1)) == 0;
+}
+
+#if !defined(__SIZEOF_INT128__)
+//! \return the 128 bit product of \a a and \a b, its high half in \a high
+uint64_t multiply(uint64_t a, uint64_t b, uint64_t& high)
+{
+    const uint64_t aLow = uint32_t(a);
+    const uint64_t aHigh = a >> 32;
+    const uint64_t bLow = uint32_t(b);
+    const uint64_t bHigh = b >> 32;
+    const auto low = aLow * bLow;
+    const auto middle1 = aHigh * bLow + (low >> 32);
+    const auto middle2 = aLow * bHigh + uint32_t(middle1);
+    high = aHigh * bHigh + (middle1 >> 32) + (middle2 >> 32);
+    return (middle2 << 32) | uint32_t(low);
+}
+#endif
+
+//! \return (m * factor) >> shift for the 128 bit \a factor, 64 < shift < 128
+uint64_t multiply_shift(uint64_t m, const uint64_t* factor, int32_t shift)
+{
+#if defined(__SIZEOF_INT128__)
+    typedef unsigned __int128 uint128;
+    const auto low = uint128(m) * factor[0];
+    const auto high = uint128(m) * factor[1];
+    return uint64_t(((low >> 64) + high) >> (shift - 64));
+#else
+    uint64_t high1;
+    const auto low1 = multiply(m, factor[1], high1);
+    uint64_t high0;
+    multiply(m, factor[0], high0);
+    const auto sum = high0 + low1;
+    high1 += sum < high0;
+    return (high1 << (128 - shift)) | (sum >> (shift - 64));
+#endif
+}
+
+/*!
+** The shortest decimal in the interval of the reals that round to the
+** double, by Ulf Adams' Ryu. The bounds of the interval and the double
+** are scaled by a power of ten with the tables, then digits are removed
+** while the bounds keep them apart. The trailing zero flags track whether
+** the scaled values were exact, for the ties and the inclusive bounds.
+*/
+Decimal shortest(uint64_t ieeeMantissa, uint32_t ieeeExponent)
+{
+    int32_t e2;
+    uint64_t m2;
+    if (ieeeExponent == 0)
+    {
+        e2 = 1 - ExponentBias - MantissaBits - 2;
+        m2 = ieeeMantissa;
+    }
+    else
+    {
+        e2 = int32_t(ieeeExponent) - ExponentBias - MantissaBits - 2;
+        m2 = (uint64_t(1) << MantissaBits) | ieeeMantissa;
+    }
+    // the reals that round to the double include the bounds if it is even
+    const bool acceptBounds = (m2 & 1) == 0;
+    const uint64_t mv = 4 * m2;
+    // the interval below powers of two is half as wide
+    const uint32_t mmShift = ieeeMantissa != 0 || ieeeExponent <= 1;
+
+    uint64_t vr, vp, vm;
+    int32_t e10;
+    bool vmIsTrailingZeros = false;
+    bool vrIsTrailingZeros = false;
+    if (e2 >= 0)
+    {
+        const auto q = log10_pow2(e2) - (e2 > 3);
+        e10 = int32_t(q);
+        const auto k = Pow5InverseBits + pow5_bits(int32_t(q)) - 1;
+        const auto i = -e2 + int32_t(q) + k;
+        vr = multiply_shift(mv, Pow5Inverse[q], i);
+        vp = multiply_shift(mv + 2, Pow5Inverse[q], i);
+        vm = multiply_shift(mv - 1 - mmShift, Pow5Inverse[q], i);
+        if (q <= 21)
+        {
+            if (mv % 5 == 0)
+            {
+                vrIsTrailingZeros = multiple_of_pow5(mv, q);
+            }
+            else if (acceptBounds)
+            {
+                vmIsTrailingZeros = multiple_of_pow5(mv - 1 - mmShift, q);
+            }
+            else
+            {
+                vp -= multiple_of_pow5(mv + 2, q);
+            }
+        }
+    }
+    else
+    {
+        const auto q = log10_pow5(-e2) - (-e2 > 1);
+        e10 = int32_t(q) + e2;
+        const auto i = -e2 - int32_t(q);
+        const auto k = pow5_bits(i) - Pow5Bits;
+        const auto j = int32_t(q) - k;
+        vr = multiply_shift(mv, Pow5[i], j);
+        vp = multiply_shift(mv + 2, Pow5[i], j);
+        vm = multiply_shift(mv - 1 - mmShift, Pow5[i], j);
+        if (q <= 1)
+        {
+            vrIsTrailingZeros = true;
+            if (acceptBounds)
+            {
+                vmIsTrailingZeros = mmShift == 1;
+            }
+            else
+            {
+                --vp;
+            }
+        }
+        else if (q < 63)
+        {
+            vrIsTrailingZeros = multiple_of_pow2(mv, q);
+        }
+    }
+
+    int32_t removed = 0;
+    uint32_t lastRemovedDigit = 0;
+    uint64_t output;
+    if (vmIsTrailingZeros || vrIsTrailingZeros)
+    {
+        while (vp / 10 > vm / 10)
+        {
+            vmIsTrailingZeros &= vm % 10 == 0;
+            vrIsTrailingZeros &= lastRemovedDigit == 0;
+            lastRemovedDigit = uint32_t(vr % 10);
+            vr /= 10;
+            vp /= 10;
+            vm /= 10;
+            ++removed;
+        }
+        if (vmIsTrailingZeros)
+        {
+            while (vm % 10 == 0)
+            {
+                vrIsTrailingZeros &= lastRemovedDigit == 0;
+                lastRemovedDigit = uint32_t(vr % 10);
+                vr /= 10;
+                vp /= 10;
+                vm /= 10;
+                ++removed;
+            }
+        }
+        if (vrIsTrailingZeros && lastRemovedDigit == 5 && vr % 2 == 0)
+        {
+            // an exact tie rounds to even
+            lastRemovedDigit = 4;
+        }
+        output = vr + ((vr == vm && (!acceptBounds || !vmIsTrailingZeros)) ||
+                       lastRemovedDigit >= 5);
+    }
+    else
+    {
+        // the common case, the scaled values are not exact
+        bool roundUp = false;
+        while (vp / 10 > vm / 10)
+        {
+            roundUp = vr % 10 >= 5;
+            vr /= 10;
+            vp /= 10;
+            vm /= 10;
+            ++removed;
+        }
+        output = vr + (vr == vm || roundUp);
+    }
+    return Decimal{output, e10 + removed};
+}
+
+//! Writes the digits of \a value backwards from \a end
+//! \return the first digit
+char* write_digits(uint64_t value, char* end)
+{
+    do
+    {
+        *--end = char('0' + value % 10);
+        value /= 10;
+    } while (value != 0);
+    return end;
+}
+
+size_t lay_out(Decimal decimal, bool negative, char* out)
+{
+    char digits[20];
+    const auto end = digits + sizeof(digits);
+    const auto first = write_digits(decimal.Mantissa, end);
+    const auto count = int32_t(end - first);
+    const auto exponent = decimal.Exponent + count - 1;
+
+    auto p = out;
+    if (negative)
+    {
+        *p++ = '-';
+    }
+    if (exponent < -4 || exponent > 16)
+    {
+        *p++ = *first;
+        if (count > 1)
+        {
+            *p++ = '.';
+            p = std::copy(first + 1, end, p);
+        }
+        *p++ = 'e';
+        *p++ = exponent < 0 ? '-' : '+';
+        const auto magnitude = uint64_t(exponent < 0 ? -exponent : exponent);
+        char exponentDigits[3];
+        const auto exponentEnd = exponentDigits + sizeof(exponentDigits);
+        auto exponentFirst = write_digits(magnitude, exponentEnd);
+        if (magnitude < 10)
+        {
+            *--exponentFirst = '0';
+        }
+        p = std::copy(exponentFirst, exponentEnd, p);
+    }
+    else if (exponent < 0)
+    {
+        *p++ = '0';
+        *p++ = '.';
+        p = std::fill_n(p, -exponent - 1, '0');
+        p = std::copy(first, end, p);
+    }
+    else if (exponent + 1 >= count)
+    {
+        p = std::copy(first, end, p);
+        p = std::fill_n(p, exponent + 1 - count, '0');
+    }
+    else
+    {
+        p = std::copy(first, first + exponent + 1, p);
+        *p++ = '.';
+        p = std::copy(first + exponent + 1, end, p);
+    }
+    return size_t(p - out);
+}
+
+size_t write_text(const char* text, char* out)
+{
+    const auto length = std::strlen(text);
+    std::memcpy(out, text, length);
+    return length;
+}
+}  // namespace
+
+size_t format_number(double value, char* out)
+{
+    uint64_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    const bool negative = (bits >> 63) != 0;
+    const auto ieeeMantissa = bits & ((uint64_t(1) << MantissaBits) - 1);
+    const auto ieeeExponent = uint32_t(bits >> MantissaBits) & 0x7ff;
+    if (ieeeExponent == 0x7ff)
+    {
+        return write_text(ieeeMantissa != 0 ? "nan"
+                                            : negative ? "-inf" : "inf",
+                          out);
+    }
+    if (ieeeExponent == 0 && ieeeMantissa == 0)
+    {
+        return write_text(negative ? "-0" : "0", out);
+    }
+
+    // integers below 2^53 are their own shortest decimal
+    const auto e2 = int32_t(ieeeExponent) - ExponentBias - MantissaBits;
+    if (e2 <= 0 && e2 >= -MantissaBits)
+    {
+        const auto m2 = (uint64_t(1) << MantissaBits) | ieeeMantissa;
+        if ((m2 & ((uint64_t(1) << -e2) - 1)) == 0)
+        {
+            Decimal decimal{m2 >> -e2, 0};
+            while (decimal.Mantissa % 10 == 0)
+            {
+                decimal.Mantissa /= 10;
+                ++decimal.Exponent;
+            }
+            return lay_out(decimal, negative, out);
+        }
+    }
+    return lay_out(shortest(ieeeMantissa, ieeeExponent), negative, out);
+}
+
+size_t format_integer(int64_t value, char* out)
+{
+    char digits[20];
+    const auto end = digits + sizeof(digits);
+    // negated as unsigned, so the lowest value does not overflow
+    const auto magnitude =
+        value < 0 ? ~uint64_t(value) + 1 : uint64_t(value);
+    const auto first = write_digits(magnitude, end);
+    auto p = out;
+    if (value < 0)
+    {
+        *p++ = '-';
+    }
+    return size_t(std::copy(first, end, p) - out);
+}
+
+}  // namespace SpasmImpl
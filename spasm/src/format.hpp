@@ -0,0 +1,27 @@
+#ifndef FORMAT_HPP
+#define FORMAT_HPP
+
+#include <cstddef>
+#include <cstdint>
+
+namespace SpasmImpl
+{
+//! Longest text format_number and format_integer write
+const size_t NumberLength = 32;
+
+//! Writes the shortest decimal that reads back as \a value
+/*!
+** The digits are those of the Ryu algorithm: the fewest that parse to
+** the same double, the closest to it when there are several. They are laid
+** out like %g does, in scientific notation for exponents below -4 or above
+** 16, so integers up to 10^17 are written in full.
+**
+** \return the number of characters written to \a out, which has room for
+** NumberLength
+*/
+size_t format_number(double value, char* out);
+
+size_t format_integer(int64_t value, char* out);
+
+}  // namespace SpasmImpl
+#endif  // #ifndef FORMAT_HPP
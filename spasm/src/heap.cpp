@@ -0,0 +1,555 @@
+#include <algorithm>
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+
+#include "array.hpp"
+#include "elements.hpp"
+#include "heap.hpp"
+#include "rope.hpp"
+#include "shape.hpp"
+
+namespace SpasmImpl
+{
+namespace
+{
+const size_t s_CellSizes[] = {16,  32,  48,   64,   96,   128,  192,  256,
+                              384, 512, 768,  1024, 1536, 2048, 3072, 4096};
+const size_t s_SizeClasses = sizeof(s_CellSizes) / sizeof(s_CellSizes[0]);
+const size_t s_MaxSmallSize = s_CellSizes[s_SizeClasses - 1];
+
+//! every arena starts with a byte for each of its cards
+const size_t s_CardCount = Heap::ArenaSize / Heap::CardSize;
+//! offset of the first cell in an arena
+const size_t s_FirstCell = s_CardCount;
+
+//! large objects take whole pages of the cage
+size_t large_size(size_t size)
+{
+    return (size + HeapCage::PageSize - 1) & ~(HeapCage::PageSize - 1);
+}
+
+//! Calls \a f with a reference to every value and HeapRef stored in
+//! \a object
+template <typename F>
+void for_each_child(HeapObject* object, F f)
+{
+    switch (object->Kind)
+    {
+        case HeapKind::Array:
+        {
+            const auto array = static_cast<SPArrayValue*>(object);
+            const auto elements = array->GetElements();
+            for (size_t i = 0, e = array->GetLength(); i < e; ++i)
+            {
+                f(elements[i]);
+            }
+            break;
+        }
+        case HeapKind::Object:
+        {
+            const auto value = static_cast<SPObjectValue*>(object);
+            const auto slots = value->GetInlineSlots();
+            for (uint32_t i = 0; i < SPObjectValue::InlineSlots; ++i)
+            {
+                f(slots[i]);
+            }
+            f(value->GetOverflow());
+            break;
+        }
+        case HeapKind::Elements:
+            f(static_cast<SPElementsArray*>(object)->GetStore());
+            break;
+        case HeapKind::Rope:
+        {
+            const auto rope = static_cast<SPRopeValue*>(object);
+            f(rope->GetLeftRef());
+            f(rope->GetRightRef());
+            break;
+        }
+        case HeapKind::Free:
+        case HeapKind::String:
+        case HeapKind::Buffer:
+        case HeapKind::Forwarded:
+            break;
+    }
+}
+
+double elapsed(std::chrono::steady_clock::time_point start)
+{
+    const std::chrono::duration<double, std::micro> pause =
+        std::chrono::steady_clock::now() - start;
+    return pause.count();
+}
+}  // namespace
+
+const size_t PauseHistogram::Buckets;
+
+void PauseHistogram::Add(double microseconds)
+{
+    size_t bucket = 0;
+    for (double limit = 1; bucket + 1 < Buckets && microseconds >= limit;
+         limit *= 2)
+    {
+        ++bucket;
+    }
+    ++Counts[bucket];
+}
+
+double PauseHistogram::Percentile(double p) const
+{
+    uint64_t total = 0;
+    for (auto count : Counts)
+    {
+        total += count;
+    }
+    if (total == 0)
+    {
+        return 0;
+    }
+    const auto rank = uint64_t(p * double(total));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < Buckets; ++i)
+    {
+        seen += Counts[i];
+        if (seen > rank || seen == total)
+        {
+            return double(uint64_t(1) << i);
+        }
+    }
+    return 0;
+}
+
+const size_t Heap::ArenaSize;
+const size_t Heap::CardSize;
+const size_t Heap::NurserySize;
+const size_t Heap::MinTrigger;
+const uint8_t Heap::LargeObject;
+const uint8_t Heap::YoungObject;
+
+struct Heap::FreeCell : HeapObject
+{
+    HeapRef Next;
+};
+
+Heap::Heap()
+{
+    static_assert(sizeof(FreeCell) <= 16, "Free cells must fit in a cell");
+    static_assert(sizeof(ForwardedObject) <= 16,
+                  "Forwarded objects must fit in the smallest object");
+    static_assert(s_SizeClasses == sizeof(m_FreeCells) / sizeof(FreeCell*),
+                  "A free list for every size class");
+    std::fill(m_FreeCells, m_FreeCells + s_SizeClasses, nullptr);
+    m_Nursery = m_Cage.Allocate(NurserySize);
+    m_NurseryTop = m_Nursery;
+    m_NurseryEnd = m_Nursery + NurserySize;
+    m_Stats.HeapSize = NurserySize;
+}
+
+Heap::~Heap()
+{
+    if (m_Marker.joinable())
+    {
+        m_Marker.join();
+    }
+}
+
+uint8_t Heap::size_class(size_t size)
+{
+    for (size_t i = 0; i < s_SizeClasses; ++i)
+    {
+        if (size <= s_CellSizes[i])
+        {
+            return uint8_t(i);
+        }
+    }
+    return LargeObject;
+}
+
+size_t Heap::allocation_size(const HeapObject* object)
+{
+    return object->SizeClass == LargeObject ? object->Size
+                                            : s_CellSizes[object->SizeClass];
+}
+
+HeapObject* Heap::Allocate(size_t size, HeapKind kind)
+{
+    const auto allocated = align(size);
+    if (size > s_MaxSmallSize || ShouldCollectYoung(size))
+    {
+        return AllocateOld(size, kind);
+    }
+    const auto object = reinterpret_cast<HeapObject*>(m_NurseryTop);
+    m_NurseryTop += allocated;
+    object->Kind = kind;
+    object->Marked = false;
+    object->SizeClass = YoungObject;
+    object->Remembered = false;
+    object->Size = uint32_t(size);
+    m_Stats.TotalAllocated += allocated;
+    return object;
+}
+
+HeapObject* Heap::AllocateOld(size_t size, HeapKind kind)
+{
+    const auto sizeClass = size_class(size);
+    HeapObject* object = nullptr;
+    size_t allocated = size;
+    if (sizeClass == LargeObject)
+    {
+        object = reinterpret_cast<HeapObject*>(m_Cage.Allocate(size));
+        m_LargeObjects.push_back(object);
+        m_Stats.HeapSize += large_size(size);
+    }
+    else
+    {
+        object = allocate_small(sizeClass);
+        allocated = s_CellSizes[sizeClass];
+    }
+    object->Kind = kind;
+    // objects allocated during a concurrent marking survive it
+    object->Marked = m_Marking;
+    object->SizeClass = sizeClass;
+    object->Remembered = false;
+    object->Size = uint32_t(size);
+    if (m_Marking)
+    {
+        m_AllocatedMarked += allocated;
+    }
+    m_Stats.AllocatedSinceCollection += allocated;
+    m_Stats.TotalAllocated += allocated;
+    return object;
+}
+
+HeapObject* Heap::allocate_small(uint8_t sizeClass)
+{
+    if (m_Unswept[sizeClass])
+    {
+        sweep_arenas(sizeClass);
+    }
+    if (auto cell = m_FreeCells[sizeClass])
+    {
+        m_FreeCells[sizeClass] = m_Cage.Decompress<FreeCell>(cell->Next);
+        return cell;
+    }
+    const auto cellSize = s_CellSizes[sizeClass];
+    auto& arenas = m_Arenas[sizeClass];
+    if (arenas.empty() || arenas.back().Top + cellSize > ArenaSize)
+    {
+        // fresh memory of the cage is zeroed, so are the cards
+        arenas.push_back(
+            Arena{m_Cage.Allocate(ArenaSize, ArenaSize), s_FirstCell});
+        m_Stats.HeapSize += ArenaSize;
+    }
+    auto& arena = arenas.back();
+    const auto object = reinterpret_cast<HeapObject*>(arena.Memory + arena.Top);
+    arena.Top += cellSize;
+    return object;
+}
+
+void Heap::remember(HeapObject* owner)
+{
+    if (owner->SizeClass == LargeObject)
+    {
+        if (!owner->Remembered)
+        {
+            owner->Remembered = true;
+            m_RememberedLarge.push_back(owner);
+        }
+        return;
+    }
+    const auto address = reinterpret_cast<uintptr_t>(owner);
+    const auto cards = reinterpret_cast<uint8_t*>(address & ~(ArenaSize - 1));
+    cards[(address & (ArenaSize - 1)) / CardSize] = 1;
+}
+
+void Heap::BeginMinorCollection()
+{
+    m_CollectionStart = std::chrono::steady_clock::now();
+}
+
+void Heap::Evacuate(data_t& slot)
+{
+    if (!is_object(slot) || !IsYoung(slot.get_pointer()))
+    {
+        return;
+    }
+    const auto target =
+        promote(static_cast<HeapObject*>(slot.get_pointer()));
+    store_field(slot, data_t(slot.get_type(), static_cast<void*>(target)));
+}
+
+void Heap::Evacuate(HeapRef& slot)
+{
+    const auto object = m_Cage.Decompress<HeapObject>(slot);
+    if (object && IsYoung(object))
+    {
+        store_field(slot, HeapCage::Compress(promote(object)));
+    }
+}
+
+HeapObject* Heap::promote(HeapObject* object)
+{
+    auto forwarded = static_cast<ForwardedObject*>(object);
+    if (object->Kind != HeapKind::Forwarded)
+    {
+        const auto copy = AllocateOld(object->Size, object->Kind);
+        std::memcpy(reinterpret_cast<uint8_t*>(copy) + sizeof(HeapObject),
+                    reinterpret_cast<uint8_t*>(object) + sizeof(HeapObject),
+                    object->Size - sizeof(HeapObject));
+        m_Stats.PromotedBytes += object->Size;
+        m_Promoted.push_back(HeapCage::Compress(copy));
+        forwarded->Kind = HeapKind::Forwarded;
+        forwarded->Target = HeapCage::Compress(copy);
+    }
+    return HeapCage::Decompress<HeapObject>(forwarded, forwarded->Target);
+}
+
+/*!
+** Evacuates the young objects referenced from the dirty cards of the old
+** space and from the objects promoted by this collection, and empties the
+** nursery.
+*/
+void Heap::FinishMinorCollection()
+{
+    const auto evacuate = [this](auto& slot) { Evacuate(slot); };
+    for (uint8_t i = 0; i < s_SizeClasses; ++i)
+    {
+        scan_cards(i);
+    }
+    for (auto object : m_RememberedLarge)
+    {
+        object->Remembered = false;
+        for_each_child(object, evacuate);
+    }
+    m_RememberedLarge.clear();
+    while (!m_Promoted.empty())
+    {
+        const auto object = m_Cage.Decompress<HeapObject>(m_Promoted.back());
+        m_Promoted.pop_back();
+        for_each_child(object, evacuate);
+    }
+    m_NurseryTop = m_Nursery;
+
+    ++m_Stats.MinorCollections;
+    m_Stats.LastMinorPause = elapsed(m_CollectionStart);
+    m_Stats.MaxMinorPause =
+        std::max(m_Stats.MaxMinorPause, m_Stats.LastMinorPause);
+    m_Stats.TotalMinorPause += m_Stats.LastMinorPause;
+    m_Stats.MinorPauses.Add(m_Stats.LastMinorPause);
+}
+
+void Heap::scan_cards(uint8_t sizeClass)
+{
+    const auto cellSize = s_CellSizes[sizeClass];
+    const auto evacuate = [this](auto& slot) { Evacuate(slot); };
+    auto& arenas = m_Arenas[sizeClass];
+    // evacuating may add arenas, so they are indexed and Top is reloaded
+    for (size_t i = 0; i < arenas.size(); ++i)
+    {
+        const auto memory = arenas[i].Memory;
+        for (size_t card = 0; card < s_CardCount; ++card)
+        {
+            if (!memory[card])
+            {
+                continue;
+            }
+            memory[card] = 0;
+            const auto begin = card * CardSize;
+            const auto end = begin + CardSize;
+            auto offset = s_FirstCell;
+            if (begin > s_FirstCell)
+            {
+                offset += (begin - s_FirstCell) / cellSize * cellSize;
+            }
+            for (; offset < end && offset < arenas[i].Top; offset += cellSize)
+            {
+                auto object = reinterpret_cast<HeapObject*>(memory + offset);
+                for_each_child(object, evacuate);
+            }
+        }
+    }
+}
+
+void Heap::BeginCollection()
+{
+    assert(!m_Marking && "A concurrent marking is running");
+    assert(m_NurseryTop == m_Nursery &&
+           "Full collections need an empty nursery");
+    m_CollectionStart = std::chrono::steady_clock::now();
+    for (uint8_t i = 0; i < s_SizeClasses; ++i)
+    {
+        if (m_Unswept[i])
+        {
+            sweep_arenas(i);
+        }
+    }
+    m_Stats.LiveBytes = 0;
+}
+
+void Heap::Mark(data_t value)
+{
+    if (is_object(value))
+    {
+        Mark(static_cast<HeapObject*>(value.get_pointer()));
+    }
+}
+
+//! Young objects are skipped, they are alive until the next minor collection
+void Heap::Mark(HeapObject* object)
+{
+    if (object && !IsYoung(object) && !object->Marked)
+    {
+        object->Marked = true;
+        m_Stats.LiveBytes += allocation_size(object);
+        m_Gray.push_back(HeapCage::Compress(object));
+    }
+}
+
+void Heap::Trace()
+{
+    while (!m_Gray.empty())
+    {
+        const auto object = m_Cage.Decompress<HeapObject>(m_Gray.back());
+        m_Gray.pop_back();
+        for_each_child(object, [this](auto& field) { mark_field(field); });
+    }
+}
+
+void Heap::Sweep()
+{
+    for (uint8_t i = 0; i < s_SizeClasses; ++i)
+    {
+        sweep_arenas(i);
+    }
+    sweep_large();
+    finish_collection();
+}
+
+/*!
+** Ends the pause for the roots. Until FinishConcurrentMarking only the
+** helper thread touches the mark bits of existing objects and LiveBytes.
+*/
+void Heap::TraceConcurrently()
+{
+    record_pause();
+    m_Marking = true;
+    m_MarkingDone = false;
+    m_Marker = std::thread([this] {
+        Trace();
+        m_MarkingDone = true;
+    });
+}
+
+void Heap::FinishConcurrentMarking()
+{
+    m_Marker.join();
+    m_CollectionStart = std::chrono::steady_clock::now();
+    for (auto object : m_Overwritten)
+    {
+        Mark(m_Cage.Decompress<HeapObject>(object));
+    }
+    m_Overwritten.clear();
+    Trace();
+}
+
+void Heap::SweepLazily()
+{
+    std::fill(m_Unswept, m_Unswept + s_SizeClasses, true);
+    sweep_large();
+    finish_collection();
+}
+
+void Heap::finish_collection()
+{
+    m_Stats.LiveBytes += m_AllocatedMarked;
+    m_AllocatedMarked = 0;
+    m_Marking = false;
+    m_Trigger = std::max(MinTrigger, m_Stats.LiveBytes);
+    m_Stats.AllocatedSinceCollection = 0;
+    ++m_Stats.Collections;
+    record_pause();
+}
+
+void Heap::record_pause()
+{
+    m_Stats.LastPause = elapsed(m_CollectionStart);
+    m_Stats.MaxPause = std::max(m_Stats.MaxPause, m_Stats.LastPause);
+    m_Stats.TotalPause += m_Stats.LastPause;
+    m_Stats.Pauses.Add(m_Stats.LastPause);
+}
+
+/*!
+** Rebuilds the free list of the size class from the dead cells of its
+** arenas. Arenas without any live objects are returned to the system.
+*/
+void Heap::sweep_arenas(uint8_t sizeClass)
+{
+    const auto cellSize = s_CellSizes[sizeClass];
+    auto& arenas = m_Arenas[sizeClass];
+    FreeCell* freeCells = nullptr;
+    size_t kept = 0;
+    for (auto& arena : arenas)
+    {
+        FreeCell* arenaCells = nullptr;
+        FreeCell* last = nullptr;
+        size_t live = 0;
+        for (auto offset = s_FirstCell; offset < arena.Top; offset += cellSize)
+        {
+            auto object = reinterpret_cast<HeapObject*>(arena.Memory + offset);
+            if (object->Marked)
+            {
+                object->Marked = false;
+                ++live;
+                continue;
+            }
+            auto cell = static_cast<FreeCell*>(object);
+            cell->Kind = HeapKind::Free;
+            cell->Next = HeapCage::Compress(arenaCells);
+            arenaCells = cell;
+            last = last ? last : cell;
+        }
+        // the arena being bumped is kept, there is nothing to free in it
+        if (live == 0 && &arena != &arenas.back())
+        {
+            m_Cage.Free(arena.Memory, ArenaSize);
+            m_Stats.HeapSize -= ArenaSize;
+            continue;
+        }
+        if (last)
+        {
+            last->Next = HeapCage::Compress(freeCells);
+            freeCells = arenaCells;
+        }
+        arenas[kept++] = arena;
+    }
+    arenas.resize(kept);
+    m_FreeCells[sizeClass] = freeCells;
+    m_Unswept[sizeClass] = false;
+}
+
+void Heap::sweep_large()
+{
+    // dead objects leave the remembered set before they are freed
+    const auto dead = [](const HeapObject* object) { return !object->Marked; };
+    m_RememberedLarge.erase(std::remove_if(m_RememberedLarge.begin(),
+                                           m_RememberedLarge.end(), dead),
+                            m_RememberedLarge.end());
+    size_t kept = 0;
+    for (auto object : m_LargeObjects)
+    {
+        if (object->Marked)
+        {
+            object->Marked = false;
+            m_LargeObjects[kept++] = object;
+        }
+        else
+        {
+            m_Stats.HeapSize -= large_size(object->Size);
+            m_Cage.Free(object, object->Size);
+        }
+    }
+    m_LargeObjects.resize(kept);
+}
+
+}  // namespace SpasmImpl
@@ -0,0 +1,391 @@
+#ifndef HEAP_HPP
+#define HEAP_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <thread>
+#include <utility>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+#include "cage.hpp"
+#include "object.hpp"
+#include "types.hpp"
+
+namespace SpasmImpl
+{
+//! Number of pauses in power of two buckets of microseconds
+struct PauseHistogram
+{
+    static const size_t Buckets = 24;
+    //! Counts[i] is the number of pauses shorter than 2^i microseconds and
+    //! not shorter than 2^(i - 1), the last bucket has all longer pauses
+    uint64_t Counts[Buckets] = {};
+
+    void Add(double microseconds);
+    //! \return upper bound of the pause at percentile \a p in 0..1
+    double Percentile(double p) const;
+};
+
+//! Counters of the Heap for tuning the collector
+struct HeapStats
+{
+    //! bytes taken from the system - nursery, arenas and large objects
+    size_t HeapSize = 0;
+    //! bytes of the old objects marked by the last full collection
+    size_t LiveBytes = 0;
+    //! bytes allocated in the old space since the last full collection
+    size_t AllocatedSinceCollection = 0;
+    //! bytes allocated since the heap was created
+    uint64_t TotalAllocated = 0;
+    //! bytes copied from the nursery to the old space
+    uint64_t PromotedBytes = 0;
+    uint64_t Collections = 0;
+    uint64_t MinorCollections = 0;
+    //! pauses of the full collections in microseconds, a concurrent
+    //! collection pauses twice - for the roots and for the remark
+    double LastPause = 0;
+    double MaxPause = 0;
+    double TotalPause = 0;
+    PauseHistogram Pauses;
+    //! pauses of the minor collections in microseconds
+    double LastMinorPause = 0;
+    double MaxMinorPause = 0;
+    double TotalMinorPause = 0;
+    PauseHistogram MinorPauses;
+};
+
+//! Garbage collected heap of the machine
+/*!
+** New objects are bump allocated in the nursery. A minor collection copies
+** the reachable ones to the old space and empties the nursery, so its cost
+** depends only on the survivors.
+**
+** In the old space small objects are allocated in arenas of fixed size
+** cells, one list of arenas per size class. The cells freed by the
+** collector are reused before the arenas grow. Objects larger than the
+** largest size class are allocated separately and never in the nursery.
+**
+** The owner of the heap knows the roots, so it drives the collections.
+** A minor collection updates the roots that point to moved objects:
+**
+**     heap.BeginMinorCollection();
+**     heap.Evacuate(root)...
+**     heap.FinishMinorCollection();
+**
+** A full collection is a precise, non-moving mark-sweep of the old space
+** and has to start with an empty nursery:
+**
+**     heap.BeginCollection();
+**     heap.Mark(root)...
+**     heap.Trace();
+**     // drop weak references to objects that are not IsMarked
+**     heap.Sweep();
+**
+** The marking can also run on a helper thread while the owner keeps
+** running. The owner pauses only to mark the roots and for the remark:
+**
+**     heap.BeginCollection();
+**     heap.Mark(root)...
+**     heap.TraceConcurrently();
+**     // ... later, once IsMarkingDone
+**     heap.FinishConcurrentMarking();
+**     // drop weak references to objects that are not IsMarked
+**     heap.SweepLazily();
+**
+** The marking uses a snapshot-at-the-beginning barrier: Store logs the
+** references it overwrites and objects allocated during the marking are
+** marked, so everything reachable when the marking began survives. Weak
+** references that are handed out during the marking need KeepAlive.
+** The helper thread reads the values of objects while the owner writes
+** them, so both sides access the values through load_field and
+** store_field. A lazy sweep leaves every size class to be swept before its
+** next allocation.
+**
+** All the memory of the heap is in its HeapCage. The fields that only
+** hold references - the children of ropes, the store of an array and the
+** overflow of an object - are 32-bit HeapRef offsets, as are the lists of
+** the collector. The values of objects and arrays stay 64-bit NaN boxes,
+** they hold numbers as well. The cage takes 4 GiB of address space per
+** heap, twice that for a moment while it is aligned.
+**
+** Allocation never collects. The owner checks ShouldCollectYoung and
+** ShouldCollect before it allocates.
+**
+** Every store of a value into a heap object must go through Store. It
+** marks the card of an old object that gets a reference to a young one,
+** and minor collections scan only the dirty cards of the old space instead
+** of all of it. The data stack is a root of every collection, so stores to
+** it need no barrier.
+*/
+class Heap
+{
+   public:
+    //! arenas are aligned to their size, so an object finds its arena
+    static const size_t ArenaSize = 64 << 10;
+    static const size_t CardSize = 512;
+    static const size_t NurserySize = 1 << 20;
+    //! the full collector does not run before the old space grows this much
+    static const size_t MinTrigger = 1 << 20;
+    static const uint8_t LargeObject = 0xff;
+    static const uint8_t YoungObject = 0xfe;
+
+    Heap();
+    ~Heap();
+    Heap(const Heap&) = delete;
+    Heap& operator=(const Heap&) = delete;
+
+    //! Allocates \a size bytes with an initialized header in the nursery
+    //! or in the old space if it does not fit
+    HeapObject* Allocate(size_t size, HeapKind kind);
+    //! Allocates directly in the old space, for objects that never move
+    HeapObject* AllocateOld(size_t size, HeapKind kind);
+
+    //! Allocates \a size bytes and constructs a T in them
+    template <typename T, typename... Args>
+    T* New(size_t size, Args&&... args)
+    {
+        return construct<T>(Allocate(size, HeapKind::Free),
+                            std::forward<Args>(args)...);
+    }
+
+    template <typename T, typename... Args>
+    T* NewOld(size_t size, Args&&... args)
+    {
+        return construct<T>(AllocateOld(size, HeapKind::Free),
+                            std::forward<Args>(args)...);
+    }
+
+    bool ShouldCollect() const
+    {
+        return m_Stats.AllocatedSinceCollection >= m_Trigger;
+    }
+
+    //! \return true if an object of \a size does not fit in the nursery
+    bool ShouldCollectYoung(size_t size) const
+    {
+        return size_t(m_NurseryEnd - m_NurseryTop) < align(size);
+    }
+
+    bool IsYoung(const void* object) const
+    {
+        const auto p = static_cast<const uint8_t*>(object);
+        return p >= m_Nursery && p < m_NurseryEnd;
+    }
+
+    //! Stores \a value in \a field of \a owner
+    void Store(HeapObject* owner, data_t& field, data_t value)
+    {
+        if (m_Marking && is_object(field) && !IsYoung(field.get_pointer()))
+        {
+            m_Overwritten.push_back(
+                HeapCage::Compress(field.get_pointer()));
+        }
+        store_field(field, value);
+        if (is_object(value) && IsYoung(value.get_pointer()) &&
+            !IsYoung(owner))
+        {
+            remember(owner);
+        }
+    }
+
+    //! Stores a reference to \a value, which may be nullptr, in \a field of
+    //! \a owner
+    void Store(HeapObject* owner, HeapRef& field, HeapObject* value)
+    {
+        if (m_Marking && field &&
+            !IsYoung(m_Cage.Decompress<HeapObject>(field)))
+        {
+            m_Overwritten.push_back(field);
+        }
+        store_field(field, HeapCage::Compress(value));
+        if (value && IsYoung(value) && !IsYoung(owner))
+        {
+            remember(owner);
+        }
+    }
+
+    //! Keeps \a object alive during a concurrent marking
+    void KeepAlive(HeapObject* object)
+    {
+        if (m_Marking)
+        {
+            m_Overwritten.push_back(HeapCage::Compress(object));
+        }
+    }
+
+    void BeginMinorCollection();
+    //! Moves the young object \a slot refers to and updates \a slot
+    void Evacuate(data_t& slot);
+    void Evacuate(HeapRef& slot);
+    void FinishMinorCollection();
+
+    void BeginCollection();
+    void Mark(data_t value);
+    void Mark(HeapObject* object);
+    //! Marks everything reachable from the marked objects
+    void Trace();
+    //! Frees the objects that are not marked and finishes the collection
+    void Sweep();
+
+    //! Continues the marking on a helper thread
+    void TraceConcurrently();
+    bool IsMarking() const { return m_Marking; }
+    bool IsMarkingDone() const { return m_MarkingDone.load(); }
+    //! Waits for the helper thread and marks what the owner changed
+    void FinishConcurrentMarking();
+    //! Frees the large objects that are not marked, the small ones are
+    //! freed when their size class needs a cell
+    void SweepLazily();
+
+    static bool IsMarked(const HeapObject* object) { return object->Marked; }
+
+    const HeapStats& GetStats() const { return m_Stats; }
+
+   private:
+    struct FreeCell;
+    struct Arena
+    {
+        uint8_t* Memory;
+        //! offset of the first cell that was never allocated
+        size_t Top;
+    };
+
+    template <typename T, typename... Args>
+    static T* construct(HeapObject* object, Args&&... args)
+    {
+        const auto sizeClass = object->SizeClass;
+        const auto size = object->Size;
+        const auto marked = object->Marked;
+        const auto result = new (object) T(std::forward<Args>(args)...);
+        result->SizeClass = sizeClass;
+        result->Size = size;
+        result->Marked = marked;
+        return result;
+    }
+
+    static bool is_object(data_t value)
+    {
+        return !value.is_double() &&
+               value.get_type() >= ::Spasm::ValueType::String;
+    }
+
+    static size_t align(size_t size) { return (size + 15) & ~size_t(15); }
+
+    //! Atomic load of a value the owner may be writing, pairs with
+    //! store_field so the objects it refers to are seen initialized
+    static data_t load_field(const data_t& field)
+    {
+        uint64_t bits;
+#if defined(_MSC_VER)
+        // x64 loads are acquire, only the compiler must not reorder them
+        bits = uint64_t(__iso_volatile_load64(
+            reinterpret_cast<const volatile __int64*>(&field)));
+        _ReadWriteBarrier();
+#else
+        bits = __atomic_load_n(reinterpret_cast<const uint64_t*>(&field),
+                               __ATOMIC_ACQUIRE);
+#endif
+        data_t value;
+        std::memcpy(static_cast<void*>(&value), &bits, sizeof(value));
+        return value;
+    }
+
+    static HeapRef load_field(const HeapRef& field)
+    {
+#if defined(_MSC_VER)
+        const auto ref = HeapRef(__iso_volatile_load32(
+            reinterpret_cast<const volatile __int32*>(&field)));
+        _ReadWriteBarrier();
+        return ref;
+#else
+        return __atomic_load_n(&field, __ATOMIC_ACQUIRE);
+#endif
+    }
+
+    //! Atomic store of a value the helper thread may be reading
+    static void store_field(data_t& field, data_t value)
+    {
+        uint64_t bits;
+        std::memcpy(&bits, &value, sizeof(bits));
+#if defined(_MSC_VER)
+        _ReadWriteBarrier();
+        __iso_volatile_store64(reinterpret_cast<volatile __int64*>(&field),
+                               __int64(bits));
+#else
+        __atomic_store_n(reinterpret_cast<uint64_t*>(&field), bits,
+                         __ATOMIC_RELEASE);
+#endif
+    }
+
+    static void store_field(HeapRef& field, HeapRef ref)
+    {
+#if defined(_MSC_VER)
+        _ReadWriteBarrier();
+        __iso_volatile_store32(reinterpret_cast<volatile __int32*>(&field),
+                               __int32(ref));
+#else
+        __atomic_store_n(&field, ref, __ATOMIC_RELEASE);
+#endif
+    }
+
+    //! Marks the object \a field refers to, for the values of objects
+    void mark_field(const data_t& field) { Mark(load_field(field)); }
+    void mark_field(const HeapRef& field)
+    {
+        Mark(m_Cage.Decompress<HeapObject>(load_field(field)));
+    }
+
+    //! \return the copy of the young \a object in the old space
+    HeapObject* promote(HeapObject* object);
+
+    static uint8_t size_class(size_t size);
+    static size_t allocation_size(const HeapObject* object);
+    HeapObject* allocate_small(uint8_t sizeClass);
+    void remember(HeapObject* owner);
+    void scan_cards(uint8_t sizeClass);
+    void sweep_arenas(uint8_t sizeClass);
+    void sweep_large();
+    void finish_collection();
+    void record_pause();
+
+    //! declared first to release the memory after everything else
+    HeapCage m_Cage;
+
+    uint8_t* m_Nursery = nullptr;
+    uint8_t* m_NurseryTop = nullptr;
+    uint8_t* m_NurseryEnd = nullptr;
+
+    //! the arenas of every size class, allocation bumps in the last one
+    SPVector<Arena> m_Arenas[16];
+    //! cells freed by the collector, for every size class
+    FreeCell* m_FreeCells[16];
+    SPVector<HeapObject*> m_LargeObjects;
+    //! large objects with references to young objects
+    SPVector<HeapObject*> m_RememberedLarge;
+    //! marked objects whose children are not marked yet
+    SPVector<HeapRef> m_Gray;
+    //! promoted objects whose children are not evacuated yet
+    SPVector<HeapRef> m_Promoted;
+
+    //! a concurrent marking is running, new objects are marked
+    bool m_Marking = false;
+    std::atomic<bool> m_MarkingDone{false};
+    std::thread m_Marker;
+    //! references overwritten during the concurrent marking
+    SPVector<HeapRef> m_Overwritten;
+    //! bytes allocated during the concurrent marking
+    size_t m_AllocatedMarked = 0;
+    //! size classes with arenas to sweep before the next allocation
+    bool m_Unswept[16] = {};
+
+    size_t m_Trigger = MinTrigger;
+    HeapStats m_Stats;
+    std::chrono::steady_clock::time_point m_CollectionStart;
+};
+
+}  // namespace SpasmImpl
+#endif  // #ifndef HEAP_HPP
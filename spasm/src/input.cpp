@@ -0,0 +1,129 @@
+#include <algorithm>
+#include <cstring>
+
+#include "input.hpp"
+#include "parse.hpp"
+
+namespace SpasmImpl
+{
+namespace
+{
+bool is_space(char c)
+{
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+//! \return whether \a c may be part of a number parse_number reads
+bool is_number_part(char c)
+{
+    return (c >= '0' && c <= '9') || c == '.' || c == '-' || c == '+' ||
+           c == 'e' || c == 'E';
+}
+}  // namespace
+
+bool InputBuffer::fill()
+{
+    if (m_Stream == nullptr || m_Stream->rdbuf() == nullptr)
+    {
+        return false;
+    }
+    if (m_Begin != 0)
+    {
+        std::memmove(m_Data.data(), m_Data.data() + m_Begin, m_End - m_Begin);
+        m_End -= m_Begin;
+        m_Begin = 0;
+    }
+    if (m_End == m_Data.size())
+    {
+        m_Data.resize(m_Data.size() * 2);
+    }
+
+    typedef std::istream::traits_type traits;
+    auto buffer = m_Stream->rdbuf();
+    // blocks until there is something to read, then takes what is there
+    if (traits::eq_int_type(buffer->sgetc(), traits::eof()))
+    {
+        m_Stream->setstate(std::ios_base::eofbit);
+        return false;
+    }
+    const auto available = std::max<std::streamsize>(buffer->in_avail(), 1);
+    const auto room = std::streamsize(m_Data.size() - m_End);
+    const auto count =
+        buffer->sgetn(m_Data.data() + m_End, std::min(available, room));
+    m_End += size_t(count);
+    return count > 0;
+}
+
+bool InputBuffer::ReadNumber(double& value)
+{
+    value = 0;
+    for (;;)
+    {
+        while (m_Begin != m_End && is_space(m_Data[m_Begin]))
+        {
+            ++m_Begin;
+        }
+        if (m_Begin != m_End)
+        {
+            break;
+        }
+        if (!fill())
+        {
+            return false;
+        }
+    }
+
+    // the whole number has to be in the buffer before it is parsed
+    auto length = size_t(0);
+    for (;;)
+    {
+        while (m_Begin + length != m_End &&
+               is_number_part(m_Data[m_Begin + length]))
+        {
+            ++length;
+        }
+        if (m_Begin + length != m_End || !fill())
+        {
+            break;
+        }
+    }
+
+    const auto begin = m_Data.data() + m_Begin;
+    const auto end = parse_number(begin, begin + length, value);
+    m_Begin += size_t(end - begin);
+    return end != begin;
+}
+
+bool InputBuffer::ReadLine(std::string& line)
+{
+    line.clear();
+    bool read = false;
+    for (;;)
+    {
+        const auto begin = m_Data.data() + m_Begin;
+        const auto length = m_End - m_Begin;
+        const auto newline =
+            static_cast<const char*>(std::memchr(begin, '\n', length));
+        if (newline != nullptr)
+        {
+            line.append(begin, size_t(newline - begin));
+            m_Begin += size_t(newline - begin) + 1;
+            read = true;
+            break;
+        }
+        line.append(begin, length);
+        m_Begin = m_End;
+        read |= length != 0;
+        if (!fill())
+        {
+            break;
+        }
+    }
+    if (!line.empty() && line.back() == '\r')
+    {
+        line.pop_back();
+    }
+    return read;
+}
+
+}  // namespace SpasmImpl
@@ -0,0 +1,56 @@
+#ifndef INPUT_HPP
+#define INPUT_HPP
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace SpasmImpl
+{
+const size_t InputBufferSize = 64 * 1024;
+
+//! Input of a machine, read from its stream in large blocks
+/*!
+** Numbers are parsed in place by parse_number, lines are copied out of the
+** buffer. The buffer reads ahead of what the program consumed, so nothing
+** else should read from the stream.
+*/
+class InputBuffer
+{
+   public:
+    InputBuffer() : m_Data(InputBufferSize) {}
+    InputBuffer(const InputBuffer&) = delete;
+    InputBuffer& operator=(const InputBuffer&) = delete;
+
+    //! Drops what was buffered from the stream before
+    void SetStream(std::istream& stream)
+    {
+        m_Stream = &stream;
+        m_Begin = 0;
+        m_End = 0;
+    }
+
+    //! Skips white space and reads a number, \a value is 0 if there is none
+    //! \return false at the end of the input or before text that is not a
+    //! number, which is left unread
+    bool ReadNumber(double& value);
+
+    //! Reads the text up to the end of the line, without the '\n' and a '\r'
+    //! before it
+    //! \return false at the end of the input
+    bool ReadLine(std::string& line);
+
+   private:
+    //! Reads more of the stream after the buffered text, moving it to the
+    //! front of the buffer or growing it when it is full
+    //! \return false at the end of the stream
+    bool fill();
+
+    std::vector<char> m_Data;
+    size_t m_Begin = 0;
+    size_t m_End = 0;
+    std::istream* m_Stream = nullptr;
+};
+
+}  // namespace SpasmImpl
+#endif  // #ifndef INPUT_HPP
@@ -0,0 +1,662 @@
+#include <cstddef>
+#include <initializer_list>
+#include <utility>
+
+#include "jit.hpp"
+
+namespace SpasmImpl
+{
+#if SPASM_JIT
+namespace
+{
+using namespace X64;
+
+// Registers holding the machine state in the native code
+const Register StateRegister = RBX;
+const Register FrameRegister = R12;
+const Register StackRegister = R13;
+
+//! Translates instructions, each method returns false if it can't
+/*!
+** Arithmetic and comparisons check the types of their operands. Two
+** Integers take the integer path, other Numbers are converted to doubles
+** for the SSE2 one. Other types and integer overflows jump to the slow
+** path of the instruction, where the interpreter executes it. The checks
+** come before any local is written, so the slow path starts the
+** instruction over.
+*/
+class Compiler
+{
+   public:
+    Compiler(Emitter& emitter, SPVector<size_t>& labels)
+        : x(emitter), m_Labels(labels)
+    {
+    }
+
+    //! Slow paths used by the instructions translated so far
+    const SPVector<std::pair<int32_t, size_t>>& slow_paths() const
+    {
+        return m_SlowPaths;
+    }
+
+    //! Translates the instruction, false if the interpreter has to execute it
+    bool instruction(const Instruction& i, size_t index, int32_t exit)
+    {
+        m_Index = index;
+        m_Slow = -1;
+        switch (i.OpCode)
+        {
+            case OpCodes::Halt:
+                x.jump(exit);
+                return true;
+            case OpCodes::Dup:
+                dup();
+                return true;
+            case OpCodes::Pop:
+                return pop(i.A0);
+            case OpCodes::PopTo:
+                return popto(i.A0);
+            case OpCodes::PushFrom:
+                return push(i.A0);
+            case OpCodes::Push:
+                return push_zeroes(i.A0);
+            case OpCodes::Jump:
+                x.jump(i.A0);
+                return true;
+            case OpCodes::JumpT:
+                return branch(true, i.A0, i.A1);
+            case OpCodes::JumpF:
+                return branch(false, i.A0, i.A1);
+            case OpCodes::Const:
+            case OpCodes::String:
+                return constant(i.A0, i.Value);
+            case OpCodes::Add:
+            case OpCodes::Sub:
+            case OpCodes::Mul:
+            case OpCodes::Div:
+                return arithmetic(i.OpCode, i.A0, i.A1, i.A2);
+            case OpCodes::Less:
+            case OpCodes::LessEq:
+            case OpCodes::Greater:
+            case OpCodes::GreaterEq:
+            case OpCodes::Equal:
+            case OpCodes::NotEqual:
+                return compare(i.OpCode, i.A0, i.A1, i.A2);
+            case OpCodes::LessJumpT:
+            case OpCodes::LessJumpF:
+                return compare_branch(OpCodes::Less, i);
+            case OpCodes::LessEqJumpT:
+            case OpCodes::LessEqJumpF:
+                return compare_branch(OpCodes::LessEq, i);
+            case OpCodes::EqualJumpT:
+            case OpCodes::EqualJumpF:
+                return compare_branch(OpCodes::Equal, i);
+            case OpCodes::NotEqualJumpT:
+            case OpCodes::NotEqualJumpF:
+                return compare_branch(OpCodes::NotEqual, i);
+            case OpCodes::AddConst:
+                return constant(i.A3, i.Value) &&
+                       arithmetic(OpCodes::Add, i.A0, i.A1, i.A2);
+            case OpCodes::SubConst:
+                return constant(i.A3, i.Value) &&
+                       arithmetic(OpCodes::Sub, i.A0, i.A1, i.A2);
+            case OpCodes::IncrementConstAndCompare:
+                if (!constant(i.A1, i.Value))
+                {
+                    return false;
+                }
+            // fall through
+            case OpCodes::IncrementAndCompare:
+                return increment_and_compare(i);
+            default:
+                return false;
+        }
+    }
+
+   private:
+    int32_t label()
+    {
+        m_Labels.push_back(0);
+        return int32_t(m_Labels.size() - 1);
+    }
+
+    void bind(int32_t label) { m_Labels[size_t(label)] = x.size(); }
+
+    //! Label of the slow path of the current instruction
+    int32_t slow()
+    {
+        if (m_Slow < 0)
+        {
+            m_Slow = label();
+            m_SlowPaths.emplace_back(m_Slow, m_Index);
+        }
+        return m_Slow;
+    }
+
+    //! Jumps to otherwise unless every m_FP[disp] is an Integer
+    void guard_integers(std::initializer_list<int32_t> disps,
+                        int32_t otherwise)
+    {
+        for (const auto disp : disps)
+        {
+            x.load(RDX, FrameRegister, disp);
+            x.shift_right(RDX, 32);
+            x.compare32(RDX, uint32_t(IntegerBits >> 32));
+            x.jump(NotZero, otherwise);
+        }
+    }
+
+    //! Loads m_FP[disp] to xmm as a double, an Integer is converted and
+    //! any other type jumps to the slow path
+    void load_number(int xmm, int32_t disp)
+    {
+        const auto integer = label();
+        const auto done = label();
+        x.load(RAX, FrameRegister, disp);
+        x.move(RCX, RAX);
+        x.shift_right(RCX, 48);
+        x.compare32(RCX, 0xfff8);
+        x.jump(Above, integer);
+        x.move_to_xmm(xmm, RAX);
+        x.jump(done);
+        bind(integer);
+        x.compare32(RCX, uint32_t(IntegerBits >> 48));
+        x.jump(NotZero, slow());
+        x.convert_to_xmm(xmm, RAX);
+        bind(done);
+    }
+
+    //! m_FP[d0] = m_FP[d1] op m_FP[d2] on Integers, the product is zero
+    //! only on the slow path as it may be -0
+    void integer_arithmetic(OpCodes op, int32_t d0, int32_t d1, int32_t d2)
+    {
+        x.load(RAX, FrameRegister, d1);
+        x.load(RCX, FrameRegister, d2);
+        switch (op)
+        {
+            case OpCodes::Add:
+                x.alu(AddRegister, RAX, RCX);
+                x.jump(Overflow, slow());
+                break;
+            case OpCodes::Sub:
+                x.alu(SubRegister, RAX, RCX);
+                x.jump(Overflow, slow());
+                break;
+            default:
+                x.multiply32(RAX, RCX);
+                x.jump(Overflow, slow());
+                x.alu(TestRegister, RAX, RAX);
+                x.jump(Zero, slow());
+                break;
+        }
+        // the 32-bit operation cleared the upper half of rax
+        x.move(RCX, IntegerBits);
+        x.alu(OrRegister, RAX, RCX, true);
+        x.store(FrameRegister, d0, RAX);
+    }
+
+    //! m_FP[d0] = xmm0 op xmm1
+    void double_arithmetic(OpCodes op, int32_t d0)
+    {
+        x.sse(sse(op), 0, 1);
+        x.sse(MoveStore, 0, FrameRegister, d0);
+    }
+
+    static SSE sse(OpCodes op)
+    {
+        switch (op)
+        {
+            case OpCodes::Add:
+                return AddSD;
+            case OpCodes::Sub:
+                return SubSD;
+            case OpCodes::Mul:
+                return MulSD;
+            default:
+                return DivSD;
+        }
+    }
+
+    bool arithmetic(OpCodes op, int64_t a0, int64_t a1, int64_t a2)
+    {
+        int32_t d0, d1, d2;
+        if (!slot(a0, d0) || !slot(a1, d1) || !slot(a2, d2))
+        {
+            return false;
+        }
+        const auto doubles = label();
+        const auto done = label();
+        if (op != OpCodes::Div)
+        {
+            guard_integers({d1, d2}, doubles);
+            integer_arithmetic(op, d0, d1, d2);
+            x.jump(done);
+        }
+        bind(doubles);
+        load_number(0, d1);
+        load_number(1, d2);
+        double_arithmetic(op, d0);
+        bind(done);
+        return true;
+    }
+
+    //! Leaves 0 or 1 in eax for m_FP[d1] op m_FP[d2] on Integers
+    void integer_compare(OpCodes op, int32_t d1, int32_t d2)
+    {
+        x.load(RAX, FrameRegister, d1);
+        x.load(RCX, FrameRegister, d2);
+        x.alu(CompareRegister, RAX, RCX);
+        switch (op)
+        {
+            case OpCodes::Less:
+                x.set(SignedLess, RAX);
+                break;
+            case OpCodes::LessEq:
+                x.set(SignedLessEqual, RAX);
+                break;
+            case OpCodes::Greater:
+                x.set(SignedGreater, RAX);
+                break;
+            case OpCodes::GreaterEq:
+                x.set(SignedGreaterEqual, RAX);
+                break;
+            case OpCodes::Equal:
+                x.set(Zero, RAX);
+                break;
+            default:
+                x.set(NotZero, RAX);
+                break;
+        }
+    }
+
+    //! Leaves 0 or 1 in eax for xmm lhs op xmm rhs
+    void double_compare(OpCodes op, int lhs, int rhs)
+    {
+        switch (op)
+        {
+            case OpCodes::Less:
+            case OpCodes::LessEq:
+                // lhs < rhs as rhs > lhs, unordered operands set CF
+                x.sse(UnorderedCompare, rhs, lhs);
+                x.set(op == OpCodes::Less ? Above : AboveEqual, RAX);
+                break;
+            case OpCodes::Greater:
+            case OpCodes::GreaterEq:
+                x.sse(UnorderedCompare, lhs, rhs);
+                x.set(op == OpCodes::Greater ? Above : AboveEqual, RAX);
+                break;
+            case OpCodes::Equal:
+                x.sse(UnorderedCompare, lhs, rhs);
+                x.set(Zero, RAX);
+                x.set(NoParity, RCX);
+                x.emit(0x20);  // and al, cl
+                x.emit(0xc8);
+                break;
+            default:
+                x.sse(UnorderedCompare, lhs, rhs);
+                x.set(NotZero, RAX);
+                x.set(Parity, RCX);
+                x.emit(0x08);  // or al, cl
+                x.emit(0xc8);
+                break;
+        }
+    }
+
+    //! Stores the Boolean in al to m_FP[d0] and leaves 0 or 1 in eax
+    void store_boolean(int32_t d0)
+    {
+        x.emit(0x0f);  // movzx eax, al
+        x.emit(0xb6);
+        x.emit(0xc0);
+        x.move(RCX, FalseBits);
+        x.alu(OrRegister, RCX, RAX, true);
+        x.store(FrameRegister, d0, RCX);
+    }
+
+    static bool is_comparison(OpCodes op)
+    {
+        switch (op)
+        {
+            case OpCodes::Less:
+            case OpCodes::LessEq:
+            case OpCodes::Greater:
+            case OpCodes::GreaterEq:
+            case OpCodes::Equal:
+            case OpCodes::NotEqual:
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    //! Stores the Boolean result in a0 and leaves 0 or 1 in eax
+    bool compare(OpCodes op, int64_t a0, int64_t a1, int64_t a2)
+    {
+        int32_t d0, d1, d2;
+        if (!is_comparison(op) || !slot(a0, d0) || !slot(a1, d1) ||
+            !slot(a2, d2))
+        {
+            return false;
+        }
+        const auto doubles = label();
+        const auto done = label();
+        guard_integers({d1, d2}, doubles);
+        integer_compare(op, d1, d2);
+        x.jump(done);
+        bind(doubles);
+        load_number(0, d1);
+        load_number(1, d2);
+        double_compare(op, 0, 1);
+        bind(done);
+        store_boolean(d0);
+        return true;
+    }
+
+    //! a0 += a1, a2 = a0 < a3 and the branch. The types of all the operands
+    //! are checked before a0 is written.
+    bool increment_and_compare(const Instruction& i)
+    {
+        int32_t d0, d1, d2, d3;
+        if (!slot(i.A0, d0) || !slot(i.A1, d1) || !slot(i.A2, d2) ||
+            !slot(i.A3, d3))
+        {
+            return false;
+        }
+        const auto doubles = label();
+        const auto done = label();
+        guard_integers({d0, d1, d3}, doubles);
+        integer_arithmetic(OpCodes::Add, d0, d0, d1);
+        integer_compare(OpCodes::Less, d0, d3);
+        x.jump(done);
+        bind(doubles);
+        load_number(0, d0);
+        load_number(1, d1);
+        load_number(2, d3);
+        double_arithmetic(OpCodes::Add, d0);
+        double_compare(OpCodes::Less, 0, 2);
+        bind(done);
+        store_boolean(d2);
+        branch_on_result(true, i.A4);
+        return true;
+    }
+
+    //! Jumps to target if the result of compare is true
+    void branch_on_result(bool onTrue, int32_t target)
+    {
+        x.alu(TestRegister, RAX, RAX);
+        x.jump(onTrue ? NotZero : Zero, target);
+    }
+
+    //! Jumps to target if m_FP[a0] is (not) truthy, see Value::operator bool
+    bool branch(bool onTrue, int64_t a0, int32_t target)
+    {
+        int32_t d0;
+        if (!slot(a0, d0))
+        {
+            return false;
+        }
+        const auto payload = label();
+        const auto test = label();
+        x.load(RAX, FrameRegister, d0);
+        x.move(RCX, RAX);
+        x.shift_right(RCX, 48);
+        x.compare32(RCX, uint32_t(FalseBits >> 48));
+        x.jump(Zero, payload);
+        x.compare32(RCX, uint32_t(IntegerBits >> 48));
+        x.jump(NotZero, test);
+        bind(payload);
+        // a Boolean or an Integer is its payload
+        x.shift_left(RAX, 16);
+        bind(test);
+        x.alu(TestRegister, RAX, RAX, true);
+        x.jump(onTrue ? NotZero : Zero, target);
+        return true;
+    }
+
+    bool constant(int64_t a0, data_t value)
+    {
+        int32_t d0;
+        if (!slot(a0, d0))
+        {
+            return false;
+        }
+        x.move(RAX, uint64_t(value.m_value.as_int64));
+        x.store(FrameRegister, d0, RAX);
+        return true;
+    }
+
+    bool push(int64_t a0)
+    {
+        int32_t d0;
+        if (!slot(a0, d0))
+        {
+            return false;
+        }
+        x.load(RAX, FrameRegister, d0);
+        x.store(StackRegister, 0, RAX);
+        x.add(StackRegister, int32_t(sizeof(data_t)));
+        return true;
+    }
+
+    bool popto(int64_t a0)
+    {
+        int32_t d0;
+        if (!slot(a0, d0))
+        {
+            return false;
+        }
+        x.add(StackRegister, -int32_t(sizeof(data_t)));
+        x.load(RAX, StackRegister, 0);
+        x.store(FrameRegister, d0, RAX);
+        return true;
+    }
+
+    void dup()
+    {
+        x.load(RAX, StackRegister, -int32_t(sizeof(data_t)));
+        x.store(StackRegister, 0, RAX);
+        x.add(StackRegister, int32_t(sizeof(data_t)));
+    }
+
+    //! Pushes count zeroes, long runs are left to the interpreter
+    bool push_zeroes(int64_t count)
+    {
+        if (count < 0 || count > 64)
+        {
+            return false;
+        }
+        x.emit(0x31);  // xor eax, eax
+        x.emit(0xc0);
+        for (int32_t i = 0; i < count; ++i)
+        {
+            x.store(StackRegister, i * int32_t(sizeof(data_t)), RAX);
+        }
+        x.add(StackRegister, int32_t(count * sizeof(data_t)));
+        return true;
+    }
+
+    bool pop(int64_t count)
+    {
+        int32_t disp;
+        if (!slot(count, disp))
+        {
+            return false;
+        }
+        x.add(StackRegister, -disp);
+        return true;
+    }
+
+    bool compare_branch(OpCodes compareOp, const Instruction& i)
+    {
+        if (!compare(compareOp, i.A0, i.A1, i.A2))
+        {
+            return false;
+        }
+        const bool onTrue =
+            i.OpCode == OpCodes::LessJumpT ||
+            i.OpCode == OpCodes::LessEqJumpT ||
+            i.OpCode == OpCodes::EqualJumpT ||
+            i.OpCode == OpCodes::NotEqualJumpT;
+        branch_on_result(onTrue, i.A3);
+        return true;
+    }
+
+    Emitter& x;
+    SPVector<size_t>& m_Labels;
+    //! label and instruction index of every slow path
+    SPVector<std::pair<int32_t, size_t>> m_SlowPaths;
+    size_t m_Index = 0;
+    //! slow path label of the current instruction, -1 if it has none yet
+    int32_t m_Slow = -1;
+};
+
+void save_registers(Emitter& x)
+{
+    x.store(StateRegister, offsetof(JitState, FP), FrameRegister);
+    x.store(StateRegister, offsetof(JitState, SP), StackRegister);
+}
+
+void load_registers(Emitter& x)
+{
+    x.load(FrameRegister, StateRegister, offsetof(JitState, FP));
+    x.load(StackRegister, StateRegister, offsetof(JitState, SP));
+}
+
+//! Executes the instruction at index in the interpreter and continues at
+//! the native address the helper returns
+void call_fallback(Emitter& x, size_t index, const void* fallback)
+{
+    save_registers(x);
+    x.move(RDI, StateRegister);
+    x.move(RSI, uint64_t(index));
+    x.move(RAX, uint64_t(reinterpret_cast<uintptr_t>(fallback)));
+    x.call(RAX);
+    load_registers(x);
+    x.jump(RAX);
+}
+}  // namespace
+#endif  // #if SPASM_JIT
+
+Jit::Jit(Spasm& vm) : m_VM(vm) {}
+
+Jit::~Jit() {}
+
+/*!
+** Translates the whole decoded program. Spasm has no function boundaries,
+** every instruction gets an entry point so calls, returns and the
+** interpreter can continue at any of them.
+**
+** \param code	- decoded program, the last instruction must be a trap
+*/
+bool Jit::Compile(const InstructionStream& code)
+{
+#if SPASM_JIT
+    Emitter x;
+    // int64_t entry(JitState* state, const void* target)
+    // rbx, r12-r15 and rbp are callee saved, the extra 8 bytes keep the
+    // stack 16 byte aligned for the helper calls
+    const Register saved[] = {RBP, RBX, R12, R13, R14, R15};
+    for (const auto r : saved)
+    {
+        x.push(r);
+    }
+    x.add(RSP, -8);
+    x.move(StateRegister, RDI);
+    load_registers(x);
+    x.jump(RSI);
+
+    const auto exitOffset = x.size();
+    save_registers(x);
+    x.load(RAX, StateRegister, offsetof(JitState, Result));
+    x.add(RSP, 8);
+    for (auto r = std::end(saved); r != std::begin(saved);)
+    {
+        x.pop(*--r);
+    }
+    x.ret();
+
+    // the labels of the instructions, the exit and then the local ones
+    SPVector<size_t> offsets(code.size() + 1);
+    // the exit stub as a jump target for Halt
+    const auto exit = int32_t(code.size());
+    offsets[size_t(exit)] = exitOffset;
+
+    const auto helper = reinterpret_cast<const void*>(&fallback);
+    Compiler compiler(x, offsets);
+    for (size_t i = 0; i < code.size(); ++i)
+    {
+        offsets[i] = x.size();
+        if (!compiler.instruction(code[i], i, exit))
+        {
+            call_fallback(x, i, helper);
+        }
+    }
+    // the slow paths are out of line, after all the instructions
+    for (const auto& path : compiler.slow_paths())
+    {
+        offsets[size_t(path.first)] = x.size();
+        call_fallback(x, path.second, helper);
+    }
+    x.link(offsets);
+
+    if (!m_Memory.Assign(x))
+    {
+        return false;
+    }
+    const auto memory = m_Memory.get();
+    m_Entry = reinterpret_cast<Entry>(const_cast<uint8_t*>(memory));
+    m_Exit = memory + exitOffset;
+    m_Targets.resize(code.size());
+    for (size_t i = 0; i < code.size(); ++i)
+    {
+        m_Targets[i] = memory + offsets[i];
+    }
+    return true;
+#else
+    (void)code;
+    return false;
+#endif
+}
+
+Spasm::RunResult Jit::Run()
+{
+    JitState state{m_VM.m_FP, m_VM.m_SP, this, Spasm::RunResult::Success};
+    m_Entry(&state, m_Targets[m_VM.m_PC]);
+    m_VM.m_FP = state.FP;
+    m_VM.m_SP = state.SP;
+    return Spasm::RunResult(state.Result);
+}
+
+/*!
+** Called from the native code for the instructions it does not translate.
+** The interpreter executes the instruction on the machine state.
+**
+** \return native address to continue at
+*/
+const void* Jit::fallback(JitState* state, int64_t index)
+{
+    auto& vm = state->Compiler->m_VM;
+    vm.m_FP = state->FP;
+    vm.m_SP = state->SP;
+    vm.m_PC = PC_t(index);
+    Spasm::RunResult result;
+    // exceptions can't unwind through the native code
+    try
+    {
+        result = vm.step();
+    }
+    catch (...)
+    {
+        result = Spasm::RunResult::Exception;
+    }
+    state->FP = vm.m_FP;
+    state->SP = vm.m_SP;
+    if (result != Spasm::RunResult::Success)
+    {
+        state->Result = result;
+        return state->Compiler->m_Exit;
+    }
+    return state->Compiler->m_Targets[vm.m_PC];
+}
+
+}  // namespace SpasmImpl
@@ -0,0 +1,58 @@
+#ifndef JIT_HPP
+#define JIT_HPP
+
+#include "spasm_impl.hpp"
+#include "x64.hpp"
+
+namespace SpasmImpl
+{
+//! Machine registers shared by the native code and its helpers
+struct JitState
+{
+    data_t* FP;
+    data_t* SP;
+    Jit* Compiler;
+    int64_t Result;
+};
+
+//! Baseline compiler of the decoded program to x86-64 machine code
+/*!
+** Every instruction is translated into a fixed sequence of machine code,
+** there is no register allocation across instructions. Locals are addressed
+** as m_FP[reg] through a register holding the frame pointer and numbers are
+** handled with SSE2. Instructions without translation, including Call and
+** Ret, are executed by the interpreter, so native code and the interpreter
+** share the frame stack and the data stack.
+*/
+class Jit
+{
+   public:
+    explicit Jit(Spasm& vm);
+    ~Jit();
+    Jit(const Jit&) = delete;
+    Jit& operator=(const Jit&) = delete;
+
+    //! \return false if native code is not supported or can't be allocated
+    bool Compile(const InstructionStream& code);
+
+    //! Runs the native code from the instruction at the program counter
+    Spasm::RunResult Run();
+
+   private:
+    static const void* fallback(JitState* state, int64_t index);
+
+    typedef int64_t (*Entry)(JitState*, const void*);
+
+    Spasm& m_VM;
+
+    X64::ExecutableMemory m_Memory;
+
+    Entry m_Entry = nullptr;
+    //! restores the registers and returns from m_Entry
+    const void* m_Exit = nullptr;
+    //! native address of every decoded instruction
+    SPVector<const void*> m_Targets;
+};
+
+}  // namespace SpasmImpl
+#endif  // #ifndef JIT_HPP
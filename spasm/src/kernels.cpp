@@ -0,0 +1,453 @@
+#include <algorithm>
+#include <limits>
+
+#include "kernels.hpp"
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define SPASM_KERNELS_X64 1
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#define SPASM_TARGET_AVX2
+#else
+#define SPASM_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#else
+#define SPASM_KERNELS_X64 0
+#endif
+
+namespace SpasmImpl
+{
+namespace
+{
+const size_t Lanes = 8;
+const double Infinity = std::numeric_limits<double>::infinity();
+const double NaN = std::numeric_limits<double>::quiet_NaN();
+
+// The partial results of the reductions are combined and the remaining
+// elements added the same way for every instruction set.
+
+double finish_sum(const double* lanes, const double* x, const double* y,
+                  size_t n)
+{
+    auto sum = ((lanes[0] + lanes[1]) + (lanes[2] + lanes[3])) +
+               ((lanes[4] + lanes[5]) + (lanes[6] + lanes[7]));
+    for (size_t i = 0; i < n; ++i)
+    {
+        sum += y ? x[i] * y[i] : x[i];
+    }
+    return sum;
+}
+
+double finish_min(const double* lanes, bool nan, const double* x, size_t n)
+{
+    auto result = Infinity;
+    for (size_t i = 0; i < Lanes; ++i)
+    {
+        result = lanes[i] < result ? lanes[i] : result;
+    }
+    for (size_t i = 0; i < n; ++i)
+    {
+        nan |= x[i] != x[i];
+        result = x[i] < result ? x[i] : result;
+    }
+    return nan ? NaN : result;
+}
+
+double finish_max(const double* lanes, bool nan, const double* x, size_t n)
+{
+    auto result = -Infinity;
+    for (size_t i = 0; i < Lanes; ++i)
+    {
+        result = lanes[i] > result ? lanes[i] : result;
+    }
+    for (size_t i = 0; i < n; ++i)
+    {
+        nan |= x[i] != x[i];
+        result = x[i] > result ? x[i] : result;
+    }
+    return nan ? NaN : result;
+}
+
+namespace scalar
+{
+double sum(const double* x, size_t n)
+{
+    double lanes[Lanes] = {};
+    size_t i = 0;
+    for (; i + Lanes <= n; i += Lanes)
+    {
+        for (size_t j = 0; j < Lanes; ++j)
+        {
+            lanes[j] += x[i + j];
+        }
+    }
+    return finish_sum(lanes, x + i, nullptr, n - i);
+}
+
+double dot(const double* x, const double* y, size_t n)
+{
+    double lanes[Lanes] = {};
+    size_t i = 0;
+    for (; i + Lanes <= n; i += Lanes)
+    {
+        for (size_t j = 0; j < Lanes; ++j)
+        {
+            lanes[j] += x[i + j] * y[i + j];
+        }
+    }
+    return finish_sum(lanes, x + i, y + i, n - i);
+}
+
+double min(const double* x, size_t n)
+{
+    double lanes[Lanes];
+    std::fill(lanes, lanes + Lanes, Infinity);
+    bool nan = false;
+    size_t i = 0;
+    for (; i + Lanes <= n; i += Lanes)
+    {
+        for (size_t j = 0; j < Lanes; ++j)
+        {
+            nan |= x[i + j] != x[i + j];
+            lanes[j] = x[i + j] < lanes[j] ? x[i + j] : lanes[j];
+        }
+    }
+    return finish_min(lanes, nan, x + i, n - i);
+}
+
+double max(const double* x, size_t n)
+{
+    double lanes[Lanes];
+    std::fill(lanes, lanes + Lanes, -Infinity);
+    bool nan = false;
+    size_t i = 0;
+    for (; i + Lanes <= n; i += Lanes)
+    {
+        for (size_t j = 0; j < Lanes; ++j)
+        {
+            nan |= x[i + j] != x[i + j];
+            lanes[j] = x[i + j] > lanes[j] ? x[i + j] : lanes[j];
+        }
+    }
+    return finish_max(lanes, nan, x + i, n - i);
+}
+
+void scale(double* x, size_t n, double factor)
+{
+    for (size_t i = 0; i < n; ++i)
+    {
+        x[i] *= factor;
+    }
+}
+
+void add(double* x, const double* y, size_t n)
+{
+    for (size_t i = 0; i < n; ++i)
+    {
+        x[i] += y[i];
+    }
+}
+
+void fill(double* x, size_t n, double value)
+{
+    std::fill(x, x + n, value);
+}
+}  // namespace scalar
+
+#if SPASM_KERNELS_X64
+// SSE2 is part of x86-64, four registers of two lanes
+namespace sse2
+{
+double sum(const double* x, size_t n)
+{
+    __m128d lanes[4] = {_mm_setzero_pd(), _mm_setzero_pd(), _mm_setzero_pd(),
+                        _mm_setzero_pd()};
+    size_t i = 0;
+    for (; i + Lanes <= n; i += Lanes)
+    {
+        for (size_t j = 0; j < 4; ++j)
+        {
+            lanes[j] = _mm_add_pd(lanes[j], _mm_loadu_pd(x + i + 2 * j));
+        }
+    }
+    double result[Lanes];
+    for (size_t j = 0; j < 4; ++j)
+    {
+        _mm_storeu_pd(result + 2 * j, lanes[j]);
+    }
+    return finish_sum(result, x + i, nullptr, n - i);
+}
+
+double dot(const double* x, const double* y, size_t n)
+{
+    __m128d lanes[4] = {_mm_setzero_pd(), _mm_setzero_pd(), _mm_setzero_pd(),
+                        _mm_setzero_pd()};
+    size_t i = 0;
+    for (; i + Lanes <= n; i += Lanes)
+    {
+        for (size_t j = 0; j < 4; ++j)
+        {
+            lanes[j] = _mm_add_pd(lanes[j],
+                                  _mm_mul_pd(_mm_loadu_pd(x + i + 2 * j),
+                                             _mm_loadu_pd(y + i + 2 * j)));
+        }
+    }
+    double result[Lanes];
+    for (size_t j = 0; j < 4; ++j)
+    {
+        _mm_storeu_pd(result + 2 * j, lanes[j]);
+    }
+    return finish_sum(result, x + i, y + i, n - i);
+}
+
+template <bool Min>
+double extreme(const double* x, size_t n)
+{
+    const auto start = _mm_set1_pd(Min ? Infinity : -Infinity);
+    __m128d lanes[4] = {start, start, start, start};
+    auto nan = _mm_setzero_pd();
+    size_t i = 0;
+    for (; i + Lanes <= n; i += Lanes)
+    {
+        for (size_t j = 0; j < 4; ++j)
+        {
+            const auto value = _mm_loadu_pd(x + i + 2 * j);
+            nan = _mm_or_pd(nan, _mm_cmpunord_pd(value, value));
+            // x < lane ? x : lane, as the scalar loop
+            lanes[j] = Min ? _mm_min_pd(value, lanes[j])
+                           : _mm_max_pd(value, lanes[j]);
+        }
+    }
+    double result[Lanes];
+    for (size_t j = 0; j < 4; ++j)
+    {
+        _mm_storeu_pd(result + 2 * j, lanes[j]);
+    }
+    const bool anyNaN = _mm_movemask_pd(nan) != 0;
+    return Min ? finish_min(result, anyNaN, x + i, n - i)
+               : finish_max(result, anyNaN, x + i, n - i);
+}
+
+double min(const double* x, size_t n)
+{
+    return extreme<true>(x, n);
+}
+
+double max(const double* x, size_t n)
+{
+    return extreme<false>(x, n);
+}
+
+void scale(double* x, size_t n, double factor)
+{
+    const auto f = _mm_set1_pd(factor);
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2)
+    {
+        _mm_storeu_pd(x + i, _mm_mul_pd(_mm_loadu_pd(x + i), f));
+    }
+    scalar::scale(x + i, n - i, factor);
+}
+
+void add(double* x, const double* y, size_t n)
+{
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2)
+    {
+        _mm_storeu_pd(x + i,
+                      _mm_add_pd(_mm_loadu_pd(x + i), _mm_loadu_pd(y + i)));
+    }
+    scalar::add(x + i, y + i, n - i);
+}
+
+void fill(double* x, size_t n, double value)
+{
+    const auto v = _mm_set1_pd(value);
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2)
+    {
+        _mm_storeu_pd(x + i, v);
+    }
+    scalar::fill(x + i, n - i, value);
+}
+}  // namespace sse2
+
+// two registers of four lanes, compiled for AVX2 only in these functions
+namespace avx2
+{
+SPASM_TARGET_AVX2 double sum(const double* x, size_t n)
+{
+    __m256d lanes[2] = {_mm256_setzero_pd(), _mm256_setzero_pd()};
+    size_t i = 0;
+    for (; i + Lanes <= n; i += Lanes)
+    {
+        lanes[0] = _mm256_add_pd(lanes[0], _mm256_loadu_pd(x + i));
+        lanes[1] = _mm256_add_pd(lanes[1], _mm256_loadu_pd(x + i + 4));
+    }
+    double result[Lanes];
+    _mm256_storeu_pd(result, lanes[0]);
+    _mm256_storeu_pd(result + 4, lanes[1]);
+    return finish_sum(result, x + i, nullptr, n - i);
+}
+
+SPASM_TARGET_AVX2 double dot(const double* x, const double* y, size_t n)
+{
+    __m256d lanes[2] = {_mm256_setzero_pd(), _mm256_setzero_pd()};
+    size_t i = 0;
+    for (; i + Lanes <= n; i += Lanes)
+    {
+        // no FMA, it would round differently from the other kernels
+        lanes[0] = _mm256_add_pd(
+            lanes[0],
+            _mm256_mul_pd(_mm256_loadu_pd(x + i), _mm256_loadu_pd(y + i)));
+        lanes[1] = _mm256_add_pd(lanes[1],
+                                 _mm256_mul_pd(_mm256_loadu_pd(x + i + 4),
+                                               _mm256_loadu_pd(y + i + 4)));
+    }
+    double result[Lanes];
+    _mm256_storeu_pd(result, lanes[0]);
+    _mm256_storeu_pd(result + 4, lanes[1]);
+    return finish_sum(result, x + i, y + i, n - i);
+}
+
+template <bool Min>
+SPASM_TARGET_AVX2 double extreme(const double* x, size_t n)
+{
+    const auto start = _mm256_set1_pd(Min ? Infinity : -Infinity);
+    __m256d lanes[2] = {start, start};
+    auto nan = _mm256_setzero_pd();
+    size_t i = 0;
+    for (; i + Lanes <= n; i += Lanes)
+    {
+        for (size_t j = 0; j < 2; ++j)
+        {
+            const auto value = _mm256_loadu_pd(x + i + 4 * j);
+            nan = _mm256_or_pd(nan,
+                               _mm256_cmp_pd(value, value, _CMP_UNORD_Q));
+            lanes[j] = Min ? _mm256_min_pd(value, lanes[j])
+                           : _mm256_max_pd(value, lanes[j]);
+        }
+    }
+    double result[Lanes];
+    _mm256_storeu_pd(result, lanes[0]);
+    _mm256_storeu_pd(result + 4, lanes[1]);
+    const bool anyNaN = _mm256_movemask_pd(nan) != 0;
+    return Min ? finish_min(result, anyNaN, x + i, n - i)
+               : finish_max(result, anyNaN, x + i, n - i);
+}
+
+SPASM_TARGET_AVX2 double min(const double* x, size_t n)
+{
+    return extreme<true>(x, n);
+}
+
+SPASM_TARGET_AVX2 double max(const double* x, size_t n)
+{
+    return extreme<false>(x, n);
+}
+
+SPASM_TARGET_AVX2 void scale(double* x, size_t n, double factor)
+{
+    const auto f = _mm256_set1_pd(factor);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        _mm256_storeu_pd(x + i, _mm256_mul_pd(_mm256_loadu_pd(x + i), f));
+    }
+    scalar::scale(x + i, n - i, factor);
+}
+
+SPASM_TARGET_AVX2 void add(double* x, const double* y, size_t n)
+{
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        _mm256_storeu_pd(x + i, _mm256_add_pd(_mm256_loadu_pd(x + i),
+                                              _mm256_loadu_pd(y + i)));
+    }
+    scalar::add(x + i, y + i, n - i);
+}
+
+SPASM_TARGET_AVX2 void fill(double* x, size_t n, double value)
+{
+    const auto v = _mm256_set1_pd(value);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        _mm256_storeu_pd(x + i, v);
+    }
+    scalar::fill(x + i, n - i, value);
+}
+}  // namespace avx2
+
+bool has_avx2()
+{
+#if defined(_MSC_VER) && !defined(__clang__)
+    int info[4];
+    __cpuid(info, 1);
+    // the OS has to save the ymm registers, see XGETBV
+    const bool osxsave = (info[2] & (1 << 27)) != 0;
+    if (!osxsave || (_xgetbv(0) & 6) != 6)
+    {
+        return false;
+    }
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif
+
+const NumericKernels s_Scalar = {
+    KernelIsa::Scalar, "scalar",      scalar::sum, scalar::min, scalar::max,
+    scalar::dot,       scalar::scale, scalar::add, scalar::fill,
+};
+
+#if SPASM_KERNELS_X64
+const NumericKernels s_Sse2 = {
+    KernelIsa::Sse2, "sse2",      sse2::sum, sse2::min, sse2::max,
+    sse2::dot,       sse2::scale, sse2::add, sse2::fill,
+};
+
+const NumericKernels s_Avx2 = {
+    KernelIsa::Avx2, "avx2",      avx2::sum, avx2::min, avx2::max,
+    avx2::dot,       avx2::scale, avx2::add, avx2::fill,
+};
+#endif
+}  // namespace
+
+const NumericKernels& GetNumericKernels()
+{
+    static const NumericKernels& s_Best =
+        FindNumericKernels(KernelIsa::Avx2)
+            ? *FindNumericKernels(KernelIsa::Avx2)
+            : FindNumericKernels(KernelIsa::Sse2)
+                  ? *FindNumericKernels(KernelIsa::Sse2)
+                  : s_Scalar;
+    return s_Best;
+}
+
+const NumericKernels* FindNumericKernels(KernelIsa isa)
+{
+    switch (isa)
+    {
+        case KernelIsa::Scalar:
+            return &s_Scalar;
+#if SPASM_KERNELS_X64
+        case KernelIsa::Sse2:
+            return &s_Sse2;
+        case KernelIsa::Avx2:
+        {
+            static const bool s_HasAvx2 = has_avx2();
+            return s_HasAvx2 ? &s_Avx2 : nullptr;
+        }
+#endif
+        default:
+            return nullptr;
+    }
+}
+
+}  // namespace SpasmImpl
@@ -0,0 +1,48 @@
+#ifndef KERNELS_HPP
+#define KERNELS_HPP
+
+#include <cstddef>
+
+namespace SpasmImpl
+{
+//! Instruction sets the numeric kernels are compiled for
+enum class KernelIsa
+{
+    Scalar,
+    Sse2,
+    Avx2,
+};
+
+//! Loops over arrays of doubles, for the builtins of the machine
+/*!
+** The reductions keep eight partial results, each of which adds every
+** eighth element, and combine them in a fixed order. Every instruction set
+** uses the same order, so the results do not depend on the CPU.
+*/
+struct NumericKernels
+{
+    KernelIsa Isa;
+    const char* Name;
+    double (*Sum)(const double*, size_t);
+    //! the minimum, NaN if any element is NaN, +Infinity if there is none
+    double (*Min)(const double*, size_t);
+    //! the maximum, NaN if any element is NaN, -Infinity if there is none
+    double (*Max)(const double*, size_t);
+    double (*Dot)(const double*, const double*, size_t);
+    //! x[i] *= factor
+    void (*Scale)(double* x, size_t, double factor);
+    //! x[i] += y[i]
+    void (*Add)(double* x, const double* y, size_t);
+    void (*Fill)(double*, size_t, double);
+};
+
+//! \return the kernels for the best instruction set the CPU supports,
+//! checked with CPUID on the first call
+const NumericKernels& GetNumericKernels();
+
+//! \return the kernels for \a isa or nullptr if the build or the CPU does
+//! not support it
+const NumericKernels* FindNumericKernels(KernelIsa isa);
+
+}  // namespace SpasmImpl
+#endif  // #ifndef KERNELS_HPP
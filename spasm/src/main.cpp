@@ -1,34 +1,241 @@
-#include <fstream>
-#include <iostream>
-
-#include <memory>
-#include "spasm.hpp"
-
-int main(int argc, const char* argv[])
-{
-    if (argc != 2)
-        return 1;
-
-    std::ifstream input(argv[1], std::ios_base::in | std::ios_base::binary);
-
-    size_t len;
-
-    input.read((char*)&len, sizeof(len));
-
-    std::unique_ptr<Spasm::byte[]> bytecode(new Spasm::byte[len]);
-
-    input.read((char*)bytecode.get(), len);
-
-    for (size_t i = 0; i < len; ++i)
-        std::cout << std::hex << (int)bytecode[i] << ' ';
-    std::cout << std::endl;
-
-    Spasm::Spasm vm;
-    vm.Initialize(len, bytecode.get());
-
-    vm.run();
-
-    std::cout << std::endl;
-
-    return 0;
-}
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <memory>
+#include "spasm.hpp"
+#include "threadpool.hpp"
+
+namespace
+{
+//! Writes the output of the jobs in the order of their input files, each
+//! as soon as the jobs before it have finished
+class OrderedOutput
+{
+   public:
+    explicit OrderedOutput(size_t jobs)
+        : m_Outputs(jobs), m_Errors(jobs), m_Finished(jobs, false)
+    {
+    }
+
+    void Finish(size_t job, std::string output, std::string error)
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_Outputs[job] = std::move(output);
+        m_Errors[job] = std::move(error);
+        m_Finished[job] = true;
+        for (; m_Next < m_Finished.size() && m_Finished[m_Next]; ++m_Next)
+        {
+            std::cout << m_Outputs[m_Next];
+            std::cerr << m_Errors[m_Next];
+            std::string().swap(m_Outputs[m_Next]);
+        }
+    }
+
+   private:
+    std::mutex m_Mutex;
+    std::vector<std::string> m_Outputs;
+    std::vector<std::string> m_Errors;
+    std::vector<bool> m_Finished;
+    //! the first job whose output is not written yet
+    size_t m_Next = 0;
+};
+}  // namespace
+
+/*!
+** sprun [options] program.spb runs the program with the standard input and
+** output.
+**
+** sprun [options] --jobs N program.spb input... runs the program once per
+** input file, N at a time. The runs share the bytecode and each has its
+** own machine, the output of every run follows that of the run before it.
+** The statistics options report single runs only, --dump prints the
+** bytecode in hex before running it.
+*/
+int main(int argc, const char* argv[])
+{
+    auto dispatch = Spasm::Spasm::Dispatch::Threaded;
+    const char* program = nullptr;
+    bool time = false;
+    bool dump = false;
+    bool gcStats = false;
+    bool concurrentGc = false;
+    bool quickeningStats = false;
+    bool inlineCacheStats = false;
+    const Spasm::NumericKernels* kernels = nullptr;
+    int workerThreads = -1;
+    int jobs = 0;
+    std::vector<const char*> inputs;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (std::strcmp(argv[i], "--switch") == 0)
+            dispatch = Spasm::Spasm::Dispatch::Switch;
+        else if (std::strcmp(argv[i], "--threaded") == 0)
+            dispatch = Spasm::Spasm::Dispatch::Threaded;
+        else if (std::strcmp(argv[i], "--jit") == 0)
+            dispatch = Spasm::Spasm::Dispatch::Jit;
+        else if (std::strcmp(argv[i], "--trace") == 0)
+            dispatch = Spasm::Spasm::Dispatch::Tracing;
+        else if (std::strcmp(argv[i], "--time") == 0)
+            time = true;
+        else if (std::strcmp(argv[i], "--dump") == 0)
+            dump = true;
+        else if (std::strcmp(argv[i], "--gc-stats") == 0)
+            gcStats = true;
+        else if (std::strcmp(argv[i], "--concurrent-gc") == 0)
+            concurrentGc = true;
+        else if (std::strcmp(argv[i], "--quickening-stats") == 0)
+            quickeningStats = true;
+        else if (std::strcmp(argv[i], "--ic-stats") == 0)
+            inlineCacheStats = true;
+        else if (std::strcmp(argv[i], "--kernels") == 0 && i + 1 < argc)
+        {
+            ++i;
+            for (auto isa : {Spasm::KernelIsa::Scalar, Spasm::KernelIsa::Sse2,
+                             Spasm::KernelIsa::Avx2})
+            {
+                const auto found = Spasm::FindNumericKernels(isa);
+                if (found && std::strcmp(argv[i], found->Name) == 0)
+                    kernels = found;
+            }
+            if (!kernels)
+                return 1;
+        }
+        else if (std::strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+            workerThreads = std::atoi(argv[++i]);
+        else if (std::strcmp(argv[i], "--jobs") == 0 && i + 1 < argc)
+            jobs = std::atoi(argv[++i]);
+        else if (!program)
+            program = argv[i];
+        else
+            inputs.push_back(argv[i]);
+    }
+    if (!program || jobs < 0 || (jobs == 0 && !inputs.empty()))
+        return 1;
+
+    const auto loadStart = std::chrono::steady_clock::now();
+    // the bytecode is run from the code section of the mapping
+    Spasm::MappedFile image;
+    Spasm::Module module;
+    if (!image.Open(program) ||
+        !module.Load(image.GetData(), image.GetSize()))
+    {
+        std::cerr << program << ": not a module" << std::endl;
+        return 1;
+    }
+    const auto len = module.GetCodeSize();
+    const auto bytecode = module.GetCode();
+
+    if (dump)
+    {
+        for (size_t i = 0; i < len; ++i)
+            std::cout << std::hex << (int)bytecode[i] << ' ';
+        std::cout << std::dec << std::endl;
+    }
+
+    // the jobs keep the cores busy already
+    if (jobs > 0 && workerThreads < 0)
+        workerThreads = 0;
+    const auto configure = [&](Spasm::Spasm& vm) {
+        vm.SetConcurrentMarking(concurrentGc);
+        if (kernels)
+            vm.SetKernels(*kernels);
+        if (workerThreads >= 0)
+            vm.SetWorkerThreads(size_t(workerThreads));
+    };
+
+    if (jobs > 0)
+    {
+        const auto start = std::chrono::steady_clock::now();
+        // the calling thread runs jobs too
+        Spasm::ThreadPool pool(size_t(jobs - 1));
+        OrderedOutput output(inputs.size());
+        std::atomic<size_t> failures{0};
+        pool.ParallelFor(inputs.size(), [&](size_t job) {
+            std::ifstream input(inputs[job], std::ios_base::in);
+            std::ostringstream jobOutput;
+            std::string error;
+            if (!input)
+                error = std::string(inputs[job]) + ": cannot open\n";
+            else
+            {
+                Spasm::Spasm vm;
+                configure(vm);
+                vm.Initialize(len, bytecode, input, jobOutput, dispatch);
+                if (vm.run() != Spasm::Spasm::RunResult::Success)
+                    error = std::string(inputs[job]) + ": run failed\n";
+                jobOutput << std::endl;
+            }
+            if (!error.empty())
+                ++failures;
+            output.Finish(job, jobOutput.str(), std::move(error));
+        });
+        const std::chrono::duration<double> elapsed =
+            std::chrono::steady_clock::now() - start;
+        if (time)
+            std::cerr << "run: " << elapsed.count() << "s, " << inputs.size()
+                      << " jobs" << std::endl;
+        return failures ? 1 : 0;
+    }
+
+    // the machine reads and writes std::cin and std::cout in large blocks,
+    // without the synchronization with stdio they read and write them too
+    std::ios_base::sync_with_stdio(false);
+    Spasm::Spasm vm;
+    configure(vm);
+    vm.Initialize(len, bytecode, std::cin, std::cout, dispatch);
+
+    const auto start = std::chrono::steady_clock::now();
+    const auto result = vm.run();
+    const std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    const std::chrono::duration<double> load = start - loadStart;
+
+    std::cout << std::endl;
+    // an invalid instruction has reported itself already
+    if (result == Spasm::Spasm::RunResult::Exception)
+        std::cerr << program << ": stack overflow" << std::endl;
+    else if (result != Spasm::Spasm::RunResult::Success)
+        std::cerr << program << ": run failed" << std::endl;
+    if (time)
+        std::cerr << "load: " << load.count() << "s\nrun: "
+                  << elapsed.count() << "s" << std::endl;
+    if (gcStats)
+    {
+        const auto& stats = vm.GetHeapStats();
+        std::cerr << "heap: " << stats.HeapSize << " bytes, "
+                  << stats.LiveBytes << " live, " << stats.TotalAllocated
+                  << " allocated\n"
+                  << "gc: " << stats.Collections << " collections, pauses "
+                  << stats.TotalPause << "us total, " << stats.MaxPause
+                  << "us max, p50 " << stats.Pauses.Percentile(0.5)
+                  << "us, p99 " << stats.Pauses.Percentile(0.99) << "us\n"
+                  << "minor gc: " << stats.MinorCollections
+                  << " collections, " << stats.PromotedBytes
+                  << " bytes promoted, pauses " << stats.TotalMinorPause
+                  << "us total, " << stats.MaxMinorPause << "us max, p50 "
+                  << stats.MinorPauses.Percentile(0.5) << "us, p99 "
+                  << stats.MinorPauses.Percentile(0.99) << "us" << std::endl;
+    }
+    if (quickeningStats)
+    {
+        const auto& stats = vm.GetQuickeningStats();
+        std::cerr << "quickening: " << stats.Quickened << " quickened, "
+                  << stats.Dequickened << " dequickened" << std::endl;
+    }
+    if (inlineCacheStats)
+    {
+        const auto& stats = vm.GetInlineCacheStats();
+        std::cerr << "inline caches: " << stats.Hits << " hits, "
+                  << stats.Misses << " misses" << std::endl;
+    }
+
+    return result == Spasm::Spasm::RunResult::Success ? 0 : 1;
+}
@@ -0,0 +1,107 @@
+#include <fstream>
+#include <iterator>
+
+#include "mappedfile.hpp"
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace SpasmImpl
+{
+MappedFile::~MappedFile()
+{
+    close();
+}
+
+bool MappedFile::Open(const char* path)
+{
+    close();
+#if defined(_WIN32)
+    const auto file =
+        CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr,
+                    OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        return false;
+    }
+    LARGE_INTEGER size;
+    if (GetFileSizeEx(file, &size) && size.QuadPart > 0)
+    {
+        // the view keeps the file open
+        const auto mapping =
+            CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (mapping)
+        {
+            m_Data = static_cast<const byte*>(
+                MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+            CloseHandle(mapping);
+        }
+        m_Size = size_t(size.QuadPart);
+    }
+    CloseHandle(file);
+#else
+    const auto file = open(path, O_RDONLY);
+    if (file < 0)
+    {
+        return false;
+    }
+    struct stat status;
+    if (fstat(file, &status) == 0 && S_ISREG(status.st_mode) &&
+        status.st_size > 0)
+    {
+        // the mapping keeps the file open
+        const auto memory = mmap(nullptr, size_t(status.st_size), PROT_READ,
+                                 MAP_PRIVATE, file, 0);
+        if (memory != MAP_FAILED)
+        {
+            m_Data = static_cast<const byte*>(memory);
+        }
+        m_Size = size_t(status.st_size);
+    }
+    ::close(file);
+#endif
+    if (m_Data)
+    {
+        m_Mapped = true;
+        return true;
+    }
+
+    std::ifstream input(path, std::ios_base::in | std::ios_base::binary);
+    if (!input)
+    {
+        return false;
+    }
+    m_Copy.assign(std::istreambuf_iterator<char>(input),
+                  std::istreambuf_iterator<char>());
+    if (input.bad())
+    {
+        return false;
+    }
+    m_Size = m_Copy.size();
+    m_Data = reinterpret_cast<const byte*>(m_Copy.data());
+    return true;
+}
+
+void MappedFile::close()
+{
+    if (m_Mapped)
+    {
+#if defined(_WIN32)
+        UnmapViewOfFile(m_Data);
+#else
+        munmap(const_cast<byte*>(m_Data), m_Size);
+#endif
+    }
+    m_Data = nullptr;
+    m_Size = 0;
+    m_Mapped = false;
+    m_Copy.clear();
+}
+
+}  // namespace SpasmImpl
@@ -0,0 +1,42 @@
+#ifndef MAPPEDFILE_HPP
+#define MAPPEDFILE_HPP
+
+#include <string>
+
+#include "types.hpp"
+
+namespace SpasmImpl
+{
+//! Read-only view of the contents of a file
+/*!
+** The file is mapped into memory, so opening it costs no copy and the
+** pages are read when they are first touched. Files that cannot be mapped,
+** like pipes, are read into memory instead.
+*/
+class MappedFile
+{
+   public:
+    MappedFile() = default;
+    ~MappedFile();
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    //! \return false if the file cannot be opened or read
+    bool Open(const char* path);
+
+    const byte* GetData() const { return m_Data; }
+    size_t GetSize() const { return m_Size; }
+    bool IsMapped() const { return m_Mapped; }
+
+   private:
+    void close();
+
+    const byte* m_Data = nullptr;
+    size_t m_Size = 0;
+    bool m_Mapped = false;
+    //! the contents of a file that is not mapped
+    std::string m_Copy;
+};
+
+}  // namespace SpasmImpl
+#endif  // #ifndef MAPPEDFILE_HPP
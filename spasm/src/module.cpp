@@ -0,0 +1,151 @@
+#include <algorithm>
+#include <cstring>
+
+#include "module.hpp"
+
+namespace SpasmImpl
+{
+bool Module::Load(const byte* data, size_t size)
+{
+    *this = Module();
+    if (reinterpret_cast<uintptr_t>(data) % ModuleAlignment != 0 ||
+        size < sizeof(ModuleHeader))
+    {
+        return false;
+    }
+    const auto header = reinterpret_cast<const ModuleHeader*>(data);
+    if (std::memcmp(header->Magic, ModuleMagic, sizeof(ModuleMagic)) != 0 ||
+        header->Version != ModuleVersion || header->Size > size ||
+        header->Size < sizeof(ModuleHeader) ||
+        header->SectionCount >
+            (header->Size - sizeof(ModuleHeader)) / sizeof(ModuleSection))
+    {
+        return false;
+    }
+    m_Data = data;
+    m_Header = header;
+    m_Sections =
+        reinterpret_cast<const ModuleSection*>(data + sizeof(ModuleHeader));
+    for (uint32_t i = 0; i < header->SectionCount; ++i)
+    {
+        const auto& section = m_Sections[i];
+        if (section.Offset % ModuleAlignment != 0 ||
+            section.Offset > header->Size ||
+            section.Size > header->Size - section.Offset)
+        {
+            return false;
+        }
+    }
+
+    const auto code = find_section(SectionKind::Code);
+    if (!code)
+    {
+        return false;
+    }
+    m_Code = data + code->Offset;
+    m_CodeSize = code->Size;
+
+    if (!load_table(SectionKind::Strings, m_Strings, m_StringCount,
+                    m_StringNames) ||
+        !load_table(SectionKind::Symbols, m_Symbols, m_SymbolCount,
+                    m_SymbolNames))
+    {
+        return false;
+    }
+    for (size_t i = 0; i < m_StringCount; ++i)
+    {
+        if (!check_name(m_Strings[i], SectionKind::Strings))
+        {
+            return false;
+        }
+    }
+    for (size_t i = 0; i < m_SymbolCount; ++i)
+    {
+        if (!check_name(m_Symbols[i].Name, SectionKind::Symbols))
+        {
+            return false;
+        }
+    }
+
+    if (const auto numbers = find_section(SectionKind::Numbers))
+    {
+        m_Numbers = reinterpret_cast<const double*>(data + numbers->Offset);
+        m_NumberCount = numbers->Size / sizeof(double);
+    }
+    if (const auto lines = find_section(SectionKind::Lines))
+    {
+        m_Lines = reinterpret_cast<const ModuleLine*>(data + lines->Offset);
+        m_LineCount = lines->Size / sizeof(ModuleLine);
+    }
+    return true;
+}
+
+const char* Module::GetString(size_t index, size_t& length) const
+{
+    length = m_Strings[index].Length;
+    return m_StringNames + m_Strings[index].Offset;
+}
+
+const char* Module::GetSymbolName(size_t index, size_t& length) const
+{
+    length = m_Symbols[index].Name.Length;
+    return m_SymbolNames + m_Symbols[index].Name.Offset;
+}
+
+//! The lines are sorted by address, an instruction has the line of the
+//! last entry at or before it
+uint64_t Module::FindLine(uint64_t address) const
+{
+    const auto end = m_Lines + m_LineCount;
+    const auto next = std::upper_bound(
+        m_Lines, end, address,
+        [](uint64_t a, const ModuleLine& line) { return a < line.Address; });
+    return next == m_Lines ? 0 : (next - 1)->Line;
+}
+
+const ModuleSection* Module::find_section(SectionKind kind) const
+{
+    for (uint32_t i = 0; i < m_Header->SectionCount; ++i)
+    {
+        if (m_Sections[i].Kind == kind)
+        {
+            return &m_Sections[i];
+        }
+    }
+    return nullptr;
+}
+
+template <typename Entry>
+bool Module::load_table(SectionKind kind,
+                        const Entry*& entries,
+                        size_t& count,
+                        const char*& names) const
+{
+    const auto section = find_section(kind);
+    if (!section)
+    {
+        return true;
+    }
+    if (section->Size < sizeof(uint64_t))
+    {
+        return false;
+    }
+    const auto start = m_Data + section->Offset;
+    const auto entryCount = *reinterpret_cast<const uint64_t*>(start);
+    if (entryCount > (section->Size - sizeof(uint64_t)) / sizeof(Entry))
+    {
+        return false;
+    }
+    entries = reinterpret_cast<const Entry*>(start + sizeof(uint64_t));
+    count = size_t(entryCount);
+    names = reinterpret_cast<const char*>(start);
+    return true;
+}
+
+bool Module::check_name(const ModuleString& name, SectionKind kind) const
+{
+    const auto size = find_section(kind)->Size;
+    return name.Offset <= size && name.Length <= size - name.Offset;
+}
+
+}  // namespace SpasmImpl
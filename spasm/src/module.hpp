@@ -0,0 +1,162 @@
+#ifndef MODULE_HPP
+#define MODULE_HPP
+
+#include <cstddef>
+#include <cstdint>
+
+#include "types.hpp"
+
+namespace SpasmImpl
+{
+//! Layout of the files the assembler writes, read in place by the loaders
+/*!
+** A module starts with a ModuleHeader, followed by a ModuleSection for
+** each section. Every section starts at a multiple of ModuleAlignment, so
+** a module that is mapped or loaded at an aligned address can use the
+** tables of its sections as arrays. All the fields are little endian.
+**
+** The code section is the bytecode the machine runs. The other sections
+** describe it for the tools and are optional:
+** - Strings: the distinct string literals and names of the code
+** - Numbers: the distinct numeric constants of the code, as doubles
+** - Symbols: the labels and the offsets in the code they stand for
+** - Lines: the source line of every instruction, by its offset
+**
+** The code keeps its literals inline, the pools only list them.
+*/
+const char ModuleMagic[8] = {'S', 'P', 'A', 'S', 'M', 'M', 'O', 'D'};
+const uint32_t ModuleVersion = 1;
+const size_t ModuleAlignment = 8;
+
+enum ModuleFlags : uint32_t
+{
+    //! the module has a Lines section
+    ModuleHasLines = 1,
+};
+
+enum class SectionKind : uint32_t
+{
+    Code = 1,
+    Strings,
+    Numbers,
+    Symbols,
+    Lines,
+};
+
+struct ModuleHeader
+{
+    char Magic[8];
+    uint32_t Version;
+    uint32_t Flags;
+    uint32_t SectionCount;
+    uint32_t Reserved;
+    //! size of the whole module, to detect truncated files
+    uint64_t Size;
+};
+
+struct ModuleSection
+{
+    SectionKind Kind;
+    uint32_t Reserved;
+    //! from the start of the module
+    uint64_t Offset;
+    uint64_t Size;
+};
+
+//! The Strings and Symbols sections start with the number of entries,
+//! followed by the entries and then by the characters of the names. The
+//! offsets of the names are from the start of the section.
+struct ModuleString
+{
+    uint64_t Offset;
+    uint64_t Length;
+};
+
+struct ModuleSymbol
+{
+    ModuleString Name;
+    //! offset in the code the label stands for
+    uint64_t Address;
+};
+
+//! The Lines section is an array of these, sorted by Address
+struct ModuleLine
+{
+    uint64_t Address;
+    //! starting from 1
+    uint64_t Line;
+};
+
+static_assert(sizeof(ModuleHeader) % ModuleAlignment == 0 &&
+                  sizeof(ModuleSection) % ModuleAlignment == 0 &&
+                  sizeof(ModuleSymbol) % ModuleAlignment == 0,
+              "The tables of a module must keep its sections aligned");
+
+//! Reads the sections of a module where it is loaded
+/*!
+** Loading checks that the header, the section table and the names are in
+** the bounds of the module and copies nothing, the accessors point into
+** the module. It has to stay loaded while the Module is used.
+*/
+class Module
+{
+   public:
+    //! \return false if \a data is not a module of this version, is
+    //! truncated or is not aligned to ModuleAlignment
+    bool Load(const byte* data, size_t size);
+
+    uint32_t GetFlags() const { return m_Header->Flags; }
+
+    const byte* GetCode() const { return m_Code; }
+    size_t GetCodeSize() const { return m_CodeSize; }
+
+    size_t GetStringCount() const { return m_StringCount; }
+    //! \return the characters of the string \a index, not null terminated
+    const char* GetString(size_t index, size_t& length) const;
+
+    size_t GetNumberCount() const { return m_NumberCount; }
+    const double* GetNumbers() const { return m_Numbers; }
+
+    size_t GetSymbolCount() const { return m_SymbolCount; }
+    const ModuleSymbol& GetSymbol(size_t index) const
+    {
+        return m_Symbols[index];
+    }
+    //! \return the characters of the name of the symbol \a index
+    const char* GetSymbolName(size_t index, size_t& length) const;
+
+    size_t GetLineCount() const { return m_LineCount; }
+    const ModuleLine* GetLines() const { return m_Lines; }
+    //! \return the line of the instruction at \a address, 0 if unknown
+    uint64_t FindLine(uint64_t address) const;
+
+   private:
+    const ModuleSection* find_section(SectionKind kind) const;
+    //! Points \a entries at the table of \a kind, whose names follow it
+    template <typename Entry>
+    bool load_table(SectionKind kind,
+                    const Entry*& entries,
+                    size_t& count,
+                    const char*& names) const;
+    bool check_name(const ModuleString& name, SectionKind kind) const;
+
+    const byte* m_Data = nullptr;
+    const ModuleHeader* m_Header = nullptr;
+    const ModuleSection* m_Sections = nullptr;
+
+    const byte* m_Code = nullptr;
+    size_t m_CodeSize = 0;
+    const ModuleString* m_Strings = nullptr;
+    size_t m_StringCount = 0;
+    const char* m_StringNames = nullptr;
+    const double* m_Numbers = nullptr;
+    size_t m_NumberCount = 0;
+    const ModuleSymbol* m_Symbols = nullptr;
+    size_t m_SymbolCount = 0;
+    const char* m_SymbolNames = nullptr;
+    const ModuleLine* m_Lines = nullptr;
+    size_t m_LineCount = 0;
+};
+
+}  // namespace SpasmImpl
+#endif  // #ifndef MODULE_HPP
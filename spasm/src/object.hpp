@@ -0,0 +1,48 @@
+#ifndef OBJECT_HPP
+#define OBJECT_HPP
+
+#include <cstdint>
+
+namespace SpasmImpl
+{
+//! Reference to an object in a HeapCage - its offset from the base of the
+//! cage, 0 is the null reference
+typedef uint32_t HeapRef;
+
+//! Kinds of the objects allocated in the Heap
+enum class HeapKind : uint8_t
+{
+    //! unused cell of an arena
+    Free,
+    String,
+    Array,
+    Object,
+    Buffer,
+    Elements,
+    //! String made of two Strings, see SPRopeValue
+    Rope,
+    //! young object that was moved, ForwardedObject::Target is the copy
+    Forwarded,
+};
+
+//! Header of every object allocated in the Heap
+struct HeapObject
+{
+    HeapKind Kind = HeapKind::Free;
+    //! set by the collector on the reachable objects
+    bool Marked = false;
+    //! index of the size class, Heap::LargeObject outside the arenas
+    uint8_t SizeClass = 0;
+    //! large object that is in the remembered set of the Heap
+    bool Remembered = false;
+    //! requested size of the object in bytes, including the header
+    uint32_t Size = 0;
+};
+
+struct ForwardedObject : HeapObject
+{
+    HeapRef Target;
+};
+
+}  // namespace SpasmImpl
+#endif  // #ifndef OBJECT_HPP
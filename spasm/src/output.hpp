@@ -0,0 +1,84 @@
+#ifndef OUTPUT_HPP
+#define OUTPUT_HPP
+
+#include <cstring>
+#include <iostream>
+#include <memory>
+
+namespace SpasmImpl
+{
+const size_t OutputBufferSize = 64 * 1024;
+
+//! Output of a machine, written to its stream in large blocks
+/*!
+** Print appends the text to the buffer, numbers are formatted in place.
+** The buffer is written to the stream when it fills up, before the program
+** reads and when it stops.
+*/
+class OutputBuffer
+{
+   public:
+    OutputBuffer() : m_Data(new char[OutputBufferSize]) {}
+    OutputBuffer(const OutputBuffer&) = delete;
+    OutputBuffer& operator=(const OutputBuffer&) = delete;
+
+    //! Writes what is buffered for the stream before
+    void SetStream(std::ostream& stream)
+    {
+        Flush();
+        m_Stream = &stream;
+    }
+
+    void Write(const char* data, size_t length)
+    {
+        if (length > OutputBufferSize - m_Size)
+        {
+            write_long(data, length);
+            return;
+        }
+        std::memcpy(m_Data.get() + m_Size, data, length);
+        m_Size += length;
+    }
+
+    //! \return room for \a length characters, at most OutputBufferSize,
+    //! Commit adds those written to the output
+    char* Reserve(size_t length)
+    {
+        if (length > OutputBufferSize - m_Size)
+        {
+            Flush();
+        }
+        return m_Data.get() + m_Size;
+    }
+
+    void Commit(size_t length) { m_Size += length; }
+
+    void Flush()
+    {
+        if (m_Size != 0)
+        {
+            m_Stream->write(m_Data.get(), m_Size);
+            m_Size = 0;
+        }
+    }
+
+   private:
+    void write_long(const char* data, size_t length)
+    {
+        Flush();
+        if (length >= OutputBufferSize)
+        {
+            m_Stream->write(data, length);
+            return;
+        }
+        std::memcpy(m_Data.get(), data, length);
+        m_Size = length;
+    }
+
+    std::unique_ptr<char[]> m_Data;
+    size_t m_Size = 0;
+    std::ostream* m_Stream = nullptr;
+};
+
+}  // namespace SpasmImpl
+#endif  // #ifndef OUTPUT_HPP
@@ -0,0 +1,257 @@
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include "parse.hpp"
+#include "parse_tables.hpp"
+
+namespace SpasmImpl
+{
+namespace
+{
+const int32_t MantissaBits = 52;
+const int32_t MinimumExponent = -1023;
+const int32_t InfinitePower = 0x7ff;
+//! digits that always fit in a uint64_t
+const int32_t MaxDigits = 19;
+
+//! The powers of ten a double holds exactly
+const double ExactPowersOfTen[] = {
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+struct Product
+{
+    uint64_t High;
+    uint64_t Low;
+};
+
+Product multiply(uint64_t a, uint64_t b)
+{
+#if defined(__SIZEOF_INT128__)
+    typedef unsigned __int128 uint128;
+    const auto product = uint128(a) * b;
+    return Product{uint64_t(product >> 64), uint64_t(product)};
+#else
+    const uint64_t aLow = uint32_t(a);
+    const uint64_t aHigh = a >> 32;
+    const uint64_t bLow = uint32_t(b);
+    const uint64_t bHigh = b >> 32;
+    const auto low = aLow * bLow;
+    const auto middle1 = aHigh * bLow + (low >> 32);
+    const auto middle2 = aLow * bHigh + uint32_t(middle1);
+    return Product{aHigh * bHigh + (middle1 >> 32) + (middle2 >> 32),
+                   (middle2 << 32) | uint32_t(low)};
+#endif
+}
+
+int32_t leading_zeroes(uint64_t value)
+{
+    int32_t count = 0;
+    for (; (value & (uint64_t(1) << 63)) == 0; value <<= 1)
+    {
+        ++count;
+    }
+    return count;
+}
+
+/*!
+** Eisel-Lemire: the nearest double to \a w * 10^\a q, w != 0. The
+** normalized w is multiplied by the 128 bit 5^q and the product gives the
+** mantissa and its rounding, unless it is too close to a halfway point to
+** tell, which is rare.
+**
+** \return false if the product cannot tell how to round
+*/
+bool eisel_lemire(uint64_t w, int64_t q, uint64_t& bits)
+{
+    if (q < SmallestPowerOfFive)
+    {
+        bits = 0;
+        return true;
+    }
+    if (q > LargestPowerOfFive)
+    {
+        bits = uint64_t(InfinitePower) << MantissaBits;
+        return true;
+    }
+    const auto lz = leading_zeroes(w);
+    w <<= lz;
+    const auto& power = PowersOfFive[q - SmallestPowerOfFive];
+    auto product = multiply(w, power[0]);
+    // the bits below the mantissa and its rounding bit are all ones, the
+    // low half of the power may carry into them
+    const uint64_t precisionMask = ~uint64_t(0) >> (MantissaBits + 3);
+    if ((product.High & precisionMask) == precisionMask)
+    {
+        const auto second = multiply(w, power[1]);
+        product.Low += second.High;
+        product.High += second.High > product.Low;
+    }
+    // the powers of five are exact between 5^-27 and 5^55, elsewhere this
+    // may be the truncation of the table
+    if (product.Low == ~uint64_t(0) && (q < -27 || q > 55))
+    {
+        return false;
+    }
+
+    const auto upperBit = int32_t(product.High >> 63);
+    const auto shift = upperBit + 64 - MantissaBits - 3;
+    auto mantissa = product.High >> shift;
+    int32_t power2 = int32_t((((152170 + 65536) * q) >> 16) + 63) +
+                     upperBit - lz - MinimumExponent;
+    if (power2 <= 0)
+    {
+        // subnormal
+        if (-power2 + 1 >= 64)
+        {
+            bits = 0;
+            return true;
+        }
+        mantissa >>= -power2 + 1;
+        mantissa += mantissa & 1;
+        mantissa >>= 1;
+        power2 = mantissa < (uint64_t(1) << MantissaBits) ? 0 : 1;
+        bits = (uint64_t(power2) << MantissaBits) |
+               (mantissa & ((uint64_t(1) << MantissaBits) - 1));
+        return true;
+    }
+    // an exact halfway point rounds to even, they only exist for small q
+    if (product.Low <= 1 && q >= -4 && q <= 23 && (mantissa & 3) == 1 &&
+        (mantissa << shift) == product.High)
+    {
+        mantissa &= ~uint64_t(1);
+    }
+    mantissa += mantissa & 1;
+    mantissa >>= 1;
+    if (mantissa >= (uint64_t(2) << MantissaBits))
+    {
+        mantissa = uint64_t(1) << MantissaBits;
+        ++power2;
+    }
+    if (power2 >= InfinitePower)
+    {
+        bits = uint64_t(InfinitePower) << MantissaBits;
+        return true;
+    }
+    bits = (uint64_t(power2) << MantissaBits) |
+           (mantissa & ((uint64_t(1) << MantissaBits) - 1));
+    return true;
+}
+
+bool is_digit(char c)
+{
+    return c >= '0' && c <= '9';
+}
+}  // namespace
+
+const char* parse_number(const char* begin, const char* end, double& value)
+{
+    auto p = begin;
+    const bool negative = p != end && *p == '-';
+    if (p != end && (*p == '-' || *p == '+'))
+    {
+        ++p;
+    }
+
+    // the first MaxDigits significant digits, the others only move the
+    // decimal point
+    uint64_t w = 0;
+    int32_t digits = 0;
+    int64_t exponent = 0;
+    bool truncated = false;
+    bool any = false;
+    for (; p != end && is_digit(*p); ++p, any = true)
+    {
+        if (digits < MaxDigits)
+        {
+            w = w * 10 + uint64_t(*p - '0');
+            digits += w != 0;
+        }
+        else
+        {
+            ++exponent;
+            truncated |= *p != '0';
+        }
+    }
+    if (p != end && *p == '.')
+    {
+        ++p;
+        for (; p != end && is_digit(*p); ++p, any = true)
+        {
+            if (digits < MaxDigits)
+            {
+                w = w * 10 + uint64_t(*p - '0');
+                digits += w != 0;
+                --exponent;
+            }
+            else
+            {
+                truncated |= *p != '0';
+            }
+        }
+    }
+    if (!any)
+    {
+        value = 0;
+        return begin;
+    }
+    if (p != end && (*p == 'e' || *p == 'E'))
+    {
+        auto e = p + 1;
+        const bool negativeExponent = e != end && *e == '-';
+        if (e != end && (*e == '-' || *e == '+'))
+        {
+            ++e;
+        }
+        if (e != end && is_digit(*e))
+        {
+            int64_t parsed = 0;
+            for (; e != end && is_digit(*e); ++e)
+            {
+                // beyond any double, but without overflowing
+                if (parsed < 100000)
+                {
+                    parsed = parsed * 10 + (*e - '0');
+                }
+            }
+            exponent += negativeExponent ? -parsed : parsed;
+            p = e;
+        }
+    }
+
+    if (truncated)
+    {
+        const std::string text(begin, p);
+        value = std::strtod(text.c_str(), nullptr);
+        return p;
+    }
+    if (w == 0)
+    {
+        value = negative ? -0.0 : 0.0;
+        return p;
+    }
+    // Clinger's fast path, the operands are exact so the result is rounded
+    // once
+    if (w <= (uint64_t(1) << 53) && exponent >= -22 && exponent <= 22)
+    {
+        value = exponent < 0 ? double(w) / ExactPowersOfTen[-exponent]
+                             : double(w) * ExactPowersOfTen[exponent];
+        value = negative ? -value : value;
+        return p;
+    }
+    uint64_t bits;
+    if (!eisel_lemire(w, exponent, bits))
+    {
+        const std::string text(begin, p);
+        value = std::strtod(text.c_str(), nullptr);
+        return p;
+    }
+    bits |= uint64_t(negative) << 63;
+    std::memcpy(&value, &bits, sizeof(value));
+    return p;
+}
+
+}  // namespace SpasmImpl
@@ -0,0 +1,20 @@
+#ifndef PARSE_HPP
+#define PARSE_HPP
+
+#include <cstddef>
+
+namespace SpasmImpl
+{
+//! Parses the decimal number at \a begin to the nearest double
+/*!
+** The number is an optional sign, digits with an optional decimal point and
+** an optional exponent, as the iostreams read it. Up to 19 significant
+** digits are converted by the Eisel-Lemire algorithm, with a table of the
+** powers of five, longer numbers by strtod.
+**
+** \return the end of the number, \a begin if there is no number there
+*/
+const char* parse_number(const char* begin, const char* end, double& value);
+
+}  // namespace SpasmImpl
+#endif  // #ifndef PARSE_HPP
@@ -0,0 +1,222 @@
+#include <utility>
+
+#include "spasm_impl.hpp"
+
+namespace SpasmImpl
+{
+namespace
+{
+typedef bool (*Fuser)(const Instruction&, const Instruction&, Instruction&);
+
+/*!
+** less rX rA rB; jmpf rX label -> lessjmpf rX rA rB label
+** Greater and GreaterEq become Less and LessEq with swapped operands.
+*/
+bool fuse_compare_branch(const Instruction& compare,
+                         const Instruction& branch,
+                         Instruction& fused)
+{
+    if ((branch.OpCode != OpCodes::JumpT && branch.OpCode != OpCodes::JumpF) ||
+        branch.A0 != compare.A0)
+    {
+        return false;
+    }
+    const bool onTrue = branch.OpCode == OpCodes::JumpT;
+    fused.A0 = compare.A0;
+    fused.A1 = compare.A1;
+    fused.A2 = compare.A2;
+    fused.A3 = branch.A1;
+    switch (compare.OpCode)
+    {
+        case OpCodes::Greater:
+            std::swap(fused.A1, fused.A2);
+        // fall through
+        case OpCodes::Less:
+            fused.OpCode = onTrue ? OpCodes::LessJumpT : OpCodes::LessJumpF;
+            return true;
+        case OpCodes::GreaterEq:
+            std::swap(fused.A1, fused.A2);
+        // fall through
+        case OpCodes::LessEq:
+            fused.OpCode = onTrue ? OpCodes::LessEqJumpT : OpCodes::LessEqJumpF;
+            return true;
+        case OpCodes::Equal:
+            fused.OpCode = onTrue ? OpCodes::EqualJumpT : OpCodes::EqualJumpF;
+            return true;
+        case OpCodes::NotEqual:
+            fused.OpCode =
+                onTrue ? OpCodes::NotEqualJumpT : OpCodes::NotEqualJumpF;
+            return true;
+        default:
+            return false;
+    }
+}
+
+/*!
+** const rT k; add rX rA rT -> addconst rX rA rT rT k
+** The temporary is still assigned, so later reads of it see the constant.
+*/
+bool fuse_const_arithmetic(const Instruction& constant,
+                           const Instruction& arithmetic,
+                           Instruction& fused)
+{
+    if (constant.OpCode != OpCodes::Const ||
+        (arithmetic.OpCode != OpCodes::Add &&
+         arithmetic.OpCode != OpCodes::Sub) ||
+        (arithmetic.A1 != constant.A0 && arithmetic.A2 != constant.A0))
+    {
+        return false;
+    }
+    fused.OpCode = arithmetic.OpCode == OpCodes::Add ? OpCodes::AddConst
+                                                     : OpCodes::SubConst;
+    fused.A0 = arithmetic.A0;
+    fused.A1 = arithmetic.A1;
+    fused.A2 = arithmetic.A2;
+    fused.A3 = constant.A0;
+    fused.Value = constant.Value;
+    return true;
+}
+
+/*!
+** add rI rI rS; lessjmpt rX rI rN label -> incjmp rI rS rX rN label
+** The step may also be a constant folded by fuse_const_arithmetic.
+*/
+bool fuse_increment_compare(const Instruction& increment,
+                            const Instruction& compare,
+                            Instruction& fused)
+{
+    if (compare.OpCode != OpCodes::LessJumpT || increment.A0 != increment.A1 ||
+        compare.A1 != increment.A0)
+    {
+        return false;
+    }
+    if (increment.OpCode == OpCodes::Add)
+    {
+        fused.OpCode = OpCodes::IncrementAndCompare;
+    }
+    else if (increment.OpCode == OpCodes::AddConst &&
+             increment.A2 == increment.A3)
+    {
+        fused.OpCode = OpCodes::IncrementConstAndCompare;
+        fused.Value = increment.Value;
+    }
+    else
+    {
+        return false;
+    }
+    fused.A0 = increment.A0;
+    fused.A1 = increment.A2;
+    fused.A2 = compare.A0;
+    fused.A3 = compare.A2;
+    fused.A4 = compare.A3;
+    return true;
+}
+
+/*!
+** add rI rI rS; jmp L, where L is lessjmpf rX rI rN exit
+**     -> incjmp rI rS rX rN L+1; jmp L
+** The code generator tests the condition of a loop at its top and jumps back
+** to it after the increment. The fused instruction enters the body while
+** the condition holds, only the last iteration takes the jump back to the
+** test, so the stream keeps its size and no target moves.
+*/
+size_t rotate_loops(InstructionStream& code)
+{
+    size_t count = 0;
+    for (size_t i = 0; i + 1 < code.size(); ++i)
+    {
+        const auto& jump = code[i + 1];
+        if (jump.OpCode != OpCodes::Jump || jump.A0 < 0 ||
+            code[size_t(jump.A0)].OpCode != OpCodes::LessJumpF)
+        {
+            continue;
+        }
+        // the test branches into the body while the condition holds
+        auto compare = code[size_t(jump.A0)];
+        compare.OpCode = OpCodes::LessJumpT;
+        compare.A3 = jump.A0 + 1;
+        Instruction fused;
+        if (fuse_increment_compare(code[i], compare, fused))
+        {
+            code[i] = fused;
+            ++count;
+        }
+    }
+    return count;
+}
+
+/*!
+** Replaces adjacent pairs accepted by the fuser with a single instruction.
+** The second instruction of a pair must not be a jump target or a return
+** address. Branch targets are remapped to the compacted stream.
+*/
+size_t fuse_pairs(InstructionStream& code, Fuser fuser)
+{
+    SPVector<bool> isTarget(code.size() + 1, false);
+    for (size_t i = 0; i < code.size(); ++i)
+    {
+        if (const auto target = BranchTarget(code[i]))
+        {
+            isTarget[size_t(*target)] = true;
+        }
+        if (code[i].OpCode == OpCodes::Call)
+        {
+            isTarget[i + 1] = true;
+        }
+    }
+
+    // the stream is compacted in place, the write position never passes
+    // the read position
+    SPVector<int32_t> remap(code.size());
+    size_t count = 0;
+    size_t write = 0;
+    for (size_t i = 0; i < code.size(); ++i, ++write)
+    {
+        remap[i] = int32_t(write);
+        Instruction combined;
+        if (i + 1 < code.size() && !isTarget[i + 1] &&
+            fuser(code[i], code[i + 1], combined))
+        {
+            remap[i + 1] = remap[i];
+            code[write] = combined;
+            ++i;
+            ++count;
+        }
+        else
+        {
+            code[write] = code[i];
+        }
+    }
+    code.resize(write);
+
+    for (auto& instruction : code)
+    {
+        if (const auto target = BranchTarget(instruction))
+        {
+            *target = remap[size_t(*target)];
+        }
+    }
+    return count;
+}
+}  // namespace
+
+/*!
+** Peephole pass over the decoded program that forms superinstructions from
+** the sequences the code generator emits for conditions, constant
+** arithmetic and loop counters.
+**
+** \param code	- decoded program, as produced by DecodeByteCode
+**
+** \return number of instructions removed, from the stream or from the
+** iterations of a rotated loop
+*/
+size_t FuseInstructions(InstructionStream& code)
+{
+    size_t count = fuse_pairs(code, fuse_compare_branch);
+    count += fuse_pairs(code, fuse_const_arithmetic);
+    count += fuse_pairs(code, fuse_increment_compare);
+    count += rotate_loops(code);
+    return count;
+}
+
+}  // namespace SpasmImpl
@@ -0,0 +1,273 @@
+#include <algorithm>
+#include <cstring>
+
+#include "rope.hpp"
+#include "spasm_impl.hpp"
+
+namespace SpasmImpl
+{
+namespace
+{
+//! Concatenations up to this length are copied into a flat string, short
+//! pieces appended to a rope are merged into its last flat string
+const size_t FlatLength = 256;
+
+data_t string_value(HeapObject* object)
+{
+    return data_t(::Spasm::ValueType::String, (void*)object);
+}
+
+SPRopeValue* rope_of(data_t value)
+{
+    return static_cast<SPRopeValue*>(value.get_pointer());
+}
+
+bool is_rope(data_t value)
+{
+    return static_cast<HeapObject*>(value.get_pointer())->Kind ==
+           HeapKind::Rope;
+}
+
+//! \return the height of the String \a value, 0 for flat strings
+uint32_t rope_height(data_t value)
+{
+    return is_rope(value) ? rope_of(value)->GetHeight() : 0;
+}
+
+//! \return the flat copy for a flattened rope, \a value otherwise
+data_t unwrap(data_t value)
+{
+    if (is_rope(value) && rope_of(value)->IsFlattened())
+    {
+        return rope_of(value)->GetLeft();
+    }
+    return value;
+}
+
+//! Copies the characters of the String \a value to \a out
+void copy_characters(data_t value, char* out)
+{
+    if (const auto flat = flat_string(value))
+    {
+        std::memcpy(out, flat->GetData(), flat->GetLength());
+        return;
+    }
+    const auto left = rope_of(value)->GetLeft();
+    copy_characters(left, out);
+    copy_characters(rope_of(value)->GetRight(), out + string_length(left));
+}
+
+//! Concatenates Strings the way AVL trees are joined
+/*!
+** The shorter side is hung at the place on the edge of the taller one
+** where the heights meet, and the nodes on the way there are copied with
+** a rotation where they would be out of balance. An append costs the
+** height of the rope, the other nodes are shared.
+**
+** It allocates without collecting, so the Strings do not move while it
+** works.
+*/
+class RopeBuilder
+{
+   public:
+    explicit RopeBuilder(Heap& heap) : m_Heap(heap) {}
+
+    data_t Join(data_t left, data_t right)
+    {
+        const auto lh = rope_height(left);
+        const auto rh = rope_height(right);
+        if (lh > rh + 1)
+        {
+            return join_right(left, right);
+        }
+        if (rh > lh + 1)
+        {
+            return join_left(left, right);
+        }
+        return meet(left, right);
+    }
+
+   private:
+    //! \a tree is higher than \a right by more than one
+    data_t join_right(data_t tree, data_t right)
+    {
+        const auto rope = rope_of(tree);
+        const auto left = unwrap(rope->GetLeft());
+        const auto middle = unwrap(rope->GetRight());
+        if (rope_height(middle) > rope_height(right) + 1)
+        {
+            const auto joined = join_right(middle, right);
+            if (rope_height(joined) <= rope_height(left) + 1)
+            {
+                return node(left, joined);
+            }
+            const auto top = rope_of(joined);
+            return node(node(left, top->GetLeft()), top->GetRight());
+        }
+        if (std::max(rope_height(middle), rope_height(right)) <=
+                rope_height(left) ||
+            !is_rope(middle))
+        {
+            return node(left, meet(middle, right));
+        }
+        // a double rotation
+        const auto inner = rope_of(middle);
+        return node(node(left, unwrap(inner->GetLeft())),
+                    meet(unwrap(inner->GetRight()), right));
+    }
+
+    //! \a tree is higher than \a left by more than one
+    data_t join_left(data_t left, data_t tree)
+    {
+        const auto rope = rope_of(tree);
+        const auto middle = unwrap(rope->GetLeft());
+        const auto right = unwrap(rope->GetRight());
+        if (rope_height(middle) > rope_height(left) + 1)
+        {
+            const auto joined = join_left(left, middle);
+            if (rope_height(joined) <= rope_height(right) + 1)
+            {
+                return node(joined, right);
+            }
+            const auto top = rope_of(joined);
+            return node(top->GetLeft(), node(top->GetRight(), right));
+        }
+        if (std::max(rope_height(left), rope_height(middle)) <=
+                rope_height(right) ||
+            !is_rope(middle))
+        {
+            return node(meet(left, middle), right);
+        }
+        // a double rotation
+        const auto inner = rope_of(middle);
+        return node(meet(left, unwrap(inner->GetLeft())),
+                    node(unwrap(inner->GetRight()), right));
+    }
+
+    //! Joins two Strings whose heights differ by one at most, merging a
+    //! short piece into the flat string next to it
+    data_t meet(data_t left, data_t right)
+    {
+        if (!is_rope(left) && !is_rope(right) &&
+            string_length(left) + string_length(right) <= FlatLength)
+        {
+            return flat(left, right);
+        }
+        if (rope_height(left) == 1 && !is_rope(right))
+        {
+            const auto last = unwrap(rope_of(left)->GetRight());
+            if (string_length(last) + string_length(right) <= FlatLength)
+            {
+                return node(unwrap(rope_of(left)->GetLeft()),
+                            flat(last, right));
+            }
+        }
+        if (rope_height(right) == 1 && !is_rope(left))
+        {
+            const auto first = unwrap(rope_of(right)->GetLeft());
+            if (string_length(left) + string_length(first) <= FlatLength)
+            {
+                return node(flat(left, first),
+                            unwrap(rope_of(right)->GetRight()));
+            }
+        }
+        return node(left, right);
+    }
+
+    data_t node(data_t left, data_t right)
+    {
+        const auto rope = m_Heap.New<SPRopeValue>(
+            sizeof(SPRopeValue), string_length(left) + string_length(right),
+            std::max(rope_height(left), rope_height(right)) + 1);
+        m_Heap.Store(rope, rope->GetLeftRef(),
+                     static_cast<HeapObject*>(left.get_pointer()));
+        m_Heap.Store(rope, rope->GetRightRef(),
+                     static_cast<HeapObject*>(right.get_pointer()));
+        return string_value(rope);
+    }
+
+    data_t flat(data_t left, data_t right)
+    {
+        const auto lhsLength = string_length(left);
+        const auto length = lhsLength + string_length(right);
+        const auto value = m_Heap.New<SPStringValue>(
+            SPStringValue::AllocationSize(length), length);
+        copy_characters(left, value->GetData());
+        copy_characters(right, value->GetData() + lhsLength);
+        return string_value(value);
+    }
+
+    Heap& m_Heap;
+};
+}  // namespace
+
+/*!
+** Stores the concatenation of the Strings a1 and a2 in a0. Long results are
+** ropes that share the operands, their characters are copied when they are
+** read.
+*/
+void Spasm::concatenate(reg_t a0, reg_t a1, reg_t a2)
+{
+    if (string_length(get_local(a2)) == 0)
+    {
+        set_local(a0, get_local(a1));
+        return;
+    }
+    if (string_length(get_local(a1)) == 0)
+    {
+        set_local(a0, get_local(a2));
+        return;
+    }
+    // room for a copy of the path down the taller operand, the collection
+    // may move the operands
+    const auto height =
+        std::max(rope_height(get_local(a1)), rope_height(get_local(a2)));
+    collect(2 * (height + 2) * sizeof(SPRopeValue) +
+            SPStringValue::AllocationSize(FlatLength));
+    RopeBuilder builder(m_Heap);
+    set_local(a0,
+              builder.Join(unwrap(get_local(a1)), unwrap(get_local(a2))));
+}
+
+/*!
+** Copies the characters of the String in \a reg into a flat string unless
+** it is one already. The copy replaces the pieces of the rope, which other
+** references share, and the rope in \a reg.
+*/
+SPStringValue* Spasm::flatten(reg_t reg)
+{
+    if (const auto value = flat_string(get_local(reg)))
+    {
+        set_local(reg, string_value(value));
+        return value;
+    }
+    const auto length = string_length(get_local(reg));
+    const auto size = SPStringValue::AllocationSize(length);
+    // the collection may move the rope
+    collect(size);
+    const auto value = m_Heap.New<SPStringValue>(size, length);
+    const auto rope = rope_of(get_local(reg));
+    copy_characters(get_local(reg), value->GetData());
+    m_Heap.Store(rope, rope->GetLeftRef(), value);
+    m_Heap.Store(rope, rope->GetRightRef(), nullptr);
+    rope->SetFlattened();
+    set_local(reg, string_value(value));
+    return value;
+}
+
+//! \return true if the Strings in \a a1 and \a a2 have the same characters
+bool Spasm::equal_strings(reg_t a1, reg_t a2)
+{
+    const auto length = string_length(get_local(a1));
+    if (length != string_length(get_local(a2)))
+    {
+        return false;
+    }
+    flatten(a1);
+    const auto rhs = flatten(a2);
+    // flattening a2 may have moved a1
+    const auto lhs = flat_string(get_local(a1));
+    return std::memcmp(lhs->GetData(), rhs->GetData(), length) == 0;
+}
+
+}  // namespace SpasmImpl
@@ -0,0 +1,84 @@
+#ifndef ROPE_HPP
+#define ROPE_HPP
+
+#include "cage.hpp"
+#include "types.hpp"
+
+namespace SpasmImpl
+{
+//! Concatenation of two strings whose characters have not been copied yet
+/*!
+** Left and Right are Strings, each an SPStringValue or an SPRopeValue,
+** stored as HeapRef. Reading the characters flattens the rope: Left
+** becomes the flat copy and Right the null reference, so the copy is made
+** once and the pieces can be collected. Stores to Left and Right have to
+** go through Heap::Store.
+**
+** The height is the longest path down to a flat string. The machine keeps
+** the heights of the two sides of a node within one of each other, so a
+** rope of n pieces is never deeper than about 1.44 log2(n).
+*/
+class SPRopeValue : public HeapObject
+{
+   public:
+    SPRopeValue(size_t length, uint32_t height)
+        : m_Length(length), m_Height(height)
+    {
+        Kind = HeapKind::Rope;
+    }
+
+    SPRopeValue(const SPRopeValue&) = delete;
+    SPRopeValue& operator=(const SPRopeValue&) = delete;
+
+    data_t GetLeft() const { return child(m_Left); }
+    //! undefined once the rope is flattened
+    data_t GetRight() const { return child(m_Right); }
+    HeapRef& GetLeftRef() { return m_Left; }
+    HeapRef& GetRightRef() { return m_Right; }
+    size_t GetLength() const { return m_Length; }
+    uint32_t GetHeight() const { return m_Height; }
+
+    bool IsFlattened() const { return !m_Right; }
+    //! Called once the flat copy is in Left and null in Right
+    void SetFlattened() { m_Height = 0; }
+
+   private:
+    data_t child(HeapRef ref) const
+    {
+        return ref ? data_t(::Spasm::ValueType::String,
+                            HeapCage::Decompress<void>(this, ref))
+                   : data_t(::Spasm::ValueType::Undefined, uint64_t(0));
+    }
+
+    HeapRef m_Left = 0;
+    HeapRef m_Right = 0;
+    size_t m_Length;
+    uint32_t m_Height;
+};
+
+//! \return the number of characters of the String \a value
+inline size_t string_length(data_t value)
+{
+    const auto object = static_cast<HeapObject*>(value.get_pointer());
+    return object->Kind == HeapKind::Rope
+               ? static_cast<SPRopeValue*>(object)->GetLength()
+               : static_cast<SPStringValue*>(object)->GetLength();
+}
+
+//! \return the flat string with the characters of the String \a value,
+//! nullptr for a rope that is not flattened yet
+inline SPStringValue* flat_string(data_t value)
+{
+    const auto object = static_cast<HeapObject*>(value.get_pointer());
+    if (object->Kind != HeapKind::Rope)
+    {
+        return static_cast<SPStringValue*>(object);
+    }
+    const auto rope = static_cast<SPRopeValue*>(object);
+    return rope->IsFlattened()
+               ? static_cast<SPStringValue*>(rope->GetLeft().get_pointer())
+               : nullptr;
+}
+
+}  // namespace SpasmImpl
+#endif  // #ifndef ROPE_HPP
@@ -0,0 +1,121 @@
+#ifndef SHAPE_HPP
+#define SHAPE_HPP
+
+#include <memory>
+#include <unordered_map>
+
+#include "array.hpp"
+#include "cage.hpp"
+#include "string.hpp"
+
+namespace SpasmImpl
+{
+//! Hidden class of the objects that got the same properties in the same order
+/*!
+** The shapes form a tree rooted at the shape of the empty object and every
+** edge adds one property, so objects built alike end up sharing a shape.
+** The slot of a property depends only on the shape, which lets an inline
+** cache find it by comparing the shape pointer.
+**
+** Property names are interned strings and compare by identity.
+*/
+class Shape
+{
+   public:
+    Shape() = default;
+    Shape(const Shape&) = delete;
+    Shape& operator=(const Shape&) = delete;
+
+    //! \return the slot of the property \a name or -1 if there is none
+    int32_t Find(const SPStringValue* name) const
+    {
+        for (auto shape = this; shape->m_Parent; shape = shape->m_Parent)
+        {
+            if (shape->m_Name == name)
+            {
+                return int32_t(shape->m_SlotCount - 1);
+            }
+        }
+        return -1;
+    }
+
+    //! \return the shape after adding \a name, which is not a property yet
+    Shape* AddProperty(const SPStringValue* name)
+    {
+        auto& child = m_Transitions[name];
+        if (!child)
+        {
+            child.reset(new Shape(this, name));
+        }
+        return child.get();
+    }
+
+    uint32_t GetSlotCount() const { return m_SlotCount; }
+
+   private:
+    Shape(const Shape* parent, const SPStringValue* name)
+        : m_Parent(parent), m_Name(name), m_SlotCount(parent->m_SlotCount + 1)
+    {
+    }
+
+    const Shape* m_Parent = nullptr;
+    //! the property this shape added to its parent, in the last slot
+    const SPStringValue* m_Name = nullptr;
+    uint32_t m_SlotCount = 0;
+    std::unordered_map<const SPStringValue*, std::unique_ptr<Shape>>
+        m_Transitions;
+};
+
+//! Object in the Heap, its Shape tells which property is in which slot
+/*!
+** The first slots are inline, the rest are the elements of an overflow
+** SPArrayValue, which is a HeapRef. Stores to the slots and to the
+** overflow have to go through Heap::Store.
+*/
+class SPObjectValue : public HeapObject
+{
+   public:
+    static const uint32_t InlineSlots = 4;
+
+    explicit SPObjectValue(Shape* shape) : m_Shape(shape)
+    {
+        Kind = HeapKind::Object;
+    }
+
+    SPObjectValue(const SPObjectValue&) = delete;
+    SPObjectValue& operator=(const SPObjectValue&) = delete;
+
+    Shape* GetShape() const { return m_Shape; }
+    void SetShape(Shape* shape) { m_Shape = shape; }
+
+    data_t& GetSlot(uint32_t slot)
+    {
+        return slot < InlineSlots
+                   ? m_Slots[slot]
+                   : GetOverflowArray()->GetElements()[slot - InlineSlots];
+    }
+
+    //! \return the number of slots the object has room for
+    uint32_t GetCapacity() const
+    {
+        return InlineSlots +
+               uint32_t(m_Overflow ? GetOverflowArray()->GetLength() : 0);
+    }
+
+    data_t* GetInlineSlots() { return m_Slots; }
+    //! the overflow array, null if all the slots are inline
+    HeapRef& GetOverflow() { return m_Overflow; }
+
+   private:
+    SPArrayValue* GetOverflowArray() const
+    {
+        return HeapCage::Decompress<SPArrayValue>(this, m_Overflow);
+    }
+
+    Shape* m_Shape;
+    data_t m_Slots[InlineSlots];
+    HeapRef m_Overflow = 0;
+};
+
+}  // namespace SpasmImpl
+#endif  // #ifndef SHAPE_HPP
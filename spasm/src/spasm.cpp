@@ -1,12 +1,40 @@
 #include <algorithm>
 #include <cassert>
+#include <cstring>
 #include <iostream>
+#include <string>
+#include <vector>
 
+#if defined(_MSC_VER)
+#include <windows.h>
+#endif
+
+#include "format.hpp"
+#include "jit.hpp"
+#include "rope.hpp"
 #include "spasm.hpp"
+#include "threadpool.hpp"
+#include "tracer.hpp"
+
+#if defined(__GNUC__) || defined(__clang__)
+#define SPASM_COMPUTED_GOTO 1
+#else
+#define SPASM_COMPUTED_GOTO 0
+#endif
 
 namespace SpasmImpl
 {
-Spasm::Spasm() {}
+namespace
+{
+//! Failed type checks of its variants after which a site stays generic
+const uint8_t MaxDequickenings = 4;
+}  // namespace
+
+Spasm::Spasm() : m_Strings(m_Heap)
+{
+    const auto cores = std::thread::hardware_concurrency();
+    m_WorkerThreads = cores > 1 ? cores - 1 : 0;
+}
 
 /*!
 ** Constructs new Spasm object
@@ -15,225 +43,783 @@ Spasm::Spasm() {}
 ** \param _bytecode	- the bytecode of the program
 ** \param _istr		- input stream for the machine
 ** \param _ostr		- output stream for the machine
+** \param _dispatch	- interpreter dispatch strategy
+**
+** The machine decodes the bytecode into its own instructions and does not
+** keep it, so machines on several threads can initialize from one copy.
 */
 void Spasm::Initialize(PC_t _bc_size,
                        const byte* _bytecode,
                        std::istream& _istr,
-                       std::ostream& _ostr)
+                       std::ostream& _ostr,
+                       Dispatch _dispatch)
 
 {
+    m_Dispatch = _dispatch;
     m_PC = 0;
-    m_ByteCode.assign(_bytecode, _bytecode + _bc_size);
-    istr = &_istr;
-    ostr = &_ostr;
-    data_stack.resize(1024);
-    m_SP = &data_stack[0];
-    m_FP = &data_stack[0];
+    data_stack.Reset();
+    m_SP = data_stack.begin();
+    m_FP = data_stack.begin();
+    m_Arity = 0;
+    m_QuickeningStats = QuickeningStats();
+    m_InlineCacheStats = InlineCacheStats();
+    DecodeByteCode(_bytecode, _bc_size, m_Code);
+    FuseInstructions(m_Code);
+    m_Global = nullptr;
+    m_RootShape.reset(new Shape());
+    intern_strings(_bytecode);
+    collect(sizeof(SPObjectValue));
+    m_Global = m_Heap.NewOld<SPObjectValue>(sizeof(SPObjectValue),
+                                            m_RootShape.get());
+    m_Jit.reset();
+    m_Tracer.reset();
+    if (m_Dispatch == Dispatch::Tracing)
+    {
+#if SPASM_JIT
+        m_Tracer.reset(new Tracer(*this));
+#else
+        m_Dispatch = Dispatch::Threaded;
+#endif
+    }
+    if (m_Dispatch == Dispatch::Jit)
+    {
+        m_Jit.reset(new Jit(*this));
+        if (!m_Jit->Compile(m_Code))
+        {
+            m_Jit.reset();
+            m_Dispatch = Dispatch::Threaded;
+        }
+    }
+#if !SPASM_COMPUTED_GOTO
+    if (m_Dispatch == Dispatch::Threaded)
+    {
+        m_Dispatch = Dispatch::Switch;
+    }
+#endif
+    m_Input.SetStream(_istr);
+    m_Output.SetStream(_ostr);
 }
 
 Spasm::~Spasm() {}
 
+/*!
+** Stops the world for a full collection. A running concurrent marking is
+** finished first.
+*/
+void Spasm::CollectGarbage()
+{
+    if (m_Heap.IsMarking())
+    {
+        finish_marking();
+    }
+    collect_young();
+    m_Heap.BeginCollection();
+    mark_roots();
+    m_Heap.Trace();
+    m_Strings.RemoveUnmarked();
+    m_Heap.Sweep();
+}
+
+/*!
+** Calls \a visit with every value on the data stack. The Frame records of
+** the calls are raw integers, not values, so the frame chain is walked from
+** m_FP down and the records are skipped.
+*/
+template <typename Visit>
+void Spasm::for_each_stack_value(Visit visit)
+{
+    auto top = m_SP;
+    auto fp = m_FP;
+    auto arity = m_Arity;
+    while (fp != data_stack.begin())
+    {
+        const auto record = fp - arity - FrameSlots;
+        for (auto value = record + FrameSlots; value < top; ++value)
+        {
+            visit(*value);
+        }
+        Frame frame;
+        std::memcpy(&frame, record, sizeof(frame));
+        top = record;
+        fp = data_stack.begin() + frame.FramePointer;
+        arity = frame.Arity;
+    }
+    for (auto value = data_stack.begin(); value < top; ++value)
+    {
+        visit(*value);
+    }
+}
+
+/*!
+** The roots are the values on the data stack, the constants of the
+** program and the global object.
+*/
+void Spasm::mark_roots()
+{
+    for_each_stack_value([this](data_t& value) { m_Heap.Mark(value); });
+    for (const auto& instruction : m_Code)
+    {
+        m_Heap.Mark(instruction.Value);
+    }
+    if (m_Global)
+    {
+        m_Heap.Mark(m_Global);
+    }
+}
+
+//! Runs the collections that are due before allocating \a size bytes
+void Spasm::collect(size_t size)
+{
+    if (m_Heap.IsMarking())
+    {
+        if (m_Heap.IsMarkingDone())
+        {
+            finish_marking();
+        }
+    }
+    else if (m_Heap.ShouldCollect())
+    {
+        if (m_ConcurrentMarking)
+        {
+            start_marking();
+        }
+        else
+        {
+            CollectGarbage();
+        }
+    }
+    if (m_Heap.ShouldCollectYoung(size))
+    {
+        collect_young();
+    }
+}
+
+//! Marks the roots and leaves the rest of the marking to a helper thread
+void Spasm::start_marking()
+{
+    collect_young();
+    m_Heap.BeginCollection();
+    mark_roots();
+    m_Heap.TraceConcurrently();
+}
+
+void Spasm::finish_marking()
+{
+    m_Heap.FinishConcurrentMarking();
+    m_Strings.RemoveUnmarked();
+    m_Heap.SweepLazily();
+}
+
+/*!
+** Empties the nursery. Only the data stack can refer to young objects,
+** the constants of the program and the global object are always in the old
+** space.
+*/
+void Spasm::collect_young()
+{
+    m_Heap.BeginMinorCollection();
+    for_each_stack_value([this](data_t& value) { m_Heap.Evacuate(value); });
+    m_Heap.FinishMinorCollection();
+}
+
 /*!
 ** Runs the machine. The machine stops if it reaches an invalid opcode
 ** or opcode 0 or the pc reaches beyond the end of the bytecode.
+** Overflowing the data stack stops it with RunResult::Exception.
 ** @return error code for success or failure
 */
 Spasm::RunResult Spasm::run()
 {
-    const auto codeSize = m_ByteCode.size();
-    while (m_PC < codeSize)
+#if SPASM_STACK_GUARD_SIGNAL
+    DataStack::FaultScope scope(data_stack);
+    if (sigsetjmp(scope.Buffer, 1) != 0)
     {
-        const auto instruction = m_ByteCode[m_PC++];
-        const auto opcode = OpCodes(instruction & 0x3f);
-        const auto size = instruction >> 6;
-        switch (opcode)
+        m_Output.Flush();
+        return RunResult::Exception;
+    }
+#endif
+    auto result = RunResult::Exception;
+    try
+    {
+#if defined(_MSC_VER)
+        result = dispatch_guarded(this);
+#else
+        result = dispatch();
+#endif
+    }
+    catch (const DataStackOverflow&)
+    {
+    }
+    // Halt and the errors leave the dispatch, the output is written for all
+    m_Output.Flush();
+    return result;
+}
+
+#if defined(_MSC_VER)
+namespace
+{
+int filter_guard(const DataStack& stack, EXCEPTION_POINTERS* exception)
+{
+    const auto record = exception->ExceptionRecord;
+    return record->ExceptionCode == EXCEPTION_ACCESS_VIOLATION &&
+                   stack.IsGuard(reinterpret_cast<const void*>(
+                       record->ExceptionInformation[1]))
+               ? EXCEPTION_EXECUTE_HANDLER
+               : EXCEPTION_CONTINUE_SEARCH;
+}
+}  // namespace
+
+//! SEH can't be used in a function with objects to unwind
+Spasm::RunResult Spasm::dispatch_guarded(Spasm* vm)
+{
+    __try
+    {
+        return vm->dispatch();
+    }
+    __except (filter_guard(vm->data_stack, GetExceptionInformation()))
+    {
+        return RunResult::Exception;
+    }
+}
+#endif
+
+Spasm::RunResult Spasm::dispatch()
+{
+    if (m_Jit)
+    {
+        return m_Jit->Run();
+    }
+    if (m_Tracer)
+    {
+        return execute<Dispatch::Tracing>();
+    }
+#if SPASM_COMPUTED_GOTO
+    if (m_Dispatch == Dispatch::Threaded)
+    {
+        return execute<Dispatch::Threaded>();
+    }
+#endif
+    return execute<Dispatch::Switch>();
+}
+
+/*!
+** The interpreter loop. Both dispatch strategies share the same handlers -
+** every handler is a `case` of the switch and, when the compiler supports
+** it, a label whose address is in the threaded dispatch table. The threaded
+** variant jumps from the end of each handler straight to the next one
+** instead of going back through the loop and the switch.
+** With Step set only one instruction is executed, see step().
+*/
+template <Spasm::Dispatch D, bool Step>
+Spasm::RunResult Spasm::execute()
+{
+    Instruction* const code = m_Code.data();
+    Instruction* instruction = code;
+
+#define SPASM_FETCH() instruction = &code[m_PC++]
+
+#if SPASM_COMPUTED_GOTO
+    static const void* const s_Handlers[] = {
+        &&op_Halt,    &&op_Dup,       &&op_Pop,     &&op_PopTo,
+        &&op_PushFrom, &&op_Push,     &&op_Print,   &&op_Read,
+        &&op_Call,    &&op_Ret,       &&op_Jump,    &&op_JumpT,
+        &&op_JumpF,   &&op_Const,     &&op_String,  &&op_Add,
+        &&op_Sub,     &&op_Mul,       &&op_Div,     &&op_Mod,
+        &&op_Less,    &&op_LessEq,    &&op_Greater, &&op_GreaterEq,
+        &&op_Equal,   &&op_NotEqual,  &&op_New,     &&op_Get,
+        &&op_Set,     &&op_GetG,      &&op_SetG,    &&op_NewArray,
+        &&op_LoadElement, &&op_StoreElement, &&op_Length, &&op_Builtin,
+        &&op_ReadLine, &&op_ReadNumbers, &&op_Invalid,    &&op_LessJumpT,
+        &&op_LessJumpF, &&op_LessEqJumpT, &&op_LessEqJumpF,
+        &&op_EqualJumpT, &&op_EqualJumpF, &&op_NotEqualJumpT,
+        &&op_NotEqualJumpF, &&op_AddConst, &&op_SubConst,
+        &&op_IncrementAndCompare, &&op_IncrementConstAndCompare,
+        &&op_AddIntInt, &&op_AddNumNum, &&op_AddStrStr, &&op_SubIntInt,
+        &&op_SubNumNum, &&op_LessIntInt, &&op_LessNumNum,
+    };
+    static_assert(sizeof(s_Handlers) / sizeof(s_Handlers[0]) ==
+                      OpCodes::LastQuickened + 1,
+                  "Every opcode needs a threaded handler");
+
+#define SPASM_CASE(op) \
+    case OpCodes::op:  \
+    op_##op:
+#define SPASM_THREADED_DISPATCH()                                 \
+    do                                                            \
+    {                                                             \
+        if (D != Dispatch::Switch)                                \
+        {                                                         \
+            goto* s_Handlers[instruction->OpCode];                \
+        }                                                         \
+    } while (false)
+#define SPASM_NEXT()                \
+    if (D != Dispatch::Switch)      \
+    {                               \
+        SPASM_FETCH();              \
+        SPASM_THREADED_DISPATCH();  \
+    }                               \
+    break
+#else
+#define SPASM_CASE(op) case OpCodes::op:
+#define SPASM_THREADED_DISPATCH()
+#define SPASM_NEXT() break
+#endif
+
+// Executes a quickened variant while check holds for its operands, lhs and
+// rhs, and falls back to the generic handler otherwise
+#define SPASM_QUICKENED(check, result, generic)                             \
+    do                                                                      \
+    {                                                                       \
+        const auto lhs = get_local(instruction->A1);                        \
+        const auto rhs = get_local(instruction->A2);                        \
+        if (SPASM_LIKELY(check))                                            \
+        {                                                                   \
+            set_local(instruction->A0, result);                             \
+        }                                                                   \
+        else                                                                \
+        {                                                                   \
+            dequicken(*instruction);                                        \
+            generic(instruction->A0, instruction->A1, instruction->A2);     \
+        }                                                                   \
+    } while (false)
+
+// Reports a taken backward branch of the current instruction to the tracer
+#define SPASM_BACKEDGE()                                      \
+    do                                                        \
+    {                                                         \
+        const auto index = PC_t(instruction - code);          \
+        if (D == Dispatch::Tracing && m_PC <= index)          \
+        {                                                     \
+            m_Tracer->OnBackEdge(index);                      \
+        }                                                     \
+    } while (false)
+
+    do
+    {
+        SPASM_FETCH();
+        SPASM_THREADED_DISPATCH();
+        switch (instruction->OpCode)
         {
-            case OpCodes::Halt:
+            SPASM_CASE(Halt)
                 return RunResult::Success;
-            case OpCodes::Dup:
+            SPASM_CASE(Dup)
                 dup();
-                break;
-            case OpCodes::Pop:
+                SPASM_NEXT();
+            SPASM_CASE(Pop)
             {
-                const auto count = PC_t(read_reg(size));
+                const auto count = PC_t(instruction->A0);
                 assert(m_SP - count >= m_FP);
                 m_SP -= count;
-                break;
+                SPASM_NEXT();
             }
-            case OpCodes::PopTo:
+            SPASM_CASE(PopTo)
             {
-                const auto arg0 = read_reg(size);
+                const auto arg0 = instruction->A0;
                 popto(arg0);
-                break;
+                SPASM_NEXT();
             }
-            case OpCodes::PushFrom:
+            SPASM_CASE(PushFrom)
             {
-                const auto arg0 = read_reg(size);
+                const auto arg0 = instruction->A0;
                 push(arg0);
-                break;
+                SPASM_NEXT();
             }
-            case OpCodes::Push:
+            SPASM_CASE(Push)
             {
-                const auto count = PC_t(read_reg(size));
-                assert(m_SP + count <= &data_stack[data_stack.size() - 1]);
+                const auto count = PC_t(instruction->A0);
                 std::fill(m_SP, m_SP + count, data_t{});
                 m_SP += count;
-                break;
+                SPASM_NEXT();
             }
-            case OpCodes::Print:
+            SPASM_CASE(Print)
             {
-                const auto arg0 = read_reg(size);
+                const auto arg0 = instruction->A0;
                 print(arg0);
-                break;
+                SPASM_NEXT();
             }
-            case OpCodes::Read:
+            SPASM_CASE(Read)
             {
-                const auto arg0 = read_reg(size);
+                const auto arg0 = instruction->A0;
                 read(arg0);
-                break;
+                SPASM_NEXT();
             }
-            case OpCodes::Call:
+            SPASM_CASE(Call)
             {
-                const auto arg0 = read_reg(size);
+                const auto arg0 = instruction->A0;
                 call(arg0);
-                break;
+                SPASM_NEXT();
             }
-            case OpCodes::Ret:
+            SPASM_CASE(Ret)
             {
-                const auto arg0 = read_reg(size);
+                const auto arg0 = instruction->A0;
                 ret(arg0);
-                break;
+                SPASM_NEXT();
             }
-            case OpCodes::Jump:
+            SPASM_CASE(Jump)
             {
-                const auto arg0 = read_reg(size);
+                const auto arg0 = instruction->A0;
                 go(arg0);
-                break;
+                SPASM_BACKEDGE();
+                SPASM_NEXT();
             }
-            case OpCodes::JumpT:
+            SPASM_CASE(JumpT)
             {
-                const auto arg0 = read_reg(size);
-                const auto arg1 = read_reg(size);
+                const auto arg0 = instruction->A0;
+                const auto arg1 = instruction->A1;
                 gotrue(arg0, arg1);
-                break;
+                SPASM_BACKEDGE();
+                SPASM_NEXT();
             }
-            case OpCodes::JumpF:
+            SPASM_CASE(JumpF)
             {
-                const auto arg0 = read_reg(size);
-                const auto arg1 = read_reg(size);
+                const auto arg0 = instruction->A0;
+                const auto arg1 = instruction->A1;
                 gofalse(arg0, arg1);
-                break;
+                SPASM_BACKEDGE();
+                SPASM_NEXT();
             }
-            case OpCodes::Const:
+            SPASM_CASE(Const)
             {
-                const auto reg = read_reg(size);
-                const auto value = read_number(size);
+                const auto reg = instruction->A0;
+                const auto value = instruction->Value;
                 set_local(reg, value);
-                break;
+                SPASM_NEXT();
             }
-            case OpCodes::String:
+            SPASM_CASE(String)
             {
-                const auto reg = read_reg(size);
-                const auto value = read_string(size);
+                const auto reg = instruction->A0;
+                const auto value = instruction->Value;
                 set_local(reg, value);
-                break;
+                SPASM_NEXT();
             }
-            case OpCodes::Add:
+            SPASM_CASE(Add)
             {
-                const auto arg0 = read_reg(size);
-                const auto arg1 = read_reg(size);
-                const auto arg2 = read_reg(size);
+                quicken(*instruction);
+                const auto arg0 = instruction->A0;
+                const auto arg1 = instruction->A1;
+                const auto arg2 = instruction->A2;
                 plus(arg0, arg1, arg2);
-                break;
+                SPASM_NEXT();
             }
-            case OpCodes::Sub:
+            SPASM_CASE(Sub)
             {
-                const auto arg0 = read_reg(size);
-                const auto arg1 = read_reg(size);
-                const auto arg2 = read_reg(size);
+                quicken(*instruction);
+                const auto arg0 = instruction->A0;
+                const auto arg1 = instruction->A1;
+                const auto arg2 = instruction->A2;
                 minus(arg0, arg1, arg2);
-                break;
+                SPASM_NEXT();
             }
-            case OpCodes::Mul:
+            SPASM_CASE(Mul)
             {
-                const auto arg0 = read_reg(size);
-                const auto arg1 = read_reg(size);
-                const auto arg2 = read_reg(size);
+                const auto arg0 = instruction->A0;
+                const auto arg1 = instruction->A1;
+                const auto arg2 = instruction->A2;
                 multiply(arg0, arg1, arg2);
-                break;
+                SPASM_NEXT();
             }
-            case OpCodes::Div:
+            SPASM_CASE(Div)
             {
-                const auto arg0 = read_reg(size);
-                const auto arg1 = read_reg(size);
-                const auto arg2 = read_reg(size);
+                const auto arg0 = instruction->A0;
+                const auto arg1 = instruction->A1;
+                const auto arg2 = instruction->A2;
                 divide(arg0, arg1, arg2);
-                break;
+                SPASM_NEXT();
             }
-            case OpCodes::Mod:
+            SPASM_CASE(Mod)
             {
-                const auto arg0 = read_reg(size);
-                const auto arg1 = read_reg(size);
-                const auto arg2 = read_reg(size);
+                const auto arg0 = instruction->A0;
+                const auto arg1 = instruction->A1;
+                const auto arg2 = instruction->A2;
                 modulus(arg0, arg1, arg2);
-                break;
+                SPASM_NEXT();
             }
-            case OpCodes::Less:
+            SPASM_CASE(Less)
             {
-                const auto arg0 = read_reg(size);
-                const auto arg1 = read_reg(size);
-                const auto arg2 = read_reg(size);
+                quicken(*instruction);
+                const auto arg0 = instruction->A0;
+                const auto arg1 = instruction->A1;
+                const auto arg2 = instruction->A2;
                 less(arg0, arg1, arg2);
-                break;
+                SPASM_NEXT();
             }
-            case OpCodes::LessEq:
+            SPASM_CASE(LessEq)
             {
-                const auto arg0 = read_reg(size);
-                const auto arg1 = read_reg(size);
-                const auto arg2 = read_reg(size);
+                const auto arg0 = instruction->A0;
+                const auto arg1 = instruction->A1;
+                const auto arg2 = instruction->A2;
                 lesseq(arg0, arg1, arg2);
-                break;
+                SPASM_NEXT();
             }
-            case OpCodes::Greater:
+            SPASM_CASE(Greater)
             {
-                const auto arg0 = read_reg(size);
-                const auto arg1 = read_reg(size);
-                const auto arg2 = read_reg(size);
+                const auto arg0 = instruction->A0;
+                const auto arg1 = instruction->A1;
+                const auto arg2 = instruction->A2;
                 greater(arg0, arg1, arg2);
-                break;
+                SPASM_NEXT();
             }
-            case OpCodes::GreaterEq:
+            SPASM_CASE(GreaterEq)
             {
-                const auto arg0 = read_reg(size);
-                const auto arg1 = read_reg(size);
-                const auto arg2 = read_reg(size);
+                const auto arg0 = instruction->A0;
+                const auto arg1 = instruction->A1;
+                const auto arg2 = instruction->A2;
                 greatereq(arg0, arg1, arg2);
-                break;
+                SPASM_NEXT();
             }
-            case OpCodes::Equal:
+            SPASM_CASE(Equal)
             {
-                const auto arg0 = read_reg(size);
-                const auto arg1 = read_reg(size);
-                const auto arg2 = read_reg(size);
+                const auto arg0 = instruction->A0;
+                const auto arg1 = instruction->A1;
+                const auto arg2 = instruction->A2;
                 equal(arg0, arg1, arg2);
-                break;
+                SPASM_NEXT();
             }
-            case OpCodes::NotEqual:
+            SPASM_CASE(NotEqual)
             {
-                const auto arg0 = read_reg(size);
-                const auto arg1 = read_reg(size);
-                const auto arg2 = read_reg(size);
+                const auto arg0 = instruction->A0;
+                const auto arg1 = instruction->A1;
+                const auto arg2 = instruction->A2;
                 not_equal(arg0, arg1, arg2);
-                break;
+                SPASM_NEXT();
+            }
+            SPASM_CASE(New)
+            {
+                new_object(instruction->A0);
+                SPASM_NEXT();
+            }
+            SPASM_CASE(Get)
+            {
+                get_property(instruction->A0, get_local(instruction->A1),
+                             *instruction);
+                SPASM_NEXT();
+            }
+            SPASM_CASE(Set)
+            {
+                set_property(get_local(instruction->A0), instruction->A1,
+                             *instruction);
+                SPASM_NEXT();
+            }
+            SPASM_CASE(GetG)
+            {
+                get_property(instruction->A0,
+                             data_t(::Spasm::ValueType::Object, m_Global),
+                             *instruction);
+                SPASM_NEXT();
+            }
+            SPASM_CASE(SetG)
+            {
+                set_property(data_t(::Spasm::ValueType::Object, m_Global),
+                             instruction->A0, *instruction);
+                SPASM_NEXT();
+            }
+            SPASM_CASE(NewArray)
+            {
+                new_array(instruction->A0);
+                SPASM_NEXT();
+            }
+            SPASM_CASE(LoadElement)
+            {
+                load_element(instruction->A0, instruction->A1,
+                             instruction->A2);
+                SPASM_NEXT();
+            }
+            SPASM_CASE(StoreElement)
+            {
+                store_element(instruction->A0, instruction->A1,
+                              instruction->A2);
+                SPASM_NEXT();
+            }
+            SPASM_CASE(Length)
+            {
+                length(instruction->A0, instruction->A1);
+                SPASM_NEXT();
+            }
+            SPASM_CASE(Builtin)
+            {
+                builtin(instruction->A0, instruction->A1, instruction->A2);
+                SPASM_NEXT();
+            }
+            SPASM_CASE(ReadLine)
+            {
+                read_line(instruction->A0);
+                SPASM_NEXT();
+            }
+            SPASM_CASE(ReadNumbers)
+            {
+                read_numbers(instruction->A0, instruction->A1);
+                SPASM_NEXT();
+            }
+            SPASM_CASE(LessJumpT)
+            {
+                less(instruction->A0, instruction->A1, instruction->A2);
+                gotrue(instruction->A0, instruction->A3);
+                SPASM_BACKEDGE();
+                SPASM_NEXT();
+            }
+            SPASM_CASE(LessJumpF)
+            {
+                less(instruction->A0, instruction->A1, instruction->A2);
+                gofalse(instruction->A0, instruction->A3);
+                SPASM_BACKEDGE();
+                SPASM_NEXT();
             }
+            SPASM_CASE(LessEqJumpT)
+            {
+                lesseq(instruction->A0, instruction->A1, instruction->A2);
+                gotrue(instruction->A0, instruction->A3);
+                SPASM_BACKEDGE();
+                SPASM_NEXT();
+            }
+            SPASM_CASE(LessEqJumpF)
+            {
+                lesseq(instruction->A0, instruction->A1, instruction->A2);
+                gofalse(instruction->A0, instruction->A3);
+                SPASM_BACKEDGE();
+                SPASM_NEXT();
+            }
+            SPASM_CASE(EqualJumpT)
+            {
+                equal(instruction->A0, instruction->A1, instruction->A2);
+                gotrue(instruction->A0, instruction->A3);
+                SPASM_BACKEDGE();
+                SPASM_NEXT();
+            }
+            SPASM_CASE(EqualJumpF)
+            {
+                equal(instruction->A0, instruction->A1, instruction->A2);
+                gofalse(instruction->A0, instruction->A3);
+                SPASM_BACKEDGE();
+                SPASM_NEXT();
+            }
+            SPASM_CASE(NotEqualJumpT)
+            {
+                not_equal(instruction->A0, instruction->A1, instruction->A2);
+                gotrue(instruction->A0, instruction->A3);
+                SPASM_BACKEDGE();
+                SPASM_NEXT();
+            }
+            SPASM_CASE(NotEqualJumpF)
+            {
+                not_equal(instruction->A0, instruction->A1, instruction->A2);
+                gofalse(instruction->A0, instruction->A3);
+                SPASM_BACKEDGE();
+                SPASM_NEXT();
+            }
+            SPASM_CASE(AddConst)
+            {
+                set_local(instruction->A3, instruction->Value);
+                plus(instruction->A0, instruction->A1, instruction->A2);
+                SPASM_NEXT();
+            }
+            SPASM_CASE(SubConst)
+            {
+                set_local(instruction->A3, instruction->Value);
+                minus(instruction->A0, instruction->A1, instruction->A2);
+                SPASM_NEXT();
+            }
+            SPASM_CASE(IncrementAndCompare)
+            {
+                plus(instruction->A0, instruction->A0, instruction->A1);
+                less(instruction->A2, instruction->A0, instruction->A3);
+                gotrue(instruction->A2, instruction->A4);
+                SPASM_BACKEDGE();
+                SPASM_NEXT();
+            }
+            SPASM_CASE(IncrementConstAndCompare)
+            {
+                set_local(instruction->A1, instruction->Value);
+                plus(instruction->A0, instruction->A0, instruction->A1);
+                less(instruction->A2, instruction->A0, instruction->A3);
+                gotrue(instruction->A2, instruction->A4);
+                SPASM_BACKEDGE();
+                SPASM_NEXT();
+            }
+            SPASM_CASE(AddIntInt)
+            {
+                SPASM_QUICKENED(both_integers(lhs, rhs),
+                                data_t::from_int64(int64_t(lhs.get_integer()) +
+                                                   rhs.get_integer()),
+                                plus);
+                SPASM_NEXT();
+            }
+            SPASM_CASE(AddNumNum)
+            {
+                SPASM_QUICKENED(lhs.is_number() && rhs.is_number(),
+                                data_t(lhs.get_number() + rhs.get_number()),
+                                plus);
+                SPASM_NEXT();
+            }
+            SPASM_CASE(AddStrStr)
+            {
+                if (SPASM_LIKELY(get_local(instruction->A1).is_string() &&
+                                 get_local(instruction->A2).is_string()))
+                {
+                    concatenate(instruction->A0, instruction->A1,
+                                instruction->A2);
+                }
+                else
+                {
+                    dequicken(*instruction);
+                    plus(instruction->A0, instruction->A1, instruction->A2);
+                }
+                SPASM_NEXT();
+            }
+            SPASM_CASE(SubIntInt)
+            {
+                SPASM_QUICKENED(both_integers(lhs, rhs),
+                                data_t::from_int64(int64_t(lhs.get_integer()) -
+                                                   rhs.get_integer()),
+                                minus);
+                SPASM_NEXT();
+            }
+            SPASM_CASE(SubNumNum)
+            {
+                SPASM_QUICKENED(lhs.is_number() && rhs.is_number(),
+                                data_t(lhs.get_number() - rhs.get_number()),
+                                minus);
+                SPASM_NEXT();
+            }
+            SPASM_CASE(LessIntInt)
+            {
+                SPASM_QUICKENED(both_integers(lhs, rhs),
+                                data_t(lhs.get_integer() < rhs.get_integer()),
+                                less);
+                SPASM_NEXT();
+            }
+            SPASM_CASE(LessNumNum)
+            {
+                SPASM_QUICKENED(lhs.is_number() && rhs.is_number(),
+                                data_t(lhs.get_number() < rhs.get_number()),
+                                less);
+                SPASM_NEXT();
+            }
+            SPASM_CASE(Invalid)
             default:
             {
-                std::cerr << opcode << ": not implemented" << std::endl;
+                std::cerr << instruction->A0 << ": not implemented"
+                          << std::endl;
                 return RunResult::NotImplemented;
             }
         }
-    }
+    } while (!Step);
     return RunResult::Success;
+
+#undef SPASM_BACKEDGE
+#undef SPASM_QUICKENED
+#undef SPASM_NEXT
+#undef SPASM_THREADED_DISPATCH
+#undef SPASM_CASE
+#undef SPASM_FETCH
+}
+
+/*!
+** Executes the instruction at m_PC with the switch dispatch. Native code
+** uses it for the instructions it does not translate.
+*/
+Spasm::RunResult Spasm::step()
+{
+    return execute<Dispatch::Switch, true>();
 }
 
 /*!
@@ -258,39 +844,385 @@ void Spasm::dup()
 }
 
 /*!
-** Reads a data_t object from the input stream and pushes it on the data
-** stack.
+** Reads a number from the input buffer to \a reg, 0 if the input ends or
+** there is no number.
 */
 void Spasm::read(reg_t reg)
 {
-    data_t x;
-    *istr >> x;
-    set_local(reg, x);
+    // what was printed before reading, like a prompt, has to be seen first
+    m_Output.Flush();
+    double x;
+    m_Input.ReadNumber(x);
+    set_local(reg, data_t(x));
+}
+
+//! a0 = the next line of the input as a String, false at the end of it
+void Spasm::read_line(reg_t a0)
+{
+    m_Output.Flush();
+    std::string line;
+    if (!m_Input.ReadLine(line))
+    {
+        set_local(a0, data_t(::Spasm::ValueType::Boolean, uint64_t(0)));
+        return;
+    }
+    const auto size = SPStringValue::AllocationSize(line.size());
+    collect(size);
+    const auto value = m_Heap.New<SPStringValue>(size, line.size());
+    std::memcpy(value->GetData(), line.data(), line.size());
+    set_local(a0, data_t(::Spasm::ValueType::String, (void*)value));
 }
 
 /*!
-** Pops a data_t object from the data stack and prints it on the output
-** stream.
+** a0 = a PackedDouble array of the next a1 numbers of the input. It is
+** shorter if the input ends or has something else than a number, which
+** the next readline gets.
+*/
+void Spasm::read_numbers(reg_t a0, reg_t a1)
+{
+    m_Output.Flush();
+    const auto count = get_local(a1);
+    // not a number or NaN read nothing
+    const auto limit =
+        count.is_number() && count.get_number() > 0
+            ? size_t(std::min(count.get_number(), double(UINT32_MAX)))
+            : size_t(0);
+    std::vector<double> numbers;
+    numbers.reserve(std::min(limit, size_t(4096)));
+    double x;
+    while (numbers.size() < limit && m_Input.ReadNumber(x))
+    {
+        numbers.push_back(x);
+    }
+
+    // the collection may move the new array, the data stack keeps it updated
+    const auto length = uint32_t(numbers.size());
+    const auto size = sizeof(SPElementsArray);
+    reserve_data(1);
+    collect(size);
+    push_data(data_t(::Spasm::ValueType::Array,
+                     (void*)m_Heap.New<SPElementsArray>(size)));
+    reshape_elements(ElementsKind::PackedDouble, length);
+    const auto value = pop_data();
+    const auto result = static_cast<SPElementsArray*>(value.get_pointer());
+    result->SetLength(length);
+    std::copy(numbers.begin(), numbers.end(), result->GetDoubles());
+    set_local(a0, value);
+}
+
+/*!
+** Prints the value in \a reg to the output buffer. Numbers are written as
+** the shortest decimal that reads back as them.
 */
 void Spasm::print(reg_t reg)
 {
-    *ostr << get_local(reg);
+    const auto value = get_local(reg);
+    switch (value.get_type())
+    {
+        case ::Spasm::ValueType::Number:
+            m_Output.Commit(format_number(value.get_double(),
+                                          m_Output.Reserve(NumberLength)));
+            break;
+        case ::Spasm::ValueType::Integer:
+            m_Output.Commit(format_integer(value.get_integer(),
+                                           m_Output.Reserve(NumberLength)));
+            break;
+        case ::Spasm::ValueType::Boolean:
+            m_Output.Write(value.get_boolean() ? "1" : "0", 1);
+            break;
+        case ::Spasm::ValueType::String:
+        {
+            const auto s = flatten(reg);
+            m_Output.Write(s->GetData(), s->GetLength());
+            break;
+        }
+        default:
+            break;
+    }
 }
 
 /*!
 ** Pops two data objects from the data stack and pushes their sum on the
-** data stack.
+** data stack. The sum of two strings is their concatenation.
+*/
+inline void Spasm::plus(reg_t a0, reg_t a1, reg_t a2)
+{
+    const auto lhs = get_local(a1);
+    const auto rhs = get_local(a2);
+    if (lhs.is_string() && rhs.is_string())
+    {
+        concatenate(a0, a1, a2);
+        return;
+    }
+    set_local(a0, lhs + rhs);
+}
+
+//! Stores a new object without properties in a0
+void Spasm::new_object(reg_t a0)
+{
+    const auto size = sizeof(SPObjectValue);
+    collect(size);
+    const auto object = m_Heap.New<SPObjectValue>(size, m_RootShape.get());
+    set_local(a0, data_t(::Spasm::ValueType::Object, (void*)object));
+}
+
+/*!
+** Stores the property of \a object named by the instruction in a0. The
+** value is undefined if \a object is not an object or has no such property.
+*/
+void Spasm::get_property(reg_t a0, data_t object, const Instruction& i)
+{
+    if (object.get_type() != ::Spasm::ValueType::Object)
+    {
+        set_local(a0, data_t(::Spasm::ValueType::Undefined, uint64_t(0)));
+        return;
+    }
+    const auto value = static_cast<SPObjectValue*>(object.get_pointer());
+    const auto entry = find_property(value, i, false);
+    set_local(a0, entry.To ? value->GetSlot(entry.Slot)
+                           : data_t(::Spasm::ValueType::Undefined,
+                                    uint64_t(0)));
+}
+
+/*!
+** Stores a1 in the property of \a object named by the instruction. The
+** property is added if the object does not have it yet, a store to a value
+** that is not an object is ignored.
+*/
+void Spasm::set_property(data_t object, reg_t a1, const Instruction& i)
+{
+    if (object.get_type() != ::Spasm::ValueType::Object)
+    {
+        return;
+    }
+    auto value = static_cast<SPObjectValue*>(object.get_pointer());
+    const auto entry = find_property(value, i, true);
+    if (entry.Slot >= value->GetCapacity())
+    {
+        value = grow_slots(object, entry.Slot);
+    }
+    value->SetShape(entry.To);
+    m_Heap.Store(value, value->GetSlot(entry.Slot), get_local(a1));
+}
+
+/*!
+** Looks the property named by the instruction up in the shape of \a object,
+** first in the inline cache of the instruction. On a miss the shape is
+** searched and, if the cache is not full, the result is cached.
+**
+** \param add	- add the property if the object does not have it
+**
+** \return the slot of the property and the shape of the object after the
+** access, To is nullptr if the property is missing and not added
+*/
+InlineCache::Entry Spasm::find_property(const SPObjectValue* object,
+                                        const Instruction& i,
+                                        bool add)
+{
+    auto& cache = m_InlineCaches[size_t(i.A2)];
+    const auto shape = object->GetShape();
+    for (uint32_t e = 0; e < cache.Count; ++e)
+    {
+        if (cache.Entries[e].From == shape)
+        {
+            ++m_InlineCacheStats.Hits;
+            return cache.Entries[e];
+        }
+    }
+    ++m_InlineCacheStats.Misses;
+    const auto name = static_cast<const SPStringValue*>(i.Value.get_pointer());
+    const auto slot = shape->Find(name);
+    InlineCache::Entry entry{shape, shape, uint32_t(slot)};
+    if (slot < 0)
+    {
+        if (!add)
+        {
+            // a later Set may add the property, so the miss is not cached
+            return InlineCache::Entry{shape, nullptr, 0};
+        }
+        entry.To = shape->AddProperty(name);
+        entry.Slot = shape->GetSlotCount();
+    }
+    if (cache.Count < InlineCache::MaxEntries)
+    {
+        cache.Entries[cache.Count++] = entry;
+    }
+    return entry;
+}
+
+/*!
+** Reallocates the overflow array of \a object so it has room for \a slot.
+** The collection may move the object, so the new address is returned.
+*/
+SPObjectValue* Spasm::grow_slots(data_t object, uint32_t slot)
+{
+    const auto capacity =
+        static_cast<SPObjectValue*>(object.get_pointer())->GetCapacity();
+    const auto length =
+        std::max(slot + 1, 2 * capacity) - SPObjectValue::InlineSlots;
+    const auto size = SPArrayValue::AllocationSize(length);
+    // the data stack is a root, it keeps the object up to date
+    reserve_data(1);
+    push_data(object);
+    collect(size);
+    const auto value = static_cast<SPObjectValue*>(pop_data().get_pointer());
+    const auto overflow = m_Heap.New<SPArrayValue>(size, length);
+    for (auto i = SPObjectValue::InlineSlots; i < capacity; ++i)
+    {
+        m_Heap.Store(overflow,
+                     overflow->GetElements()[i - SPObjectValue::InlineSlots],
+                     value->GetSlot(i));
+    }
+    m_Heap.Store(value, value->GetOverflow(), overflow);
+    return value;
+}
+
+/*!
+** a0 = a1[a2]. Reading an element of an array of a packed kind is inline,
+** the other reads take get_element.
+*/
+inline void Spasm::load_element(reg_t a0, reg_t a1, reg_t a2)
+{
+    const auto array = get_local(a1);
+    const auto index = get_local(a2);
+    if (SPASM_LIKELY(array.get_type() == ::Spasm::ValueType::Array &&
+                     index.is_integer()))
+    {
+        data_t value;
+        if (static_cast<SPElementsArray*>(array.get_pointer())
+                ->GetFast(uint32_t(index.get_integer()), value))
+        {
+            set_local(a0, value);
+            return;
+        }
+    }
+    set_local(a0, get_element(array, index));
+}
+
+/*!
+** a0[a1] = a2. A store within the capacity, that leaves no hole and fits
+** the kind of the array is inline, the others take set_element.
+*/
+inline void Spasm::store_element(reg_t a0, reg_t a1, reg_t a2)
+{
+    const auto target = get_local(a0);
+    const auto index = get_local(a1);
+    const auto value = get_local(a2);
+    if (SPASM_LIKELY(target.get_type() == ::Spasm::ValueType::Array &&
+                     index.is_integer()))
+    {
+        const auto array = static_cast<SPElementsArray*>(target.get_pointer());
+        const auto i = uint32_t(index.get_integer());
+        const auto length = array->GetLength();
+        if (i <= length && i < array->GetCapacity())
+        {
+            bool stored = true;
+            switch (array->GetElementsKind())
+            {
+                case ElementsKind::PackedSmallInt:
+                    stored = value.is_integer();
+                    if (stored)
+                    {
+                        array->GetSmallInts()[i] = value.get_integer();
+                    }
+                    break;
+                case ElementsKind::PackedDouble:
+                    stored = value.is_number();
+                    if (stored)
+                    {
+                        array->GetDoubles()[i] = value.get_number();
+                    }
+                    break;
+                case ElementsKind::Packed:
+                case ElementsKind::Holey:
+                    m_Heap.Store(array->GetStoreObject(),
+                                 array->GetValues()[i], value);
+                    break;
+                default:
+                    stored = false;
+                    break;
+            }
+            if (stored)
+            {
+                array->SetLength(std::max(length, i + 1));
+                return;
+            }
+        }
+    }
+    set_element(a0, a1, a2);
+}
+
+//! a0 = a1.length for arrays and strings, undefined for other values
+inline void Spasm::length(reg_t a0, reg_t a1)
+{
+    const auto value = get_local(a1);
+    switch (value.get_type())
+    {
+        case ::Spasm::ValueType::Array:
+            set_local(a0, data_t::from_int64(
+                              static_cast<SPElementsArray*>(value.get_pointer())
+                                  ->GetLength()));
+            break;
+        case ::Spasm::ValueType::String:
+            set_local(a0, data_t::from_int64(int64_t(string_length(value))));
+            break;
+        default:
+            set_local(a0, data_t(::Spasm::ValueType::Undefined, uint64_t(0)));
+            break;
+    }
+}
+
+/*!
+** Rewrites a generic Add, Sub or Less into the variant for the types of
+** its operands, so the next executions skip the dispatch on the types.
+** A site whose variants keep failing their type checks stays generic.
 */
-void Spasm::plus(reg_t a0, reg_t a1, reg_t a2)
+inline void Spasm::quicken(Instruction& instruction)
 {
-    set_local(a0, get_local(a1) + get_local(a2));
+    if (instruction.Dequickened >= MaxDequickenings)
+    {
+        return;
+    }
+    const auto lhs = get_local(instruction.A1);
+    const auto rhs = get_local(instruction.A2);
+    const auto add = instruction.OpCode == OpCodes::Add;
+    const auto sub = instruction.OpCode == OpCodes::Sub;
+    if (both_integers(lhs, rhs))
+    {
+        instruction.OpCode = add   ? OpCodes::AddIntInt
+                             : sub ? OpCodes::SubIntInt
+                                   : OpCodes::LessIntInt;
+    }
+    else if (lhs.is_number() && rhs.is_number())
+    {
+        instruction.OpCode = add   ? OpCodes::AddNumNum
+                             : sub ? OpCodes::SubNumNum
+                                   : OpCodes::LessNumNum;
+    }
+    else if (add && lhs.is_string() && rhs.is_string())
+    {
+        instruction.OpCode = OpCodes::AddStrStr;
+    }
+    else
+    {
+        return;
+    }
+    ++m_QuickeningStats.Quickened;
+}
+
+//! Rewrites a quickened variant, whose type check failed, back to generic
+void Spasm::dequicken(Instruction& instruction)
+{
+    instruction.OpCode = GenericOpCode(instruction.OpCode);
+    ++instruction.Dequickened;
+    ++m_QuickeningStats.Dequickened;
 }
 
 /*!
 ** Pops two data objects from the data stack and pushes their difference
 ** on the data stack.
 */
-void Spasm::minus(reg_t a0, reg_t a1, reg_t a2)
+inline void Spasm::minus(reg_t a0, reg_t a1, reg_t a2)
 {
     set_local(a0, get_local(a1) - get_local(a2));
 }
@@ -299,7 +1231,7 @@ void Spasm::minus(reg_t a0, reg_t a1, reg_t a2)
 ** Pops two data objects from the data stack and pushes their product
 ** on the data stack.
 */
-void Spasm::multiply(reg_t a0, reg_t a1, reg_t a2)
+inline void Spasm::multiply(reg_t a0, reg_t a1, reg_t a2)
 {
     set_local(a0, get_local(a1) * get_local(a2));
 }
@@ -317,7 +1249,7 @@ void Spasm::divide(reg_t a0, reg_t a1, reg_t a2)
 ** Pops two data objects from the data stack and pushes their modulus
 ** on the data stack.
 */
-void Spasm::modulus(reg_t a0, reg_t a1, reg_t a2)
+inline void Spasm::modulus(reg_t a0, reg_t a1, reg_t a2)
 {
     set_local(a0, get_local(a1) % get_local(a2));
 }
@@ -327,7 +1259,7 @@ void Spasm::modulus(reg_t a0, reg_t a1, reg_t a2)
 ** If the data_t object on top of the data stack evaluates to true
 ** execution continues from the place pointed by number in the next bytes
 */
-void Spasm::gotrue(reg_t a0, reg_t a1)
+inline void Spasm::gotrue(reg_t a0, reg_t a1)
 {
     if (get_local(a0))
     {
@@ -340,7 +1272,7 @@ void Spasm::gotrue(reg_t a0, reg_t a1)
 ** If the data_t object on top of the data stack evaluates to false
 ** execution continues from the place pointed by number in the next bytes
 */
-void Spasm::gofalse(reg_t a0, reg_t a1)
+inline void Spasm::gofalse(reg_t a0, reg_t a1)
 {
     if (!get_local(a0))
     {
@@ -358,15 +1290,26 @@ void Spasm::go(reg_t a0)
 }
 
 /*!
-** Function call. A new frame with the specified size is created, the
-** return address is saved in the return stack and the new pc is loaded.
+** Function call. The arguments and the arity on top of the data stack are
+** moved up to make room for a Frame below them, which saves the return
+** address and the frame of the caller, and the new pc is loaded.
 */
 void Spasm::call(reg_t a0)
 {
-    Frame call{m_PC, PC_t(m_FP - &data_stack[0]),
-               m_SP - &data_stack[0] - PC_t((*(m_SP - 1)).get_double()) - 1};
-    m_Frames.push(std::move(call));
+    static_assert(sizeof(Frame) % sizeof(data_t) == 0,
+                  "Frames must take whole stack slots");
+    const auto arity = uint32_t((*(m_SP - 1)).get_number());
+    const auto arguments = m_SP - arity - 1;
+    // a handful of values, a plain loop beats calling memmove
+    for (auto value = m_SP - 1; value >= arguments; --value)
+    {
+        value[FrameSlots] = *value;
+    }
+    const Frame frame{m_PC, uint32_t(m_FP - data_stack.begin()), m_Arity};
+    std::memcpy(static_cast<void*>(arguments), &frame, sizeof(frame));
+    m_SP += FrameSlots;
     m_FP = m_SP - 1;
+    m_Arity = arity;
     go(a0);
 }
 
@@ -376,12 +1319,15 @@ void Spasm::call(reg_t a0)
 */
 void Spasm::ret(reg_t reg)
 {
-    Frame parent = m_Frames.top();
-    m_Frames.pop();
-    m_SP = &data_stack[parent.StackPointer];
-    *(m_SP - 1) = m_FP[reg];
-    m_FP = &data_stack[parent.FramePointer];
-    m_PC = parent.ReturnAddress;
+    const auto result = m_FP[reg];
+    const auto record = m_FP - m_Arity - FrameSlots;
+    Frame frame;
+    std::memcpy(&frame, record, sizeof(frame));
+    m_SP = record;
+    *(m_SP - 1) = result;
+    m_FP = data_stack.begin() + frame.FramePointer;
+    m_Arity = frame.Arity;
+    m_PC = frame.ReturnAddress;
 }
 
 /*!
@@ -405,7 +1351,7 @@ void Spasm::store()
 ** Compares the values on top of the stack. Pushes 1 if the value before
 ** the top of the stack is less than that on top of the stack.
 */
-void Spasm::less(reg_t a0, reg_t a1, reg_t a2)
+inline void Spasm::less(reg_t a0, reg_t a1, reg_t a2)
 {
     set_local(a0, get_local(a1) < get_local(a2));
 }
@@ -414,104 +1360,123 @@ void Spasm::less(reg_t a0, reg_t a1, reg_t a2)
 ** Compares the values on top of the stack. Pushes 1 if the value before
 ** the top of the stack is less than or equal to that on top of the stack.
 */
-void Spasm::lesseq(reg_t a0, reg_t a1, reg_t a2)
+inline void Spasm::lesseq(reg_t a0, reg_t a1, reg_t a2)
 {
     set_local(a0, get_local(a1) <= get_local(a2));
 }
 
-void Spasm::greater(reg_t a0, reg_t a1, reg_t a2)
+inline void Spasm::greater(reg_t a0, reg_t a1, reg_t a2)
 {
     set_local(a0, get_local(a1) > get_local(a2));
 }
 
-void Spasm::greatereq(reg_t a0, reg_t a1, reg_t a2)
+inline void Spasm::greatereq(reg_t a0, reg_t a1, reg_t a2)
 {
     set_local(a0, get_local(a1) >= get_local(a2));
 }
 
-void Spasm::equal(reg_t a0, reg_t a1, reg_t a2)
+//! Strings are equal if they have the same characters
+inline void Spasm::equal(reg_t a0, reg_t a1, reg_t a2)
 {
+    if (get_local(a1).is_string() && get_local(a2).is_string())
+    {
+        set_local(a0, data_t(equal_strings(a1, a2)));
+        return;
+    }
     set_local(a0, get_local(a1) == get_local(a2));
 }
 
-void Spasm::not_equal(reg_t a0, reg_t a1, reg_t a2)
+inline void Spasm::not_equal(reg_t a0, reg_t a1, reg_t a2)
 {
+    if (get_local(a1).is_string() && get_local(a2).is_string())
+    {
+        set_local(a0, data_t(!equal_strings(a1, a2)));
+        return;
+    }
     set_local(a0, get_local(a1) != get_local(a2));
 }
 
 data_t Spasm::get_local(reg_t reg)
 {
-    assert(&data_stack[0] <= (m_FP + reg));
-    assert((m_FP + reg) < &data_stack[data_stack.size() - 1]);
     return m_FP[reg];
 }
 
 void Spasm::set_local(reg_t reg, data_t data)
 {
-    assert(&data_stack[0] <= (m_FP + reg));
-    assert((m_FP + reg) < &data_stack[data_stack.size() - 1]);
     m_FP[reg] = data;
 }
 
 data_t Spasm::pop_data()
 {
-    auto result = data_stack.back();
-    data_stack.pop_back();
-    return result;
+    return *(--m_SP);
 }
 
 void Spasm::push_data(data_t data)
 {
-    assert(m_SP < &data_stack[data_stack.size() - 1]);
     *(m_SP++) = data;
 }
 
-reg_t Spasm::read_reg(size_t size)
-{
-    return read_integer(size);
-}
-
-data_t Spasm::read_number(size_t size)
+/*!
+** Throws DataStackOverflow unless \a count more values fit on the data
+** stack. The helpers that own vectors, strings or other locals with
+** destructors call it before they push, so only the frames with trivial
+** locals can fault on the guard regions.
+*/
+void Spasm::reserve_data(size_t count)
 {
-    return data_t(double(read_integer(size)));
+    if (size_t(data_stack.end() - m_SP) < count)
+    {
+        throw DataStackOverflow();
+    }
 }
 
-int64_t Spasm::read_integer(size_t size)
+/*!
+** Builds the constant pool of the program. Every string literal is interned
+** once and its boxed value is stored in the String instruction, so running
+** it is a plain load like Const. The property names are interned the same
+** way and every property access gets its InlineCache. The names of the
+** builtins become their index, an unknown one traps as Invalid.
+**
+** \param bytecode	- the bytecode m_Code was decoded from, which holds
+** the characters of the strings
+*/
+void Spasm::intern_strings(const byte* bytecode)
 {
-    switch (size)
+    m_InlineCaches.clear();
+    for (auto& instruction : m_Code)
     {
-        case 0:
-            return m_ByteCode[m_PC++];
-        case 1:
+        if (IsPropertyAccess(instruction.OpCode))
         {
-            auto result = *reinterpret_cast<int16_t*>(&m_ByteCode[0] + m_PC);
-            m_PC += 2;
-            return result;
+            const auto s =
+                reinterpret_cast<const char*>(&bytecode[instruction.A3]);
+            collect(SPStringValue::AllocationSize(size_t(instruction.A4)));
+            const auto name = m_Strings.Get(s, size_t(instruction.A4));
+            instruction.Value =
+                data_t(::Spasm::ValueType::String, (void*)name);
+            instruction.A2 = int32_t(m_InlineCaches.size());
+            m_InlineCaches.emplace_back();
         }
-        case 2:
+        if (instruction.OpCode == OpCodes::Builtin)
         {
-            auto result = *reinterpret_cast<int32_t*>(&m_ByteCode[0] + m_PC);
-            m_PC += 4;
-            return result;
+            instruction.A2 = FindBuiltin(
+                reinterpret_cast<const char*>(&bytecode[instruction.A3]),
+                size_t(instruction.A4));
+            if (instruction.A2 < 0)
+            {
+                instruction.OpCode = OpCodes::Invalid;
+                instruction.A0 = OpCodes::Builtin;
+            }
         }
-        case 3:
+        if (instruction.OpCode == OpCodes::String)
         {
-            auto result = *reinterpret_cast<int64_t*>(&m_ByteCode[0] + m_PC);
-            m_PC += 8;
-            return result;
+            const auto s =
+                reinterpret_cast<const char*>(&bytecode[instruction.A1]);
+            collect(SPStringValue::AllocationSize(size_t(instruction.A2)));
+            const auto value = m_Strings.Get(s, size_t(instruction.A2));
+            instruction.Value =
+                data_t(::Spasm::ValueType::String, (void*)value);
         }
     }
-    assert(false && "not reached");
-    return 0;
-}
-
-data_t Spasm::read_string(size_t size)
-{
-    const auto length = size_t(read_integer(size));
-    const auto s = reinterpret_cast<const char*>(&m_ByteCode[m_PC]);
-    m_PC += length;
-    const auto value = m_Strings.Get(s, length);
-    return data_t(::Spasm::ValueType::String, (void*)value);
 }
 
 }  // namespace SpasmImpl
@@ -1,15 +1,23 @@
 #ifndef SPASM_HPP
 #define SPASM_HPP
 
+#include "mappedfile.hpp"
+#include "module.hpp"
 #include "spasm_impl.hpp"
 #include "value.hpp"
 
 namespace Spasm
 {
 using SpasmImpl::byte;
+using SpasmImpl::FindNumericKernels;
+using SpasmImpl::KernelIsa;
+using SpasmImpl::MappedFile;
+using SpasmImpl::Module;
+using SpasmImpl::NumericKernels;
 using SpasmImpl::OpCodes;
 using SpasmImpl::PC_t;
 using SpasmImpl::Spasm;
+using SpasmImpl::ThreadPool;
 }  // namespace Spasm
 
 #endif  // #ifndef SPASM_HPP
@@ -3,7 +3,15 @@
 
 #include <iostream>
 
-#include <unordered_set>
+#include <memory>
+#include <unordered_map>
+#include "elements.hpp"
+#include "heap.hpp"
+#include "input.hpp"
+#include "kernels.hpp"
+#include "output.hpp"
+#include "shape.hpp"
+#include "stack.hpp"
 #include "types.hpp"
 
 namespace SpasmImpl
@@ -36,23 +44,220 @@ enum OpCodes : char
     GreaterEq,
     Equal,
     NotEqual,
-    LastIndex = NotEqual,
+    //! a0 = {}
+    New,
+    //! a0 = a1.name
+    Get,
+    //! a0.name = a1
+    Set,
+    //! a0 = name of the global object
+    GetG,
+    //! name of the global object = a0
+    SetG,
+    //! a0 = []
+    NewArray,
+    //! a0 = a1[a2]
+    LoadElement,
+    //! a0[a1] = a2
+    StoreElement,
+    //! a0 = a1.length
+    Length,
+    //! a0 = name(a1, a1 + 1, ...), see FindBuiltin
+    Builtin,
+    //! a0 = the next line of the input, false at its end
+    ReadLine,
+    //! a0 = [up to a1 numbers of the input], shorter at its end or before
+    //! text that is not a number
+    ReadNumbers,
+    LastIndex = ReadNumbers,
+    //! Exists only in the decoded stream - traps on undecodable bytecode
+    Invalid,
+    // Superinstructions formed by the loader from common sequences, see
+    // FuseInstructions
+    LessJumpT,
+    LessJumpF,
+    LessEqJumpT,
+    LessEqJumpF,
+    EqualJumpT,
+    EqualJumpF,
+    NotEqualJumpT,
+    NotEqualJumpF,
+    AddConst,
+    SubConst,
+    IncrementAndCompare,
+    IncrementConstAndCompare,
+    LastDecoded = IncrementConstAndCompare,
+    // Type-specialized variants the interpreter rewrites Add, Sub and Less
+    // into as they execute, see Spasm::quicken. IntInt takes two Integers,
+    // NumNum any two Numbers and computes in doubles.
+    AddIntInt,
+    AddNumNum,
+    AddStrStr,
+    SubIntInt,
+    SubNumNum,
+    LessIntInt,
+    LessNumNum,
+    LastQuickened = LessNumNum,
 };
 static_assert(LastIndex < 0x3f, "Too many opcodes");
 
+//! Fixed width decoded instruction
+/*!
+** The bytecode packs the operand size in the top two bits of the opcode and
+** the operands follow with variable width. At load time it is translated
+** into an array of these, so the interpreter reads operands directly.
+** Jump and call targets are indices in the decoded array, not byte offsets.
+*/
+struct alignas(32) Instruction
+{
+    OpCodes OpCode = OpCodes::Halt;
+    //! times a quickened variant of the instruction failed its type check
+    uint8_t Dequickened = 0;
+    int32_t A0 = 0;
+    int32_t A1 = 0;
+    int32_t A2 = 0;
+    //! Extra operands of the superinstructions, offset and length of the
+    //! name of Get, Set, GetG, SetG and Builtin in the bytecode
+    int32_t A3 = 0;
+    int32_t A4 = 0;
+    //! Immediate value of Const, AddConst, ..., the literal of String and
+    //! the property name of Get, Set, GetG and SetG
+    data_t Value;
+};
+static_assert(sizeof(Instruction) == 32, "Instructions must stay compact");
+
+typedef std::vector<Instruction, AlignedAllocator<Instruction>>
+    InstructionStream;
+
+bool DecodeByteCode(const byte*, size_t, InstructionStream&,
+                    SPVector<size_t>* offsets = nullptr);
+size_t FuseInstructions(InstructionStream&);
+int32_t* BranchTarget(Instruction&);
+
+//! \return the generic instruction \a op is a quickened variant of, or
+//! \a op itself
+inline OpCodes GenericOpCode(OpCodes op)
+{
+    switch (op)
+    {
+        case OpCodes::AddIntInt:
+        case OpCodes::AddNumNum:
+        case OpCodes::AddStrStr:
+            return OpCodes::Add;
+        case OpCodes::SubIntInt:
+        case OpCodes::SubNumNum:
+            return OpCodes::Sub;
+        case OpCodes::LessIntInt:
+        case OpCodes::LessNumNum:
+            return OpCodes::Less;
+        default:
+            return op;
+    }
+}
+
+//! Instruction sites rewritten by the interpreter since Initialize
+struct QuickeningStats
+{
+    //! generic instructions rewritten into a type-specialized variant
+    uint64_t Quickened = 0;
+    //! variants rewritten back as their type check failed
+    uint64_t Dequickened = 0;
+};
+
+//! \return true if the instruction names a property, see InlineCache
+inline bool IsPropertyAccess(OpCodes op)
+{
+    return op == OpCodes::Get || op == OpCodes::Set || op == OpCodes::GetG ||
+           op == OpCodes::SetG;
+}
+
+//! \return true if a name follows the operands of \a op in the bytecode
+inline bool HasName(OpCodes op)
+{
+    return IsPropertyAccess(op) || op == OpCodes::Builtin;
+}
+
+//! \return the index of the builtin \a name or -1 if there is none
+int32_t FindBuiltin(const char* name, size_t length);
+
+//! Shapes a property access saw and the slot of the property in each
+/*!
+** Every Get, Set, GetG and SetG has its own cache, the index of which is
+** the A2 of the instruction. A hit compares the shape of the object with
+** the cached ones and takes the slot without a lookup. A cache with one
+** entry is monomorphic, up to MaxEntries polymorphic and a site that sees
+** more shapes looks the property up on every miss.
+*/
+struct InlineCache
+{
+    static const uint32_t MaxEntries = 4;
+    struct Entry
+    {
+        //! shape of the object before the access
+        const Shape* From;
+        //! shape after the access, the child of From if Set adds the property
+        Shape* To;
+        uint32_t Slot;
+    };
+    Entry Entries[MaxEntries];
+    uint32_t Count = 0;
+};
+
+//! Property accesses since Initialize
+struct InlineCacheStats
+{
+    //! accesses that found the shape of the object in the inline cache
+    uint64_t Hits = 0;
+    //! accesses that looked the property up in the shape
+    uint64_t Misses = 0;
+};
+
+class Jit;
+class ThreadPool;
+class Tracer;
+
+//! Interns strings, every distinct string is stored once
+/*!
+** The table does not keep the strings alive, the owner of the heap calls
+** RemoveUnmarked during a collection to forget the dead ones.
+*/
 class StringTable
 {
    public:
-    const SPStringValue* Get(const char* s, size_t length)
+    explicit StringTable(Heap& heap) : m_Heap(heap) {}
+
+    //! Looks the string up without allocating and copies it only when new
+    SPStringValue* Get(const char* s, size_t length)
+    {
+        const auto pos = m_Strings.find(SPStringKey{s, length});
+        if (pos != m_Strings.end())
+        {
+            m_Heap.KeepAlive(pos->second);
+            return pos->second;
+        }
+        // interned strings never move, the compilers embed their addresses
+        const auto value = m_Heap.NewOld<SPStringValue>(
+            SPStringValue::AllocationSize(length), length);
+        std::memcpy(value->GetData(), s, length);
+        // the key points into the characters of the value
+        const SPStringKey key{value->GetData(), length};
+        m_Strings.emplace(key, value);
+        return value;
+    }
+
+    void RemoveUnmarked()
     {
-        SPString v(s, length);
-        auto pos = m_Strings.insert(SPStringValue(v));
-        return &(*pos.first);
+        for (auto i = m_Strings.begin(); i != m_Strings.end();)
+        {
+            i = Heap::IsMarked(i->second) ? std::next(i) : m_Strings.erase(i);
+        }
     }
 
    private:
-    typedef std::unordered_set<SPStringValue> StringMap;
+    typedef std::unordered_map<SPStringKey, SPStringValue*, SPStringKeyHash>
+        StringMap;
     StringMap m_Strings;
+    Heap& m_Heap;
 };
 
 //! The Abstract Stack Machine
@@ -64,11 +269,25 @@ class StringTable
 class Spasm
 {
    public:
+    //! Instruction dispatch strategy of the interpreter loop
+    enum class Dispatch
+    {
+        //! portable `switch` over the opcode
+        Switch,
+        //! computed-goto threaded code, falls back to Switch if unsupported
+        Threaded,
+        //! native x86-64 code, falls back to Threaded if unsupported
+        Jit,
+        //! Threaded with native traces of hot loops, falls back to Threaded
+        Tracing,
+    };
+
     Spasm();
     void Initialize(PC_t,
                     const byte*,
                     std::istream& = std::cin,
-                    std::ostream& = std::cout);
+                    std::ostream& = std::cout,
+                    Dispatch = Dispatch::Threaded);
     ~Spasm();
     Spasm(const Spasm&) = delete;
     Spasm& operator=(const Spasm&) = delete;
@@ -81,15 +300,63 @@ class Spasm
     };
     RunResult run();
 
+    Dispatch GetDispatch() const { return m_Dispatch; }
+
+    //! Runs a full garbage collection
+    void CollectGarbage();
+    //! Runs the marking of full collections on a helper thread
+    void SetConcurrentMarking(bool enabled) { m_ConcurrentMarking = enabled; }
+    const HeapStats& GetHeapStats() const { return m_Heap.GetStats(); }
+    const QuickeningStats& GetQuickeningStats() const
+    {
+        return m_QuickeningStats;
+    }
+    const InlineCacheStats& GetInlineCacheStats() const
+    {
+        return m_InlineCacheStats;
+    }
+    //! Selects the loops of the array builtins, the best the CPU supports
+    //! by default
+    void SetKernels(const NumericKernels& kernels) { m_Kernels = &kernels; }
+    const NumericKernels& GetKernels() const { return *m_Kernels; }
+    //! Sets the threads the array builtins split long arrays across, besides
+    //! the one running the machine, none runs them sequentially
+    void SetWorkerThreads(size_t workers);
+    size_t GetWorkerThreads() const { return m_WorkerThreads; }
+
    private:
+    friend class Jit;
+    friend class Tracer;
+
+    template <Dispatch D, bool Step = false>
+    RunResult execute();
+
+    //! Runs the selected engine, without catching stack overflows
+    RunResult dispatch();
+#if defined(_MSC_VER)
+    static RunResult dispatch_guarded(Spasm* vm);
+#endif
+
+    //! Executes only the instruction at m_PC
+    RunResult step();
+
+    //! Dispatch strategy selected in Initialize
+    Dispatch m_Dispatch = Dispatch::Switch;
+
     //! Program counter - points the current opcode
     PC_t m_PC = 0;
 
-    typedef SPVector<byte> ByteCode;
-    //! bytecode of the program
-    ByteCode m_ByteCode;
+    //! the decoded program, m_PC is an index in it
+    InstructionStream m_Code;
+
+    QuickeningStats m_QuickeningStats;
+
+    //! native code for m_Code when running with Dispatch::Jit
+    std::unique_ptr<Jit> m_Jit;
+
+    //! loop traces when running with Dispatch::Tracing
+    std::unique_ptr<Tracer> m_Tracer;
 
-    typedef SPVector<data_t> DataStack;
     //! stack for storing arguments and local variables
     DataStack data_stack;
 
@@ -99,24 +366,44 @@ class Spasm
     //! Frame pointer - the start of the stack for the current function
     data_t* m_FP = nullptr;
 
+    //! Number of arguments of the current function
+    uint32_t m_Arity = 0;
+
+    //! Call record kept in the data stack just below the arguments
     struct Frame
     {
         PC_t ReturnAddress;
-        PC_t FramePointer;
-        PC_t StackPointer;
+        //! offset of the frame pointer of the caller in data_stack
+        uint32_t FramePointer;
+        //! arity of the caller
+        uint32_t Arity;
     };
 
-    typedef std::stack<Frame> FrameStack;
-    //! Stack for function frames
-    FrameStack m_Frames;
+    static const size_t FrameSlots = sizeof(Frame) / sizeof(data_t);
 
+    //! all objects the program allocates
+    Heap m_Heap;
+    bool m_ConcurrentMarking = false;
     StringTable m_Strings;
 
-    //! Input stream for read () operation
-    std::istream* istr;
+    //! shape of the empty object, the root of the tree of all shapes
+    std::unique_ptr<Shape> m_RootShape;
+    //! the object of GetG and SetG, in the old space so it never moves
+    SPObjectValue* m_Global = nullptr;
+    SPVector<InlineCache> m_InlineCaches;
+    InlineCacheStats m_InlineCacheStats;
+
+    const NumericKernels* m_Kernels = &GetNumericKernels();
+    //! workers of m_ThreadPool, a thread per core besides this one
+    size_t m_WorkerThreads = 0;
+    //! started by the first builtin with an array long enough to split
+    std::unique_ptr<ThreadPool> m_ThreadPool;
 
-    //! Output stream for print () opertion
-    std::ostream* ostr;
+    //! Input of read (), read from the input stream in blocks
+    InputBuffer m_Input;
+
+    //! Output of print (), written to the output stream in blocks
+    OutputBuffer m_Output;
 
     void push(reg_t reg);
     void popto(reg_t reg);
@@ -124,12 +411,49 @@ class Spasm
 
     void print(reg_t reg);
     void read(reg_t reg);
+    void read_line(reg_t a0);
+    void read_numbers(reg_t a0, reg_t a1);
 
     void plus(reg_t a0, reg_t a1, reg_t a2);
     void minus(reg_t a0, reg_t a1, reg_t a2);
     void multiply(reg_t a0, reg_t a1, reg_t a2);
     void divide(reg_t a0, reg_t a1, reg_t a2);
     void modulus(reg_t a0, reg_t a1, reg_t a2);
+    void concatenate(reg_t a0, reg_t a1, reg_t a2);
+    SPStringValue* flatten(reg_t reg);
+    bool equal_strings(reg_t a1, reg_t a2);
+
+    void new_object(reg_t a0);
+    void get_property(reg_t a0, data_t object, const Instruction&);
+    void set_property(data_t object, reg_t a1, const Instruction&);
+    InlineCache::Entry find_property(const SPObjectValue*,
+                                     const Instruction&,
+                                     bool add);
+    SPObjectValue* grow_slots(data_t object, uint32_t slot);
+
+    void new_array(reg_t a0);
+    void load_element(reg_t a0, reg_t a1, reg_t a2);
+    void store_element(reg_t a0, reg_t a1, reg_t a2);
+    void length(reg_t a0, reg_t a1);
+    data_t get_element(data_t array, data_t index);
+    void set_element(reg_t a0, reg_t a1, reg_t a2);
+    void put_element(reg_t a0, uint32_t index, reg_t a2);
+    void reshape_elements(ElementsKind kind, uint32_t capacity);
+
+    void builtin(reg_t a0, reg_t a1, int32_t id);
+    double reduce(int32_t op, reg_t a1, reg_t a2);
+    void sort(reg_t a1);
+    void map(reg_t a0, reg_t a1);
+    ThreadPool* thread_pool(uint32_t length);
+    void to_doubles(reg_t a0);
+    void put_value(reg_t a0, uint32_t index, data_t value);
+    void scale(reg_t a1);
+    void add_arrays(reg_t a1);
+    void fill(reg_t a1);
+    void copy_within(reg_t a1);
+
+    void quicken(Instruction& instruction);
+    void dequicken(Instruction& instruction);
 
     void gotrue(reg_t a0, reg_t a1);
     void gofalse(reg_t a0, reg_t a1);
@@ -154,10 +478,15 @@ class Spasm
     void set_local(reg_t reg, data_t data);
     data_t pop_data();
     void push_data(data_t);
-    reg_t read_reg(size_t size);
-    data_t read_number(size_t size);
-    int64_t read_integer(size_t size);
-    data_t read_string(size_t size);
+    void reserve_data(size_t count);
+    void intern_strings(const byte* bytecode);
+    void collect(size_t size);
+    void collect_young();
+    void mark_roots();
+    template <typename Visit>
+    void for_each_stack_value(Visit visit);
+    void start_marking();
+    void finish_marking();
 };
 
 }  // namespace SpasmImpl
@@ -0,0 +1,250 @@
+#include <algorithm>
+#include <csignal>
+#include <mutex>
+#include <vector>
+
+#include "stack.hpp"
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+namespace SpasmImpl
+{
+namespace
+{
+#if defined(_WIN32)
+const size_t PageSize = 4096;
+
+//! The stacks the guard page handler can grow
+std::mutex& stacks_mutex()
+{
+    static std::mutex s_Mutex;
+    return s_Mutex;
+}
+
+std::vector<DataStack*>& stacks()
+{
+    static std::vector<DataStack*> s_Stacks;
+    return s_Stacks;
+}
+
+/*!
+** Commits more of the stack when its PAGE_GUARD page is touched, or the
+** uncommitted pages after it when an access jumps over it. Runs before the
+** frame based handlers, so Spasm::dispatch_guarded only sees the faults on
+** the guard regions.
+*/
+LONG CALLBACK on_guard_page(EXCEPTION_POINTERS* exception)
+{
+    const auto record = exception->ExceptionRecord;
+    if (record->ExceptionCode != EXCEPTION_GUARD_PAGE &&
+        record->ExceptionCode != EXCEPTION_ACCESS_VIOLATION)
+    {
+        return EXCEPTION_CONTINUE_SEARCH;
+    }
+    const auto address =
+        reinterpret_cast<const void*>(record->ExceptionInformation[1]);
+    std::lock_guard<std::mutex> lock(stacks_mutex());
+    for (const auto stack : stacks())
+    {
+        if (stack->Commit(address))
+        {
+            return EXCEPTION_CONTINUE_EXECUTION;
+        }
+    }
+    return EXCEPTION_CONTINUE_SEARCH;
+}
+
+void install_guard_page_handler()
+{
+    static std::once_flag s_Installed;
+    std::call_once(s_Installed,
+                   [] { AddVectoredExceptionHandler(1, on_guard_page); });
+}
+#endif
+
+#if SPASM_STACK_GUARD_SIGNAL
+thread_local DataStack::FaultScope* t_Scope = nullptr;
+
+struct sigaction s_PreviousSegv;
+struct sigaction s_PreviousBus;
+
+void forward(const struct sigaction& previous,
+             int signal,
+             siginfo_t* info,
+             void* context)
+{
+    if (previous.sa_flags & SA_SIGINFO)
+    {
+        previous.sa_sigaction(signal, info, context);
+    }
+    else if (previous.sa_handler == SIG_DFL || previous.sa_handler == SIG_IGN)
+    {
+        // the faulting instruction is restarted and gets the default action
+        std::signal(signal, SIG_DFL);
+    }
+    else
+    {
+        previous.sa_handler(signal);
+    }
+}
+
+void on_fault(int signal, siginfo_t* info, void* context)
+{
+    for (auto scope = t_Scope; scope; scope = scope->Previous)
+    {
+        if (scope->Stack.IsGuard(info->si_addr))
+        {
+            siglongjmp(scope->Buffer, 1);
+        }
+    }
+    forward(signal == SIGBUS ? s_PreviousBus : s_PreviousSegv, signal, info,
+            context);
+}
+
+void install_fault_handler()
+{
+    static std::once_flag s_Installed;
+    std::call_once(s_Installed, [] {
+        struct sigaction action = {};
+        action.sa_sigaction = on_fault;
+        action.sa_flags = SA_SIGINFO | SA_NODEFER;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGSEGV, &action, &s_PreviousSegv);
+        sigaction(SIGBUS, &action, &s_PreviousBus);
+    });
+}
+#endif
+}  // namespace
+
+/*!
+** Reserves the stack.
+**
+** \param size	- usable size of the stack in bytes
+*/
+DataStack::DataStack(size_t size)
+{
+    m_ReservationSize = GuardSize + size + GuardSize;
+#if defined(_WIN32)
+    auto memory = static_cast<uint8_t*>(
+        VirtualAlloc(nullptr, m_ReservationSize, MEM_RESERVE, PAGE_NOACCESS));
+    if (!memory)
+    {
+        throw std::bad_alloc();
+    }
+    m_Committed = memory + GuardSize;
+    m_End = reinterpret_cast<data_t*>(memory + GuardSize + size);
+    if (!Commit(m_Committed))
+    {
+        VirtualFree(memory, 0, MEM_RELEASE);
+        throw std::bad_alloc();
+    }
+    install_guard_page_handler();
+    {
+        std::lock_guard<std::mutex> lock(stacks_mutex());
+        stacks().push_back(this);
+    }
+#else
+    void* reservation =
+        mmap(nullptr, m_ReservationSize, PROT_NONE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (reservation == MAP_FAILED)
+    {
+        throw std::bad_alloc();
+    }
+    auto memory = static_cast<uint8_t*>(reservation);
+    if (mprotect(memory + GuardSize, size, PROT_READ | PROT_WRITE) != 0)
+    {
+        munmap(memory, m_ReservationSize);
+        throw std::bad_alloc();
+    }
+#endif
+    m_Reservation = memory;
+    m_Begin = reinterpret_cast<data_t*>(memory + GuardSize);
+    m_End = reinterpret_cast<data_t*>(memory + GuardSize + size);
+}
+
+DataStack::~DataStack()
+{
+#if defined(_WIN32)
+    {
+        std::lock_guard<std::mutex> lock(stacks_mutex());
+        auto& all = stacks();
+        all.erase(std::find(all.begin(), all.end(), this));
+    }
+    VirtualFree(m_Reservation, 0, MEM_RELEASE);
+#else
+    munmap(m_Reservation, m_ReservationSize);
+#endif
+}
+
+void DataStack::Reset()
+{
+    const auto begin = reinterpret_cast<uint8_t*>(m_Begin);
+    const auto size = size_t(reinterpret_cast<uint8_t*>(m_End) - begin);
+#if defined(_WIN32)
+    std::lock_guard<std::mutex> lock(stacks_mutex());
+    VirtualFree(begin, size, MEM_DECOMMIT);
+    m_Committed = begin;
+    Commit(begin);
+#else
+    madvise(begin, size, MADV_DONTNEED);
+#endif
+}
+
+bool DataStack::IsGuard(const void* address) const
+{
+    const auto a = static_cast<const uint8_t*>(address);
+    const auto begin = reinterpret_cast<const uint8_t*>(m_Begin);
+    const auto end = reinterpret_cast<const uint8_t*>(m_End);
+    return (a >= m_Reservation && a < begin) ||
+           (a >= end && a < m_Reservation + m_ReservationSize);
+}
+
+#if defined(_WIN32)
+bool DataStack::Commit(const void* address)
+{
+    const auto a = static_cast<const uint8_t*>(address);
+    const auto end = reinterpret_cast<uint8_t*>(m_End);
+    if (a < m_Committed || a >= end)
+    {
+        return false;
+    }
+    const auto page = size_t(a - m_Committed) & ~(PageSize - 1);
+    const auto next =
+        m_Committed + std::min(page + CommitSize, size_t(end - m_Committed));
+    DWORD previous;
+    // the guard page keeps PAGE_GUARD if the access jumped over it
+    if (!VirtualAlloc(m_Committed, size_t(next - m_Committed), MEM_COMMIT,
+                      PAGE_READWRITE) ||
+        !VirtualProtect(m_Committed, PageSize, PAGE_READWRITE, &previous))
+    {
+        return false;
+    }
+    m_Committed = next;
+    if (next != end)
+    {
+        VirtualAlloc(next, PageSize, MEM_COMMIT, PAGE_READWRITE | PAGE_GUARD);
+    }
+    return true;
+}
+#endif
+
+#if SPASM_STACK_GUARD_SIGNAL
+DataStack::FaultScope::FaultScope(const DataStack& stack)
+    : Stack(stack), Previous(t_Scope)
+{
+    install_fault_handler();
+    t_Scope = this;
+}
+
+DataStack::FaultScope::~FaultScope()
+{
+    t_Scope = Previous;
+}
+#endif
+
+}  // namespace SpasmImpl
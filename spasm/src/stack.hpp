@@ -0,0 +1,107 @@
+#ifndef STACK_HPP
+#define STACK_HPP
+
+#include <exception>
+
+#include "types.hpp"
+
+#if defined(_WIN32)
+#define SPASM_STACK_GUARD_SEH 1
+#else
+#include <csetjmp>
+#define SPASM_STACK_GUARD_SIGNAL 1
+#endif
+
+namespace SpasmImpl
+{
+//! Data stack of the machine in its own virtual memory range
+/*!
+** The whole range is reserved up front and committed as the stack grows,
+** so a deep stack costs only what is used. On POSIX the OS commits the
+** pages on first touch. Windows does not, there the stack is committed
+** CommitSize at a time behind a PAGE_GUARD page and a vectored exception
+** handler commits more when the guard page or the pages after it are
+** touched.
+**
+** The range is surrounded by inaccessible guard regions - an overflow
+** faults instead of corrupting memory and Spasm::run reports it as
+** RunResult::Exception. Only accesses within GuardSize of either end are
+** caught, larger jumps over the guard are not.
+*/
+class DataStack
+{
+   public:
+    //! 8M values
+    static const size_t DefaultSize = size_t(64) << 20;
+    static const size_t GuardSize = size_t(1) << 20;
+    //! committed at a time on Windows
+    static const size_t CommitSize = size_t(64) << 10;
+
+    explicit DataStack(size_t size = DefaultSize);
+    ~DataStack();
+    DataStack(const DataStack&) = delete;
+    DataStack& operator=(const DataStack&) = delete;
+
+    data_t* begin() const { return m_Begin; }
+    data_t* end() const { return m_End; }
+
+    //! Releases the committed pages, the stack reads as zeroes afterwards
+    void Reset();
+
+    //! \return true if address is in one of the guard regions
+    bool IsGuard(const void* address) const;
+
+#if defined(_WIN32)
+    //! Commits the stack up to address and CommitSize after it
+    //! \return false if address is not in the uncommitted part of the stack
+    bool Commit(const void* address);
+#endif
+
+#if SPASM_STACK_GUARD_SIGNAL
+    //! Catches the faults on the guard regions of stack on this thread
+    /*!
+    ** While the scope is alive a fault on the guard regions jumps to
+    ** Buffer, which the owner of the scope has to set with sigsetjmp.
+    */
+    struct FaultScope
+    {
+        explicit FaultScope(const DataStack& stack);
+        ~FaultScope();
+        FaultScope(const FaultScope&) = delete;
+        FaultScope& operator=(const FaultScope&) = delete;
+
+        sigjmp_buf Buffer;
+        const DataStack& Stack;
+        FaultScope* Previous;
+    };
+#endif
+
+   private:
+    uint8_t* m_Reservation = nullptr;
+    size_t m_ReservationSize = 0;
+    data_t* m_Begin = nullptr;
+    data_t* m_End = nullptr;
+#if defined(_WIN32)
+    //! end of the committed pages, the PAGE_GUARD page starts there
+    uint8_t* m_Committed = nullptr;
+#endif
+};
+
+//! Overflow of the data stack where faulting on the guard is not safe
+/*!
+** A fault on the guard regions leaves the frames on the native stack
+** without running their destructors. The paths with locals to destroy check
+** for room with Spasm::reserve_data before they push and throw this
+** instead, Spasm::run reports it as RunResult::Exception as well.
+*/
+class DataStackOverflow : public std::exception
+{
+   public:
+    const char* what() const noexcept override
+    {
+        return "data stack overflow";
+    }
+};
+
+}  // namespace SpasmImpl
+#endif  // #ifndef STACK_HPP
@@ -1,43 +1,68 @@
 #pragma once
 
+#include <cstdint>
+#include <cstring>
 #include <string>
 
+#include "object.hpp"
+
 namespace SpasmImpl
 {
 typedef std::string SPString;
 
-class SPStringValue
+//! Immutable string in the Heap, the characters follow the object
+class SPStringValue : public HeapObject
 {
    public:
-    explicit SPStringValue(SPString s) : m_Value(std::move(s)) {}
+    explicit SPStringValue(size_t length) : m_Length(length)
+    {
+        Kind = HeapKind::String;
+    }
 
     SPStringValue(const SPStringValue&) = delete;
-    SPStringValue(SPStringValue&&) = default;
     SPStringValue& operator=(const SPStringValue&) = delete;
-    SPStringValue& operator=(SPStringValue&&) = default;
-
-    const SPString& GetValue() const { return m_Value; }
 
-    bool operator==(const SPStringValue& rhs) const
+    const char* GetData() const
     {
-        return m_Value == rhs.m_Value;
+        return reinterpret_cast<const char*>(this + 1);
     }
+    char* GetData() { return reinterpret_cast<char*>(this + 1); }
+    size_t GetLength() const { return m_Length; }
 
-    bool operator==(const SPString& rhs) const { return m_Value == rhs; }
+    //! \return bytes needed for a string with \a length characters
+    static size_t AllocationSize(size_t length)
+    {
+        return sizeof(SPStringValue) + length;
+    }
 
    private:
-    SPString m_Value;
+    size_t m_Length;
 };
-}  // namespace SpasmImpl
 
-namespace std
+//! Non-owning view of a string, used to look up strings without a copy
+struct SPStringKey
 {
-template <>
-struct hash<SpasmImpl::SPStringValue>
+    const char* Data;
+    size_t Length;
+
+    bool operator==(const SPStringKey& rhs) const
+    {
+        return Length == rhs.Length &&
+               std::memcmp(Data, rhs.Data, Length) == 0;
+    }
+};
+
+struct SPStringKeyHash
 {
-    size_t operator()(const SpasmImpl::SPStringValue& v) const
+    //! FNV-1a
+    size_t operator()(const SPStringKey& key) const
     {
-        return std::hash<SpasmImpl::SPString>{}(v.GetValue());
+        uint64_t hash = 14695981039346656037ull;
+        for (size_t i = 0; i < key.Length; ++i)
+        {
+            hash = (hash ^ uint8_t(key.Data[i])) * 1099511628211ull;
+        }
+        return size_t(hash);
     }
 };
-}  // namespace std
\ No newline at end of file
+}  // namespace SpasmImpl
@@ -0,0 +1,131 @@
+#include "threadpool.hpp"
+
+namespace SpasmImpl
+{
+ThreadPool::ThreadPool(size_t workers)
+{
+    for (size_t i = 0; i <= workers; ++i)
+    {
+        m_Queues.emplace_back(new Queue);
+    }
+    for (size_t i = 0; i < workers; ++i)
+    {
+        m_Workers.emplace_back([this, i] { worker(i); });
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_Stop = true;
+    }
+    m_Wake.notify_all();
+    for (auto& thread : m_Workers)
+    {
+        thread.join();
+    }
+}
+
+/*!
+** The tasks are dealt to the queues in contiguous runs, so every thread
+** starts with neighbouring tasks.
+*/
+void ThreadPool::ParallelFor(size_t count,
+                             const std::function<void(size_t)>& task)
+{
+    if (m_Workers.empty() || count < 2)
+    {
+        for (size_t i = 0; i < count; ++i)
+        {
+            task(i);
+        }
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_Task = &task;
+        m_Pending = count;
+        const auto queues = m_Queues.size();
+        for (size_t q = 0; q < queues; ++q)
+        {
+            std::lock_guard<std::mutex> queueLock(m_Queues[q]->Mutex);
+            for (size_t i = count * q / queues; i < count * (q + 1) / queues;
+                 ++i)
+            {
+                m_Queues[q]->Tasks.push_back(i);
+            }
+        }
+        ++m_Generation;
+    }
+    m_Wake.notify_all();
+
+    work(m_Workers.size());
+    std::unique_lock<std::mutex> lock(m_Mutex);
+    m_Done.wait(lock, [this] { return m_Pending == 0; });
+    m_Task = nullptr;
+}
+
+bool ThreadPool::take(size_t self, size_t& index)
+{
+    {
+        auto& own = *m_Queues[self];
+        std::lock_guard<std::mutex> lock(own.Mutex);
+        if (!own.Tasks.empty())
+        {
+            index = own.Tasks.back();
+            own.Tasks.pop_back();
+            return true;
+        }
+    }
+    for (size_t i = 1; i < m_Queues.size(); ++i)
+    {
+        auto& victim = *m_Queues[(self + i) % m_Queues.size()];
+        std::lock_guard<std::mutex> lock(victim.Mutex);
+        if (!victim.Tasks.empty())
+        {
+            index = victim.Tasks.front();
+            victim.Tasks.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
+
+void ThreadPool::work(size_t self)
+{
+    size_t index;
+    while (take(self, index))
+    {
+        // the queues are empty between two ParallelFor, so a task taken
+        // belongs to the running one
+        (*m_Task)(index);
+        if (--m_Pending == 0)
+        {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            m_Done.notify_all();
+        }
+    }
+}
+
+void ThreadPool::worker(size_t self)
+{
+    uint64_t generation = 0;
+    for (;;)
+    {
+        {
+            std::unique_lock<std::mutex> lock(m_Mutex);
+            m_Wake.wait(lock, [&] {
+                return m_Stop || m_Generation != generation;
+            });
+            if (m_Stop)
+            {
+                return;
+            }
+            generation = m_Generation;
+        }
+        work(self);
+    }
+}
+
+}  // namespace SpasmImpl
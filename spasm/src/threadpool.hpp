@@ -0,0 +1,69 @@
+#ifndef THREADPOOL_HPP
+#define THREADPOOL_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace SpasmImpl
+{
+//! Work-stealing pool of threads for splitting loops into tasks
+/*!
+** Every thread has its own queue of tasks. It takes its tasks from the back
+** of its queue and, when that is empty, steals from the front of the
+** others, so a thread that finishes early helps the slow ones without a
+** shared queue everyone contends on.
+**
+** The thread calling ParallelFor works on the tasks too, a pool without
+** workers runs them on it in order.
+*/
+class ThreadPool
+{
+   public:
+    explicit ThreadPool(size_t workers);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    size_t GetWorkerCount() const { return m_Workers.size(); }
+
+    //! Runs task(0) to task(count - 1) and returns when all of them are
+    //! finished, the tasks may run in any order and at the same time
+    void ParallelFor(size_t count, const std::function<void(size_t)>& task);
+
+   private:
+    struct Queue
+    {
+        std::mutex Mutex;
+        std::deque<size_t> Tasks;
+    };
+
+    //! Takes a task for the thread \a self, stealing if its queue is empty
+    bool take(size_t self, size_t& index);
+    //! Runs the tasks it can take, \return when there are none left
+    void work(size_t self);
+    void worker(size_t self);
+
+    std::vector<std::thread> m_Workers;
+    //! a queue per worker and the last one for the caller of ParallelFor
+    std::vector<std::unique_ptr<Queue>> m_Queues;
+
+    std::mutex m_Mutex;
+    std::condition_variable m_Wake;
+    std::condition_variable m_Done;
+    //! the task of the running ParallelFor
+    const std::function<void(size_t)>* m_Task = nullptr;
+    std::atomic<size_t> m_Pending{0};
+    //! incremented by every ParallelFor to wake the workers
+    uint64_t m_Generation = 0;
+    bool m_Stop = false;
+};
+
+}  // namespace SpasmImpl
+#endif  // #ifndef THREADPOOL_HPP
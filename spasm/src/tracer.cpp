@@ -0,0 +1,617 @@
+#include "tracer.hpp"
+
+namespace SpasmImpl
+{
+namespace
+{
+using namespace X64;
+
+//! Taken backward branches before the loop is recorded
+const uint32_t HotLoop = 64;
+//! Longest trace in instructions
+const size_t MaxTraceLength = 256;
+//! Distinct locals of a trace, they live in xmm2 - xmm15
+const size_t MaxSlots = 14;
+
+const Register FrameRegister = RDI;
+const Register FalseRegister = RDX;
+
+enum class SlotType : uint8_t
+{
+    Unknown,
+    //! a Number or an Integer, the trace keeps both as doubles
+    Double,
+    Boolean,
+};
+
+SlotType type_of(data_t value)
+{
+    if (value.is_number())
+    {
+        return SlotType::Double;
+    }
+    return value.get_type() == ::Spasm::ValueType::Boolean ? SlotType::Boolean
+                                                          : SlotType::Unknown;
+}
+
+struct TraceOp
+{
+    enum Kind : uint8_t
+    {
+        Constant,
+        Arithmetic,
+        Compare,
+        //! Leaves the trace unless the truthiness of Dst is OnTrue
+        Guard,
+    };
+    Kind Is;
+    //! the operation of Arithmetic and Compare
+    OpCodes Op;
+    bool OnTrue;
+    //! materialized once before the loop instead of every iteration
+    bool Hoisted;
+    //! indices in the slots of the trace
+    uint8_t Dst, Lhs, Rhs;
+    data_t Value;
+    //! where the interpreter continues if the guard fails
+    PC_t Exit;
+    //! type of the local tested by Guard
+    SlotType Tested;
+};
+
+//! A local of the traced frame, kept in a register for the whole trace
+struct Slot
+{
+    reg_t Reg;
+    int32_t Displacement;
+    //! type checked on entry for live-in slots
+    SlotType Entry;
+    SlotType Current;
+    //! read before written in the trace
+    bool LiveIn;
+    size_t Writes;
+};
+
+//! Builds the trace from the instructions as the interpreter executes them
+class Recorder
+{
+   public:
+    explicit Recorder(const data_t* fp) : m_FP(fp) {}
+
+    //! Records the instruction before it is executed
+    bool instruction(const Instruction& i)
+    {
+        // a quickened instruction is traced as its generic one, the trace
+        // checks the types on its own
+        const auto op = GenericOpCode(i.OpCode);
+        switch (op)
+        {
+            case OpCodes::Jump:
+                return true;
+            case OpCodes::JumpT:
+            case OpCodes::JumpF:
+            {
+                uint8_t s;
+                return read(i.A0, true, s);
+            }
+            case OpCodes::Const:
+                return constant(i.A0, i.Value);
+            case OpCodes::Add:
+            case OpCodes::Sub:
+            case OpCodes::Mul:
+            case OpCodes::Div:
+            case OpCodes::Less:
+            case OpCodes::LessEq:
+            case OpCodes::Greater:
+            case OpCodes::GreaterEq:
+            case OpCodes::Equal:
+            case OpCodes::NotEqual:
+                return binary(op, i.A0, i.A1, i.A2);
+            case OpCodes::LessJumpT:
+            case OpCodes::LessJumpF:
+                return binary(OpCodes::Less, i.A0, i.A1, i.A2);
+            case OpCodes::LessEqJumpT:
+            case OpCodes::LessEqJumpF:
+                return binary(OpCodes::LessEq, i.A0, i.A1, i.A2);
+            case OpCodes::EqualJumpT:
+            case OpCodes::EqualJumpF:
+                return binary(OpCodes::Equal, i.A0, i.A1, i.A2);
+            case OpCodes::NotEqualJumpT:
+            case OpCodes::NotEqualJumpF:
+                return binary(OpCodes::NotEqual, i.A0, i.A1, i.A2);
+            case OpCodes::AddConst:
+                return constant(i.A3, i.Value) &&
+                       binary(OpCodes::Add, i.A0, i.A1, i.A2);
+            case OpCodes::SubConst:
+                return constant(i.A3, i.Value) &&
+                       binary(OpCodes::Sub, i.A0, i.A1, i.A2);
+            case OpCodes::IncrementConstAndCompare:
+                return constant(i.A1, i.Value) &&
+                       binary(OpCodes::Add, i.A0, i.A0, i.A1) &&
+                       binary(OpCodes::Less, i.A2, i.A0, i.A3);
+            case OpCodes::IncrementAndCompare:
+                return binary(OpCodes::Add, i.A0, i.A0, i.A1) &&
+                       binary(OpCodes::Less, i.A2, i.A0, i.A3);
+            default:
+                return false;
+        }
+    }
+
+    //! Records the direction taken by the executed branch at pc
+    void branch(const Instruction& i, PC_t pc)
+    {
+        reg_t condition;
+        PC_t target;
+        bool jumpOnTrue = true;
+        switch (i.OpCode)
+        {
+            case OpCodes::JumpF:
+                jumpOnTrue = false;
+            // fall through
+            case OpCodes::JumpT:
+                condition = i.A0;
+                target = PC_t(i.A1);
+                break;
+            case OpCodes::LessJumpF:
+            case OpCodes::LessEqJumpF:
+            case OpCodes::EqualJumpF:
+            case OpCodes::NotEqualJumpF:
+                jumpOnTrue = false;
+            // fall through
+            case OpCodes::LessJumpT:
+            case OpCodes::LessEqJumpT:
+            case OpCodes::EqualJumpT:
+            case OpCodes::NotEqualJumpT:
+                condition = i.A0;
+                target = PC_t(i.A3);
+                break;
+            case OpCodes::IncrementAndCompare:
+            case OpCodes::IncrementConstAndCompare:
+                condition = i.A2;
+                target = PC_t(i.A4);
+                break;
+            default:
+                return;
+        }
+        if (target == pc + 1)
+        {
+            return;
+        }
+        const bool truthy = bool(m_FP[condition]);
+        const bool taken = truthy == jumpOnTrue;
+        TraceOp op = {};
+        op.Is = TraceOp::Guard;
+        op.Dst = find(condition);
+        op.Tested = m_Slots[op.Dst].Current;
+        op.OnTrue = truthy;
+        op.Exit = taken ? pc + 1 : target;
+        m_Ops.push_back(op);
+    }
+
+    //! Checks the recorded trace can loop and optimizes it
+    bool finish()
+    {
+        for (const auto& slot : m_Slots)
+        {
+            // the types on the back edge must match the guarded ones
+            if (slot.LiveIn && slot.Current != slot.Entry)
+            {
+                return false;
+            }
+        }
+        // A constant that is the only write of a local can be assigned once
+        // before the loop. Only before the first guard, so the local has the
+        // value at every exit.
+        for (auto& op : m_Ops)
+        {
+            if (op.Is == TraceOp::Guard)
+            {
+                break;
+            }
+            const auto& slot = m_Slots[op.Dst];
+            op.Hoisted = op.Is == TraceOp::Constant && !slot.LiveIn &&
+                         slot.Writes == 1;
+        }
+        return true;
+    }
+
+    const SPVector<TraceOp>& ops() const { return m_Ops; }
+    const SPVector<Slot>& slots() const { return m_Slots; }
+
+   private:
+    //! \return index of the slot of reg or MaxSlots if it can't be traced
+    uint8_t find(reg_t reg)
+    {
+        for (size_t i = 0; i < m_Slots.size(); ++i)
+        {
+            if (m_Slots[i].Reg == reg)
+            {
+                return uint8_t(i);
+            }
+        }
+        Slot slot = {};
+        if (m_Slots.size() == MaxSlots || !X64::slot(reg, slot.Displacement))
+        {
+            return uint8_t(MaxSlots);
+        }
+        slot.Reg = reg;
+        m_Slots.push_back(slot);
+        return uint8_t(m_Slots.size() - 1);
+    }
+
+    bool read(reg_t reg, bool allowBoolean, uint8_t& index)
+    {
+        index = find(reg);
+        if (index == MaxSlots)
+        {
+            return false;
+        }
+        auto& slot = m_Slots[index];
+        if (slot.Current == SlotType::Unknown && slot.Writes == 0)
+        {
+            slot.LiveIn = true;
+            slot.Entry = slot.Current = type_of(m_FP[reg]);
+        }
+        return slot.Current == SlotType::Double ||
+               (allowBoolean && slot.Current == SlotType::Boolean);
+    }
+
+    bool write(reg_t reg, SlotType type, uint8_t& index)
+    {
+        index = find(reg);
+        if (index == MaxSlots)
+        {
+            return false;
+        }
+        auto& slot = m_Slots[index];
+        slot.Current = type;
+        ++slot.Writes;
+        return true;
+    }
+
+    bool constant(reg_t reg, data_t value)
+    {
+        TraceOp op = {};
+        op.Is = TraceOp::Constant;
+        if (type_of(value) != SlotType::Double ||
+            !write(reg, SlotType::Double, op.Dst))
+        {
+            return false;
+        }
+        op.Value = data_t(value.get_number());
+        m_Ops.push_back(op);
+        return true;
+    }
+
+    bool binary(OpCodes code, reg_t a0, reg_t a1, reg_t a2)
+    {
+        TraceOp op = {};
+        op.Op = code;
+        const bool arithmetic = code == OpCodes::Add || code == OpCodes::Sub ||
+                                code == OpCodes::Mul || code == OpCodes::Div;
+        op.Is = arithmetic ? TraceOp::Arithmetic : TraceOp::Compare;
+        if (!read(a1, false, op.Lhs) || !read(a2, false, op.Rhs) ||
+            !write(a0, arithmetic ? SlotType::Double : SlotType::Boolean,
+                   op.Dst))
+        {
+            return false;
+        }
+        m_Ops.push_back(op);
+        return true;
+    }
+
+    const data_t* m_FP;
+    SPVector<TraceOp> m_Ops;
+    SPVector<Slot> m_Slots;
+};
+
+int xmm(uint8_t slot)
+{
+    return 2 + slot;
+}
+
+//! Stores the slots written by the trace and returns pc to the interpreter
+void exit_stub(Emitter& x, const SPVector<Slot>& slots, PC_t pc)
+{
+    for (size_t i = 0; i < slots.size(); ++i)
+    {
+        if (slots[i].Writes)
+        {
+            x.sse(MoveStore, xmm(uint8_t(i)), FrameRegister,
+                  slots[i].Displacement);
+        }
+    }
+    x.move32(RAX, uint32_t(pc));
+    x.ret();
+}
+
+//! Jumps to label unless rax is a Boolean
+void boolean_guard(Emitter& x, int32_t label)
+{
+    x.move(RCX, RAX);
+    x.shift_right(RCX, 48);
+    x.compare32(RCX, uint32_t(FalseBits >> 48));
+    x.jump(NotZero, label);
+}
+
+//! Moves the number in rax to xmm as a double, jumps to label if it is
+//! neither a double nor an Integer
+void load_number(Emitter& x, int xmm, SPVector<size_t>& labels, int32_t label)
+{
+    const auto integer = int32_t(labels.size());
+    const auto done = integer + 1;
+    labels.resize(labels.size() + 2);
+    x.move(RCX, RAX);
+    x.shift_right(RCX, 48);
+    x.compare32(RCX, 0xfff8);
+    x.jump(Above, integer);
+    x.move_to_xmm(xmm, RAX);
+    x.jump(done);
+    labels[size_t(integer)] = x.size();
+    x.compare32(RCX, uint32_t(IntegerBits >> 48));
+    x.jump(NotZero, label);
+    x.convert_to_xmm(xmm, RAX);
+    labels[size_t(done)] = x.size();
+}
+
+void compare(Emitter& x, OpCodes op, int lhs, int rhs)
+{
+    switch (op)
+    {
+        case OpCodes::Less:
+        case OpCodes::LessEq:
+            // lhs < rhs as rhs > lhs, unordered operands set CF
+            x.sse(UnorderedCompare, rhs, lhs);
+            x.set(op == OpCodes::Less ? Above : AboveEqual, RAX);
+            break;
+        case OpCodes::Greater:
+        case OpCodes::GreaterEq:
+            x.sse(UnorderedCompare, lhs, rhs);
+            x.set(op == OpCodes::Greater ? Above : AboveEqual, RAX);
+            break;
+        case OpCodes::Equal:
+            x.sse(UnorderedCompare, lhs, rhs);
+            x.set(Zero, RAX);
+            x.set(NoParity, RCX);
+            x.emit(0x20);  // and al, cl
+            x.emit(0xc8);
+            break;
+        default:
+            x.sse(UnorderedCompare, lhs, rhs);
+            x.set(NotZero, RAX);
+            x.set(Parity, RCX);
+            x.emit(0x08);  // or al, cl
+            x.emit(0xc8);
+            break;
+    }
+}
+
+SSE arithmetic(OpCodes op)
+{
+    switch (op)
+    {
+        case OpCodes::Add:
+            return AddSD;
+        case OpCodes::Sub:
+            return SubSD;
+        case OpCodes::Mul:
+            return MulSD;
+        default:
+            return DivSD;
+    }
+}
+}  // namespace
+
+struct Tracer::Trace
+{
+    typedef int64_t (*Entry)(data_t* fp);
+
+    ExecutableMemory Code;
+    Entry Run = nullptr;
+};
+
+Tracer::Tracer(Spasm& vm)
+    : m_VM(vm),
+      m_Counters(vm.m_Code.size()),
+      m_Traces(vm.m_Code.size()),
+      m_Blacklist(vm.m_Code.size())
+{
+}
+
+Tracer::~Tracer() {}
+
+void Tracer::OnBackEdge(PC_t branch)
+{
+    const auto header = m_VM.m_PC;
+    if (m_Traces[header])
+    {
+        run(*m_Traces[header]);
+        return;
+    }
+    if (m_Blacklist[header] || ++m_Counters[branch] < HotLoop)
+    {
+        return;
+    }
+    m_Traces[header] = record(header);
+    if (!m_Traces[header])
+    {
+        m_Blacklist[header] = true;
+        return;
+    }
+    if (m_VM.m_PC == header)
+    {
+        run(*m_Traces[header]);
+    }
+}
+
+void Tracer::run(const Trace& trace)
+{
+    m_VM.m_PC = PC_t(trace.Run(m_VM.m_FP));
+}
+
+/*!
+** Executes one iteration of the loop at \a header in the interpreter and
+** compiles it.
+**
+** The trace keeps every local it uses in an xmm register - the loads are
+** done once on entry and the stores are sunk into the side exits. The
+** types of the live-in locals are checked once on entry instead of at
+** every use, the operations of the trace preserve them. Integers are
+** converted to doubles on entry and leave the trace as doubles. Constants
+** that are the only assignment to a local are hoisted out of the loop.
+**
+** \return the compiled trace or nullptr if the loop can't be traced. The
+** machine state is valid in both cases, the executed instructions are not
+** repeated.
+*/
+std::unique_ptr<Tracer::Trace> Tracer::record(PC_t header)
+{
+#if SPASM_JIT
+    Recorder recorder(m_VM.m_FP);
+    bool closed = false;
+    for (size_t n = 0; n < MaxTraceLength && !closed; ++n)
+    {
+        const auto pc = m_VM.m_PC;
+        const auto& instruction = m_VM.m_Code[pc];
+        if (!recorder.instruction(instruction) ||
+            m_VM.step() != Spasm::RunResult::Success)
+        {
+            return nullptr;
+        }
+        recorder.branch(instruction, pc);
+        closed = m_VM.m_PC == header;
+    }
+    if (!closed || !recorder.finish())
+    {
+        return nullptr;
+    }
+
+    const auto& slots = recorder.slots();
+    const auto& ops = recorder.ops();
+    Emitter x;
+    // labels: the loop, the entry guards, then the guard of every op
+    const int32_t loop = 0;
+    const int32_t entryExit = 1;
+    SPVector<size_t> labels(2 + ops.size());
+
+    // int64_t trace(data_t* fp) - returns the pc to continue at
+    x.move(FalseRegister, FalseBits);
+    for (size_t i = 0; i < slots.size(); ++i)
+    {
+        const auto& slot = slots[i];
+        x.load(RAX, FrameRegister, slot.Displacement);
+        if (slot.LiveIn && slot.Entry == SlotType::Double)
+        {
+            load_number(x, xmm(uint8_t(i)), labels, entryExit);
+            continue;
+        }
+        if (slot.LiveIn)
+        {
+            boolean_guard(x, entryExit);
+        }
+        x.move_to_xmm(xmm(uint8_t(i)), RAX);
+    }
+    for (const auto& op : ops)
+    {
+        if (op.Hoisted)
+        {
+            x.move(RAX, uint64_t(op.Value.m_value.as_int64));
+            x.move_to_xmm(xmm(op.Dst), RAX);
+        }
+    }
+
+    labels[loop] = x.size();
+    bool resultInAl = false;
+    for (size_t i = 0; i < ops.size(); ++i)
+    {
+        const auto& op = ops[i];
+        switch (op.Is)
+        {
+            case TraceOp::Constant:
+                if (!op.Hoisted)
+                {
+                    x.move(RAX, uint64_t(op.Value.m_value.as_int64));
+                    x.move_to_xmm(xmm(op.Dst), RAX);
+                }
+                resultInAl = false;
+                break;
+            case TraceOp::Arithmetic:
+                if (op.Dst == op.Lhs)
+                {
+                    x.sse(arithmetic(op.Op), xmm(op.Dst), xmm(op.Rhs));
+                }
+                else
+                {
+                    x.sse(MoveLoad, 0, xmm(op.Lhs));
+                    x.sse(arithmetic(op.Op), 0, xmm(op.Rhs));
+                    x.sse(MoveLoad, xmm(op.Dst), 0);
+                }
+                resultInAl = false;
+                break;
+            case TraceOp::Compare:
+                compare(x, op.Op, xmm(op.Lhs), xmm(op.Rhs));
+                x.emit(0x0f);  // movzx eax, al
+                x.emit(0xb6);
+                x.emit(0xc0);
+                x.emit(0x48);  // or rax, rdx
+                x.emit(0x09);
+                x.emit(0xd0);
+                x.move_to_xmm(xmm(op.Dst), RAX);
+                resultInAl = true;
+                break;
+            case TraceOp::Guard:
+            {
+                const bool follows = resultInAl && i > 0 &&
+                                     ops[i - 1].Is == TraceOp::Compare &&
+                                     ops[i - 1].Dst == op.Dst;
+                if (!follows)
+                {
+                    x.move_from_xmm(RAX, xmm(op.Dst));
+                }
+                if (follows || op.Tested == SlotType::Boolean)
+                {
+                    x.emit(0xa8);  // test al, 1
+                    x.emit(0x01);
+                }
+                else
+                {
+                    x.emit(0x48);  // test rax, rax
+                    x.emit(0x85);
+                    x.emit(0xc0);
+                }
+                x.jump(op.OnTrue ? Zero : NotZero, int32_t(2 + i));
+                resultInAl = false;
+                break;
+            }
+        }
+    }
+    x.jump(loop);
+
+    labels[entryExit] = x.size();
+    x.move32(RAX, uint32_t(header));
+    x.ret();
+    for (size_t i = 0; i < ops.size(); ++i)
+    {
+        if (ops[i].Is == TraceOp::Guard)
+        {
+            labels[2 + i] = x.size();
+            exit_stub(x, slots, ops[i].Exit);
+        }
+    }
+    x.link(labels);
+
+    std::unique_ptr<Trace> trace(new Trace);
+    if (!trace->Code.Assign(x))
+    {
+        return nullptr;
+    }
+    trace->Run = reinterpret_cast<Trace::Entry>(
+        const_cast<uint8_t*>(trace->Code.get()));
+    return trace;
+#else
+    (void)header;
+    return nullptr;
+#endif
+}
+
+}  // namespace SpasmImpl
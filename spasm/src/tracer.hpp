@@ -0,0 +1,48 @@
+#ifndef TRACER_HPP
+#define TRACER_HPP
+
+#include "spasm_impl.hpp"
+#include "x64.hpp"
+
+namespace SpasmImpl
+{
+//! Tracing compiler for hot numeric loops
+/*!
+** The interpreter reports every taken backward branch. When one of them
+** gets hot, the next iteration of its loop is executed instruction by
+** instruction and recorded as a linear trace. The trace is optimized and
+** compiled to native code that keeps iterating while the recorded path is
+** taken and side-exits back to the interpreter as soon as it is not.
+**
+** Unlike Jit, which translates the whole program, only loops of numbers
+** and comparisons are compiled, everything else stays in the interpreter.
+*/
+class Tracer
+{
+   public:
+    explicit Tracer(Spasm& vm);
+    ~Tracer();
+    Tracer(const Tracer&) = delete;
+    Tracer& operator=(const Tracer&) = delete;
+
+    //! Called after the branch at \a branch jumped back to the program counter
+    void OnBackEdge(PC_t branch);
+
+   private:
+    struct Trace;
+
+    std::unique_ptr<Trace> record(PC_t header);
+    void run(const Trace& trace);
+
+    Spasm& m_VM;
+
+    //! taken count of every backward branch
+    SPVector<uint32_t> m_Counters;
+    //! compiled trace for every loop header
+    SPVector<std::unique_ptr<Trace>> m_Traces;
+    //! loop headers whose traces could not be recorded or compiled
+    SPVector<bool> m_Blacklist;
+};
+
+}  // namespace SpasmImpl
+#endif  // #ifndef TRACER_HPP
@@ -2,9 +2,14 @@
 #define TYPES_HPP
 
 #include <cstdlib>
+#include <new>
 #include <stack>
 #include <vector>
 
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
 #include "value.hpp"
 
 namespace SpasmImpl
@@ -19,6 +24,59 @@ typedef void (Spasm::*Operation)();
 template <typename T>
 using SPVector = std::vector<T>;
 
+//! Allocator honouring alignof(T), before C++17 std::allocator does not
+//! guarantee more than the alignment of std::max_align_t
+template <typename T>
+struct AlignedAllocator
+{
+    typedef T value_type;
+
+    AlignedAllocator() = default;
+    template <typename U>
+    AlignedAllocator(const AlignedAllocator<U>&)
+    {
+    }
+
+    T* allocate(size_t n)
+    {
+        void* p = nullptr;
+#ifdef _WIN32
+        p = _aligned_malloc(n * sizeof(T), alignof(T));
+#else
+        if (posix_memalign(&p, alignof(T), n * sizeof(T)) != 0)
+        {
+            p = nullptr;
+        }
+#endif
+        if (!p)
+        {
+            throw std::bad_alloc();
+        }
+        return static_cast<T*>(p);
+    }
+
+    void deallocate(T* p, size_t)
+    {
+#ifdef _WIN32
+        _aligned_free(p);
+#else
+        free(p);
+#endif
+    }
+};
+
+template <typename T, typename U>
+bool operator==(const AlignedAllocator<T>&, const AlignedAllocator<U>&)
+{
+    return true;
+}
+
+template <typename T, typename U>
+bool operator!=(const AlignedAllocator<T>&, const AlignedAllocator<U>&)
+{
+    return false;
+}
+
 typedef long long int reg_t;
 }  // namespace SpasmImpl
 #endif  // ----- #ifndef TYPES_HPP
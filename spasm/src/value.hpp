@@ -1,6 +1,9 @@
 #pragma once
 
 #include <cassert>
+#include <cmath>
+#include <iostream>
+#include <limits>
 #include "string.hpp"
 
 namespace Spasm
@@ -8,16 +11,17 @@ namespace Spasm
 enum class ValueType
 {
     Number,
+    //! a Number that is an int32, produced where the result is integral
+    Integer,
     Null,
     Undefined,
     Boolean,
     String,
     Array,
     Object,
-    Function,
 };
 
-static_assert(int(ValueType::Function) < 8, "Too many types");
+static_assert(int(ValueType::Object) < 8, "Too many types");
 
 struct Value
 {
@@ -25,7 +29,15 @@ struct Value
 
     explicit Value(double v) { m_value.as_double = v; }
 
-    explicit Value(bool v) : Value(ValueType::Boolean, (uint64_t)v) {}
+    explicit Value(bool v) { m_value.as_int64 = BooleanBits | uint64_t(v); }
+
+    explicit Value(int32_t v) { m_value.as_int64 = IntegerBits | uint32_t(v); }
+
+    //! \return an Integer if \a v fits in 32 bits, a double otherwise
+    static Value from_int64(int64_t v)
+    {
+        return int64_t(int32_t(v)) == v ? Value(int32_t(v)) : Value(double(v));
+    }
 
     Value(ValueType tag, uint64_t payload)
     {
@@ -38,6 +50,13 @@ struct Value
 
     Value(ValueType tag, void* pointer) : Value(tag, (uint64_t)pointer) {}
 
+    //! bits of the Integer 0, the int32 is the low half of the payload
+    static const uint64_t IntegerBits =
+        (uint64_t(0xFFF8 | int(ValueType::Integer))) << 48;
+    //! bits of false
+    static const uint64_t BooleanBits =
+        (uint64_t(0xFFF8 | int(ValueType::Boolean))) << 48;
+
     struct NanPointer
     {
         uint64_t pointer : 48;
@@ -61,12 +80,42 @@ struct Value
 
     bool is_double() const { return m_value.to_check.check <= 0xFFF8; }
 
+    bool is_integer() const
+    {
+        return (m_value.as_int64 >> 32) == (IntegerBits >> 32);
+    }
+
+    bool is_number() const { return is_double() || is_integer(); }
+
+    bool is_string() const
+    {
+        return (m_value.as_int64 >> 48) == (0xFFF8 | int(ValueType::String));
+    }
+
     double get_double() const
     {
         assert(is_double());
         return m_value.as_double;
     }
 
+    int32_t get_integer() const
+    {
+        assert(is_integer());
+        return int32_t(uint32_t(m_value.as_int64));
+    }
+
+    //! \return the Number or the Integer as a double, NaN for the other
+    //! types, so arithmetic and comparisons on them don't need a trap
+    double get_number() const
+    {
+        if (is_integer())
+        {
+            return double(get_integer());
+        }
+        return is_double() ? get_double()
+                           : std::numeric_limits<double>::quiet_NaN();
+    }
+
     ValueType get_type() const
     {
         return is_double() ? ValueType::Number
@@ -87,8 +136,12 @@ struct Value
     explicit operator bool() const
     {
         // NaN will be true. Assume that is ok.
-        return (get_type() != ValueType::Boolean && m_value.as_int64 != 0) ||
-               get_boolean();
+        const auto top = m_value.as_int64 >> 48;
+        if (top == BooleanBits >> 48 || top == IntegerBits >> 48)
+        {
+            return m_value.as_pointer.pointer != 0;
+        }
+        return m_value.as_int64 != 0;
     }
 };
 
@@ -103,13 +156,18 @@ inline std::ostream& operator<<(std::ostream& output, const Value& value)
     {
         case ValueType::Number:
             return output << value.m_value.as_double;
+        case ValueType::Integer:
+            // formatted as the double it stands for
+            return output << double(value.get_integer());
         case ValueType::Boolean:
             return output << bool(value);
         case ValueType::String:
         {
             const auto s = static_cast<const SpasmImpl::SPStringValue*>(
                 value.get_pointer());
-            return output << s->GetValue();
+            assert(s->Kind == SpasmImpl::HeapKind::String &&
+                   "Ropes are flattened before they are printed.");
+            return output.write(s->GetData(), s->GetLength());
         }
         default:
             break;
@@ -117,59 +175,93 @@ inline std::ostream& operator<<(std::ostream& output, const Value& value)
     return output;
 }
 
-inline Value operator+(const Value& lhs, const Value& rhs)
-{
-    return Value(lhs.get_double() + rhs.get_double());
-}
+#if defined(_MSC_VER)
+#define SPASM_LIKELY(condition) (condition)
+#else
+#define SPASM_LIKELY(condition) __builtin_expect(!!(condition), 1)
+#endif
 
-inline Value operator-(const Value& lhs, const Value& rhs)
+//! \return true if both \a lhs and \a rhs are Integers, in one branch
+inline bool both_integers(const Value& lhs, const Value& rhs)
 {
-    return Value(lhs.get_double() - rhs.get_double());
+    return (((lhs.m_value.as_int64 ^ Value::IntegerBits) |
+             (rhs.m_value.as_int64 ^ Value::IntegerBits)) >>
+            32) == 0;
 }
 
-inline Value operator*(const Value& lhs, const Value& rhs)
-{
-    return Value(lhs.get_double() * rhs.get_double());
-}
+// Two Integers take the integer path, other operands and integer overflows
+// compute in doubles.
 
-inline Value operator/(const Value& lhs, const Value& rhs)
-{
-    return Value(lhs.get_double() / rhs.get_double());
-}
+#define SPASM_ARITHMETIC(op)                                              \
+    inline Value operator op(const Value& lhs, const Value& rhs)          \
+    {                                                                     \
+        if (SPASM_LIKELY(both_integers(lhs, rhs)))                        \
+        {                                                                 \
+            const auto result =                                           \
+                int64_t(lhs.get_integer()) op int64_t(rhs.get_integer()); \
+            if (int64_t(int32_t(result)) == result)                       \
+            {                                                             \
+                return Value(int32_t(result));                            \
+            }                                                             \
+        }                                                                 \
+        return Value(lhs.get_number() op rhs.get_number());               \
+    }
 
-inline Value operator%(const Value& lhs, const Value& rhs)
-{
-    return Value(double(int64_t(lhs.get_double()) % int64_t(rhs.get_double())));
-}
+SPASM_ARITHMETIC(+)
+SPASM_ARITHMETIC(-)
 
-inline Value operator<(const Value& lhs, const Value& rhs)
-{
-    return Value(lhs.get_double() < rhs.get_double());
-}
+#undef SPASM_ARITHMETIC
 
-inline Value operator>(const Value& lhs, const Value& rhs)
+inline Value operator*(const Value& lhs, const Value& rhs)
 {
-    return Value(lhs.get_double() > rhs.get_double());
+    if (SPASM_LIKELY(both_integers(lhs, rhs)))
+    {
+        const auto product = int64_t(lhs.get_integer()) * rhs.get_integer();
+        // a zero product of a negative operand is -0, only a double has it
+        if (int64_t(int32_t(product)) == product && product != 0)
+        {
+            return Value(int32_t(product));
+        }
+    }
+    return Value(lhs.get_number() * rhs.get_number());
 }
 
-inline Value operator<=(const Value& lhs, const Value& rhs)
+inline Value operator/(const Value& lhs, const Value& rhs)
 {
-    return Value(lhs.get_double() <= rhs.get_double());
+    return Value(lhs.get_number() / rhs.get_number());
 }
 
-inline Value operator>=(const Value& lhs, const Value& rhs)
+inline Value operator%(const Value& lhs, const Value& rhs)
 {
-    return Value(lhs.get_double() >= rhs.get_double());
+    // INT32_MIN % -1 overflows in 32 bits, x % -1 is 0 anyway
+    if (SPASM_LIKELY(both_integers(lhs, rhs)) &&
+        uint32_t(rhs.get_integer()) + 1 > 1)
+    {
+        return Value(lhs.get_integer() % rhs.get_integer());
+    }
+    // the remainder of the truncated operands, as the int64_t one, but NaN
+    // for NaN operands and a zero divisor
+    return Value(std::fmod(std::trunc(lhs.get_number()),
+                           std::trunc(rhs.get_number())));
 }
 
-inline Value operator==(const Value& lhs, const Value& rhs)
-{
-    return Value(lhs.get_double() == rhs.get_double());
-}
+#define SPASM_COMPARISON(op)                                      \
+    inline Value operator op(const Value& lhs, const Value& rhs) \
+    {                                                             \
+        if (SPASM_LIKELY(both_integers(lhs, rhs)))                \
+        {                                                         \
+            return Value(lhs.get_integer() op rhs.get_integer()); \
+        }                                                         \
+        return Value(lhs.get_number() op rhs.get_number());       \
+    }
 
-inline Value operator!=(const Value& lhs, const Value& rhs)
-{
-    return Value(lhs.get_double() != rhs.get_double());
-}
+SPASM_COMPARISON(<)
+SPASM_COMPARISON(>)
+SPASM_COMPARISON(<=)
+SPASM_COMPARISON(>=)
+SPASM_COMPARISON(==)
+SPASM_COMPARISON(!=)
+
+#undef SPASM_COMPARISON
 
 }  // namespace Spasm
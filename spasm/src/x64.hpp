@@ -0,0 +1,430 @@
+#ifndef X64_HPP
+#define X64_HPP
+
+#include <cstring>
+#include <limits>
+
+#include "types.hpp"
+
+#if defined(__x86_64__) && !defined(_WIN32)
+#define SPASM_JIT 1
+#include <sys/mman.h>
+#include <unistd.h>
+#else
+#define SPASM_JIT 0
+#endif
+
+namespace SpasmImpl
+{
+//! Machine code generation shared by the native code engines
+namespace X64
+{
+enum Register
+{
+    RAX = 0,
+    RCX = 1,
+    RDX = 2,
+    RBX = 3,
+    RSP = 4,
+    RBP = 5,
+    RSI = 6,
+    RDI = 7,
+    R12 = 12,
+    R13 = 13,
+    R14 = 14,
+    R15 = 15,
+};
+
+enum Condition : uint8_t
+{
+    Overflow = 0x0,
+    AboveEqual = 0x3,
+    Zero = 0x4,
+    NotZero = 0x5,
+    BelowEqual = 0x6,
+    Above = 0x7,
+    Parity = 0xa,
+    NoParity = 0xb,
+    //! signed comparisons of integers
+    SignedLess = 0xc,
+    SignedGreaterEqual = 0xd,
+    SignedLessEqual = 0xe,
+    SignedGreater = 0xf,
+};
+
+//! Integer operations of two registers, the opcode of op r/m, reg
+enum ALU : uint8_t
+{
+    AddRegister = 0x01,
+    OrRegister = 0x09,
+    SubRegister = 0x29,
+    CompareRegister = 0x39,
+    TestRegister = 0x85,
+};
+
+//! Scalar double SSE2 operations
+enum SSE : uint8_t
+{
+    MoveLoad = 0x10,
+    MoveStore = 0x11,
+    AddSD = 0x58,
+    MulSD = 0x59,
+    SubSD = 0x5c,
+    DivSD = 0x5e,
+    UnorderedCompare = 0x2e,
+};
+
+//! Bit pattern of the Boolean false, true has 1 in the payload
+const uint64_t FalseBits = data_t(false).m_value.as_int64;
+//! Bit pattern of the Integer 0, the int32 is the low half of the payload
+const uint64_t IntegerBits = data_t::IntegerBits;
+
+//! Encodes the subset of x86-64 used by the compilers
+/*!
+** Jumps refer to labels - indices of native offsets that are known only
+** after the whole code is emitted and are patched by link.
+*/
+class Emitter
+{
+   public:
+    size_t size() const { return m_Buffer.size(); }
+    const uint8_t* data() const { return m_Buffer.data(); }
+
+    void emit(uint8_t b) { m_Buffer.push_back(b); }
+
+    void emit32(uint32_t v)
+    {
+        for (int i = 0; i < 4; ++i)
+        {
+            emit(uint8_t(v >> (8 * i)));
+        }
+    }
+
+    void emit64(uint64_t v)
+    {
+        emit32(uint32_t(v));
+        emit32(uint32_t(v >> 32));
+    }
+
+    //! mov dst, [base + disp]
+    void load(Register dst, Register base, int32_t disp)
+    {
+        rex(true, dst, base);
+        emit(0x8b);
+        memory(dst, base, disp);
+    }
+
+    //! mov [base + disp], src
+    void store(Register base, int32_t disp, Register src)
+    {
+        rex(true, src, base);
+        emit(0x89);
+        memory(src, base, disp);
+    }
+
+    //! mov dst, src
+    void move(Register dst, Register src)
+    {
+        rex(true, src, dst);
+        emit(0x89);
+        emit(0xc0 | ((src & 7) << 3) | (dst & 7));
+    }
+
+    //! mov dst, imm64
+    void move(Register dst, uint64_t value)
+    {
+        rex(true, RAX, dst);
+        emit(0xb8 + (dst & 7));
+        emit64(value);
+    }
+
+    //! mov dst32, imm32
+    void move32(Register dst, uint32_t value)
+    {
+        rex(false, RAX, dst);
+        emit(0xb8 + (dst & 7));
+        emit32(value);
+    }
+
+    //! movq xmm, src
+    void move_to_xmm(int xmm, Register src)
+    {
+        emit(0x66);
+        rex(true, Register(xmm), src);
+        emit(0x0f);
+        emit(0x6e);
+        emit(0xc0 | ((xmm & 7) << 3) | (src & 7));
+    }
+
+    //! movq dst, xmm
+    void move_from_xmm(Register dst, int xmm)
+    {
+        emit(0x66);
+        rex(true, Register(xmm), dst);
+        emit(0x0f);
+        emit(0x7e);
+        emit(0xc0 | ((xmm & 7) << 3) | (dst & 7));
+    }
+
+    //! cvtsi2sd xmm, src32
+    void convert_to_xmm(int xmm, Register src)
+    {
+        emit(0xf2);
+        rex(false, Register(xmm), src);
+        emit(0x0f);
+        emit(0x2a);
+        emit(0xc0 | ((xmm & 7) << 3) | (src & 7));
+    }
+
+    //! op dst, src on the low 32 bits or the whole registers if wide
+    void alu(ALU op, Register dst, Register src, bool wide = false)
+    {
+        rex(wide, src, dst);
+        emit(op);
+        emit(0xc0 | ((src & 7) << 3) | (dst & 7));
+    }
+
+    //! imul dst32, src32
+    void multiply32(Register dst, Register src)
+    {
+        rex(false, dst, src);
+        emit(0x0f);
+        emit(0xaf);
+        emit(0xc0 | ((dst & 7) << 3) | (src & 7));
+    }
+
+    //! cmp dst32, imm32
+    void compare32(Register dst, uint32_t value)
+    {
+        rex(false, RAX, dst);
+        emit(0x81);
+        emit(0xf8 | (dst & 7));
+        emit32(value);
+    }
+
+    //! shr dst, count
+    void shift_right(Register dst, uint8_t count)
+    {
+        rex(true, RAX, dst);
+        emit(0xc1);
+        emit(0xe8 | (dst & 7));
+        emit(count);
+    }
+
+    //! shl dst, count
+    void shift_left(Register dst, uint8_t count)
+    {
+        rex(true, RAX, dst);
+        emit(0xc1);
+        emit(0xe0 | (dst & 7));
+        emit(count);
+    }
+
+    //! add dst, imm32
+    void add(Register dst, int32_t value)
+    {
+        rex(true, RAX, dst);
+        emit(0x81);
+        emit(0xc0 | (dst & 7));
+        emit32(uint32_t(value));
+    }
+
+    //! SSE2 scalar double operation of xmm with [base + disp]
+    void sse(SSE op, int xmm, Register base, int32_t disp)
+    {
+        emit(prefix(op));
+        rex(false, Register(xmm), base);
+        emit(0x0f);
+        emit(op);
+        memory(Register(xmm), base, disp);
+    }
+
+    //! SSE2 scalar double operation of two xmm registers, MoveLoad copies
+    void sse(SSE op, int dst, int src)
+    {
+        emit(prefix(op));
+        rex(false, Register(dst), Register(src));
+        emit(0x0f);
+        emit(op);
+        emit(0xc0 | ((dst & 7) << 3) | (src & 7));
+    }
+
+    //! setcc r8 for al, cl, dl and bl
+    void set(Condition condition, Register dst)
+    {
+        emit(0x0f);
+        emit(0x90 | condition);
+        emit(0xc0 | dst);
+    }
+
+    void push(Register r)
+    {
+        if (r >= 8)
+        {
+            emit(0x41);
+        }
+        emit(0x50 + (r & 7));
+    }
+
+    void pop(Register r)
+    {
+        if (r >= 8)
+        {
+            emit(0x41);
+        }
+        emit(0x58 + (r & 7));
+    }
+
+    void call(Register r)
+    {
+        rex(false, RAX, r);
+        emit(0xff);
+        emit(0xd0 | (r & 7));
+    }
+
+    void jump(Register r)
+    {
+        rex(false, RAX, r);
+        emit(0xff);
+        emit(0xe0 | (r & 7));
+    }
+
+    void ret() { emit(0xc3); }
+
+    //! jmp label
+    void jump(int32_t label)
+    {
+        emit(0xe9);
+        fixup(label);
+    }
+
+    //! jcc label
+    void jump(Condition condition, int32_t label)
+    {
+        emit(0x0f);
+        emit(0x80 | condition);
+        fixup(label);
+    }
+
+    //! Patches the jumps with the native offsets of their labels
+    void link(const SPVector<size_t>& labels)
+    {
+        for (const auto& f : m_Fixups)
+        {
+            const auto relative =
+                int32_t(labels[size_t(f.Label)] - (f.Position + 4));
+            std::memcpy(&m_Buffer[f.Position], &relative, sizeof(relative));
+        }
+    }
+
+   private:
+    static uint8_t prefix(SSE op)
+    {
+        return op == UnorderedCompare ? 0x66 : 0xf2;
+    }
+
+    void rex(bool wide, Register reg, Register base)
+    {
+        const uint8_t prefix =
+            0x40 | (wide << 3) | ((reg >> 3) << 2) | (base >> 3);
+        if (prefix != 0x40)
+        {
+            emit(prefix);
+        }
+    }
+
+    //! ModRM for [base + disp32]
+    void memory(Register reg, Register base, int32_t disp)
+    {
+        emit(0x80 | ((reg & 7) << 3) | (base & 7));
+        if ((base & 7) == RSP)
+        {
+            emit(0x24);
+        }
+        emit32(uint32_t(disp));
+    }
+
+    void fixup(int32_t label)
+    {
+        m_Fixups.push_back({m_Buffer.size(), label});
+        emit32(0);
+    }
+
+    struct Fixup
+    {
+        size_t Position;
+        int32_t Label;
+    };
+
+    SPVector<uint8_t> m_Buffer;
+    SPVector<Fixup> m_Fixups;
+};
+
+//! Read and execute pages holding a copy of emitted code
+class ExecutableMemory
+{
+   public:
+    ExecutableMemory() = default;
+    ExecutableMemory(const ExecutableMemory&) = delete;
+    ExecutableMemory& operator=(const ExecutableMemory&) = delete;
+
+    ~ExecutableMemory()
+    {
+#if SPASM_JIT
+        if (m_Memory)
+        {
+            munmap(m_Memory, m_Size);
+        }
+#endif
+    }
+
+    //! \return false if the memory can't be allocated
+    bool Assign(const Emitter& code)
+    {
+#if SPASM_JIT
+        const auto page = size_t(sysconf(_SC_PAGESIZE));
+        const auto size = (code.size() + page - 1) / page * page;
+        void* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED)
+        {
+            return false;
+        }
+        std::memcpy(memory, code.data(), code.size());
+        if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0)
+        {
+            munmap(memory, size);
+            return false;
+        }
+        m_Memory = static_cast<uint8_t*>(memory);
+        m_Size = size;
+        return true;
+#else
+        (void)code;
+        return false;
+#endif
+    }
+
+    const uint8_t* get() const { return m_Memory; }
+
+   private:
+    uint8_t* m_Memory = nullptr;
+    size_t m_Size = 0;
+};
+
+//! Offset of m_FP[reg] or false if it does not fit in a displacement
+inline bool slot(int64_t reg, int32_t& disp)
+{
+    const auto offset = reg * int64_t(sizeof(data_t));
+    if (offset < std::numeric_limits<int32_t>::min() ||
+        offset > std::numeric_limits<int32_t>::max())
+    {
+        return false;
+    }
+    disp = int32_t(offset);
+    return true;
+}
+
+}  // namespace X64
+}  // namespace SpasmImpl
+#endif  // #ifndef X64_HPP